@@ -94,6 +94,33 @@ def validate_fields(fields):
             raise ValueError('Cannot handle field type \'%s\'' % field['format'])
 
 
+"""
+Get the index of the field with the given name
+"""
+def field_index(fields, field_name):
+    for i, field in enumerate(fields):
+        if field['name'] == field_name:
+            return i
+    raise ValueError('Couldn\'t find field \'%s\'' % field_name)
+
+
+"""
+Maximum number of fields in a message handled by the field tables, must match
+MBIM_FIELDS_MAX in mbim-message-private.h
+"""
+MBIM_FIELDS_MAX = 32
+
+"""
+Field conditions supported by the field tables
+"""
+FIELD_CONDITIONS = { '==' : 'MBIM_FIELD_CONDITION_EQUAL',
+                     '!=' : 'MBIM_FIELD_CONDITION_NOT_EQUAL',
+                     '<'  : 'MBIM_FIELD_CONDITION_LESS',
+                     '<=' : 'MBIM_FIELD_CONDITION_LESS_OR_EQUAL',
+                     '>'  : 'MBIM_FIELD_CONDITION_GREATER',
+                     '>=' : 'MBIM_FIELD_CONDITION_GREATER_OR_EQUAL' }
+
+
 """
 The Message class takes care of all message handling
 """
@@ -102,7 +129,10 @@ class Message:
     """
     Constructor
     """
-    def __init__(self, dictionary):
+    def __init__(self, dictionary, message_backend = 'functions'):
+        # How messages are built, parsed and printed, either 'functions' or 'tables'
+        self.message_backend = message_backend
+
         # The message service, e.g. "Basic Connect"
         self.service = dictionary['service']
 
@@ -180,24 +210,28 @@ class Message:
         if self.has_query:
             utils.add_separator(hfile, 'Message (Query)', self.fullname);
             utils.add_separator(cfile, 'Message (Query)', self.fullname);
+            self._emit_message_fields_table(cfile, 'query', self.query)
             self._emit_message_creator(hfile, cfile, 'query', self.query, self.query_since)
             self._emit_message_printable(cfile, 'query', self.query)
 
         if self.has_set:
             utils.add_separator(hfile, 'Message (Set)', self.fullname);
             utils.add_separator(cfile, 'Message (Set)', self.fullname);
+            self._emit_message_fields_table(cfile, 'set', self.set)
             self._emit_message_creator(hfile, cfile, 'set', self.set, self.set_since)
             self._emit_message_printable(cfile, 'set', self.set)
 
         if self.has_response:
             utils.add_separator(hfile, 'Message (Response)', self.fullname);
             utils.add_separator(cfile, 'Message (Response)', self.fullname);
+            self._emit_message_fields_table(cfile, 'response', self.response)
             self._emit_message_parser(hfile, cfile, 'response', self.response, self.response_since)
             self._emit_message_printable(cfile, 'response', self.response)
 
         if self.has_notification:
             utils.add_separator(hfile, 'Message (Notification)', self.fullname);
             utils.add_separator(cfile, 'Message (Notification)', self.fullname);
+            self._emit_message_fields_table(cfile, 'notification', self.notification)
             self._emit_message_parser(hfile, cfile, 'notification', self.notification, self.notification_since)
             self._emit_message_printable(cfile, 'notification', self.notification)
 
@@ -378,6 +412,11 @@ class Message:
 
             template += (string.Template(inner_template).substitute(translations))
 
+        if self.message_backend == 'tables':
+            template += self._build_message_creator_table_body(fields)
+            cfile.write(string.Template(template).substitute(translations))
+            return
+
         template += (
             '    GError **error)\n'
             '{\n'
@@ -630,6 +669,11 @@ class Message:
 
             template += (string.Template(inner_template).substitute(translations))
 
+        if self.message_backend == 'tables':
+            template += self._build_message_parser_table_body(message_type, fields)
+            cfile.write(string.Template(template).substitute(translations))
+            return
+
         template += (
             '    GError **error)\n'
             '{\n')
@@ -995,6 +1039,10 @@ class Message:
     Emit message printable
     """
     def _emit_message_printable(self, cfile, message_type, fields):
+        if self.message_backend == 'tables':
+            self._emit_message_printable_table(cfile, message_type, fields)
+            return
+
         translations = { 'message'                  : self.name,
                          'underscore'               : utils.build_underscore_name(self.name),
                          'service'                  : self.service,
@@ -1353,6 +1401,214 @@ class Message:
         cfile.write(string.Template(template).substitute(translations))
 
 
+    """
+    Emit the constant field table of the message, interpreted by the generic
+    _mbim_message_build_fields(), _mbim_message_parse_fields() and
+    _mbim_message_print_fields()
+    """
+    def _emit_message_fields_table(self, cfile, message_type, fields):
+        if self.message_backend != 'tables' or fields == []:
+            return
+
+        if len(fields) > MBIM_FIELDS_MAX:
+            raise ValueError('Message ' + self.name + ' (' + message_type + ') has more than ' + str(MBIM_FIELDS_MAX) + ' fields')
+
+        translations = { 'underscore'   : utils.build_underscore_name (self.fullname),
+                         'message_type' : message_type }
+
+        template = (
+            '\n'
+            'static const MbimFieldInfo ${underscore}_${message_type}_fields[] = {\n')
+
+        for field in fields:
+            translations['field_name']   = field['name']
+            translations['field_format'] = 'MBIM_FIELD_FORMAT_' + field['format'].replace('-', '_').upper()
+            translations['always_read']  = 'TRUE' if 'always-read' in field else 'FALSE'
+            translations['pad_array']    = field['pad-array'] if 'pad-array' in field else 'TRUE'
+            translations['array_size']   = field['array-size'] if 'array-size' in field else '0'
+            translations['array_size_field'] = field_index(fields, field['array-size-field']) if 'array-size-field' in field else -1
+
+            inner_template = (
+                '    {\n'
+                '        .name             = "${field_name}",\n'
+                '        .format           = ${field_format},\n'
+                '        .always_read      = ${always_read},\n'
+                '        .pad_array        = ${pad_array},\n'
+                '        .array_size       = ${array_size},\n'
+                '        .array_size_field = ${array_size_field},\n')
+
+            if 'available-if' in field:
+                condition = field['available-if']
+                if condition['operation'] not in FIELD_CONDITIONS:
+                    raise ValueError('Unsupported condition operation \'%s\'' % condition['operation'])
+                translations['condition_field'] = field_index(fields, condition['field'])
+                translations['condition']       = FIELD_CONDITIONS[condition['operation']]
+                translations['condition_value'] = condition['value']
+                inner_template += (
+                    '        .condition_field  = ${condition_field},\n'
+                    '        .condition        = ${condition},\n'
+                    '        .condition_value  = ${condition_value},\n')
+            else:
+                inner_template += (
+                    '        .condition_field  = -1,\n')
+
+            if 'public-format' in field and 'always-read' not in field and \
+               (field['format'] == 'guint32' or field['format'] == 'guint64'):
+                translations['public_underscore']       = utils.build_underscore_name_from_camelcase(field['public-format'])
+                translations['public_underscore_upper'] = utils.build_underscore_name_from_camelcase(field['public-format']).upper()
+                inner_template += (
+                    '#if defined __${public_underscore_upper}_IS_ENUM__\n'
+                    '        .get_string       = (const gchar * (*) (guint)) ${public_underscore}_get_string,\n'
+                    '#elif defined __${public_underscore_upper}_IS_FLAGS__\n'
+                    '        .build_string_from_mask = (gchar * (*) (guint)) ${public_underscore}_build_string_from_mask,\n'
+                    '#else\n'
+                    '# error neither enum nor flags\n'
+                    '#endif\n')
+
+            if 'struct-type' in field:
+                translations['struct_underscore'] = utils.build_underscore_name_from_camelcase(field['struct-type'])
+                inner_template += (
+                    '        .struct_info      = &${struct_underscore}_struct_info,\n')
+
+            inner_template += (
+                '    },\n')
+            template += (string.Template(inner_template).substitute(translations))
+
+        template += (
+            '};\n')
+        cfile.write(string.Template(template).substitute(translations))
+
+
+    """
+    Build the body of a message creator packing the input values and calling
+    the generic _mbim_message_build_fields()
+    """
+    def _build_message_creator_table_body(self, fields):
+        template = (
+            '    GError **error)\n'
+            '{\n')
+
+        if fields == []:
+            template += (
+                '    return _mbim_message_build_fields (MBIM_SERVICE_${service_underscore_upper},\n'
+                '                                       ${cid_enum_name},\n'
+                '                                       MBIM_MESSAGE_COMMAND_TYPE_${message_type_upper},\n'
+                '                                       NULL, 0, NULL);\n'
+                '}\n')
+            return template
+
+        template += (
+            '    const MbimFieldValue values[] = {\n')
+
+        for field in fields:
+            translations = { 'field' : utils.build_underscore_name_from_camelcase(field['name']) }
+
+            if field['format'] == 'unsized-byte-array' or \
+               field['format'] == 'ref-byte-array' or \
+               field['format'] == 'uicc-ref-byte-array' or \
+               field['format'] == 'ref-byte-array-no-offset':
+                inner_template = ('        { .size = ${field}_size, .value.ptr = ${field} },\n')
+            elif field['format'] == 'guint32':
+                inner_template = ('        { .value.u32 = ${field} },\n')
+            elif field['format'] == 'guint64':
+                inner_template = ('        { .value.u64 = ${field} },\n')
+            else:
+                inner_template = ('        { .value.ptr = ${field} },\n')
+
+            template += (string.Template(inner_template).substitute(translations))
+
+        template += (
+            '    };\n'
+            '\n'
+            '    return _mbim_message_build_fields (MBIM_SERVICE_${service_underscore_upper},\n'
+            '                                       ${cid_enum_name},\n'
+            '                                       MBIM_MESSAGE_COMMAND_TYPE_${message_type_upper},\n'
+            '                                       ${underscore}_${message_type}_fields,\n'
+            '                                       G_N_ELEMENTS (${underscore}_${message_type}_fields),\n'
+            '                                       values);\n'
+            '}\n')
+        return template
+
+
+    """
+    Build the body of a message parser packing the output locations and calling
+    the generic _mbim_message_parse_fields()
+    """
+    def _build_message_parser_table_body(self, message_type, fields):
+        if message_type == 'response':
+            message_type_enum = 'MBIM_MESSAGE_TYPE_COMMAND_DONE'
+        elif message_type == 'notification':
+            message_type_enum = 'MBIM_MESSAGE_TYPE_INDICATE_STATUS'
+        else:
+            raise ValueError('Unexpected message type \'%s\'' % message_type)
+
+        template = (
+            '    GError **error)\n'
+            '{\n')
+
+        if fields == []:
+            template += (
+                '    return _mbim_message_parse_fields (message, ' + message_type_enum + ', NULL, 0, NULL, error);\n'
+                '}\n')
+            return template
+
+        template += (
+            '    const MbimFieldOutput outputs[] = {\n')
+
+        for field in fields:
+            translations = { 'field' : utils.build_underscore_name_from_camelcase(field['name']) }
+
+            if field['format'] == 'unsized-byte-array' or \
+               field['format'] == 'ref-byte-array' or \
+               field['format'] == 'uicc-ref-byte-array':
+                inner_template = ('        { .size = out_${field}_size, .value = out_${field} },\n')
+            else:
+                inner_template = ('        { .value = out_${field} },\n')
+
+            template += (string.Template(inner_template).substitute(translations))
+
+        template += (
+            '    };\n'
+            '\n'
+            '    return _mbim_message_parse_fields (message,\n'
+            '                                       ' + message_type_enum + ',\n'
+            '                                       ${underscore}_${message_type}_fields,\n'
+            '                                       G_N_ELEMENTS (${underscore}_${message_type}_fields),\n'
+            '                                       outputs,\n'
+            '                                       error);\n'
+            '}\n')
+        return template
+
+
+    """
+    Emit the message printable support calling the generic
+    _mbim_message_print_fields() on the message field table
+    """
+    def _emit_message_printable_table(self, cfile, message_type, fields):
+        translations = { 'underscore'   : utils.build_underscore_name (self.fullname),
+                         'message_type' : message_type,
+                         'is_response'  : 'TRUE' if message_type == 'response' else 'FALSE' }
+
+        if fields != []:
+            translations['fields']   = '${underscore}_${message_type}_fields'
+            translations['n_fields'] = 'G_N_ELEMENTS (${underscore}_${message_type}_fields)'
+        else:
+            translations['fields']   = 'NULL'
+            translations['n_fields'] = '0'
+
+        template = (
+            '\n'
+            'static gchar *\n'
+            '${underscore}_${message_type}_get_printable (\n'
+            '    const MbimMessage *message,\n'
+            '    const gchar *line_prefix,\n'
+            '    GError **error)\n'
+            '{\n'
+            '    return _mbim_message_print_fields (message, line_prefix, ' + translations['fields'] + ', ' + translations['n_fields'] + ', ${is_response});\n'
+            '}\n')
+        cfile.write(string.Template(template).substitute(translations))
+
+
     """
     Emit the section content
     """
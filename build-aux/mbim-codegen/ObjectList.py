@@ -48,7 +48,7 @@ class ObjectList:
     """
     Constructor
     """
-    def __init__(self, objects_dictionary):
+    def __init__(self, objects_dictionary, message_backend = 'functions'):
         self.command_list = []
         self.struct_list = []
         self.service = ''
@@ -56,9 +56,9 @@ class ObjectList:
         # Loop items in the list, creating Message objects for the messages
         for object_dictionary in objects_dictionary:
             if object_dictionary['type'] == 'Command':
-                self.command_list.append(Message(object_dictionary))
+                self.command_list.append(Message(object_dictionary, message_backend))
             elif object_dictionary['type'] == 'Struct':
-                self.struct_list.append(Struct(object_dictionary))
+                self.struct_list.append(Struct(object_dictionary, message_backend))
             elif object_dictionary['type'] == 'Service':
                 self.service = object_dictionary['name']
             else:
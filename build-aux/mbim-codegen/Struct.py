@@ -28,7 +28,10 @@ class Struct:
     """
     Constructor
     """
-    def __init__(self, dictionary):
+    def __init__(self, dictionary, message_backend = 'functions'):
+        # How messages are built, parsed and printed, either 'functions' or 'tables'
+        self.message_backend = message_backend
+
         self.name = dictionary['name']
         self.contents = dictionary['contents']
         self.since = dictionary['since'] if 'since' in dictionary else None
@@ -844,6 +847,32 @@ class Struct:
         cfile.write(string.Template(template).substitute(translations))
 
 
+    """
+    Emit the struct support table used by the generic table-driven message
+    builder, parser and printer
+    """
+    def _emit_info(self, cfile):
+        translations = { 'name_underscore' : utils.build_underscore_name_from_camelcase(self.name) }
+
+        template = (
+            '\n'
+            'static const MbimStructInfo ${name_underscore}_struct_info = {\n'
+            '    .read         = (MbimStructReadFunc) _mbim_message_read_${name_underscore}_struct,\n'
+            '    .append       = (MbimStructAppendFunc) _mbim_message_command_builder_append_${name_underscore}_struct,\n'
+            '    .print        = (MbimStructPrintFunc) _mbim_message_print_${name_underscore}_struct,\n'
+            '    .free         = (GDestroyNotify) _${name_underscore}_free,\n')
+
+        if self.array_member:
+            template += (
+                '    .read_array   = (MbimStructReadArrayFunc) _mbim_message_read_${name_underscore}_struct_array,\n'
+                '    .append_array = (MbimStructAppendArrayFunc) _mbim_message_command_builder_append_${name_underscore}_struct_array,\n'
+                '    .array_free   = (GDestroyNotify) ${name_underscore}_array_free,\n')
+
+        template += (
+            '};\n')
+        cfile.write(string.Template(template).substitute(translations))
+
+
     """
     Emit the struct handling implementation
     """
@@ -861,6 +890,9 @@ class Struct:
         self._emit_print(cfile)
         # Emit type's append
         self._emit_append(cfile)
+        # Emit type's support table, only if used in messages
+        if self.message_backend == 'tables' and (self.single_member or self.array_member):
+            self._emit_info(cfile)
 
 
     """
@@ -36,25 +36,55 @@
 #include "mbim-enums.h"
 #include "mbim-proxy.h"
 
-/* generated */
+/* generated, optional services only if built */
 #include "mbim-enum-types.h"
 #include "mbim-error-types.h"
 #include "mbim-basic-connect.h"
+#if MBIM_HAS_SERVICE (SMS)
 #include "mbim-sms.h"
+#endif
+#if MBIM_HAS_SERVICE (USSD)
 #include "mbim-ussd.h"
+#endif
+#if MBIM_HAS_SERVICE (AUTH)
 #include "mbim-auth.h"
+#endif
+#if MBIM_HAS_SERVICE (PHONEBOOK)
 #include "mbim-phonebook.h"
+#endif
+#if MBIM_HAS_SERVICE (STK)
 #include "mbim-stk.h"
+#endif
+#if MBIM_HAS_SERVICE (DSS)
 #include "mbim-dss.h"
+#endif
+#if MBIM_HAS_SERVICE (MS_FIRMWARE_ID)
 #include "mbim-ms-firmware-id.h"
+#endif
+#if MBIM_HAS_SERVICE (MS_HOST_SHUTDOWN)
 #include "mbim-ms-host-shutdown.h"
+#endif
+#if MBIM_HAS_SERVICE (MS_SAR)
 #include "mbim-ms-sar.h"
+#endif
+#if MBIM_HAS_SERVICE (QMI)
 #include "mbim-qmi.h"
+#endif
+#if MBIM_HAS_SERVICE (ATDS)
 #include "mbim-atds.h"
+#endif
+#if MBIM_HAS_SERVICE (QDU)
 #include "mbim-qdu.h"
+#endif
+#if MBIM_HAS_SERVICE (INTEL_FIRMWARE_UPDATE)
 #include "mbim-intel-firmware-update.h"
+#endif
+#if MBIM_HAS_SERVICE (MS_BASIC_CONNECT_EXTENSIONS)
 #include "mbim-ms-basic-connect-extensions.h"
+#endif
+#if MBIM_HAS_SERVICE (MS_UICC_LOW_LEVEL_ACCESS)
 #include "mbim-ms-uicc-low-level-access.h"
+#endif
 
 /* backwards compatibility */
 #include "mbim-compat.h"
@@ -21,389 +21,431 @@
  * Copyright (C) 2013 - 2014 Aleksander Morgado <aleksander@aleksander.es>
  */
 
+#include <config.h>
+
 #include "mbim-cid.h"
 #include "mbim-uuid.h"
 #include "mbim-enum-types.h"
 
-typedef struct {
-    gboolean set;
-    gboolean query;
-    gboolean notify;
-} CidConfig;
+/* Bitmask of MbimCidCapability values */
+typedef guint8 CidConfig;
 
-#define NO_SET    FALSE
-#define NO_QUERY  FALSE
-#define NO_NOTIFY FALSE
+#define NO_SET    0
+#define NO_QUERY  0
+#define NO_NOTIFY 0
 
-#define SET    TRUE
-#define QUERY  TRUE
-#define NOTIFY TRUE
+#define SET    MBIM_CID_CAPABILITY_SET
+#define QUERY  MBIM_CID_CAPABILITY_QUERY
+#define NOTIFY MBIM_CID_CAPABILITY_NOTIFY
 
 /* Note: index of the array is CID-1 */
 #define MBIM_CID_BASIC_CONNECT_LAST MBIM_CID_BASIC_CONNECT_MULTICARRIER_PROVIDERS
 static const CidConfig cid_basic_connect_config [MBIM_CID_BASIC_CONNECT_LAST] = {
-    { NO_SET, QUERY,    NO_NOTIFY }, /* MBIM_CID_BASIC_CONNECT_DEVICE_CAPS */
-    { NO_SET, QUERY,    NOTIFY    }, /* MBIM_CID_BASIC_CONNECT_SUBSCRIBER_READY_STATUS */
-    { SET,    QUERY,    NOTIFY    }, /* MBIM_CID_BASIC_CONNECT_RADIO_STATE */
-    { SET,    QUERY,    NO_NOTIFY }, /* MBIM_CID_BASIC_CONNECT_PIN */
-    { NO_SET, QUERY,    NO_NOTIFY }, /* MBIM_CID_BASIC_CONNECT_PIN_LIST */
-    { SET,    QUERY,    NO_NOTIFY }, /* MBIM_CID_BASIC_CONNECT_HOME_PROVIDER */
-    { SET,    QUERY,    NOTIFY    }, /* MBIM_CID_BASIC_CONNECT_PREFERRED_PROVIDERS */
-    { NO_SET, QUERY,    NO_NOTIFY }, /* MBIM_CID_BASIC_CONNECT_VISIBLE_PROVIDERS */
-    { SET,    QUERY,    NOTIFY    }, /* MBIM_CID_BASIC_CONNECT_REGISTER_STATE */
-    { SET,    QUERY,    NOTIFY    }, /* MBIM_CID_BASIC_CONNECT_PACKET_SERVICE */
-    { SET,    QUERY,    NOTIFY    }, /* MBIM_CID_BASIC_CONNECT_SIGNAL_STATE */
-    { SET,    QUERY,    NOTIFY    }, /* MBIM_CID_BASIC_CONNECT_CONNECT */
-    { SET,    QUERY,    NOTIFY    }, /* MBIM_CID_BASIC_CONNECT_PROVISIONED_CONTEXTS */
-    { SET,    NO_QUERY, NO_NOTIFY }, /* MBIM_CID_BASIC_CONNECT_SERVICE_ACTIVATION */
-    { NO_SET, QUERY,    NOTIFY    }, /* MBIM_CID_BASIC_CONNECT_IP_CONFIGURATION */
-    { NO_SET, QUERY,    NO_NOTIFY }, /* MBIM_CID_BASIC_CONNECT_DEVICE_SERVICES */
-    { NO_SET, NO_QUERY, NO_NOTIFY }, /* 17 reserved */
-    { NO_SET, NO_QUERY, NO_NOTIFY }, /* 18 reserved */
-    { SET,    NO_QUERY, NO_NOTIFY }, /* MBIM_CID_BASIC_CONNECT_DEVICE_SERVICE_SUBSCRIBE_LIST */
-    { NO_SET, QUERY,    NO_NOTIFY }, /* MBIM_CID_BASIC_CONNECT_PACKET_STATISTICS */
-    { SET,    QUERY,    NO_NOTIFY }, /* MBIM_CID_BASIC_CONNECT_NETWORK_IDLE_HINT */
-    { NO_SET, QUERY,    NOTIFY    }, /* MBIM_CID_BASIC_CONNECT_EMERGENCY_MODE */
-    { SET,    QUERY,    NO_NOTIFY }, /* MBIM_CID_BASIC_CONNECT_IP_PACKET_FILTERS */
-    { SET,    QUERY,    NOTIFY    }, /* MBIM_CID_BASIC_CONNECT_MULTICARRIER_PROVIDERS */
+    NO_SET | QUERY    | NO_NOTIFY, /* MBIM_CID_BASIC_CONNECT_DEVICE_CAPS */
+    NO_SET | QUERY    | NOTIFY,    /* MBIM_CID_BASIC_CONNECT_SUBSCRIBER_READY_STATUS */
+    SET    | QUERY    | NOTIFY,    /* MBIM_CID_BASIC_CONNECT_RADIO_STATE */
+    SET    | QUERY    | NO_NOTIFY, /* MBIM_CID_BASIC_CONNECT_PIN */
+    NO_SET | QUERY    | NO_NOTIFY, /* MBIM_CID_BASIC_CONNECT_PIN_LIST */
+    SET    | QUERY    | NO_NOTIFY, /* MBIM_CID_BASIC_CONNECT_HOME_PROVIDER */
+    SET    | QUERY    | NOTIFY,    /* MBIM_CID_BASIC_CONNECT_PREFERRED_PROVIDERS */
+    NO_SET | QUERY    | NO_NOTIFY, /* MBIM_CID_BASIC_CONNECT_VISIBLE_PROVIDERS */
+    SET    | QUERY    | NOTIFY,    /* MBIM_CID_BASIC_CONNECT_REGISTER_STATE */
+    SET    | QUERY    | NOTIFY,    /* MBIM_CID_BASIC_CONNECT_PACKET_SERVICE */
+    SET    | QUERY    | NOTIFY,    /* MBIM_CID_BASIC_CONNECT_SIGNAL_STATE */
+    SET    | QUERY    | NOTIFY,    /* MBIM_CID_BASIC_CONNECT_CONNECT */
+    SET    | QUERY    | NOTIFY,    /* MBIM_CID_BASIC_CONNECT_PROVISIONED_CONTEXTS */
+    SET    | NO_QUERY | NO_NOTIFY, /* MBIM_CID_BASIC_CONNECT_SERVICE_ACTIVATION */
+    NO_SET | QUERY    | NOTIFY,    /* MBIM_CID_BASIC_CONNECT_IP_CONFIGURATION */
+    NO_SET | QUERY    | NO_NOTIFY, /* MBIM_CID_BASIC_CONNECT_DEVICE_SERVICES */
+    NO_SET | NO_QUERY | NO_NOTIFY, /* 17 reserved */
+    NO_SET | NO_QUERY | NO_NOTIFY, /* 18 reserved */
+    SET    | NO_QUERY | NO_NOTIFY, /* MBIM_CID_BASIC_CONNECT_DEVICE_SERVICE_SUBSCRIBE_LIST */
+    NO_SET | QUERY    | NO_NOTIFY, /* MBIM_CID_BASIC_CONNECT_PACKET_STATISTICS */
+    SET    | QUERY    | NO_NOTIFY, /* MBIM_CID_BASIC_CONNECT_NETWORK_IDLE_HINT */
+    NO_SET | QUERY    | NOTIFY,    /* MBIM_CID_BASIC_CONNECT_EMERGENCY_MODE */
+    SET    | QUERY    | NO_NOTIFY, /* MBIM_CID_BASIC_CONNECT_IP_PACKET_FILTERS */
+    SET    | QUERY    | NOTIFY,    /* MBIM_CID_BASIC_CONNECT_MULTICARRIER_PROVIDERS */
 };
 
+#if defined MBIM_SERVICE_SMS_ENABLED
 /* Note: index of the array is CID-1 */
 #define MBIM_CID_SMS_LAST MBIM_CID_SMS_MESSAGE_STORE_STATUS
 static const CidConfig cid_sms_config [MBIM_CID_SMS_LAST] = {
-    { SET,    QUERY,    NOTIFY    }, /* MBIM_CID_SMS_CONFIGURATION */
-    { NO_SET, QUERY,    NOTIFY    }, /* MBIM_CID_SMS_READ */
-    { SET,    NO_QUERY, NO_NOTIFY }, /* MBIM_CID_SMS_SEND */
-    { SET,    NO_QUERY, NO_NOTIFY }, /* MBIM_CID_SMS_DELETE */
-    { NO_SET, QUERY,    NOTIFY    }, /* MBIM_CID_SMS_MESSAGE_STORE_STATUS */
+    SET    | QUERY    | NOTIFY,    /* MBIM_CID_SMS_CONFIGURATION */
+    NO_SET | QUERY    | NOTIFY,    /* MBIM_CID_SMS_READ */
+    SET    | NO_QUERY | NO_NOTIFY, /* MBIM_CID_SMS_SEND */
+    SET    | NO_QUERY | NO_NOTIFY, /* MBIM_CID_SMS_DELETE */
+    NO_SET | QUERY    | NOTIFY,    /* MBIM_CID_SMS_MESSAGE_STORE_STATUS */
 };
+#endif
 
+#if defined MBIM_SERVICE_USSD_ENABLED
 /* Note: index of the array is CID-1 */
 #define MBIM_CID_USSD_LAST MBIM_CID_USSD
 static const CidConfig cid_ussd_config [MBIM_CID_USSD_LAST] = {
-    { SET, NO_QUERY, NOTIFY }, /* MBIM_CID_USSD */
+    SET    | NO_QUERY | NOTIFY,    /* MBIM_CID_USSD */
 };
+#endif
 
+#if defined MBIM_SERVICE_PHONEBOOK_ENABLED
 /* Note: index of the array is CID-1 */
 #define MBIM_CID_PHONEBOOK_LAST MBIM_CID_PHONEBOOK_WRITE
 static const CidConfig cid_phonebook_config [MBIM_CID_PHONEBOOK_LAST] = {
-    { NO_SET, QUERY,    NOTIFY    }, /* MBIM_CID_PHONEBOOK_CONFIGURATION */
-    { NO_SET, QUERY,    NO_NOTIFY }, /* MBIM_CID_PHONEBOOK_READ */
-    { SET,    NO_QUERY, NO_NOTIFY }, /* MBIM_CID_PHONEBOOK_DELETE */
-    { SET,    NO_QUERY, NO_NOTIFY }, /* MBIM_CID_PHONEBOOK_WRITE */
+    NO_SET | QUERY    | NOTIFY,    /* MBIM_CID_PHONEBOOK_CONFIGURATION */
+    NO_SET | QUERY    | NO_NOTIFY, /* MBIM_CID_PHONEBOOK_READ */
+    SET    | NO_QUERY | NO_NOTIFY, /* MBIM_CID_PHONEBOOK_DELETE */
+    SET    | NO_QUERY | NO_NOTIFY, /* MBIM_CID_PHONEBOOK_WRITE */
 };
+#endif
 
+#if defined MBIM_SERVICE_STK_ENABLED
 /* Note: index of the array is CID-1 */
 #define MBIM_CID_STK_LAST MBIM_CID_STK_ENVELOPE
 static const CidConfig cid_stk_config [MBIM_CID_STK_LAST] = {
-    { SET, QUERY,    NOTIFY    }, /* MBIM_CID_STK_PAC */
-    { SET, NO_QUERY, NO_NOTIFY }, /* MBIM_CID_STK_TERMINAL_RESPONSE */
-    { SET, QUERY,    NO_NOTIFY }, /* MBIM_CID_STK_ENVELOPE */
+    SET    | QUERY    | NOTIFY,    /* MBIM_CID_STK_PAC */
+    SET    | NO_QUERY | NO_NOTIFY, /* MBIM_CID_STK_TERMINAL_RESPONSE */
+    SET    | QUERY    | NO_NOTIFY, /* MBIM_CID_STK_ENVELOPE */
 };
+#endif
 
+#if defined MBIM_SERVICE_AUTH_ENABLED
 /* Note: index of the array is CID-1 */
 #define MBIM_CID_AUTH_LAST MBIM_CID_AUTH_SIM
 static const CidConfig cid_auth_config [MBIM_CID_AUTH_LAST] = {
-    { NO_SET, QUERY, NO_NOTIFY }, /* MBIM_CID_AUTH_AKA */
-    { NO_SET, QUERY, NO_NOTIFY }, /* MBIM_CID_AUTH_AKAP */
-    { NO_SET, QUERY, NO_NOTIFY }, /* MBIM_CID_AUTH_SIM */
+    NO_SET | QUERY    | NO_NOTIFY, /* MBIM_CID_AUTH_AKA */
+    NO_SET | QUERY    | NO_NOTIFY, /* MBIM_CID_AUTH_AKAP */
+    NO_SET | QUERY    | NO_NOTIFY, /* MBIM_CID_AUTH_SIM */
 };
+#endif
 
+#if defined MBIM_SERVICE_DSS_ENABLED
 /* Note: index of the array is CID-1 */
 #define MBIM_CID_DSS_LAST MBIM_CID_DSS_CONNECT
 static const CidConfig cid_dss_config [MBIM_CID_DSS_LAST] = {
-    { SET, NO_QUERY, NO_NOTIFY }, /* MBIM_CID_DSS_CONNECT */
+    SET    | NO_QUERY | NO_NOTIFY, /* MBIM_CID_DSS_CONNECT */
 };
+#endif
 
+#if defined MBIM_SERVICE_MS_FIRMWARE_ID_ENABLED
 /* Note: index of the array is CID-1 */
 #define MBIM_CID_MS_FIRMWARE_ID_LAST MBIM_CID_MS_FIRMWARE_ID_GET
 static const CidConfig cid_ms_firmware_id_config [MBIM_CID_MS_FIRMWARE_ID_LAST] = {
-    { NO_SET, QUERY, NO_NOTIFY }, /* MBIM_CID_MS_FIRMWARE_ID_GET */
+    NO_SET | QUERY    | NO_NOTIFY, /* MBIM_CID_MS_FIRMWARE_ID_GET */
 };
+#endif
 
+#if defined MBIM_SERVICE_MS_HOST_SHUTDOWN_ENABLED
 /* Note: index of the array is CID-1 */
 #define MBIM_CID_MS_HOST_SHUTDOWN_LAST MBIM_CID_MS_HOST_SHUTDOWN_NOTIFY
 static const CidConfig cid_ms_host_shutdown_config [MBIM_CID_MS_HOST_SHUTDOWN_LAST] = {
-    { SET, NO_QUERY, NO_NOTIFY }, /* MBIM_CID_MS_HOST_SHUTDOWN_NOTIFY */
+    SET    | NO_QUERY | NO_NOTIFY, /* MBIM_CID_MS_HOST_SHUTDOWN_NOTIFY */
 };
+#endif
 
+#if defined MBIM_SERVICE_MS_SAR_ENABLED
 /* Note: index of the array is CID-1 */
 #define MBIM_CID_MS_SAR_LAST MBIM_CID_MS_SAR_TRANSMISSION_STATUS
 static const CidConfig cid_ms_sar_config [MBIM_CID_MS_SAR_LAST] = {
-    { SET, QUERY, NOTIFY }, /* MBIM_CID_MS_SAR_CONFIG */
-    { SET, QUERY, NOTIFY }, /* MBIM_CID_MS_SAR_TRANSMISSION_STATUS */
+    SET    | QUERY    | NOTIFY,    /* MBIM_CID_MS_SAR_CONFIG */
+    SET    | QUERY    | NOTIFY,    /* MBIM_CID_MS_SAR_TRANSMISSION_STATUS */
 };
+#endif
 
 /* Note: index of the array is CID-1 */
-#define MBIM_CID_PROXY_CONTROL_LAST MBIM_CID_PROXY_CONTROL_CONFIGURATION
+#define MBIM_CID_PROXY_CONTROL_LAST MBIM_CID_PROXY_CONTROL_STATISTICS
 static const CidConfig cid_proxy_control_config [MBIM_CID_PROXY_CONTROL_LAST] = {
-    { SET, NO_QUERY, NO_NOTIFY }, /* MBIM_CID_PROXY_CONTROL_CONFIGURATION */
+    SET    | NO_QUERY | NO_NOTIFY, /* MBIM_CID_PROXY_CONTROL_CONFIGURATION */
+    SET    | NO_QUERY | NO_NOTIFY, /* MBIM_CID_PROXY_CONTROL_INDICATION_RING */
+    SET    | NO_QUERY | NO_NOTIFY, /* MBIM_CID_PROXY_CONTROL_INDICATION_REPLAY */
+    NO_SET | QUERY    | NO_NOTIFY, /* MBIM_CID_PROXY_CONTROL_STATISTICS */
 };
 
+#if defined MBIM_SERVICE_QMI_ENABLED
 /* Note: index of the array is CID-1 */
 #define MBIM_CID_QMI_LAST MBIM_CID_QMI_MSG
 static const CidConfig cid_qmi_config [MBIM_CID_QMI_LAST] = {
-    { SET, NO_QUERY, NOTIFY }, /* MBIM_CID_QMI_MSG */
+    SET    | NO_QUERY | NOTIFY,    /* MBIM_CID_QMI_MSG */
 };
+#endif
 
+#if defined MBIM_SERVICE_ATDS_ENABLED
 /* Note: index of the array is CID-1 */
 #define MBIM_CID_ATDS_LAST MBIM_CID_ATDS_REGISTER_STATE
 static const CidConfig cid_atds_config [MBIM_CID_ATDS_LAST] = {
-    { NO_SET, QUERY, NO_NOTIFY }, /* MBIM_CID_ATDS_SIGNAL */
-    { NO_SET, QUERY, NO_NOTIFY }, /* MBIM_CID_ATDS_LOCATION */
-    { SET,    QUERY, NO_NOTIFY }, /* MBIM_CID_ATDS_OPERATORS */
-    { SET,    QUERY, NO_NOTIFY }, /* MBIM_CID_ATDS_RAT */
-    { NO_SET, QUERY, NO_NOTIFY }, /* MBIM_CID_ATDS_REGISTER_STATE */
+    NO_SET | QUERY    | NO_NOTIFY, /* MBIM_CID_ATDS_SIGNAL */
+    NO_SET | QUERY    | NO_NOTIFY, /* MBIM_CID_ATDS_LOCATION */
+    SET    | QUERY    | NO_NOTIFY, /* MBIM_CID_ATDS_OPERATORS */
+    SET    | QUERY    | NO_NOTIFY, /* MBIM_CID_ATDS_RAT */
+    NO_SET | QUERY    | NO_NOTIFY, /* MBIM_CID_ATDS_REGISTER_STATE */
 };
+#endif
 
+#if defined MBIM_SERVICE_INTEL_FIRMWARE_UPDATE_ENABLED
 /* Note: index of the array is CID-1 */
 #define MBIM_CID_INTEL_FIRMWARE_UPDATE_LAST MBIM_CID_INTEL_FIRMWARE_UPDATE_MODEM_REBOOT
 static const CidConfig cid_intel_firmware_update_config [MBIM_CID_INTEL_FIRMWARE_UPDATE_LAST] = {
-    { SET, NO_QUERY, NO_NOTIFY }, /* MBIM_CID_INTEL_FIRMWARE_UPDATE_MODEM_REBOOT */
+    SET    | NO_QUERY | NO_NOTIFY, /* MBIM_CID_INTEL_FIRMWARE_UPDATE_MODEM_REBOOT */
 };
+#endif
 
+#if defined MBIM_SERVICE_MS_BASIC_CONNECT_EXTENSIONS_ENABLED
 /* Note: index of the array is CID-1 */
 #define MBIM_CID_MS_BASIC_CONNECT_EXTENSIONS_LAST MBIM_CID_MS_BASIC_CONNECT_EXTENSIONS_DEVICE_RESET
 static const CidConfig cid_ms_basic_connect_extensions_config [MBIM_CID_MS_BASIC_CONNECT_EXTENSIONS_LAST] = {
-    { SET,    QUERY,    NOTIFY    }, /* MBIM_CID_MS_BASIC_CONNECT_EXTENSIONS_PROVISIONED_CONTEXTS */
-    { SET,    QUERY,    NOTIFY    }, /* MBIM_CID_MS_BASIC_CONNECT_EXTENSIONS_NETWORK_BLACKLIST */
-    { SET,    QUERY,    NOTIFY    }, /* MBIM_CID_MS_BASIC_CONNECT_EXTENSIONS_LTE_ATTACH_CONFIG */
-    { SET,    QUERY,    NOTIFY    }, /* MBIM_CID_MS_BASIC_CONNECT_EXTENSIONS_LTE_ATTACH_STATUS */
-    { NO_SET, QUERY,    NO_NOTIFY }, /* MBIM_CID_MS_BASIC_CONNECT_EXTENSIONS_SYS_CAPS */
-    { NO_SET, QUERY,    NO_NOTIFY }, /* MBIM_CID_MS_BASIC_CONNECT_EXTENSIONS_DEVICE_CAPS */
-    { SET,    QUERY,    NO_NOTIFY }, /* MBIM_CID_MS_BASIC_CONNECT_EXTENSIONS_DEVICE_SLOT_MAPPINGS */
-    { NO_SET, QUERY,    NOTIFY    }, /* MBIM_CID_MS_BASIC_CONNECT_EXTENSIONS_SLOT_INFO_STATUS */
-    { NO_SET, QUERY,    NOTIFY    }, /* MBIM_CID_MS_BASIC_CONNECT_EXTENSIONS_PCO */
-    { SET,    NO_QUERY, NO_NOTIFY }, /* MBIM_CID_MS_BASIC_CONNECT_EXTENSIONS_DEVICE_RESET */
+    SET    | QUERY    | NOTIFY,    /* MBIM_CID_MS_BASIC_CONNECT_EXTENSIONS_PROVISIONED_CONTEXTS */
+    SET    | QUERY    | NOTIFY,    /* MBIM_CID_MS_BASIC_CONNECT_EXTENSIONS_NETWORK_BLACKLIST */
+    SET    | QUERY    | NOTIFY,    /* MBIM_CID_MS_BASIC_CONNECT_EXTENSIONS_LTE_ATTACH_CONFIG */
+    SET    | QUERY    | NOTIFY,    /* MBIM_CID_MS_BASIC_CONNECT_EXTENSIONS_LTE_ATTACH_STATUS */
+    NO_SET | QUERY    | NO_NOTIFY, /* MBIM_CID_MS_BASIC_CONNECT_EXTENSIONS_SYS_CAPS */
+    NO_SET | QUERY    | NO_NOTIFY, /* MBIM_CID_MS_BASIC_CONNECT_EXTENSIONS_DEVICE_CAPS */
+    SET    | QUERY    | NO_NOTIFY, /* MBIM_CID_MS_BASIC_CONNECT_EXTENSIONS_DEVICE_SLOT_MAPPINGS */
+    NO_SET | QUERY    | NOTIFY,    /* MBIM_CID_MS_BASIC_CONNECT_EXTENSIONS_SLOT_INFO_STATUS */
+    NO_SET | QUERY    | NOTIFY,    /* MBIM_CID_MS_BASIC_CONNECT_EXTENSIONS_PCO */
+    SET    | NO_QUERY | NO_NOTIFY, /* MBIM_CID_MS_BASIC_CONNECT_EXTENSIONS_DEVICE_RESET */
 };
+#endif
 
+#if defined MBIM_SERVICE_QDU_ENABLED
 /* Note: index of the array is CID-1 */
 #define MBIM_CID_QDU_LAST MBIM_CID_QDU_FILE_WRITE
 static const CidConfig cid_qdu_config [MBIM_CID_QDU_LAST] = {
-    { SET,    QUERY,    NOTIFY    }, /* MBIM_CID_QDU_UPDATE_SESSION */
-    { SET,    NO_QUERY, NO_NOTIFY }, /* MBIM_CID_QDU_FILE_OPEN */
-    { SET,    NO_QUERY, NO_NOTIFY }, /* MBIM_CID_QDU_FILE_WRITE */
+    SET    | QUERY    | NOTIFY,    /* MBIM_CID_QDU_UPDATE_SESSION */
+    SET    | NO_QUERY | NO_NOTIFY, /* MBIM_CID_QDU_FILE_OPEN */
+    SET    | NO_QUERY | NO_NOTIFY, /* MBIM_CID_QDU_FILE_WRITE */
 };
+#endif
 
+#if defined MBIM_SERVICE_MS_UICC_LOW_LEVEL_ACCESS_ENABLED
 /* Note: index of the array is CID-1 */
 #define MBIM_CID_MS_UICC_LOW_LEVEL_ACCESS_LAST MBIM_CID_MS_UICC_LOW_LEVEL_ACCESS_RESET
 static const CidConfig cid_ms_uicc_low_level_access_config [MBIM_CID_MS_UICC_LOW_LEVEL_ACCESS_LAST] = {
-    { NO_SET,    QUERY,    NO_NOTIFY    }, /* MBIM_CID_MS_UICC_LOW_LEVEL_ACCESS_ATR */
-    { SET,    NO_QUERY,    NO_NOTIFY    }, /* MBIM_CID_MS_UICC_LOW_LEVEL_ACCESS_OPEN_CHANNEL */
-    { SET,    NO_QUERY,    NO_NOTIFY    }, /* MBIM_CID_MS_UICC_LOW_LEVEL_ACCESS_CLOSE_CHANNEL */
-    { SET,    NO_QUERY,    NO_NOTIFY    }, /* MBIM_CID_MS_UICC_LOW_LEVEL_ACCESS_APDU */
-    { SET,       QUERY,    NO_NOTIFY    }, /* MBIM_CID_MS_UICC_LOW_LEVEL_ACCESS_TERMINAL_CAPABILITY */
-    { SET,       QUERY,    NO_NOTIFY    }, /* MBIM_CID_MS_UICC_LOW_LEVEL_ACCESS_RESET */
+    NO_SET | QUERY    | NO_NOTIFY, /* MBIM_CID_MS_UICC_LOW_LEVEL_ACCESS_ATR */
+    SET    | NO_QUERY | NO_NOTIFY, /* MBIM_CID_MS_UICC_LOW_LEVEL_ACCESS_OPEN_CHANNEL */
+    SET    | NO_QUERY | NO_NOTIFY, /* MBIM_CID_MS_UICC_LOW_LEVEL_ACCESS_CLOSE_CHANNEL */
+    SET    | NO_QUERY | NO_NOTIFY, /* MBIM_CID_MS_UICC_LOW_LEVEL_ACCESS_APDU */
+    SET    | QUERY    | NO_NOTIFY, /* MBIM_CID_MS_UICC_LOW_LEVEL_ACCESS_TERMINAL_CAPABILITY */
+    SET    | QUERY    | NO_NOTIFY, /* MBIM_CID_MS_UICC_LOW_LEVEL_ACCESS_RESET */
+};
+#endif
+
+typedef struct {
+    const CidConfig *cids;
+    guint            n_cids;
+    const gchar   *(* get_string) (guint cid);
+} ServiceConfig;
+
+#define SERVICE_CONFIG(cids, get_string) \
+    { cids, G_N_ELEMENTS (cids), (const gchar * (*) (guint)) get_string }
+
+/* Services built in the library, indexed by MbimService */
+static const ServiceConfig service_config [MBIM_SERVICE_LAST] = {
+    [MBIM_SERVICE_BASIC_CONNECT] = SERVICE_CONFIG (cid_basic_connect_config, mbim_cid_basic_connect_get_string),
+#if defined MBIM_SERVICE_SMS_ENABLED
+    [MBIM_SERVICE_SMS] = SERVICE_CONFIG (cid_sms_config, mbim_cid_sms_get_string),
+#endif
+#if defined MBIM_SERVICE_USSD_ENABLED
+    [MBIM_SERVICE_USSD] = SERVICE_CONFIG (cid_ussd_config, mbim_cid_ussd_get_string),
+#endif
+#if defined MBIM_SERVICE_PHONEBOOK_ENABLED
+    [MBIM_SERVICE_PHONEBOOK] = SERVICE_CONFIG (cid_phonebook_config, mbim_cid_phonebook_get_string),
+#endif
+#if defined MBIM_SERVICE_STK_ENABLED
+    [MBIM_SERVICE_STK] = SERVICE_CONFIG (cid_stk_config, mbim_cid_stk_get_string),
+#endif
+#if defined MBIM_SERVICE_AUTH_ENABLED
+    [MBIM_SERVICE_AUTH] = SERVICE_CONFIG (cid_auth_config, mbim_cid_auth_get_string),
+#endif
+#if defined MBIM_SERVICE_DSS_ENABLED
+    [MBIM_SERVICE_DSS] = SERVICE_CONFIG (cid_dss_config, mbim_cid_dss_get_string),
+#endif
+#if defined MBIM_SERVICE_MS_FIRMWARE_ID_ENABLED
+    [MBIM_SERVICE_MS_FIRMWARE_ID] = SERVICE_CONFIG (cid_ms_firmware_id_config, mbim_cid_ms_firmware_id_get_string),
+#endif
+#if defined MBIM_SERVICE_MS_HOST_SHUTDOWN_ENABLED
+    [MBIM_SERVICE_MS_HOST_SHUTDOWN] = SERVICE_CONFIG (cid_ms_host_shutdown_config, mbim_cid_ms_host_shutdown_get_string),
+#endif
+#if defined MBIM_SERVICE_MS_SAR_ENABLED
+    [MBIM_SERVICE_MS_SAR] = SERVICE_CONFIG (cid_ms_sar_config, mbim_cid_ms_sar_get_string),
+#endif
+    [MBIM_SERVICE_PROXY_CONTROL] = SERVICE_CONFIG (cid_proxy_control_config, mbim_cid_proxy_control_get_string),
+#if defined MBIM_SERVICE_QMI_ENABLED
+    [MBIM_SERVICE_QMI] = SERVICE_CONFIG (cid_qmi_config, mbim_cid_qmi_get_string),
+#endif
+#if defined MBIM_SERVICE_ATDS_ENABLED
+    [MBIM_SERVICE_ATDS] = SERVICE_CONFIG (cid_atds_config, mbim_cid_atds_get_string),
+#endif
+#if defined MBIM_SERVICE_INTEL_FIRMWARE_UPDATE_ENABLED
+    [MBIM_SERVICE_INTEL_FIRMWARE_UPDATE] = SERVICE_CONFIG (cid_intel_firmware_update_config, mbim_cid_intel_firmware_update_get_string),
+#endif
+#if defined MBIM_SERVICE_QDU_ENABLED
+    [MBIM_SERVICE_QDU] = SERVICE_CONFIG (cid_qdu_config, mbim_cid_qdu_get_string),
+#endif
+#if defined MBIM_SERVICE_MS_BASIC_CONNECT_EXTENSIONS_ENABLED
+    [MBIM_SERVICE_MS_BASIC_CONNECT_EXTENSIONS] = SERVICE_CONFIG (cid_ms_basic_connect_extensions_config, mbim_cid_ms_basic_connect_extensions_get_string),
+#endif
+#if defined MBIM_SERVICE_MS_UICC_LOW_LEVEL_ACCESS_ENABLED
+    [MBIM_SERVICE_MS_UICC_LOW_LEVEL_ACCESS] = SERVICE_CONFIG (cid_ms_uicc_low_level_access_config, mbim_cid_ms_uicc_low_level_access_get_string),
+#endif
 };
 
+/*****************************************************************************/
+/* Custom service CIDs */
+
+typedef struct {
+    guint         n_cids;
+    CidConfig    *cids;
+    const gchar **names; /* interned */
+} CustomServiceCids;
+
+static GRWLock     custom_service_cids_lock;
+static GHashTable *custom_service_cids;
+
+static void
+custom_service_cids_free (CustomServiceCids *self)
+{
+    g_free (self->cids);
+    g_free (self->names);
+    g_slice_free (CustomServiceCids, self);
+}
+
 gboolean
-mbim_cid_can_set (MbimService service,
-                  guint       cid)
+mbim_register_custom_service_cids (guint                    service,
+                                   const MbimCidCapability *capabilities,
+                                   const gchar * const     *names,
+                                   guint                    n_cids)
 {
-    /* CID = 0 is never a valid command */
-    g_return_val_if_fail (cid > 0, FALSE);
-    /* Known service required */
-    g_return_val_if_fail (service > MBIM_SERVICE_INVALID, FALSE);
-    g_return_val_if_fail (service < MBIM_SERVICE_LAST, FALSE);
-
-    switch (service) {
-    case MBIM_SERVICE_BASIC_CONNECT:
-        return cid_basic_connect_config[cid - 1].set;
-    case MBIM_SERVICE_SMS:
-        return cid_sms_config[cid - 1].set;
-    case MBIM_SERVICE_USSD:
-        return cid_ussd_config[cid - 1].set;
-    case MBIM_SERVICE_PHONEBOOK:
-        return cid_phonebook_config[cid - 1].set;
-    case MBIM_SERVICE_STK:
-        return cid_stk_config[cid - 1].set;
-    case MBIM_SERVICE_AUTH:
-        return cid_auth_config[cid - 1].set;
-    case MBIM_SERVICE_DSS:
-        return cid_dss_config[cid - 1].set;
-    case MBIM_SERVICE_MS_FIRMWARE_ID:
-        return cid_ms_firmware_id_config[cid - 1].set;
-    case MBIM_SERVICE_MS_HOST_SHUTDOWN:
-        return cid_ms_host_shutdown_config[cid - 1].set;
-    case MBIM_SERVICE_MS_SAR:
-        return cid_ms_sar_config[cid - 1].set;
-    case MBIM_SERVICE_PROXY_CONTROL:
-        return cid_proxy_control_config[cid - 1].set;
-    case MBIM_SERVICE_QMI:
-        return cid_qmi_config[cid - 1].set;
-    case MBIM_SERVICE_ATDS:
-        return cid_atds_config[cid - 1].set;
-    case MBIM_SERVICE_INTEL_FIRMWARE_UPDATE:
-        return cid_intel_firmware_update_config[cid - 1].set;
-    case MBIM_SERVICE_QDU:
-        return cid_qdu_config[cid - 1].set;
-    case MBIM_SERVICE_MS_BASIC_CONNECT_EXTENSIONS:
-        return cid_ms_basic_connect_extensions_config[cid - 1].set;
-    case MBIM_SERVICE_MS_UICC_LOW_LEVEL_ACCESS:
-        return cid_ms_uicc_low_level_access_config[cid - 1].set;
-    case MBIM_SERVICE_INVALID:
-    case MBIM_SERVICE_LAST:
-    default:
-        g_assert_not_reached ();
+    CustomServiceCids *self;
+    guint              i;
+
+    g_return_val_if_fail (capabilities != NULL, FALSE);
+    g_return_val_if_fail (n_cids > 0, FALSE);
+
+    self = g_slice_new0 (CustomServiceCids);
+    self->n_cids = n_cids;
+    self->cids = g_new (CidConfig, n_cids);
+    for (i = 0; i < n_cids; i++)
+        self->cids[i] = (CidConfig) (capabilities[i] & (SET | QUERY | NOTIFY));
+    if (names) {
+        /* names are interned so that they can be returned by
+         * mbim_cid_get_printable() even if unregistered meanwhile */
+        self->names = g_new0 (const gchar *, n_cids);
+        for (i = 0; i < n_cids; i++)
+            self->names[i] = g_intern_string (names[i]);
+    }
+
+    /* keep the service registered until the CIDs are stored, the custom
+     * service lock is always taken before the CIDs lock */
+    _mbim_custom_services_lock ();
+    if (!_mbim_service_id_is_custom_unlocked (service)) {
+        _mbim_custom_services_unlock ();
+        custom_service_cids_free (self);
         return FALSE;
     }
+
+    g_rw_lock_writer_lock (&custom_service_cids_lock);
+    if (G_UNLIKELY (!custom_service_cids))
+        custom_service_cids = g_hash_table_new_full (g_direct_hash,
+                                                     g_direct_equal,
+                                                     NULL,
+                                                     (GDestroyNotify) custom_service_cids_free);
+    g_hash_table_replace (custom_service_cids, GUINT_TO_POINTER (service), self);
+    g_rw_lock_writer_unlock (&custom_service_cids_lock);
+    _mbim_custom_services_unlock ();
+
+    return TRUE;
+}
+
+void
+_mbim_cid_unregister_custom_service_cids (guint service)
+{
+    g_rw_lock_writer_lock (&custom_service_cids_lock);
+    if (custom_service_cids)
+        g_hash_table_remove (custom_service_cids, GUINT_TO_POINTER (service));
+    g_rw_lock_writer_unlock (&custom_service_cids_lock);
+}
+
+static MbimCidCapability
+custom_service_cid_lookup (guint         service,
+                           guint         cid,
+                           const gchar **name)
+{
+    CustomServiceCids *self = NULL;
+    MbimCidCapability  capabilities = MBIM_CID_CAPABILITY_NONE;
+
+    g_rw_lock_reader_lock (&custom_service_cids_lock);
+    if (custom_service_cids)
+        self = g_hash_table_lookup (custom_service_cids, GUINT_TO_POINTER (service));
+    if (self && cid <= self->n_cids) {
+        capabilities = (MbimCidCapability) self->cids[cid - 1];
+        if (name)
+            *name = self->names ? self->names[cid - 1] : NULL;
+    }
+    g_rw_lock_reader_unlock (&custom_service_cids_lock);
+
+    return capabilities;
+}
+
+/*****************************************************************************/
+
+MbimCidCapability
+mbim_cid_get_capabilities (MbimService service,
+                           guint       cid)
+{
+    const ServiceConfig *config;
+
+    /* CID = 0 is never a valid command */
+    g_return_val_if_fail (cid > 0, MBIM_CID_CAPABILITY_NONE);
+    /* Known service required */
+    g_return_val_if_fail (service > MBIM_SERVICE_INVALID, MBIM_CID_CAPABILITY_NONE);
+
+    if (service >= MBIM_SERVICE_LAST)
+        return custom_service_cid_lookup (service, cid, NULL);
+
+    config = &service_config[service];
+    if (!config->cids || cid > config->n_cids)
+        return MBIM_CID_CAPABILITY_NONE;
+    return (MbimCidCapability) config->cids[cid - 1];
+}
+
+gboolean
+mbim_cid_can_set (MbimService service,
+                  guint       cid)
+{
+    return !!(mbim_cid_get_capabilities (service, cid) & MBIM_CID_CAPABILITY_SET);
 }
 
 gboolean
 mbim_cid_can_query (MbimService service,
                     guint       cid)
 {
-    /* CID = 0 is never a valid command */
-    g_return_val_if_fail (cid > 0, FALSE);
-    /* Known service required */
-    g_return_val_if_fail (service > MBIM_SERVICE_INVALID, FALSE);
-    g_return_val_if_fail (service < MBIM_SERVICE_LAST, FALSE);
-
-    switch (service) {
-    case MBIM_SERVICE_BASIC_CONNECT:
-        return cid_basic_connect_config[cid - 1].query;
-    case MBIM_SERVICE_SMS:
-        return cid_sms_config[cid - 1].query;
-    case MBIM_SERVICE_USSD:
-        return cid_ussd_config[cid - 1].query;
-    case MBIM_SERVICE_PHONEBOOK:
-        return cid_phonebook_config[cid - 1].query;
-    case MBIM_SERVICE_STK:
-        return cid_stk_config[cid - 1].query;
-    case MBIM_SERVICE_AUTH:
-        return cid_auth_config[cid - 1].query;
-    case MBIM_SERVICE_DSS:
-        return cid_dss_config[cid - 1].query;
-    case MBIM_SERVICE_MS_FIRMWARE_ID:
-        return cid_ms_firmware_id_config[cid - 1].query;
-    case MBIM_SERVICE_MS_HOST_SHUTDOWN:
-        return cid_ms_host_shutdown_config[cid - 1].query;
-    case MBIM_SERVICE_MS_SAR:
-        return cid_ms_sar_config[cid - 1].query;
-    case MBIM_SERVICE_PROXY_CONTROL:
-        return cid_proxy_control_config[cid - 1].query;
-    case MBIM_SERVICE_QMI:
-        return cid_qmi_config[cid - 1].query;
-    case MBIM_SERVICE_ATDS:
-        return cid_atds_config[cid - 1].query;
-    case MBIM_SERVICE_INTEL_FIRMWARE_UPDATE:
-        return cid_intel_firmware_update_config[cid - 1].query;
-    case MBIM_SERVICE_QDU:
-        return cid_qdu_config[cid - 1].query;
-    case MBIM_SERVICE_MS_BASIC_CONNECT_EXTENSIONS:
-        return cid_ms_basic_connect_extensions_config[cid - 1].query;
-    case MBIM_SERVICE_MS_UICC_LOW_LEVEL_ACCESS:
-        return cid_ms_uicc_low_level_access_config[cid - 1].query;
-    case MBIM_SERVICE_INVALID:
-    case MBIM_SERVICE_LAST:
-    default:
-        g_assert_not_reached ();
-        return FALSE;
-    }
+    return !!(mbim_cid_get_capabilities (service, cid) & MBIM_CID_CAPABILITY_QUERY);
 }
 
 gboolean
 mbim_cid_can_notify (MbimService service,
                      guint       cid)
 {
-    /* CID = 0 is never a valid command */
-    g_return_val_if_fail (cid > 0, FALSE);
-    /* Known service required */
-    g_return_val_if_fail (service > MBIM_SERVICE_INVALID, FALSE);
-    g_return_val_if_fail (service < MBIM_SERVICE_LAST, FALSE);
-
-    switch (service) {
-    case MBIM_SERVICE_BASIC_CONNECT:
-        return cid_basic_connect_config[cid - 1].notify;
-    case MBIM_SERVICE_SMS:
-        return cid_sms_config[cid - 1].notify;
-    case MBIM_SERVICE_USSD:
-        return cid_ussd_config[cid - 1].notify;
-    case MBIM_SERVICE_PHONEBOOK:
-        return cid_phonebook_config[cid - 1].notify;
-    case MBIM_SERVICE_STK:
-        return cid_stk_config[cid - 1].notify;
-    case MBIM_SERVICE_AUTH:
-        return cid_auth_config[cid - 1].notify;
-    case MBIM_SERVICE_DSS:
-        return cid_dss_config[cid - 1].notify;
-    case MBIM_SERVICE_MS_FIRMWARE_ID:
-        return cid_ms_firmware_id_config[cid - 1].notify;
-    case MBIM_SERVICE_MS_HOST_SHUTDOWN:
-        return cid_ms_host_shutdown_config[cid - 1].notify;
-    case MBIM_SERVICE_MS_SAR:
-        return cid_ms_sar_config[cid - 1].notify;
-    case MBIM_SERVICE_PROXY_CONTROL:
-        return cid_proxy_control_config[cid - 1].notify;
-    case MBIM_SERVICE_QMI:
-        return cid_qmi_config[cid - 1].notify;
-    case MBIM_SERVICE_ATDS:
-        return cid_atds_config[cid - 1].notify;
-    case MBIM_SERVICE_INTEL_FIRMWARE_UPDATE:
-        return cid_intel_firmware_update_config[cid - 1].notify;
-    case MBIM_SERVICE_QDU:
-        return cid_qdu_config[cid - 1].notify;
-    case MBIM_SERVICE_MS_BASIC_CONNECT_EXTENSIONS:
-        return cid_ms_basic_connect_extensions_config[cid - 1].notify;
-    case MBIM_SERVICE_MS_UICC_LOW_LEVEL_ACCESS:
-        return cid_ms_uicc_low_level_access_config[cid - 1].notify;
-    case MBIM_SERVICE_INVALID:
-    case MBIM_SERVICE_LAST:
-    default:
-        g_assert_not_reached ();
-        return FALSE;
-    }
+    return !!(mbim_cid_get_capabilities (service, cid) & MBIM_CID_CAPABILITY_NOTIFY);
 }
 
 const gchar *
 mbim_cid_get_printable (MbimService service,
                         guint       cid)
 {
+    const gchar *name = NULL;
+
     /* CID = 0 is never a valid command */
     g_return_val_if_fail (cid > 0, NULL);
-    /* Known service required */
-    g_return_val_if_fail (service < MBIM_SERVICE_LAST, NULL);
 
-    switch (service) {
-    case MBIM_SERVICE_INVALID:
+    if (service == MBIM_SERVICE_INVALID)
         return "invalid";
-    case MBIM_SERVICE_BASIC_CONNECT:
-        return mbim_cid_basic_connect_get_string (cid);
-    case MBIM_SERVICE_SMS:
-        return mbim_cid_sms_get_string (cid);
-    case MBIM_SERVICE_USSD:
-        return mbim_cid_ussd_get_string (cid);
-    case MBIM_SERVICE_PHONEBOOK:
-        return mbim_cid_phonebook_get_string (cid);
-    case MBIM_SERVICE_STK:
-        return mbim_cid_stk_get_string (cid);
-    case MBIM_SERVICE_AUTH:
-        return mbim_cid_auth_get_string (cid);
-    case MBIM_SERVICE_DSS:
-        return mbim_cid_dss_get_string (cid);
-    case MBIM_SERVICE_MS_FIRMWARE_ID:
-        return mbim_cid_ms_firmware_id_get_string (cid);
-    case MBIM_SERVICE_MS_HOST_SHUTDOWN:
-        return mbim_cid_ms_host_shutdown_get_string (cid);
-    case MBIM_SERVICE_MS_SAR:
-        return mbim_cid_ms_sar_get_string (cid);
-    case MBIM_SERVICE_PROXY_CONTROL:
-        return mbim_cid_proxy_control_get_string (cid);
-    case MBIM_SERVICE_QMI:
-        return mbim_cid_qmi_get_string (cid);
-    case MBIM_SERVICE_ATDS:
-        return mbim_cid_atds_get_string (cid);
-    case MBIM_SERVICE_INTEL_FIRMWARE_UPDATE:
-        return mbim_cid_intel_firmware_update_get_string (cid);
-    case MBIM_SERVICE_QDU:
-        return mbim_cid_qdu_get_string (cid);
-    case MBIM_SERVICE_MS_BASIC_CONNECT_EXTENSIONS:
-        return mbim_cid_ms_basic_connect_extensions_get_string (cid);
-    case MBIM_SERVICE_MS_UICC_LOW_LEVEL_ACCESS:
-        return mbim_cid_ms_uicc_low_level_access_get_string (cid);
-    case MBIM_SERVICE_LAST:
-    default:
-        g_assert_not_reached ();
-        return NULL;
+
+    if (service >= MBIM_SERVICE_LAST) {
+        custom_service_cid_lookup (service, cid, &name);
+        return name;
     }
+
+    if (!service_config[service].get_string)
+        return NULL;
+    return service_config[service].get_string (cid);
 }
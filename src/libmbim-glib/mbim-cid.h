@@ -253,14 +253,20 @@ typedef enum { /*< since=1.26 >*/
  * MbimCidProxyControl:
  * @MBIM_CID_PROXY_CONTROL_UNKNOWN: Unknown command.
  * @MBIM_CID_PROXY_CONTROL_CONFIGURATION: Configuration.
+ * @MBIM_CID_PROXY_CONTROL_INDICATION_RING: Indication ring shared with the client. Since 1.26.
+ * @MBIM_CID_PROXY_CONTROL_INDICATION_REPLAY: Replay of the last indications seen by the proxy. Since 1.26.
+ * @MBIM_CID_PROXY_CONTROL_STATISTICS: Statistics of the proxy. Since 1.26.
  *
  * MBIM commands in the %MBIM_SERVICE_PROXY_CONTROL service.
  *
  * Since: 1.10
  */
 typedef enum { /*< since=1.10 >*/
-    MBIM_CID_PROXY_CONTROL_UNKNOWN       = 0,
-    MBIM_CID_PROXY_CONTROL_CONFIGURATION = 1
+    MBIM_CID_PROXY_CONTROL_UNKNOWN           = 0,
+    MBIM_CID_PROXY_CONTROL_CONFIGURATION     = 1,
+    MBIM_CID_PROXY_CONTROL_INDICATION_RING   = 2,
+    MBIM_CID_PROXY_CONTROL_INDICATION_REPLAY = 3,
+    MBIM_CID_PROXY_CONTROL_STATISTICS        = 4
 } MbimCidProxyControl;
 
 /**
@@ -389,9 +395,73 @@ typedef enum { /*< since=1.26 >*/
     MBIM_CID_MS_UICC_LOW_LEVEL_ACCESS_RESET                = 6,
 } MbimCidMsUiccLowLevelAccess;
 
+/**
+ * MbimCidCapability:
+ * @MBIM_CID_CAPABILITY_NONE: No capabilities.
+ * @MBIM_CID_CAPABILITY_SET: The command allows setting.
+ * @MBIM_CID_CAPABILITY_QUERY: The command allows querying.
+ * @MBIM_CID_CAPABILITY_NOTIFY: The command allows notifying.
+ *
+ * Operations supported by a given command.
+ *
+ * Since: 1.26
+ */
+typedef enum { /*< since=1.26 >*/
+    MBIM_CID_CAPABILITY_NONE   = 0,
+    MBIM_CID_CAPABILITY_SET    = 1 << 0,
+    MBIM_CID_CAPABILITY_QUERY  = 1 << 1,
+    MBIM_CID_CAPABILITY_NOTIFY = 1 << 2
+} MbimCidCapability;
+
+/**
+ * mbim_cid_get_capabilities:
+ * @service: a #MbimService or custom service.
+ * @cid: a command ID.
+ *
+ * Gets the operations supported by the given command.
+ *
+ * Returns: a bitmask of #MbimCidCapability values.
+ *
+ * Since: 1.26
+ */
+MbimCidCapability mbim_cid_get_capabilities (MbimService service,
+                                             guint       cid);
+
+/**
+ * mbim_register_custom_service_cids:
+ * @service: a custom service registered with mbim_register_custom_service().
+ * @capabilities: (array length=n_cids): the #MbimCidCapability mask of each
+ *  command, indexed by CID - 1.
+ * @names: (array length=n_cids) (nullable): the printable name of each
+ *  command, indexed by CID - 1, or %NULL.
+ * @n_cids: the number of commands in @capabilities and @names.
+ *
+ * Registers the commands supported by a custom @service, so that
+ * mbim_cid_get_capabilities(), mbim_cid_can_set(), mbim_cid_can_query(),
+ * mbim_cid_can_notify() and mbim_cid_get_printable() know about them. Any
+ * previously registered commands of the service are replaced, and they are
+ * all removed when the service is unregistered.
+ *
+ * Returns: %TRUE if the commands were registered, %FALSE if @service is not
+ * a custom service.
+ *
+ * Since: 1.26
+ */
+gboolean mbim_register_custom_service_cids (guint                    service,
+                                            const MbimCidCapability *capabilities,
+                                            const gchar * const     *names,
+                                            guint                    n_cids);
+
+#if defined (LIBMBIM_GLIB_COMPILATION)
+
+G_GNUC_INTERNAL
+void _mbim_cid_unregister_custom_service_cids (guint service);
+
+#endif
+
 /**
  * mbim_cid_can_set:
- * @service: a #MbimService.
+ * @service: a #MbimService or custom service.
  * @cid: a command ID.
  *
  * Checks whether the given command allows setting.
@@ -405,7 +475,7 @@ gboolean mbim_cid_can_set (MbimService service,
 
 /**
  * mbim_cid_can_query:
- * @service: a #MbimService.
+ * @service: a #MbimService or custom service.
  * @cid: a command ID.
  *
  * Checks whether the given command allows querying.
@@ -419,7 +489,7 @@ gboolean mbim_cid_can_query (MbimService service,
 
 /**
  * mbim_cid_can_notify:
- * @service: a #MbimService.
+ * @service: a #MbimService or custom service.
  * @cid: a command ID.
  *
  * Checks whether the given command allows notifying.
@@ -434,7 +504,7 @@ gboolean mbim_cid_can_notify (MbimService service,
 
 /**
  * mbim_cid_get_printable:
- * @service: a #MbimService.
+ * @service: a #MbimService or custom service.
  * @cid: a command ID.
  *
  * Gets a printable string for the command specified by the @service and the
@@ -18,6 +18,8 @@
  * Copyright (C) 2014 Aleksander Morgado <aleksander@aleksander.es>
  */
 
+#include <config.h>
+
 #include "mbim-compat.h"
 
 #ifndef MBIM_DISABLE_DEPRECATED
@@ -67,6 +69,8 @@ mbim_lte_attach_status_free (MbimLteAttachStatus *var)
     g_free (var);
 }
 
+#if defined MBIM_SERVICE_MS_BASIC_CONNECT_EXTENSIONS_ENABLED
+
 MbimMessage *
 mbim_message_ms_basic_connect_extensions_lte_attach_status_query_new (GError **error)
 {
@@ -123,4 +127,6 @@ mbim_message_ms_basic_connect_extensions_lte_attach_status_notification_parse (
     return TRUE;
 }
 
+#endif /* MBIM_SERVICE_MS_BASIC_CONNECT_EXTENSIONS_ENABLED */
+
 #endif /* MBIM_DISABLE_DEPRECATED */
@@ -27,8 +27,11 @@
 
 #include <glib.h>
 
+#include "mbim-version.h"
 #include "mbim-basic-connect.h"
+#if MBIM_HAS_SERVICE (MS_BASIC_CONNECT_EXTENSIONS)
 #include "mbim-ms-basic-connect-extensions.h"
+#endif
 #include "mbim-cid.h"
 
 G_BEGIN_DECLS
@@ -171,6 +174,8 @@ G_DEPRECATED
 void mbim_lte_attach_status_free (MbimLteAttachStatus *var);
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (MbimLteAttachStatus, mbim_lte_attach_status_free)
 
+#if MBIM_HAS_SERVICE (MS_BASIC_CONNECT_EXTENSIONS)
+
 /**
  * mbim_message_ms_basic_connect_extensions_lte_attach_status_query_new:
  * @error: return location for error or %NULL.
@@ -224,6 +229,8 @@ gboolean mbim_message_ms_basic_connect_extensions_lte_attach_status_notification
     MbimLteAttachStatus **out_lte_attach_status,
     GError **error);
 
+#endif /* MBIM_HAS_SERVICE (MS_BASIC_CONNECT_EXTENSIONS) */
+
 #endif /* MBIM_DISABLE_DEPRECATED */
 
 G_END_DECLS
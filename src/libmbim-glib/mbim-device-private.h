@@ -0,0 +1,51 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * libmbim-glib -- GLib/GIO based library to control MBIM devices
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301 USA.
+ *
+ * This is a private non-installed header
+ */
+
+#ifndef _LIBMBIM_GLIB_MBIM_DEVICE_PRIVATE_H_
+#define _LIBMBIM_GLIB_MBIM_DEVICE_PRIVATE_H_
+
+#if !defined (LIBMBIM_GLIB_COMPILATION)
+#error "This is a private header!!"
+#endif
+
+#include <glib.h>
+
+#include "mbim-device.h"
+
+G_BEGIN_DECLS
+
+/*****************************************************************************/
+/* Device file descriptors handed over between proxy processes */
+
+/* Descriptor of the device file, or -1 if the device isn't open or is open
+ * through the proxy; owned by the device */
+gint _mbim_device_peek_fd (MbimDevice *self);
+
+/* Use the given descriptor, already open, instead of opening the device file
+ * on the next open operation; the device takes ownership of @fd */
+void _mbim_device_adopt_fd (MbimDevice *self,
+                            gint        fd);
+
+G_END_DECLS
+
+#endif /* _LIBMBIM_GLIB_MBIM_DEVICE_PRIVATE_H_ */
@@ -35,6 +35,9 @@
 #include <unistd.h>
 #include <gio/gio.h>
 #include <gio/gunixsocketaddress.h>
+#include <gio/gunixfdlist.h>
+#include <gio/gunixfdmessage.h>
+#include <glib-unix.h>
 #include <sys/ioctl.h>
 #define IOCTL_WDM_MAX_COMMAND _IOR('H', 0xA0, guint16)
 
@@ -44,6 +47,7 @@
 #include "mbim-common.h"
 #include "mbim-utils.h"
 #include "mbim-device.h"
+#include "mbim-device-private.h"
 #include "mbim-message.h"
 #include "mbim-message-private.h"
 #include "mbim-error-types.h"
@@ -51,7 +55,10 @@
 #include "mbim-helpers.h"
 #include "mbim-proxy.h"
 #include "mbim-proxy-control.h"
+#include "mbim-proxy-helpers.h"
+#include "mbim-basic-connect.h"
 #include "mbim-net-port-manager.h"
+#include "mbim-indication-ring.h"
 
 static void async_initable_iface_init (GAsyncInitableIface *iface);
 
@@ -99,6 +106,9 @@ struct _MbimDevicePrivate {
     /* WWAN interface */
     gchar *wwan_iface;
 
+    /* Descriptor to use instead of opening the file, or -1 */
+    gint adopted_fd;
+
     /* I/O channel, set when the file is open */
     GIOChannel *iochannel;
     GSource *iochannel_source;
@@ -109,6 +119,19 @@ struct _MbimDevicePrivate {
     /* Support for mbim-proxy */
     GSocketClient *socket_client;
     GSocketConnection *socket_connection;
+    gboolean socket_seqpacket;
+    GUnixFDList *socket_received_fds;
+    guint socket_configured_timeout;
+    gboolean socket_indication_replay;
+    gboolean socket_reuse;
+
+    /* Ring where the proxy publishes indications, if requested, and the
+     * subscribe list last set through the proxy, used to filter them */
+    MbimIndicationRing *indication_ring;
+    gint indication_ring_eventfd;
+    GSource *indication_ring_source;
+    MbimEventEntry **indication_ring_subscribe_list;
+    gsize indication_ring_subscribe_list_size;
 
     /* HT to keep track of ongoing host/function transactions
      *  Host transactions:  created by us
@@ -130,6 +153,9 @@ struct _MbimDevicePrivate {
 };
 
 #define MAX_SPAWN_RETRIES             10
+#define SPAWN_INTERVAL_USECS          (G_USEC_PER_SEC / 2)
+#define SPAWN_RETRY_TIMEOUT_MS        100
+#define SPAWN_READY_TIMEOUT_MS        5000
 #define MAX_CONTROL_TRANSFER          4096
 #define MAX_TIME_BETWEEN_FRAGMENTS_MS 1250
 
@@ -731,6 +757,157 @@ mbim_device_delete_all_links (MbimDevice          *self,
 
 /*****************************************************************************/
 
+typedef struct {
+    GArray    *session_ids;
+    GPtrArray *ifnames;
+} AddLinksResult;
+
+static void
+add_links_result_free (AddLinksResult *ctx)
+{
+    if (ctx->session_ids)
+        g_array_unref (ctx->session_ids);
+    if (ctx->ifnames)
+        g_ptr_array_unref (ctx->ifnames);
+    g_free (ctx);
+}
+
+GPtrArray *
+mbim_device_add_links_finish (MbimDevice    *self,
+                              GAsyncResult  *res,
+                              GArray       **session_ids,
+                              GError       **error)
+{
+    AddLinksResult *ctx;
+    GPtrArray      *ifnames;
+
+    ctx = g_task_propagate_pointer (G_TASK (res), error);
+    if (!ctx)
+        return NULL;
+
+    if (session_ids)
+        *session_ids = g_steal_pointer (&ctx->session_ids);
+
+    ifnames = g_steal_pointer (&ctx->ifnames);
+    add_links_result_free (ctx);
+    return ifnames;
+}
+
+static void
+device_add_links_ready (MbimNetPortManager *net_port_manager,
+                        GAsyncResult       *res,
+                        GTask              *task)
+{
+    GError         *error = NULL;
+    AddLinksResult *ctx;
+
+    ctx = g_new0 (AddLinksResult, 1);
+    ctx->ifnames = mbim_net_port_manager_add_links_finish (net_port_manager, &ctx->session_ids, res, &error);
+
+    if (!ctx->ifnames) {
+        g_prefix_error (&error, "Could not allocate links: ");
+        g_task_return_error (task, error);
+        add_links_result_free (ctx);
+    } else
+        g_task_return_pointer (task, ctx, (GDestroyNotify) add_links_result_free);
+
+    g_object_unref (task);
+}
+
+void
+mbim_device_add_links (MbimDevice          *self,
+                       const guint         *session_ids,
+                       guint                n_session_ids,
+                       const gchar         *base_ifname,
+                       const gchar         *ifname_prefix,
+                       GCancellable        *cancellable,
+                       GAsyncReadyCallback  callback,
+                       gpointer             user_data)
+{
+    GTask  *task;
+    GError *error = NULL;
+    guint   i;
+
+    g_return_if_fail (MBIM_IS_DEVICE (self));
+    g_return_if_fail (base_ifname);
+    g_return_if_fail (session_ids || !n_session_ids);
+    for (i = 0; i < n_session_ids; i++)
+        g_return_if_fail ((session_ids[i] <= MBIM_DEVICE_SESSION_ID_MAX) || (session_ids[i] == MBIM_DEVICE_SESSION_ID_AUTOMATIC));
+
+    task = g_task_new (self, cancellable, callback, user_data);
+
+    if (!setup_net_port_manager (self, &error)) {
+        g_task_return_error (task, error);
+        g_object_unref (task);
+        return;
+    }
+
+    g_assert (self->priv->net_port_manager);
+    mbim_net_port_manager_add_links (self->priv->net_port_manager,
+                                     session_ids,
+                                     n_session_ids,
+                                     base_ifname,
+                                     ifname_prefix,
+                                     5,
+                                     cancellable,
+                                     (GAsyncReadyCallback) device_add_links_ready,
+                                     task);
+}
+
+gboolean
+mbim_device_delete_links_finish (MbimDevice    *self,
+                                 GAsyncResult  *res,
+                                 GError       **error)
+{
+    return g_task_propagate_boolean (G_TASK (res), error);
+}
+
+static void
+device_del_links_ready (MbimNetPortManager *net_port_manager,
+                        GAsyncResult       *res,
+                        GTask              *task)
+{
+    GError *error = NULL;
+
+    if (!mbim_net_port_manager_del_links_finish (net_port_manager, res, &error))
+        g_task_return_error (task, error);
+    else
+        g_task_return_boolean (task, TRUE);
+    g_object_unref (task);
+}
+
+void
+mbim_device_delete_links (MbimDevice          *self,
+                          const gchar * const *ifnames,
+                          GCancellable        *cancellable,
+                          GAsyncReadyCallback  callback,
+                          gpointer             user_data)
+{
+    GTask  *task;
+    GError *error = NULL;
+
+    g_return_if_fail (MBIM_IS_DEVICE (self));
+    g_return_if_fail (ifnames);
+
+    task = g_task_new (self, cancellable, callback, user_data);
+
+    if (!setup_net_port_manager (self, &error)) {
+        g_task_return_error (task, error);
+        g_object_unref (task);
+        return;
+    }
+
+    g_assert (self->priv->net_port_manager);
+    mbim_net_port_manager_del_links (self->priv->net_port_manager,
+                                     ifnames,
+                                     5, /* timeout */
+                                     cancellable,
+                                     (GAsyncReadyCallback) device_del_links_ready,
+                                     task);
+}
+
+/*****************************************************************************/
+
 gboolean
 mbim_device_list_links (MbimDevice   *self,
                         const gchar  *base_ifname,
@@ -808,6 +985,56 @@ finalize_pending_open_request (MbimDevice *self)
     transaction_task_complete_and_free (task, error);
 }
 
+/* The proxy publishes every indication of the device in the ring, so the ones
+ * outside the subscribe list of this client are filtered here, just as the
+ * proxy does for the clients not using the ring. The proxy responds to each
+ * subscribe list request with the whole list of the client. */
+static void
+indication_ring_track_subscribe_list (MbimDevice        *self,
+                                      const MbimMessage *response)
+{
+    g_autoptr(GError)  error = NULL;
+    MbimEventEntry   **entries = NULL;
+    guint32            n_entries = 0;
+
+    if (!self->priv->indication_ring ||
+        MBIM_MESSAGE_GET_MESSAGE_TYPE (response) != MBIM_MESSAGE_TYPE_COMMAND_DONE ||
+        mbim_message_command_done_get_service (response) != MBIM_SERVICE_BASIC_CONNECT ||
+        mbim_message_command_done_get_cid (response) != MBIM_CID_BASIC_CONNECT_DEVICE_SERVICE_SUBSCRIBE_LIST ||
+        mbim_message_command_done_get_status_code (response) != MBIM_STATUS_ERROR_NONE)
+        return;
+
+    if (!mbim_message_device_service_subscribe_list_response_parse (response, &n_entries, &entries, &error)) {
+        g_warning ("[%s] couldn't track the subscribe list of the indication ring: %s",
+                   self->priv->path_display, error->message);
+        return;
+    }
+
+    mbim_event_entry_array_free (self->priv->indication_ring_subscribe_list);
+    self->priv->indication_ring_subscribe_list = entries;
+    self->priv->indication_ring_subscribe_list_size = n_entries;
+}
+
+static gboolean
+indication_ring_subscribed (MbimDevice        *self,
+                            const MbimMessage *indication)
+{
+    const MbimUuid *service_id;
+    gsize           i;
+
+    /* Only the first entry of each service applies, as in the proxy */
+    service_id = mbim_message_indicate_status_get_service_id (indication);
+    for (i = 0; i < self->priv->indication_ring_subscribe_list_size; i++) {
+        const MbimEventEntry *entry;
+
+        entry = self->priv->indication_ring_subscribe_list[i];
+        if (mbim_uuid_cmp (&entry->device_service_id, service_id))
+            return _mbim_proxy_helper_service_subscribe_list_contains (&entry, 1, service_id,
+                                                                       mbim_message_indicate_status_get_cid (indication));
+    }
+    return FALSE;
+}
+
 static void
 process_message (MbimDevice        *self,
                  const MbimMessage *message)
@@ -820,8 +1047,8 @@ process_message (MbimDevice        *self,
     if (mbim_utils_get_traces_enabled ()) {
         g_autofree gchar *printable = NULL;
 
-        printable = mbim_common_str_hex (((GByteArray *)message)->data,
-                                         ((GByteArray *)message)->len,
+        printable = mbim_common_str_hex (message->data,
+                                         message->len,
                                          ':');
         g_debug ("[%s] Received message...%s\n"
                  ">>>>>> RAW:\n"
@@ -829,7 +1056,7 @@ process_message (MbimDevice        *self,
                  ">>>>>>   data   = %s\n",
                  self->priv->path_display,
                  is_partial_fragment ? " (partial fragment)" : "",
-                 ((GByteArray *)message)->len,
+                 message->len,
                  printable);
 
         if (is_partial_fragment) {
@@ -903,6 +1130,7 @@ process_message (MbimDevice        *self,
                 ctx = g_task_get_task_data (task);
                 g_assert (ctx->fragments == NULL);
                 ctx->fragments = mbim_message_dup (message);
+                indication_ring_track_subscribe_list (self, ctx->fragments);
                 transaction_task_complete_and_free (task, NULL);
                 return;
             }
@@ -933,6 +1161,7 @@ process_message (MbimDevice        *self,
                          printable);
             }
 
+            indication_ring_track_subscribe_list (self, ctx->fragments);
             transaction_task_complete_and_free (task, NULL);
             return;
         }
@@ -1023,14 +1252,15 @@ static void
 parse_response (MbimDevice *self)
 {
     do {
-        const MbimMessage *message;
-        guint32            in_length;
+        MbimMessage message_static;
+        MbimMessage *message = &message_static;
+        guint32      in_length;
 
         /* If not even the MBIM header available, just return */
         if (self->priv->response->len < 12)
             return;
 
-        message = (const MbimMessage *)self->priv->response;
+        _mbim_message_init_static (message, self->priv->response->data, self->priv->response->len);
 
         /* Fully ignore data that is clearly not a MBIM message */
         if (!validate_message_type (message)) {
@@ -1045,6 +1275,11 @@ parse_response (MbimDevice *self)
         if (self->priv->response->len < in_length)
             return;
 
+        /* Frame the message and intern its service once, copies of the message
+         * done while processing it keep it */
+        message->len = in_length;
+        _mbim_message_intern_service (message);
+
         /* Play with the received message */
         process_message (self, message);
 
@@ -1058,6 +1293,89 @@ parse_response (MbimDevice *self)
     } while (self->priv->response->len > 0);
 }
 
+/* With a SOCK_SEQPACKET connection to the proxy each datagram holds exactly one
+ * message or fragment, so it is received right away in a buffer of its own size,
+ * without any partial read to reframe. */
+static void
+read_datagrams (MbimDevice *self)
+{
+    GSocket *socket;
+
+    socket = g_socket_connection_get_socket (self->priv->socket_connection);
+    do {
+        g_autoptr(GError)       error = NULL;
+        gssize                  available;
+        gssize                  r;
+        GInputVector            vector;
+        GSocketControlMessage **messages = NULL;
+        gint                    n_messages = 0;
+        gint                    flags = 0;
+        gint                    i;
+
+        /* Port is closed; we're done */
+        if (!self->priv->iochannel_source)
+            break;
+
+        /* Size of the next datagram, if any; 0 for an empty datagram or if
+         * the proxy closed the connection, both end the loop once received */
+        available = mbim_helpers_peek_datagram_size (socket, &error);
+        if (available < 0) {
+            if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+                g_warning ("[%s] %s", self->priv->path_display, error->message);
+            break;
+        }
+
+        g_byte_array_set_size (self->priv->response, (guint) available);
+        vector.buffer = self->priv->response->data;
+        vector.size = (gsize) available;
+        r = g_socket_receive_message (socket,
+                                      NULL,
+                                      &vector,
+                                      1,
+                                      &messages,
+                                      &n_messages,
+                                      &flags,
+                                      NULL,
+                                      &error);
+
+        /* File descriptors sent by the proxy are kept until the response they
+         * come with is processed */
+        for (i = 0; i < n_messages; i++) {
+            if (G_IS_UNIX_FD_MESSAGE (messages[i])) {
+                g_clear_object (&self->priv->socket_received_fds);
+                self->priv->socket_received_fds = g_object_ref (g_unix_fd_message_get_fd_list (G_UNIX_FD_MESSAGE (messages[i])));
+            }
+            g_object_unref (messages[i]);
+        }
+        g_clear_pointer (&messages, g_free);
+
+        if (r <= 0) {
+            g_byte_array_set_size (self->priv->response, 0);
+            if (r < 0 && !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+                g_warning ("[%s] error reading from the socket: '%s'",
+                           self->priv->path_display,
+                           error->message);
+            break;
+        }
+        g_byte_array_set_size (self->priv->response, (guint) r);
+
+        parse_response (self);
+
+        /* If we were force-closed during the processing of a message, we'd be
+         * losing the response array directly, so check just in case */
+        if (!self->priv->response)
+            break;
+
+        /* A message is never split across datagrams, so whatever is left will
+         * never be completed */
+        if (self->priv->response->len > 0) {
+            g_warning ("[%s] discarding %u bytes of truncated datagram",
+                       self->priv->path_display, self->priv->response->len);
+            g_byte_array_set_size (self->priv->response, 0);
+        }
+    } while (TRUE);
+}
+
 static gboolean
 data_available (GIOChannel   *source,
                 GIOCondition  condition,
@@ -1096,7 +1414,9 @@ data_available (GIOChannel   *source,
      * reference is available for as long as we need it in the while()
      * loop. */
     g_object_ref (self);
-    {
+    if (self->priv->socket_seqpacket)
+        read_datagrams (self);
+    else {
         do {
             g_autoptr(GError) error = NULL;
 
@@ -1132,6 +1452,124 @@ data_available (GIOChannel   *source,
     return TRUE;
 }
 
+/* Indications published by the proxy in the ring are processed just like the
+ * ones read from the socket */
+static gboolean
+indication_ring_available (gint          fd,
+                           GIOCondition  condition,
+                           MbimDevice   *self)
+{
+    guint64 value;
+    guint   n_overruns = 0;
+
+    /* Reset the eventfd counter before reading, so that no wakeup is lost */
+    if (read (fd, &value, sizeof (value)) < 0 && errno != EAGAIN)
+        g_warning ("[%s] error reading indication ring eventfd: %s",
+                   self->priv->path_display, g_strerror (errno));
+
+    g_object_ref (self);
+    while (self->priv->indication_ring) {
+        g_autoptr(GBytes)  bytes = NULL;
+        MbimMessage        message_static;
+        MbimMessage       *message = &message_static;
+        const guint8      *data;
+        gsize              data_length;
+
+        bytes = _mbim_indication_ring_read (self->priv->indication_ring, &n_overruns);
+        if (!bytes)
+            break;
+
+        data = g_bytes_get_data (bytes, &data_length);
+        _mbim_message_init_static (message, data, (guint32) data_length);
+        if (data_length < 12 ||
+            MBIM_MESSAGE_GET_MESSAGE_TYPE (message) != MBIM_MESSAGE_TYPE_INDICATE_STATUS ||
+            mbim_message_get_message_length (message) != data_length) {
+            g_warning ("[%s] discarding invalid message in indication ring",
+                       self->priv->path_display);
+            continue;
+        }
+
+        _mbim_message_intern_service (message);
+        if (!indication_ring_subscribed (self, message))
+            continue;
+        process_message (self, message);
+    }
+    g_object_unref (self);
+
+    if (n_overruns)
+        g_warning ("[%s] indications lost: indication ring overrun %u times",
+                   self->priv->path_display, n_overruns);
+
+    return TRUE;
+}
+
+static gboolean
+setup_indication_ring (MbimDevice  *self,
+                       GError     **error)
+{
+    g_autoptr(GUnixFDList) fds = NULL;
+    gint                   ring_fd;
+    gint                   event_fd;
+
+    fds = g_steal_pointer (&self->priv->socket_received_fds);
+    if (!fds || g_unix_fd_list_get_length (fds) != 2) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_INVALID_MESSAGE,
+                     "Indication ring not received");
+        return FALSE;
+    }
+
+    ring_fd = g_unix_fd_list_get (fds, 0, error);
+    if (ring_fd < 0)
+        return FALSE;
+
+    event_fd = g_unix_fd_list_get (fds, 1, error);
+    if (event_fd < 0) {
+        close (ring_fd);
+        return FALSE;
+    }
+
+    self->priv->indication_ring = _mbim_indication_ring_new_from_fd (ring_fd, error);
+    if (!self->priv->indication_ring) {
+        close (ring_fd);
+        close (event_fd);
+        return FALSE;
+    }
+
+    /* Until the subscribe list is set, the proxy uses the standard one */
+    mbim_event_entry_array_free (self->priv->indication_ring_subscribe_list);
+    self->priv->indication_ring_subscribe_list = _mbim_proxy_helper_service_subscribe_list_new_standard (&self->priv->indication_ring_subscribe_list_size);
+
+    self->priv->indication_ring_eventfd = event_fd;
+    self->priv->indication_ring_source = g_unix_fd_source_new (event_fd, G_IO_IN);
+    g_source_set_callback (self->priv->indication_ring_source,
+                           (GSourceFunc)indication_ring_available,
+                           self,
+                           NULL);
+    g_source_attach (self->priv->indication_ring_source, g_main_context_get_thread_default ());
+    return TRUE;
+}
+
+static void
+destroy_indication_ring (MbimDevice *self)
+{
+    g_clear_object (&self->priv->socket_received_fds);
+
+    if (self->priv->indication_ring_source) {
+        g_source_destroy (self->priv->indication_ring_source);
+        g_source_unref (self->priv->indication_ring_source);
+        self->priv->indication_ring_source = NULL;
+    }
+
+    g_clear_pointer (&self->priv->indication_ring, _mbim_indication_ring_free);
+    g_clear_pointer (&self->priv->indication_ring_subscribe_list, mbim_event_entry_array_free);
+    self->priv->indication_ring_subscribe_list_size = 0;
+
+    if (self->priv->indication_ring_eventfd >= 0) {
+        close (self->priv->indication_ring_eventfd);
+        self->priv->indication_ring_eventfd = -1;
+    }
+}
+
 /* "MBIM Control Model Functional Descriptor" */
 struct usb_cdc_mbim_desc {
     guint8  bLength;
@@ -1244,12 +1682,33 @@ read_max_control_transfer (MbimDevice *self)
 }
 
 typedef struct {
-    guint spawn_retries;
+    guint    spawn_retries;
+    gint     ready_fd;
+    GSource *ready_source;
+    GSource *wait_source;
 } CreateIoChannelContext;
 
+static void
+create_iochannel_context_clear_wait (CreateIoChannelContext *ctx)
+{
+    if (ctx->wait_source) {
+        g_source_destroy (ctx->wait_source);
+        g_clear_pointer (&ctx->wait_source, g_source_unref);
+    }
+    if (ctx->ready_source) {
+        g_source_destroy (ctx->ready_source);
+        g_clear_pointer (&ctx->ready_source, g_source_unref);
+    }
+    if (ctx->ready_fd >= 0) {
+        close (ctx->ready_fd);
+        ctx->ready_fd = -1;
+    }
+}
+
 static void
 create_iochannel_context_free (CreateIoChannelContext *ctx)
 {
+    create_iochannel_context_clear_wait (ctx);
     g_slice_free (CreateIoChannelContext, ctx);
 }
 
@@ -1313,7 +1772,12 @@ create_iochannel_with_fd (GTask *task)
 
     self = g_task_get_source_object (task);
     errno = 0;
-    fd = open (self->priv->path, O_RDWR | O_EXCL | O_NONBLOCK | O_NOCTTY);
+    if (self->priv->adopted_fd >= 0) {
+        fd = self->priv->adopted_fd;
+        self->priv->adopted_fd = -1;
+        g_debug ("[%s] using already open descriptor %d", self->priv->path_display, fd);
+    } else
+        fd = open (self->priv->path, O_RDWR | O_EXCL | O_NONBLOCK | O_NOCTTY);
     if (fd < 0) {
         g_task_return_new_error (task,
                                  MBIM_CORE_ERROR,
@@ -1351,39 +1815,344 @@ static void create_iochannel_with_socket (GTask *task);
 static gboolean
 wait_for_proxy_cb (GTask *task)
 {
+    create_iochannel_context_clear_wait (g_task_get_task_data (task));
+    create_iochannel_with_socket (task);
+    return FALSE;
+}
+
+static gboolean
+proxy_ready_cb (gint          fd,
+                GIOCondition  condition,
+                GTask        *task)
+{
+    /* Either ready to accept clients, or exited before getting ready */
+    create_iochannel_context_clear_wait (g_task_get_task_data (task));
     create_iochannel_with_socket (task);
     return FALSE;
 }
 
 static void
-spawn_child_setup (void)
+spawn_child_setup (gpointer user_data)
 {
+    gint ready_fd = GPOINTER_TO_INT (user_data);
+
     if (setpgid (0, 0) < 0)
         g_warning ("couldn't setup proxy specific process group");
+
+    /* The proxy writes to the pipe once listening */
+    if (ready_fd >= 0 && fcntl (ready_fd, F_SETFD, 0) < 0)
+        g_warning ("couldn't pass readiness pipe to the proxy");
 }
 
 static void
-create_iochannel_with_socket (GTask *task)
+spawn_proxy (gint *ready_fd)
 {
-    MbimDevice                *self;
-    CreateIoChannelContext    *ctx;
-    g_autoptr(GSocketAddress)  socket_address = NULL;
-    GError                    *error = NULL;
+    g_auto(GStrv)      argc = NULL;
+    g_autoptr(GError)  error = NULL;
+    gint               ready_pipe[2] = { -1, -1 };
 
-    self = g_task_get_source_object (task);
-    ctx = g_task_get_task_data (task);
+    /* Without the pipe, just poll until the proxy is listening */
+    if (!g_unix_open_pipe (ready_pipe, FD_CLOEXEC, &error)) {
+        g_debug ("couldn't create readiness pipe for mbim-proxy: %s", error->message);
+        g_clear_error (&error);
+    }
+
+    argc = g_new0 (gchar *, 3);
+    argc[0] = g_strdup (LIBEXEC_PATH "/mbim-proxy");
+    if (ready_pipe[1] >= 0)
+        argc[1] = g_strdup_printf ("--ready-fd=%d", ready_pipe[1]);
+
+    if (!g_spawn_async (NULL, /* working directory */
+                        argc,
+                        NULL, /* envp */
+                        G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL,
+                        (GSpawnChildSetupFunc) spawn_child_setup,
+                        GINT_TO_POINTER (ready_pipe[1]),
+                        NULL,
+                        &error)) {
+        g_debug ("error spawning mbim-proxy: %s", error->message);
+        if (ready_pipe[0] >= 0) {
+            close (ready_pipe[0]);
+            ready_pipe[0] = -1;
+        }
+    }
+
+    /* Only the proxy keeps the write end, so that it's closed if the proxy
+     * exits before getting ready */
+    if (ready_pipe[1] >= 0)
+        close (ready_pipe[1]);
+
+    *ready_fd = ready_pipe[0];
+}
+
+/*****************************************************************************/
+/* Proxy connections shared by all devices in the process
+ *
+ * A device opened with MBIM_DEVICE_OPEN_FLAGS_PROXY_REUSE and closed gracefully
+ * leaves its proxy connection parked here, already configured for its path, so
+ * that opening the same path again with the same flag (with the same or with a
+ * new MbimDevice) skips connecting and configuring. Only seqpacket connections
+ * are parked, as those can be drained of unsolicited messages without losing
+ * the framing.
+ *
+ * Before parking, the subscribe list of the connection is reset in the proxy
+ * to the standard one, so that it is reused in the same state as a new
+ * connection. Parked connections not reused for a while are closed. */
+
+#define PARKED_CONNECTION_IDLE_TIMEOUT_SECS 30
+
+typedef struct {
+    gchar             *path;
+    GSocketConnection *connection;
+    guint16            max_control_transfer;
+    guint              configured_timeout;
+    GSource           *drain_source;
+    GSource           *idle_source;
+} ParkedConnection;
+
+G_LOCK_DEFINE_STATIC (proxy_connections);
+static GHashTable *parked_connections;
+static gint64      last_spawn_time;
+
+static void
+parked_connection_free (ParkedConnection *parked)
+{
+    if (parked->drain_source) {
+        g_source_destroy (parked->drain_source);
+        g_source_unref (parked->drain_source);
+    }
+    if (parked->idle_source) {
+        g_source_destroy (parked->idle_source);
+        g_source_unref (parked->idle_source);
+    }
+    g_clear_object (&parked->connection);
+    g_free (parked->path);
+    g_slice_free (ParkedConnection, parked);
+}
+
+static gboolean
+parked_connection_drain_cb (GSocket          *socket,
+                            GIOCondition      condition,
+                            ParkedConnection *parked)
+{
+    gboolean keep = TRUE;
+
+    G_LOCK (proxy_connections);
+
+    /* May have been taken by another thread right before dispatching */
+    if (g_source_is_destroyed (g_main_current_source ())) {
+        G_UNLOCK (proxy_connections);
+        return FALSE;
+    }
+
+    if (condition & (G_IO_HUP | G_IO_ERR))
+        keep = FALSE;
+    else {
+        /* Indications may still be forwarded by the proxy, just drop them;
+         * datagrams longer than the buffer are truncated */
+        while (TRUE) {
+            g_autoptr(GError) error = NULL;
+            guint8            buffer[512];
+            gssize            n;
+
+            n = g_socket_receive (socket, (gchar *)buffer, sizeof (buffer), NULL, &error);
+            if (n < 0 && g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+                break;
+            if (n <= 0) {
+                keep = FALSE;
+                break;
+            }
+        }
+    }
+
+    if (!keep) {
+        g_debug ("[%s] parked proxy connection closed", parked->path);
+        g_hash_table_remove (parked_connections, parked->path);
+    }
+
+    G_UNLOCK (proxy_connections);
+    return keep;
+}
+
+static gboolean
+parked_connection_idle_cb (ParkedConnection *parked)
+{
+    G_LOCK (proxy_connections);
+
+    /* May have been taken by another thread right before dispatching */
+    if (!g_source_is_destroyed (g_main_current_source ())) {
+        g_debug ("[%s] parked proxy connection not reused, closing it", parked->path);
+        g_hash_table_remove (parked_connections, parked->path);
+    }
+
+    G_UNLOCK (proxy_connections);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean device_send (MbimDevice   *self,
+                             MbimMessage  *message,
+                             GError      **error);
+
+static gboolean
+reset_proxy_subscribe_list (MbimDevice *self)
+{
+    g_autoptr(MbimEventEntryArray) entries = NULL;
+    g_autoptr(MbimMessage)         request = NULL;
+    g_autoptr(GError)              error = NULL;
+    gsize                          n_entries;
+
+    /* The response is dropped while the connection is parked */
+    entries = _mbim_proxy_helper_service_subscribe_list_new_standard (&n_entries);
+    request = mbim_message_device_service_subscribe_list_set_new ((guint32) n_entries,
+                                                                  (const MbimEventEntry *const *) entries,
+                                                                  &error);
+    if (request) {
+        mbim_message_set_transaction_id (request, mbim_device_get_next_transaction_id (self));
+        if (device_send (self, request, &error))
+            return TRUE;
+    }
+
+    g_debug ("[%s] couldn't reset the proxy subscribe list: %s",
+             self->priv->path_display, error->message);
+    return FALSE;
+}
+
+static void
+park_proxy_connection (MbimDevice *self)
+{
+    ParkedConnection *parked;
+    GSocket          *socket;
+
+    /* Only if asked to. Connections with pending operations, receiving
+     * indications through a ring or replaying indications are not reusable
+     * as they are */
+    if (!self->priv->socket_reuse ||
+        !self->priv->socket_connection ||
+        !self->priv->socket_seqpacket ||
+        !self->priv->socket_configured_timeout ||
+        self->priv->socket_indication_replay ||
+        self->priv->indication_ring ||
+        (self->priv->transactions[TRANSACTION_TYPE_HOST] &&
+         g_hash_table_size (self->priv->transactions[TRANSACTION_TYPE_HOST]) > 0))
+        return;
+
+    if (!reset_proxy_subscribe_list (self))
+        return;
+
+    /* Detach the connection from the channel, keeping the socket open */
+    if (self->priv->iochannel_source) {
+        g_source_destroy (self->priv->iochannel_source);
+        g_source_unref (self->priv->iochannel_source);
+        self->priv->iochannel_source = NULL;
+    }
+    if (self->priv->iochannel) {
+        g_io_channel_set_close_on_unref (self->priv->iochannel, FALSE);
+        g_io_channel_unref (self->priv->iochannel);
+        self->priv->iochannel = NULL;
+    }
+
+    parked = g_slice_new0 (ParkedConnection);
+    parked->path = g_strdup (self->priv->path);
+    parked->connection = g_steal_pointer (&self->priv->socket_connection);
+    parked->max_control_transfer = self->priv->max_control_transfer;
+    parked->configured_timeout = self->priv->socket_configured_timeout;
+
+    socket = g_socket_connection_get_socket (parked->connection);
+    parked->drain_source = g_socket_create_source (socket, G_IO_IN | G_IO_ERR | G_IO_HUP, NULL);
+    g_source_set_callback (parked->drain_source,
+                           (GSourceFunc)parked_connection_drain_cb,
+                           parked,
+                           NULL);
+    parked->idle_source = g_timeout_source_new_seconds (PARKED_CONNECTION_IDLE_TIMEOUT_SECS);
+    g_source_set_callback (parked->idle_source,
+                           (GSourceFunc)parked_connection_idle_cb,
+                           parked,
+                           NULL);
+
+    G_LOCK (proxy_connections);
+    if (!parked_connections)
+        parked_connections = g_hash_table_new_full (g_str_hash,
+                                                    g_str_equal,
+                                                    NULL,
+                                                    (GDestroyNotify)parked_connection_free);
+    g_hash_table_replace (parked_connections, parked->path, parked);
+    g_source_attach (parked->drain_source, g_main_context_get_thread_default ());
+    g_source_attach (parked->idle_source, g_main_context_get_thread_default ());
+    G_UNLOCK (proxy_connections);
+
+    g_debug ("[%s] proxy connection parked for reuse", self->priv->path_display);
+}
+
+static gboolean
+reuse_proxy_connection (MbimDevice *self)
+{
+    ParkedConnection *parked = NULL;
+
+    if (!self->priv->socket_reuse)
+        return FALSE;
+
+    G_LOCK (proxy_connections);
+    if (parked_connections)
+        parked = g_hash_table_lookup (parked_connections, self->priv->path);
+    if (parked) {
+        g_hash_table_steal (parked_connections, self->priv->path);
+        g_source_destroy (parked->drain_source);
+        g_clear_pointer (&parked->drain_source, g_source_unref);
+        g_source_destroy (parked->idle_source);
+        g_clear_pointer (&parked->idle_source, g_source_unref);
+    }
+    G_UNLOCK (proxy_connections);
+
+    if (!parked)
+        return FALSE;
+
+    g_debug ("[%s] reusing parked proxy connection", self->priv->path_display);
+
+    g_assert (!self->priv->socket_connection);
+    self->priv->socket_connection = g_steal_pointer (&parked->connection);
+    self->priv->socket_seqpacket = TRUE;
+    self->priv->socket_configured_timeout = parked->configured_timeout;
+    self->priv->max_control_transfer = parked->max_control_transfer;
+    parked_connection_free (parked);
+    return TRUE;
+}
+
+static gboolean
+spawn_proxy_allowed (void)
+{
+    gboolean allowed;
+    gint64   now;
+
+    /* Devices opened in parallel while the proxy isn't running yet would
+     * otherwise each spawn their own one */
+    now = g_get_monotonic_time ();
+    G_LOCK (proxy_connections);
+    allowed = (!last_spawn_time || (now - last_spawn_time) >= SPAWN_INTERVAL_USECS);
+    if (allowed)
+        last_spawn_time = now;
+    G_UNLOCK (proxy_connections);
+    return allowed;
+}
+
+static gboolean
+connect_to_proxy (MbimDevice   *self,
+                  GSocketType   socket_type,
+                  const gchar  *socket_path,
+                  GError      **error)
+{
+    g_autoptr(GSocketAddress) socket_address = NULL;
 
     /* Create socket client */
     if (self->priv->socket_client)
         g_object_unref (self->priv->socket_client);
     self->priv->socket_client = g_socket_client_new ();
     g_socket_client_set_family (self->priv->socket_client, G_SOCKET_FAMILY_UNIX);
-    g_socket_client_set_socket_type (self->priv->socket_client, G_SOCKET_TYPE_STREAM);
+    g_socket_client_set_socket_type (self->priv->socket_client, socket_type);
     g_socket_client_set_protocol (self->priv->socket_client, G_SOCKET_PROTOCOL_DEFAULT);
 
     /* Setup socket address */
     socket_address = (g_unix_socket_address_new_with_type (
-                          MBIM_PROXY_SOCKET_PATH,
+                          socket_path,
                           -1,
                           G_UNIX_SOCKET_ADDRESS_ABSTRACT));
 
@@ -1394,15 +2163,49 @@ create_iochannel_with_socket (GTask *task)
                                               self->priv->socket_client,
                                               G_SOCKET_CONNECTABLE (socket_address),
                                               NULL,
-                                              &error));
-
+                                              error));
     if (!self->priv->socket_connection) {
-        g_auto(GStrv)      argc = NULL;
-        g_autoptr(GSource) source = NULL;
+        g_clear_object (&self->priv->socket_client);
+        return FALSE;
+    }
+
+    /* Datagrams are received along with their control messages through the
+     * socket API, which must never block */
+    self->priv->socket_seqpacket = (socket_type == G_SOCKET_TYPE_SEQPACKET);
+    if (self->priv->socket_seqpacket)
+        g_socket_set_blocking (g_socket_connection_get_socket (self->priv->socket_connection), FALSE);
+    return TRUE;
+}
 
+static void
+create_iochannel_with_socket (GTask *task)
+{
+    MbimDevice             *self;
+    CreateIoChannelContext *ctx;
+    GError                 *error = NULL;
+
+    self = g_task_get_source_object (task);
+    ctx = g_task_get_task_data (task);
+
+    if (reuse_proxy_connection (self)) {
+        self->priv->iochannel = g_io_channel_unix_new (
+                                         g_socket_get_fd (
+                                             g_socket_connection_get_socket (self->priv->socket_connection)));
+        setup_iochannel (task);
+        return;
+    }
+
+    /* Prefer the message-based socket, and fallback to the stream-based one
+     * if the proxy doesn't provide it */
+    if (!connect_to_proxy (self, G_SOCKET_TYPE_SEQPACKET, MBIM_PROXY_SEQPACKET_SOCKET_PATH, &error)) {
+        g_debug ("cannot connect to proxy using a seqpacket socket: %s", error->message);
+        g_clear_error (&error);
+        connect_to_proxy (self, G_SOCKET_TYPE_STREAM, MBIM_PROXY_SOCKET_PATH, &error);
+    }
+
+    if (!self->priv->socket_connection) {
         g_debug ("cannot connect to proxy: %s", error->message);
         g_clear_error (&error);
-        g_clear_object (&self->priv->socket_client);
 
         /* Don't retry forever */
         ctx->spawn_retries++;
@@ -1415,26 +2218,23 @@ create_iochannel_with_socket (GTask *task)
             return;
         }
 
-        g_debug ("spawning new mbim-proxy (try %u)...", ctx->spawn_retries);
-
-        argc = g_new0 (gchar *, 2);
-        argc[0] = g_strdup (LIBEXEC_PATH "/mbim-proxy");
-        if (!g_spawn_async (NULL, /* working directory */
-                            argc,
-                            NULL, /* envp */
-                            G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL,
-                            (GSpawnChildSetupFunc) spawn_child_setup,
-                            NULL, /* child_setup_user_data */
-                            NULL,
-                            &error)) {
-            g_debug ("error spawning mbim-proxy: %s", error->message);
-            g_clear_error (&error);
+        if (!spawn_proxy_allowed ())
+            g_debug ("waiting for recently spawned mbim-proxy (try %u)...", ctx->spawn_retries);
+        else {
+            g_debug ("spawning new mbim-proxy (try %u)...", ctx->spawn_retries);
+            spawn_proxy (&ctx->ready_fd);
         }
 
-        /* Wait some ms and retry */
-        source = g_timeout_source_new (100);
-        g_source_set_callback (source, (GSourceFunc)wait_for_proxy_cb, task, NULL);
-        g_source_attach (source, g_main_context_get_thread_default ());
+        /* Retry as soon as the proxy reports being ready; if readiness cannot
+         * be reported, wait some ms and retry */
+        if (ctx->ready_fd >= 0) {
+            ctx->ready_source = g_unix_fd_source_new (ctx->ready_fd, G_IO_IN | G_IO_ERR | G_IO_HUP);
+            g_source_set_callback (ctx->ready_source, (GSourceFunc)proxy_ready_cb, task, NULL);
+            g_source_attach (ctx->ready_source, g_main_context_get_thread_default ());
+        }
+        ctx->wait_source = g_timeout_source_new (ctx->ready_fd >= 0 ? SPAWN_READY_TIMEOUT_MS : SPAWN_RETRY_TIMEOUT_MS);
+        g_source_set_callback (ctx->wait_source, (GSourceFunc)wait_for_proxy_cb, task, NULL);
+        g_source_attach (ctx->wait_source, g_main_context_get_thread_default ());
         return;
     }
 
@@ -1457,8 +2257,9 @@ create_iochannel (MbimDevice           *self,
     CreateIoChannelContext *ctx;
     GTask *task;
 
-    ctx = g_slice_new (CreateIoChannelContext);
+    ctx = g_slice_new0 (CreateIoChannelContext);
     ctx->spawn_retries = 0;
+    ctx->ready_fd = -1;
 
     task = g_task_new (self, NULL, callback, user_data);
     g_task_set_task_data (task, ctx, (GDestroyNotify)create_iochannel_context_free);
@@ -1487,6 +2288,8 @@ typedef enum {
     DEVICE_OPEN_CONTEXT_STEP_FLAGS_PROXY,
     DEVICE_OPEN_CONTEXT_STEP_CLOSE_MESSAGE,
     DEVICE_OPEN_CONTEXT_STEP_OPEN_MESSAGE,
+    DEVICE_OPEN_CONTEXT_STEP_INDICATION_RING,
+    DEVICE_OPEN_CONTEXT_STEP_INDICATION_REPLAY,
     DEVICE_OPEN_CONTEXT_STEP_LAST
 } DeviceOpenContextStep;
 
@@ -1656,6 +2459,8 @@ proxy_cfg_message_ready (MbimDevice   *self,
         return;
     }
 
+    self->priv->socket_configured_timeout = ctx->timeout;
+
     ctx->step++;
     device_open_context_step (task);
 }
@@ -1683,6 +2488,98 @@ proxy_cfg_message (GTask *task)
                          task);
 }
 
+static void
+proxy_indication_ring_message_ready (MbimDevice   *self,
+                                     GAsyncResult *res,
+                                     GTask        *task)
+{
+    DeviceOpenContext      *ctx;
+    g_autoptr(GError)       error = NULL;
+    g_autoptr(MbimMessage)  response = NULL;
+
+    ctx = g_task_get_task_data (task);
+
+    /* Not a hard error, indications are then received through the socket */
+    response = mbim_device_command_finish (self, res, &error);
+    if (!response ||
+        !mbim_message_response_get_result (response, MBIM_MESSAGE_TYPE_COMMAND_DONE, &error) ||
+        !setup_indication_ring (self, &error)) {
+        g_debug ("[%s] indication ring not available: %s",
+                 self->priv->path_display, error->message);
+        g_clear_object (&self->priv->socket_received_fds);
+    } else
+        g_debug ("[%s] receiving indications through the indication ring",
+                 self->priv->path_display);
+
+    ctx->step++;
+    device_open_context_step (task);
+}
+
+static void
+proxy_indication_ring_message (GTask *task)
+{
+    MbimDevice             *self;
+    DeviceOpenContext      *ctx;
+    g_autoptr(MbimMessage)  request = NULL;
+
+    self = g_task_get_source_object (task);
+    ctx = g_task_get_task_data (task);
+
+    request = mbim_message_proxy_control_indication_ring_set_new (NULL);
+    g_assert (request);
+
+    mbim_device_command (self,
+                         request,
+                         ctx->timeout,
+                         g_task_get_cancellable (task),
+                         (GAsyncReadyCallback)proxy_indication_ring_message_ready,
+                         task);
+}
+
+static void
+proxy_indication_replay_message_ready (MbimDevice   *self,
+                                       GAsyncResult *res,
+                                       GTask        *task)
+{
+    DeviceOpenContext      *ctx;
+    g_autoptr(GError)       error = NULL;
+    g_autoptr(MbimMessage)  response = NULL;
+
+    ctx = g_task_get_task_data (task);
+
+    /* Not a hard error, the client just needs to query the device itself */
+    response = mbim_device_command_finish (self, res, &error);
+    if (!response || !mbim_message_response_get_result (response, MBIM_MESSAGE_TYPE_COMMAND_DONE, &error))
+        g_debug ("[%s] indication replay not available: %s",
+                 self->priv->path_display, error->message);
+    else
+        self->priv->socket_indication_replay = TRUE;
+
+    ctx->step++;
+    device_open_context_step (task);
+}
+
+static void
+proxy_indication_replay_message (GTask *task)
+{
+    MbimDevice             *self;
+    DeviceOpenContext      *ctx;
+    g_autoptr(MbimMessage)  request = NULL;
+
+    self = g_task_get_source_object (task);
+    ctx = g_task_get_task_data (task);
+
+    request = mbim_message_proxy_control_indication_replay_set_new (NULL);
+    g_assert (request);
+
+    mbim_device_command (self,
+                         request,
+                         ctx->timeout,
+                         g_task_get_cancellable (task),
+                         (GAsyncReadyCallback)proxy_indication_replay_message_ready,
+                         task);
+}
+
 static void
 create_iochannel_ready (MbimDevice   *self,
                         GAsyncResult *res,
@@ -1754,6 +2651,8 @@ device_open_context_step (GTask *task)
         /* Fall through */
 
     case DEVICE_OPEN_CONTEXT_STEP_CREATE_IOCHANNEL:
+        self->priv->socket_reuse = ((ctx->flags & MBIM_DEVICE_OPEN_FLAGS_PROXY) &&
+                                    (ctx->flags & MBIM_DEVICE_OPEN_FLAGS_PROXY_REUSE));
         create_iochannel (self,
                           !!(ctx->flags & MBIM_DEVICE_OPEN_FLAGS_PROXY),
                           (GAsyncReadyCallback)create_iochannel_ready,
@@ -1761,7 +2660,9 @@ device_open_context_step (GTask *task)
         return;
 
     case DEVICE_OPEN_CONTEXT_STEP_FLAGS_PROXY:
-        if (ctx->flags & MBIM_DEVICE_OPEN_FLAGS_PROXY) {
+        /* A reused connection is already configured for this device */
+        if ((ctx->flags & MBIM_DEVICE_OPEN_FLAGS_PROXY) &&
+            (self->priv->socket_configured_timeout != ctx->timeout)) {
             proxy_cfg_message (task);
             return;
         }
@@ -1787,6 +2688,28 @@ device_open_context_step (GTask *task)
         ctx->step++;
         /* Fall through */
 
+    case DEVICE_OPEN_CONTEXT_STEP_INDICATION_RING:
+        if ((ctx->flags & MBIM_DEVICE_OPEN_FLAGS_PROXY) &&
+            (ctx->flags & MBIM_DEVICE_OPEN_FLAGS_PROXY_INDICATION_RING)) {
+            if (self->priv->socket_seqpacket) {
+                proxy_indication_ring_message (task);
+                return;
+            }
+            g_debug ("[%s] indication ring not available: no seqpacket connection to the proxy",
+                     self->priv->path_display);
+        }
+        ctx->step++;
+        /* Fall through */
+
+    case DEVICE_OPEN_CONTEXT_STEP_INDICATION_REPLAY:
+        if ((ctx->flags & MBIM_DEVICE_OPEN_FLAGS_PROXY) &&
+            (ctx->flags & MBIM_DEVICE_OPEN_FLAGS_PROXY_INDICATION_REPLAY)) {
+            proxy_indication_replay_message (task);
+            return;
+        }
+        ctx->step++;
+        /* Fall through */
+
     case DEVICE_OPEN_CONTEXT_STEP_LAST:
         /* Nothing else to process, complete without error */
         self->priv->open_status = OPEN_STATUS_OPEN;
@@ -1870,6 +2793,12 @@ destroy_iochannel (MbimDevice  *self,
     /* Failures when closing still make the device to get closed */
     g_clear_object (&self->priv->socket_connection);
     g_clear_object (&self->priv->socket_client);
+    self->priv->socket_seqpacket = FALSE;
+    self->priv->socket_configured_timeout = 0;
+    self->priv->socket_indication_replay = FALSE;
+    self->priv->socket_reuse = FALSE;
+
+    destroy_indication_ring (self);
 
     if (self->priv->iochannel_source) {
         g_source_destroy (self->priv->iochannel_source);
@@ -1930,10 +2859,14 @@ close_message_ready (MbimDevice   *self,
         g_task_return_error (task, error);
     else if (!mbim_message_response_get_result (response, MBIM_MESSAGE_TYPE_CLOSE_DONE, &error))
         g_task_return_error (task, error);
-    else if (!destroy_iochannel (self, &error))
-        g_task_return_error (task, error);
-    else
-        g_task_return_boolean (task, TRUE);
+    else {
+        /* Explicitly closed, so the proxy connection can be reused as is */
+        park_proxy_connection (self);
+        if (!destroy_iochannel (self, &error))
+            g_task_return_error (task, error);
+        else
+            g_task_return_boolean (task, TRUE);
+    }
     g_object_unref (task);
 }
 
@@ -2018,6 +2951,31 @@ mbim_device_get_transaction_id (MbimDevice *self)
 
 /*****************************************************************************/
 
+gint
+_mbim_device_peek_fd (MbimDevice *self)
+{
+    g_return_val_if_fail (MBIM_IS_DEVICE (self), -1);
+
+    if (!self->priv->iochannel || self->priv->socket_connection)
+        return -1;
+
+    return g_io_channel_unix_get_fd (self->priv->iochannel);
+}
+
+void
+_mbim_device_adopt_fd (MbimDevice *self,
+                       gint        fd)
+{
+    g_return_if_fail (MBIM_IS_DEVICE (self));
+    g_return_if_fail (fd >= 0);
+
+    if (self->priv->adopted_fd >= 0)
+        close (self->priv->adopted_fd);
+    self->priv->adopted_fd = fd;
+}
+
+/*****************************************************************************/
+
 static gboolean
 device_write (MbimDevice    *self,
               const guint8  *data,
@@ -2087,7 +3045,7 @@ device_send (MbimDevice   *self,
                  "<<<<<<   length = %u\n"
                  "<<<<<<   data   = %s\n",
                  self->priv->path_display,
-                 ((GByteArray *)message)->len,
+                 message->len,
                  hex);
 
         printable = mbim_message_get_printable (message, "<<<<<< ", FALSE);
@@ -2114,8 +3072,12 @@ device_send (MbimDevice   *self,
         g_byte_array_append (full_fragment, (guint8 *)&fragments[i].fragment_header, sizeof (fragments[i].fragment_header));
 
         /* Build dummy message with only headers for printable purposes only */
-        if (mbim_utils_get_traces_enabled ())
-            printable_headers = mbim_message_get_printable ((MbimMessage *)full_fragment, "<<<<<< ", TRUE);
+        if (mbim_utils_get_traces_enabled ()) {
+            MbimMessage headers;
+
+            _mbim_message_init_static (&headers, full_fragment->data, full_fragment->len);
+            printable_headers = mbim_message_get_printable (&headers, "<<<<<< ", TRUE);
+        }
 
         /* Append the actual fragment data */
         g_byte_array_append (full_fragment, (guint8 *)fragments[i].data, fragments[i].data_length);
@@ -2233,9 +3195,10 @@ mbim_device_command (MbimDevice          *self,
     g_return_if_fail (message != NULL);
 
     /* If the message comes without a explicit transaction ID, add one
-     * ourselves */
+     * ourselves. Prepared commands are submitted multiple times, so they
+     * always get a new one, rewritten in place. */
     transaction_id = mbim_message_get_transaction_id (message);
-    if (!transaction_id) {
+    if (!transaction_id || message->prepared) {
         transaction_id = mbim_device_get_next_transaction_id (self);
         mbim_message_set_transaction_id (message, transaction_id);
     }
@@ -2450,6 +3413,8 @@ mbim_device_init (MbimDevice *self)
     /* Initialize transaction ID */
     self->priv->transaction_id = 0x01;
     self->priv->open_status = OPEN_STATUS_CLOSED;
+    self->priv->indication_ring_eventfd = -1;
+    self->priv->adopted_fd = -1;
 }
 
 static void
@@ -2462,6 +3427,11 @@ dispose (GObject *object)
     destroy_iochannel (self, NULL);
     g_clear_object (&self->priv->net_port_manager);
 
+    if (self->priv->adopted_fd >= 0) {
+        close (self->priv->adopted_fd);
+        self->priv->adopted_fd = -1;
+    }
+
     G_OBJECT_CLASS (mbim_device_parent_class)->dispose (object);
 }
 
@@ -229,14 +229,31 @@ gboolean mbim_device_is_open (MbimDevice *self);
  * MbimDeviceOpenFlags:
  * @MBIM_DEVICE_OPEN_FLAGS_NONE: None.
  * @MBIM_DEVICE_OPEN_FLAGS_PROXY: Try to open the port through the 'mbim-proxy'.
+ * @MBIM_DEVICE_OPEN_FLAGS_PROXY_INDICATION_RING: When opening the port through
+ *  the 'mbim-proxy', try to receive indications through a ring in memory shared
+ *  with the proxy instead of through the proxy socket. Meant for clients
+ *  monitoring high rates of indications, which may lose the oldest ones if
+ *  they don't keep up. Since 1.26.
+ * @MBIM_DEVICE_OPEN_FLAGS_PROXY_INDICATION_REPLAY: When opening the port
+ *  through the 'mbim-proxy', ask the proxy to send right away the last
+ *  indication it received for each CID the client is subscribed to, and to do
+ *  the same for the CIDs added in later subscribe list updates. Allows clients
+ *  to learn the current state of the device without querying it. Since 1.26.
+ * @MBIM_DEVICE_OPEN_FLAGS_PROXY_REUSE: When opening the port through the
+ *  'mbim-proxy', reuse a connection to the proxy left by a previous device
+ *  with the same path in the same process, and leave the connection to be
+ *  reused when the device is closed with mbim_device_close(). Since 1.26.
  *
  * Flags to specify which actions to be performed when the device is open.
  *
  * Since: 1.10
  */
 typedef enum { /*< since=1.10 >*/
-    MBIM_DEVICE_OPEN_FLAGS_NONE  = 0,
-    MBIM_DEVICE_OPEN_FLAGS_PROXY = 1 << 0
+    MBIM_DEVICE_OPEN_FLAGS_NONE                    = 0,
+    MBIM_DEVICE_OPEN_FLAGS_PROXY                   = 1 << 0,
+    MBIM_DEVICE_OPEN_FLAGS_PROXY_INDICATION_RING   = 1 << 1,
+    MBIM_DEVICE_OPEN_FLAGS_PROXY_INDICATION_REPLAY = 1 << 2,
+    MBIM_DEVICE_OPEN_FLAGS_PROXY_REUSE             = 1 << 3
 } MbimDeviceOpenFlags;
 
 /**
@@ -328,6 +345,11 @@ gboolean mbim_device_open_finish (MbimDevice    *self,
  *
  * Asynchronously closes a #MbimDevice for I/O.
  *
+ * If the device was opened with %MBIM_DEVICE_OPEN_FLAGS_PROXY_REUSE, the
+ * connection to the proxy may be kept around for a while after the close, so
+ * that opening the same device path again in the same process reuses it. Use
+ * mbim_device_close_force() to always close the connection.
+ *
  * When the operation is finished @callback will be called. You can then call
  * mbim_device_close_finish() to get the result of the operation.
  *
@@ -606,6 +628,106 @@ gboolean mbim_device_delete_all_links_finish (MbimDevice    *self,
                                               GAsyncResult  *res,
                                               GError       **error);
 
+/**
+ * mbim_device_add_links:
+ * @self: a #MbimDevice.
+ * @session_ids: (array length=n_session_ids): the session ids for the links,
+ *   each one in the [#MBIM_DEVICE_SESSION_ID_MIN,#MBIM_DEVICE_SESSION_ID_MAX]
+ *   range, or #MBIM_DEVICE_SESSION_ID_AUTOMATIC to find the first available
+ *   session id.
+ * @n_session_ids: the number of items in @session_ids.
+ * @base_ifname: the interface which the new links will be created on.
+ * @ifname_prefix: the prefix suggested to be used for the name of the new links
+ *   created.
+ * @cancellable: a #GCancellable, or %NULL.
+ * @callback: a #GAsyncReadyCallback to call when the operation is finished.
+ * @user_data: the data to pass to callback function.
+ *
+ * Asynchronously creates several new virtual network device nodes on top of
+ * @base_ifname at once, as mbim_device_add_link() does for a single one.
+ *
+ * All the links are requested to the kernel in a single batch, instead of
+ * waiting for each one to be created before requesting the next one.
+ *
+ * The links are created independently of each other, so if the creation of
+ * one of them fails, the ones already created are not removed.
+ *
+ * When the operation is finished @callback will be called. You can then call
+ * mbim_device_add_links_finish() to get the result of the operation.
+ *
+ * Since: 1.26
+ */
+void mbim_device_add_links (MbimDevice          *self,
+                            const guint         *session_ids,
+                            guint                n_session_ids,
+                            const gchar         *base_ifname,
+                            const gchar         *ifname_prefix,
+                            GCancellable        *cancellable,
+                            GAsyncReadyCallback  callback,
+                            gpointer             user_data);
+
+/**
+ * mbim_device_add_links_finish:
+ * @self: a #MbimDevice.
+ * @res: a #GAsyncResult.
+ * @session_ids: (out)(optional)(transfer full)(element-type guint): return
+ *   location for the session IDs of the links created, or %NULL.
+ * @error: Return location for error or %NULL.
+ *
+ * Finishes an operation started with mbim_device_add_links().
+ *
+ * Returns: (transfer full)(element-type utf8): the names of the net interfaces
+ * created, in the same order as the session IDs requested, or %NULL if @error
+ * is set. The returned value should be freed with g_ptr_array_unref().
+ *
+ * Since: 1.26
+ */
+GPtrArray *mbim_device_add_links_finish (MbimDevice    *self,
+                                         GAsyncResult  *res,
+                                         GArray       **session_ids,
+                                         GError       **error);
+
+/**
+ * mbim_device_delete_links:
+ * @self: a #MbimDevice.
+ * @ifnames: (array zero-terminated=1): a %NULL-terminated array with the names
+ *   of the links to remove.
+ * @cancellable: a #GCancellable, or %NULL.
+ * @callback: a #GAsyncReadyCallback to call when the operation is finished.
+ * @user_data: the data to pass to callback function.
+ *
+ * Asynchronously deletes several virtual network interfaces at once, as
+ * mbim_device_delete_link() does for a single one.
+ *
+ * All the links are requested to be removed in a single batch to the kernel.
+ *
+ * When the operation is finished @callback will be called. You can then call
+ * mbim_device_delete_links_finish() to get the result of the operation.
+ *
+ * Since: 1.26
+ */
+void mbim_device_delete_links (MbimDevice          *self,
+                               const gchar * const *ifnames,
+                               GCancellable        *cancellable,
+                               GAsyncReadyCallback  callback,
+                               gpointer             user_data);
+
+/**
+ * mbim_device_delete_links_finish:
+ * @self: a #MbimDevice.
+ * @res: a #GAsyncResult.
+ * @error: Return location for error or %NULL.
+ *
+ * Finishes an operation started with mbim_device_delete_links().
+ *
+ * Returns: %TRUE if all links were removed, %FALSE if @error is set.
+ *
+ * Since: 1.26
+ */
+gboolean mbim_device_delete_links_finish (MbimDevice    *self,
+                                          GAsyncResult  *res,
+                                          GError       **error);
+
 /**
  * mbim_device_list_links:
  * @self: a #MbimDevice.
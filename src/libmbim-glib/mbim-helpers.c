@@ -29,6 +29,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <pwd.h>
+#include <sys/socket.h>
 
 #include "mbim-helpers.h"
 #include "mbim-error-types.h"
@@ -36,12 +37,13 @@
 /*****************************************************************************/
 
 gboolean
-mbim_helpers_check_user_allowed (uid_t    uid,
-                                 GError **error)
+mbim_helpers_get_allowed_user (uid_t   *uid,
+                               GError **error)
 {
 #ifndef MBIM_USERNAME_ENABLED
-    if (uid == 0)
-        return TRUE;
+    /* Only the root user */
+    *uid = 0;
+    return TRUE;
 #else
 # ifndef MBIM_USERNAME
 #  error MBIM username not defined
@@ -49,10 +51,6 @@ mbim_helpers_check_user_allowed (uid_t    uid,
 
     struct passwd *expected_usr = NULL;
 
-    /* Root user is always allowed, regardless of the specified MBIM_USERNAME */
-    if (uid == 0)
-        return TRUE;
-
     expected_usr = getpwnam (MBIM_USERNAME);
     if (!expected_usr) {
         g_set_error (error,
@@ -62,9 +60,26 @@ mbim_helpers_check_user_allowed (uid_t    uid,
         return FALSE;
     }
 
-    if (uid == expected_usr->pw_uid)
-        return TRUE;
+    *uid = expected_usr->pw_uid;
+    return TRUE;
 #endif
+}
+
+gboolean
+mbim_helpers_check_user_allowed (uid_t    uid,
+                                 GError **error)
+{
+    uid_t allowed;
+
+    /* Root user is always allowed, regardless of the specified MBIM_USERNAME */
+    if (uid == 0)
+        return TRUE;
+
+    if (!mbim_helpers_get_allowed_user (&allowed, error))
+        return FALSE;
+
+    if (uid == allowed)
+        return TRUE;
 
     g_set_error (error,
                  MBIM_CORE_ERROR,
@@ -178,6 +193,29 @@ mbim_helpers_list_links (GFile         *sysfs_file,
     return TRUE;
 }
 
+/*****************************************************************************/
+
+gssize
+mbim_helpers_peek_datagram_size (GSocket  *socket,
+                                 GError  **error)
+{
+    gssize r;
+
+    /* With MSG_TRUNC the real length of the datagram is returned, even if
+     * nothing is copied; FIONREAD would report all the bytes queued instead */
+    do {
+        r = recv (g_socket_get_fd (socket), NULL, 0, MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT);
+    } while (r < 0 && errno == EINTR);
+
+    if (r < 0) {
+        int saved_errno = errno;
+
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                     "Couldn't get size of the next datagram: %s", g_strerror (saved_errno));
+    }
+    return r;
+}
+
 #if !GLIB_CHECK_VERSION(2,54,0)
 
 gboolean
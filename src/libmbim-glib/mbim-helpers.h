@@ -33,6 +33,12 @@
 
 G_BEGIN_DECLS
 
+/* User allowed besides root, which is root itself unless a specific MBIM
+ * username is configured; this may involve a user database lookup */
+G_GNUC_INTERNAL
+gboolean mbim_helpers_get_allowed_user (uid_t   *uid,
+                                        GError **error);
+
 G_GNUC_INTERNAL
 gboolean mbim_helpers_check_user_allowed (uid_t    uid,
                                           GError **error);
@@ -52,6 +58,12 @@ gboolean mbim_helpers_list_links (GFile         *sysfs_file,
                                   GPtrArray    **out_links,
                                   GError       **error);
 
+/* Size of the next datagram in a SOCK_SEQPACKET or SOCK_DGRAM socket, without
+ * receiving it; 0 if the peer closed the connection */
+G_GNUC_INTERNAL
+gssize mbim_helpers_peek_datagram_size (GSocket  *socket,
+                                        GError  **error);
+
 #if !GLIB_CHECK_VERSION(2,54,0)
 
 /* Pointer Array lookup with a GEqualFunc, imported from GLib 2.54 */
@@ -0,0 +1,341 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * libmbim-glib -- GLib/GIO based library to control MBIM devices
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301 USA.
+ */
+
+#define _GNU_SOURCE
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mbim-indication-ring.h"
+#include "mbim-error-types.h"
+
+/*
+ * Layout of the shared memory: a header followed by the data area, where each
+ * message is stored as a record with its length and its contents, aligned to
+ * 8 bytes. Records may wrap around the end of the data area.
+ *
+ * Positions only ever increase (modulo 2^32), and are translated to offsets
+ * in the data area when accessing it. The producer moves 'oldest' past the
+ * records about to be overwritten before writing a new record, and then moves
+ * 'head' past the new record. A consumer reading a record checks 'oldest'
+ * again once the record is copied, and if the record was overwritten in the
+ * meantime, the copy is discarded.
+ *
+ * This is a seqlock: the atomic operations on the positions are not enough
+ * to order them with the plain accesses to the data area, so the producer
+ * issues a release fence between publishing 'oldest' and overwriting the
+ * data, and the consumer an acquire fence between copying the data and
+ * reading 'oldest' again.
+ */
+
+#define RING_MAGIC    0x4e52424d /* "MBRN" */
+#define RING_MIN_SIZE 4096
+#define RING_MAX_SIZE (16 * 1024 * 1024)
+
+#define RECORD_SIZE(data_length) ((sizeof (guint32) + (data_length) + 7) & ~((guint32) 7))
+
+struct ring_header {
+    guint32       magic;
+    guint32       size;
+    volatile gint head;
+    volatile gint oldest;
+    guint8        padding[48];
+};
+
+struct _MbimIndicationRing {
+    gint                fd;
+    guint8             *map;
+    gsize               map_size;
+    struct ring_header *header;
+    guint8             *data;
+    guint32             mask;
+    gboolean            producer;
+    /* Consumer only: position of the next record to read */
+    guint32             position;
+};
+
+/*****************************************************************************/
+
+static void
+ring_copy_out (MbimIndicationRing *self,
+               guint32             position,
+               gpointer            dest,
+               guint32             length)
+{
+    guint32 offset;
+    guint32 first;
+
+    offset = position & self->mask;
+    first = MIN (length, self->mask + 1 - offset);
+    memcpy (dest, &self->data[offset], first);
+    if (first < length)
+        memcpy ((guint8 *)dest + first, self->data, length - first);
+}
+
+static void
+ring_copy_in (MbimIndicationRing *self,
+              guint32             position,
+              gconstpointer       src,
+              guint32             length)
+{
+    guint32 offset;
+    guint32 first;
+
+    offset = position & self->mask;
+    first = MIN (length, self->mask + 1 - offset);
+    memcpy (&self->data[offset], src, first);
+    if (first < length)
+        memcpy (self->data, (const guint8 *)src + first, length - first);
+}
+
+static MbimIndicationRing *
+ring_map (gint       fd,
+          gsize      map_size,
+          gboolean   producer,
+          GError   **error)
+{
+    MbimIndicationRing *self;
+    gpointer            map;
+
+    map = mmap (NULL, map_size, producer ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                     "Couldn't map indication ring: %s", g_strerror (errno));
+        return NULL;
+    }
+
+    self = g_slice_new0 (MbimIndicationRing);
+    self->fd = fd;
+    self->map = map;
+    self->map_size = map_size;
+    self->header = (struct ring_header *) self->map;
+    self->data = self->map + sizeof (struct ring_header);
+    self->producer = producer;
+    return self;
+}
+
+MbimIndicationRing *
+_mbim_indication_ring_new (guint32   size,
+                           GError  **error)
+{
+    MbimIndicationRing *self;
+    gint                fd;
+
+    /* Power of two, so that positions wrap around at the end of the data area */
+    size = CLAMP (size, RING_MIN_SIZE, RING_MAX_SIZE);
+    size = 1 << g_bit_storage (size - 1);
+
+    fd = memfd_create ("mbim-indication-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                     "Couldn't create indication ring: %s", g_strerror (errno));
+        return NULL;
+    }
+
+    /* Consumers must never see the memory going away under them */
+    if (ftruncate (fd, sizeof (struct ring_header) + size) < 0 ||
+        fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                     "Couldn't setup indication ring: %s", g_strerror (errno));
+        close (fd);
+        return NULL;
+    }
+
+    self = ring_map (fd, sizeof (struct ring_header) + size, TRUE, error);
+    if (!self) {
+        close (fd);
+        return NULL;
+    }
+
+    self->mask = size - 1;
+    self->header->magic = RING_MAGIC;
+    self->header->size = size;
+    g_atomic_int_set (&self->header->head, 0);
+    g_atomic_int_set (&self->header->oldest, 0);
+    return self;
+}
+
+MbimIndicationRing *
+_mbim_indication_ring_new_from_fd (gint     fd,
+                                   GError **error)
+{
+    MbimIndicationRing *self;
+    struct stat         st;
+    guint32             size;
+
+    if (fstat (fd, &st) < 0) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                     "Couldn't query indication ring: %s", g_strerror (errno));
+        return NULL;
+    }
+
+    if (st.st_size < (off_t) (sizeof (struct ring_header) + RING_MIN_SIZE) ||
+        st.st_size > (off_t) (sizeof (struct ring_header) + RING_MAX_SIZE)) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_INVALID_ARGS,
+                     "Invalid indication ring size: %" G_GINT64_FORMAT, (gint64) st.st_size);
+        return NULL;
+    }
+
+    self = ring_map (fd, (gsize) st.st_size, FALSE, error);
+    if (!self)
+        return NULL;
+
+    size = self->header->size;
+    if (self->header->magic != RING_MAGIC ||
+        (size & (size - 1)) != 0 ||
+        sizeof (struct ring_header) + size != (gsize) st.st_size) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_INVALID_ARGS,
+                     "Invalid indication ring");
+        /* The fd is owned by the caller on error */
+        self->fd = -1;
+        _mbim_indication_ring_free (self);
+        return NULL;
+    }
+
+    /* Only messages published from now on are read */
+    self->mask = size - 1;
+    self->position = (guint32) g_atomic_int_get (&self->header->head);
+    return self;
+}
+
+void
+_mbim_indication_ring_free (MbimIndicationRing *self)
+{
+    munmap (self->map, self->map_size);
+    if (self->fd >= 0)
+        close (self->fd);
+    g_slice_free (MbimIndicationRing, self);
+}
+
+gint
+_mbim_indication_ring_dup_readonly_fd (MbimIndicationRing  *self,
+                                       GError             **error)
+{
+    g_autofree gchar *path = NULL;
+    gint              fd;
+
+    /* Reopening the memfd read-only ensures consumers can only map it
+     * read-only, so they can never corrupt the ring */
+    path = g_strdup_printf ("/proc/self/fd/%d", self->fd);
+    fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                     "Couldn't reopen indication ring read-only: %s", g_strerror (errno));
+    return fd;
+}
+
+gboolean
+_mbim_indication_ring_publish (MbimIndicationRing *self,
+                               const guint8       *data,
+                               guint32             data_length)
+{
+    guint32 record_size;
+    guint32 head;
+    guint32 oldest;
+
+    g_assert (self->producer);
+
+    /* Messages not fitting in half the ring are not published, so that there
+     * is always some history available */
+    record_size = RECORD_SIZE (data_length);
+    if (data_length > self->mask / 2 || record_size > (self->mask + 1) / 2)
+        return FALSE;
+
+    /* Only the producer updates the positions */
+    head = (guint32) self->header->head;
+    oldest = (guint32) self->header->oldest;
+
+    /* Drop the oldest records until the new one fits */
+    while (head + record_size - oldest > self->mask + 1) {
+        guint32 length;
+
+        ring_copy_out (self, oldest, &length, sizeof (length));
+        oldest += RECORD_SIZE (length);
+    }
+    g_atomic_int_set (&self->header->oldest, (gint) oldest);
+    /* 'oldest' must be visible before any of the records is overwritten */
+    __atomic_thread_fence (__ATOMIC_RELEASE);
+
+    ring_copy_in (self, head, &data_length, sizeof (data_length));
+    ring_copy_in (self, head + sizeof (guint32), data, data_length);
+    g_atomic_int_set (&self->header->head, (gint) (head + record_size));
+    return TRUE;
+}
+
+GBytes *
+_mbim_indication_ring_read (MbimIndicationRing *self,
+                            guint              *n_overruns)
+{
+    g_assert (!self->producer);
+
+    while (TRUE) {
+        guint32  head;
+        guint32  oldest;
+        guint32  length;
+        guint8  *data;
+
+        head = (guint32) g_atomic_int_get (&self->header->head);
+        if (self->position == head)
+            return NULL;
+
+        /* Overwritten before being read, skip to the oldest available */
+        oldest = (guint32) g_atomic_int_get (&self->header->oldest);
+        if ((gint32) (self->position - oldest) < 0) {
+            if (n_overruns)
+                (*n_overruns)++;
+            self->position = oldest;
+            continue;
+        }
+
+        ring_copy_out (self, self->position, &length, sizeof (length));
+        if (length > self->mask / 2) {
+            /* Either overwritten while reading the length, or a broken ring;
+             * in the latter case just resync with the producer */
+            __atomic_thread_fence (__ATOMIC_ACQUIRE);
+            oldest = (guint32) g_atomic_int_get (&self->header->oldest);
+            if ((gint32) (self->position - oldest) >= 0) {
+                if (n_overruns)
+                    (*n_overruns)++;
+                self->position = head;
+            }
+            continue;
+        }
+
+        data = g_malloc (length);
+        ring_copy_out (self, self->position + sizeof (guint32), data, length);
+
+        /* The record may have been overwritten while being copied; the copy
+         * must be complete before 'oldest' is read again */
+        __atomic_thread_fence (__ATOMIC_ACQUIRE);
+        oldest = (guint32) g_atomic_int_get (&self->header->oldest);
+        if ((gint32) (self->position - oldest) < 0) {
+            g_free (data);
+            continue;
+        }
+
+        self->position += RECORD_SIZE (length);
+        return g_bytes_new_take (data, length);
+    }
+}
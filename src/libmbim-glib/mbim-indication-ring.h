@@ -0,0 +1,60 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * libmbim-glib -- GLib/GIO based library to control MBIM devices
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301 USA.
+ *
+ * This is a private non-installed header
+ */
+
+#ifndef _LIBMBIM_GLIB_MBIM_INDICATION_RING_H_
+#define _LIBMBIM_GLIB_MBIM_INDICATION_RING_H_
+
+#if !defined (LIBMBIM_GLIB_COMPILATION)
+#error "This is a private header!!"
+#endif
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Single-producer multi-consumer ring of messages in a memfd, shared by the
+ * proxy with its clients. The producer never waits for the consumers: the
+ * oldest messages are overwritten when the ring is full, and consumers reading
+ * too slowly detect the overrun and skip to the oldest message still available.
+ */
+typedef struct _MbimIndicationRing MbimIndicationRing;
+
+MbimIndicationRing *_mbim_indication_ring_new              (guint32              size,
+                                                            GError             **error);
+MbimIndicationRing *_mbim_indication_ring_new_from_fd      (gint                 fd,
+                                                            GError             **error);
+void                _mbim_indication_ring_free             (MbimIndicationRing  *self);
+gint                _mbim_indication_ring_dup_readonly_fd  (MbimIndicationRing  *self,
+                                                            GError             **error);
+gboolean            _mbim_indication_ring_publish          (MbimIndicationRing  *self,
+                                                            const guint8        *data,
+                                                            guint32              data_length);
+GBytes             *_mbim_indication_ring_read             (MbimIndicationRing  *self,
+                                                            guint               *n_overruns);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (MbimIndicationRing, _mbim_indication_ring_free)
+
+G_END_DECLS
+
+#endif /* _LIBMBIM_GLIB_MBIM_INDICATION_RING_H_ */
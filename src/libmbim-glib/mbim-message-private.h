@@ -39,12 +39,32 @@ G_BEGIN_DECLS
 /*****************************************************************************/
 /* The MbimMessage */
 
-/* Defined in the same way as GByteArray */
+/* Defined in the same way as GByteArray, so that data and len can be accessed
+ * directly; the remaining fields are only managed by mbim-message.c */
 struct _MbimMessage {
-  guint8 *data;
-  guint   len;
+  guint8  *data;
+  guint    len;
+  /* <private> */
+  gint     ref_count;
+  gsize    allocated;
+  GBytes  *bytes;
+  gboolean prepared;
+  gint     service; /* interned service, or -1 if not computed yet */
 };
 
+/* Setup a message struct wrapping @data without copying or owning it, e.g. to
+ * frame a message received in a larger buffer. The message must not be
+ * referenced beyond the lifetime of @data. */
+G_GNUC_INTERNAL
+void _mbim_message_init_static (MbimMessage  *self,
+                                const guint8 *data,
+                                guint32       data_length);
+
+/* Compute and cache the service of the message from its service UUID, so that
+ * the service getters don't need to look it up again. */
+G_GNUC_INTERNAL
+void _mbim_message_intern_service (const MbimMessage *self);
+
 /*****************************************************************************/
 /* Basic message types */
 
@@ -130,7 +150,7 @@ struct full_message {
 
 /*****************************************************************************/
 /* Message creation */
-GByteArray *_mbim_message_allocate (MbimMessageType message_type, guint32 transaction_id, guint32 additional_size);
+MbimMessage *_mbim_message_allocate (MbimMessageType message_type, guint32 transaction_id, guint32 additional_size);
 
 /*****************************************************************************/
 /* Fragment interface */
@@ -317,6 +337,132 @@ gboolean _mbim_message_read_ipv6_array    (const MbimMessage  *self,
                                            MbimIPv6          **array,
                                            GError            **error);
 
+/*****************************************************************************/
+/* Table-driven message support */
+
+/* Maximum number of fields in a message handled by the field tables */
+#define MBIM_FIELDS_MAX 32
+
+typedef enum {
+    MBIM_FIELD_FORMAT_BYTE_ARRAY,
+    MBIM_FIELD_FORMAT_UNSIZED_BYTE_ARRAY,
+    MBIM_FIELD_FORMAT_REF_BYTE_ARRAY,
+    MBIM_FIELD_FORMAT_UICC_REF_BYTE_ARRAY,
+    MBIM_FIELD_FORMAT_REF_BYTE_ARRAY_NO_OFFSET,
+    MBIM_FIELD_FORMAT_UUID,
+    MBIM_FIELD_FORMAT_GUINT32,
+    MBIM_FIELD_FORMAT_GUINT64,
+    MBIM_FIELD_FORMAT_STRING,
+    MBIM_FIELD_FORMAT_STRING_ARRAY,
+    MBIM_FIELD_FORMAT_STRUCT,
+    MBIM_FIELD_FORMAT_STRUCT_ARRAY,
+    MBIM_FIELD_FORMAT_REF_STRUCT_ARRAY,
+    MBIM_FIELD_FORMAT_IPV4,
+    MBIM_FIELD_FORMAT_REF_IPV4,
+    MBIM_FIELD_FORMAT_IPV4_ARRAY,
+    MBIM_FIELD_FORMAT_IPV6,
+    MBIM_FIELD_FORMAT_REF_IPV6,
+    MBIM_FIELD_FORMAT_IPV6_ARRAY
+} MbimFieldFormat;
+
+typedef enum {
+    MBIM_FIELD_CONDITION_EQUAL,
+    MBIM_FIELD_CONDITION_NOT_EQUAL,
+    MBIM_FIELD_CONDITION_LESS,
+    MBIM_FIELD_CONDITION_LESS_OR_EQUAL,
+    MBIM_FIELD_CONDITION_GREATER,
+    MBIM_FIELD_CONDITION_GREATER_OR_EQUAL
+} MbimFieldCondition;
+
+/* Typed struct support emitted for each struct type, called through generic
+ * pointers. Members not needed by the struct type are NULL. */
+typedef gpointer (* MbimStructReadFunc)        (const MbimMessage          *self,
+                                                guint32                     relative_offset,
+                                                guint32                    *bytes_read,
+                                                GError                    **error);
+typedef gboolean (* MbimStructReadArrayFunc)   (const MbimMessage          *self,
+                                                guint32                     array_size,
+                                                guint32                     relative_offset_array_start,
+                                                gboolean                    refs,
+                                                gpointer                   *out_array,
+                                                GError                    **error);
+typedef void     (* MbimStructAppendFunc)      (MbimMessageCommandBuilder  *builder,
+                                                gconstpointer               value);
+typedef void     (* MbimStructAppendArrayFunc) (MbimMessageCommandBuilder  *builder,
+                                                const gconstpointer        *values,
+                                                guint32                     n_values,
+                                                gboolean                    refs);
+typedef gchar   *(* MbimStructPrintFunc)       (gconstpointer               value,
+                                                const gchar                *line_prefix);
+
+typedef struct {
+    MbimStructReadFunc        read;
+    MbimStructReadArrayFunc   read_array;
+    MbimStructAppendFunc      append;
+    MbimStructAppendArrayFunc append_array;
+    MbimStructPrintFunc       print;
+    GDestroyNotify            free;
+    GDestroyNotify            array_free;
+} MbimStructInfo;
+
+typedef struct {
+    const gchar          *name;
+    MbimFieldFormat       format;
+    /* Value is stored so that other fields may refer to it */
+    gboolean              always_read;
+    /* Whether byte arrays are padded to 4 bytes when building */
+    gboolean              pad_array;
+    /* Fixed size of a byte-array field */
+    guint32               array_size;
+    /* Index of the field giving the number of items of the array, or -1 */
+    gint                  array_size_field;
+    /* Index of the field to compare with condition_value, or -1 */
+    gint                  condition_field;
+    MbimFieldCondition    condition;
+    guint32               condition_value;
+    /* Enum or flags printers for integer fields, if any */
+    const gchar        *(* get_string)             (guint value);
+    gchar              *(* build_string_from_mask) (guint value);
+    /* Struct support for struct fields */
+    const MbimStructInfo *struct_info;
+} MbimFieldInfo;
+
+/* Value of a field given to the builder: sized byte arrays take the size in
+ * 'size' and the data in 'value.ptr' */
+typedef struct {
+    guint32 size;
+    union {
+        guint32       u32;
+        guint64       u64;
+        gconstpointer ptr;
+    } value;
+} MbimFieldValue;
+
+/* Output locations of a field given to the parser: sized byte arrays take the
+ * size location in 'size' */
+typedef struct {
+    guint32  *size;
+    gpointer  value;
+} MbimFieldOutput;
+
+MbimMessage *_mbim_message_build_fields (MbimService                service,
+                                         guint32                    cid,
+                                         MbimMessageCommandType     command_type,
+                                         const MbimFieldInfo       *fields,
+                                         guint                      n_fields,
+                                         const MbimFieldValue      *values);
+gboolean     _mbim_message_parse_fields (const MbimMessage         *self,
+                                         MbimMessageType            message_type,
+                                         const MbimFieldInfo       *fields,
+                                         guint                      n_fields,
+                                         const MbimFieldOutput     *outputs,
+                                         GError                   **error);
+gchar       *_mbim_message_print_fields (const MbimMessage         *self,
+                                         const gchar               *line_prefix,
+                                         const MbimFieldInfo       *fields,
+                                         guint                      n_fields,
+                                         gboolean                   is_response);
+
 G_END_DECLS
 
 #endif /* _LIBMBIM_GLIB_MBIM_MESSAGE_PRIVATE_H_ */
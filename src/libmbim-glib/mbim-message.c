@@ -21,7 +21,10 @@
  * Copyright (C) 2013 - 2018 Aleksander Morgado <aleksander@aleksander.es>
  */
 
+#include <config.h>
+
 #include <glib.h>
+#include <gio/gio.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -33,22 +36,52 @@
 #include "mbim-enum-types.h"
 
 #include "mbim-basic-connect.h"
+#if defined MBIM_SERVICE_AUTH_ENABLED
 #include "mbim-auth.h"
+#endif
+#if defined MBIM_SERVICE_DSS_ENABLED
 #include "mbim-dss.h"
+#endif
+#if defined MBIM_SERVICE_PHONEBOOK_ENABLED
 #include "mbim-phonebook.h"
+#endif
+#if defined MBIM_SERVICE_SMS_ENABLED
 #include "mbim-sms.h"
+#endif
+#if defined MBIM_SERVICE_STK_ENABLED
 #include "mbim-stk.h"
+#endif
+#if defined MBIM_SERVICE_USSD_ENABLED
 #include "mbim-ussd.h"
+#endif
 #include "mbim-proxy-control.h"
+#if defined MBIM_SERVICE_QMI_ENABLED
 #include "mbim-qmi.h"
+#endif
+#if defined MBIM_SERVICE_MS_FIRMWARE_ID_ENABLED
 #include "mbim-ms-firmware-id.h"
+#endif
+#if defined MBIM_SERVICE_MS_HOST_SHUTDOWN_ENABLED
 #include "mbim-ms-host-shutdown.h"
+#endif
+#if defined MBIM_SERVICE_MS_SAR_ENABLED
 #include "mbim-ms-sar.h"
+#endif
+#if defined MBIM_SERVICE_ATDS_ENABLED
 #include "mbim-atds.h"
+#endif
+#if defined MBIM_SERVICE_INTEL_FIRMWARE_UPDATE_ENABLED
 #include "mbim-intel-firmware-update.h"
+#endif
+#if defined MBIM_SERVICE_QDU_ENABLED
 #include "mbim-qdu.h"
+#endif
+#if defined MBIM_SERVICE_MS_BASIC_CONNECT_EXTENSIONS_ENABLED
 #include "mbim-ms-basic-connect-extensions.h"
+#endif
+#if defined MBIM_SERVICE_MS_UICC_LOW_LEVEL_ACCESS_ENABLED
 #include "mbim-ms-uicc-low-level-access.h"
+#endif
 
 /*****************************************************************************/
 
@@ -108,19 +141,91 @@ mbim_message_get_type (void)
 }
 
 /*****************************************************************************/
+/* Message storage
+ *
+ * A message either owns its data (heap allocated, growable), or it references
+ * the read-only memory of a GBytes. Messages referencing a GBytes are turned
+ * into owned messages the first time they need to be modified; the memory is
+ * stolen from the GBytes if we hold the only reference, and copied otherwise.
+ */
 
-GByteArray *
+static MbimMessage *
+message_new_take (guint8 *data,
+                  guint32 data_length)
+{
+    MbimMessage *self;
+
+    self = g_slice_new0 (MbimMessage);
+    self->ref_count = 1;
+    self->data = data;
+    self->len = data_length;
+    self->allocated = data_length;
+    self->service = -1;
+    return self;
+}
+
+void
+_mbim_message_init_static (MbimMessage  *self,
+                           const guint8 *data,
+                           guint32       data_length)
+{
+    memset (self, 0, sizeof (MbimMessage));
+    self->ref_count = 1;
+    self->data = (guint8 *) data;
+    self->len = data_length;
+    self->service = -1;
+}
+
+static void
+message_ensure_writable (MbimMessage *self)
+{
+    gsize size;
+
+    if (!self->bytes)
+        return;
+
+    self->data = g_bytes_unref_to_data (self->bytes, &size);
+    self->allocated = size;
+    self->bytes = NULL;
+}
+
+static void
+message_append (MbimMessage  *self,
+                const guint8 *buffer,
+                guint32       buffer_len)
+{
+    if (!buffer_len)
+        return;
+
+    message_ensure_writable (self);
+
+    if (self->len + buffer_len > self->allocated) {
+        gsize want;
+
+        /* Grow in the same way GByteArray does, so that fragment reassembly
+         * doesn't end up reallocating on every single fragment */
+        want = MAX (self->allocated, 16);
+        while (want < self->len + buffer_len)
+            want <<= 1;
+        self->data = g_realloc (self->data, want);
+        self->allocated = want;
+    }
+
+    memcpy (&self->data[self->len], buffer, buffer_len);
+    self->len += buffer_len;
+}
+
+MbimMessage *
 _mbim_message_allocate (MbimMessageType message_type,
                         guint32         transaction_id,
                         guint32         additional_size)
 {
-    GByteArray *self;
+    MbimMessage *self;
     guint32 len;
 
     /* Compute size of the basic empty message and allocate heap for it */
     len = sizeof (struct header) + additional_size;
-    self = g_byte_array_sized_new (len);
-    g_byte_array_set_size (self, len);
+    self = message_new_take (g_malloc0 (len), len);
 
     /* Set MBIM header */
     ((struct header *)(self->data))->type           = GUINT32_TO_LE (message_type);
@@ -772,6 +877,721 @@ _mbim_message_read_ipv6_array (const MbimMessage  *self,
     return TRUE;
 }
 
+/*****************************************************************************/
+/* Table-driven message support
+ *
+ * Used by the 'tables' message backend of the code generator, which emits a
+ * constant MbimFieldInfo array per message instead of one builder, parser and
+ * printer function per message. The typed public builders and parsers just
+ * pack their arguments into an array and call the generic interpreters below.
+ * The behavior must be exactly the same one as the one of the per-message
+ * functions.
+ */
+
+static gboolean
+field_condition_matches (const MbimFieldInfo *field,
+                         guint32              value)
+{
+    switch (field->condition) {
+    case MBIM_FIELD_CONDITION_EQUAL:
+        return (value == field->condition_value);
+    case MBIM_FIELD_CONDITION_NOT_EQUAL:
+        return (value != field->condition_value);
+    case MBIM_FIELD_CONDITION_LESS:
+        return (value < field->condition_value);
+    case MBIM_FIELD_CONDITION_LESS_OR_EQUAL:
+        return (value <= field->condition_value);
+    case MBIM_FIELD_CONDITION_GREATER:
+        return (value > field->condition_value);
+    case MBIM_FIELD_CONDITION_GREATER_OR_EQUAL:
+        return (value >= field->condition_value);
+    default:
+        g_assert_not_reached ();
+        return FALSE;
+    }
+}
+
+MbimMessage *
+_mbim_message_build_fields (MbimService             service,
+                            guint32                 cid,
+                            MbimMessageCommandType  command_type,
+                            const MbimFieldInfo    *fields,
+                            guint                   n_fields,
+                            const MbimFieldValue   *values)
+{
+    MbimMessageCommandBuilder *builder;
+    guint                      i;
+
+    builder = _mbim_message_command_builder_new (0, service, cid, command_type);
+
+    for (i = 0; i < n_fields; i++) {
+        const MbimFieldInfo  *field = &fields[i];
+        const MbimFieldValue *value = &values[i];
+        guint32               array_size = 0;
+
+        if (field->condition_field >= 0 &&
+            !field_condition_matches (field, values[field->condition_field].value.u32))
+            continue;
+
+        if (field->array_size_field >= 0)
+            array_size = values[field->array_size_field].value.u32;
+
+        switch (field->format) {
+        case MBIM_FIELD_FORMAT_BYTE_ARRAY:
+            _mbim_message_command_builder_append_byte_array (builder, FALSE, FALSE, field->pad_array, value->value.ptr, field->array_size, FALSE);
+            break;
+        case MBIM_FIELD_FORMAT_UNSIZED_BYTE_ARRAY:
+            _mbim_message_command_builder_append_byte_array (builder, FALSE, FALSE, field->pad_array, value->value.ptr, value->size, FALSE);
+            break;
+        case MBIM_FIELD_FORMAT_REF_BYTE_ARRAY:
+            _mbim_message_command_builder_append_byte_array (builder, TRUE, TRUE, field->pad_array, value->value.ptr, value->size, FALSE);
+            break;
+        case MBIM_FIELD_FORMAT_UICC_REF_BYTE_ARRAY:
+            _mbim_message_command_builder_append_byte_array (builder, TRUE, TRUE, field->pad_array, value->value.ptr, value->size, TRUE);
+            break;
+        case MBIM_FIELD_FORMAT_REF_BYTE_ARRAY_NO_OFFSET:
+            _mbim_message_command_builder_append_byte_array (builder, FALSE, TRUE, field->pad_array, value->value.ptr, value->size, FALSE);
+            break;
+        case MBIM_FIELD_FORMAT_UUID:
+            _mbim_message_command_builder_append_uuid (builder, value->value.ptr);
+            break;
+        case MBIM_FIELD_FORMAT_GUINT32:
+            _mbim_message_command_builder_append_guint32 (builder, value->value.u32);
+            break;
+        case MBIM_FIELD_FORMAT_GUINT64:
+            _mbim_message_command_builder_append_guint64 (builder, value->value.u64);
+            break;
+        case MBIM_FIELD_FORMAT_STRING:
+            _mbim_message_command_builder_append_string (builder, value->value.ptr);
+            break;
+        case MBIM_FIELD_FORMAT_STRING_ARRAY:
+            _mbim_message_command_builder_append_string_array (builder, value->value.ptr, array_size);
+            break;
+        case MBIM_FIELD_FORMAT_STRUCT:
+            field->struct_info->append (builder, value->value.ptr);
+            break;
+        case MBIM_FIELD_FORMAT_STRUCT_ARRAY:
+        case MBIM_FIELD_FORMAT_REF_STRUCT_ARRAY:
+            field->struct_info->append_array (builder, value->value.ptr, array_size,
+                                              field->format == MBIM_FIELD_FORMAT_REF_STRUCT_ARRAY);
+            break;
+        case MBIM_FIELD_FORMAT_IPV4:
+        case MBIM_FIELD_FORMAT_REF_IPV4:
+            _mbim_message_command_builder_append_ipv4 (builder, value->value.ptr, field->format == MBIM_FIELD_FORMAT_REF_IPV4);
+            break;
+        case MBIM_FIELD_FORMAT_IPV4_ARRAY:
+            _mbim_message_command_builder_append_ipv4_array (builder, value->value.ptr, array_size);
+            break;
+        case MBIM_FIELD_FORMAT_IPV6:
+        case MBIM_FIELD_FORMAT_REF_IPV6:
+            _mbim_message_command_builder_append_ipv6 (builder, value->value.ptr, field->format == MBIM_FIELD_FORMAT_REF_IPV6);
+            break;
+        case MBIM_FIELD_FORMAT_IPV6_ARRAY:
+            _mbim_message_command_builder_append_ipv6_array (builder, value->value.ptr, array_size);
+            break;
+        default:
+            g_assert_not_reached ();
+        }
+    }
+
+    return _mbim_message_command_builder_complete (builder);
+}
+
+static gboolean
+field_format_is_allocated (MbimFieldFormat format)
+{
+    return (format == MBIM_FIELD_FORMAT_STRING ||
+            format == MBIM_FIELD_FORMAT_STRING_ARRAY ||
+            format == MBIM_FIELD_FORMAT_STRUCT ||
+            format == MBIM_FIELD_FORMAT_STRUCT_ARRAY ||
+            format == MBIM_FIELD_FORMAT_REF_STRUCT_ARRAY ||
+            format == MBIM_FIELD_FORMAT_IPV4_ARRAY ||
+            format == MBIM_FIELD_FORMAT_IPV6_ARRAY);
+}
+
+static void
+field_free_allocated (const MbimFieldInfo *field,
+                      gpointer             allocated)
+{
+    switch (field->format) {
+    case MBIM_FIELD_FORMAT_STRING_ARRAY:
+        g_strfreev (allocated);
+        break;
+    case MBIM_FIELD_FORMAT_STRUCT:
+        field->struct_info->free (allocated);
+        break;
+    case MBIM_FIELD_FORMAT_STRUCT_ARRAY:
+    case MBIM_FIELD_FORMAT_REF_STRUCT_ARRAY:
+        field->struct_info->array_free (allocated);
+        break;
+    case MBIM_FIELD_FORMAT_BYTE_ARRAY:
+    case MBIM_FIELD_FORMAT_UNSIZED_BYTE_ARRAY:
+    case MBIM_FIELD_FORMAT_REF_BYTE_ARRAY:
+    case MBIM_FIELD_FORMAT_UICC_REF_BYTE_ARRAY:
+    case MBIM_FIELD_FORMAT_REF_BYTE_ARRAY_NO_OFFSET:
+    case MBIM_FIELD_FORMAT_UUID:
+    case MBIM_FIELD_FORMAT_GUINT32:
+    case MBIM_FIELD_FORMAT_GUINT64:
+    case MBIM_FIELD_FORMAT_STRING:
+    case MBIM_FIELD_FORMAT_IPV4:
+    case MBIM_FIELD_FORMAT_REF_IPV4:
+    case MBIM_FIELD_FORMAT_IPV4_ARRAY:
+    case MBIM_FIELD_FORMAT_IPV6:
+    case MBIM_FIELD_FORMAT_REF_IPV6:
+    case MBIM_FIELD_FORMAT_IPV6_ARRAY:
+    default:
+        g_free (allocated);
+        break;
+    }
+}
+
+static gboolean
+parse_field (const MbimMessage      *self,
+             const MbimFieldInfo    *field,
+             const MbimFieldOutput  *output,
+             const guint32          *values,
+             guint32                *value,
+             gpointer               *allocated,
+             guint32                *offset,
+             GError                **error)
+{
+    guint32 array_size = 0;
+
+    if (field->array_size_field >= 0)
+        array_size = values[field->array_size_field];
+
+    switch (field->format) {
+    case MBIM_FIELD_FORMAT_BYTE_ARRAY:
+    case MBIM_FIELD_FORMAT_UNSIZED_BYTE_ARRAY:
+    case MBIM_FIELD_FORMAT_REF_BYTE_ARRAY:
+    case MBIM_FIELD_FORMAT_UICC_REF_BYTE_ARRAY:
+    case MBIM_FIELD_FORMAT_REF_BYTE_ARRAY_NO_OFFSET: {
+        const guint8 *tmp;
+        guint32       tmpsize = 0;
+        gboolean      has_offset;
+        gboolean      has_length;
+
+        has_offset = (field->format == MBIM_FIELD_FORMAT_REF_BYTE_ARRAY ||
+                      field->format == MBIM_FIELD_FORMAT_UICC_REF_BYTE_ARRAY);
+        has_length = (has_offset || field->format == MBIM_FIELD_FORMAT_REF_BYTE_ARRAY_NO_OFFSET);
+
+        if (field->format == MBIM_FIELD_FORMAT_BYTE_ARRAY) {
+            if (!_mbim_message_read_byte_array (self, 0, *offset, FALSE, FALSE, field->array_size, &tmp, NULL, error, FALSE))
+                return FALSE;
+            *offset += field->array_size;
+        } else {
+            if (!_mbim_message_read_byte_array (self, 0, *offset, has_offset, has_length, 0, &tmp, &tmpsize, error,
+                                                field->format == MBIM_FIELD_FORMAT_UICC_REF_BYTE_ARRAY))
+                return FALSE;
+            if (field->format == MBIM_FIELD_FORMAT_UNSIZED_BYTE_ARRAY)
+                *offset += tmpsize;
+            else
+                *offset += has_offset ? 8 : 4;
+            if (output->size)
+                *output->size = tmpsize;
+        }
+        if (output->value)
+            *((const guint8 **)output->value) = tmp;
+        return TRUE;
+    }
+
+    case MBIM_FIELD_FORMAT_UUID:
+        if (output->value && !_mbim_message_read_uuid (self, *offset, (const MbimUuid **)output->value, error))
+            return FALSE;
+        *offset += 16;
+        return TRUE;
+
+    case MBIM_FIELD_FORMAT_GUINT32:
+        if (field->always_read || output->value) {
+            if (!_mbim_message_read_guint32 (self, *offset, value, error))
+                return FALSE;
+            if (output->value)
+                *((guint32 *)output->value) = *value;
+        }
+        *offset += 4;
+        return TRUE;
+
+    case MBIM_FIELD_FORMAT_GUINT64:
+        if (output->value && !_mbim_message_read_guint64 (self, *offset, (guint64 *)output->value, error))
+            return FALSE;
+        *offset += 8;
+        return TRUE;
+
+    case MBIM_FIELD_FORMAT_STRING:
+        if (output->value && !_mbim_message_read_string (self, 0, *offset, (gchar **)allocated, error))
+            return FALSE;
+        *offset += 8;
+        return TRUE;
+
+    case MBIM_FIELD_FORMAT_STRING_ARRAY:
+        if (output->value && !_mbim_message_read_string_array (self, array_size, 0, *offset, (gchar ***)allocated, error))
+            return FALSE;
+        *offset += (8 * array_size);
+        return TRUE;
+
+    case MBIM_FIELD_FORMAT_STRUCT: {
+        gpointer tmp;
+        guint32  bytes_read = 0;
+
+        tmp = field->struct_info->read (self, *offset, &bytes_read, error);
+        if (!tmp)
+            return FALSE;
+        if (output->value)
+            *allocated = tmp;
+        else
+            field->struct_info->free (tmp);
+        *offset += bytes_read;
+        return TRUE;
+    }
+
+    case MBIM_FIELD_FORMAT_STRUCT_ARRAY:
+    case MBIM_FIELD_FORMAT_REF_STRUCT_ARRAY: {
+        gboolean refs;
+
+        refs = (field->format == MBIM_FIELD_FORMAT_REF_STRUCT_ARRAY);
+        if (output->value && !field->struct_info->read_array (self, array_size, *offset, refs, allocated, error))
+            return FALSE;
+        *offset += refs ? (8 * array_size) : 4;
+        return TRUE;
+    }
+
+    case MBIM_FIELD_FORMAT_IPV4:
+    case MBIM_FIELD_FORMAT_REF_IPV4:
+        if (output->value && !_mbim_message_read_ipv4 (self, *offset, field->format == MBIM_FIELD_FORMAT_REF_IPV4,
+                                                       (const MbimIPv4 **)output->value, error))
+            return FALSE;
+        *offset += 4;
+        return TRUE;
+
+    case MBIM_FIELD_FORMAT_IPV4_ARRAY:
+        if (output->value && !_mbim_message_read_ipv4_array (self, array_size, *offset, (MbimIPv4 **)allocated, error))
+            return FALSE;
+        *offset += 4;
+        return TRUE;
+
+    case MBIM_FIELD_FORMAT_IPV6:
+    case MBIM_FIELD_FORMAT_REF_IPV6:
+        if (output->value && !_mbim_message_read_ipv6 (self, *offset, field->format == MBIM_FIELD_FORMAT_REF_IPV6,
+                                                       (const MbimIPv6 **)output->value, error))
+            return FALSE;
+        *offset += (field->format == MBIM_FIELD_FORMAT_REF_IPV6) ? 4 : 16;
+        return TRUE;
+
+    case MBIM_FIELD_FORMAT_IPV6_ARRAY:
+        if (output->value && !_mbim_message_read_ipv6_array (self, array_size, *offset, (MbimIPv6 **)allocated, error))
+            return FALSE;
+        *offset += 4;
+        return TRUE;
+
+    default:
+        g_assert_not_reached ();
+        return FALSE;
+    }
+}
+
+gboolean
+_mbim_message_parse_fields (const MbimMessage      *self,
+                            MbimMessageType         message_type,
+                            const MbimFieldInfo    *fields,
+                            guint                   n_fields,
+                            const MbimFieldOutput  *outputs,
+                            GError                **error)
+{
+    guint32  values[MBIM_FIELDS_MAX];
+    gpointer allocated[MBIM_FIELDS_MAX];
+    guint32  offset = 0;
+    gboolean success = TRUE;
+    guint    i;
+
+    g_assert (n_fields <= MBIM_FIELDS_MAX);
+
+    if (mbim_message_get_message_type (self) != message_type) {
+        g_set_error (error,
+                     MBIM_CORE_ERROR,
+                     MBIM_CORE_ERROR_INVALID_MESSAGE,
+                     (message_type == MBIM_MESSAGE_TYPE_COMMAND_DONE) ?
+                     "Message is not a response" : "Message is not a notification");
+        return FALSE;
+    }
+
+    if (!n_fields)
+        return TRUE;
+
+    if (!((message_type == MBIM_MESSAGE_TYPE_COMMAND_DONE) ?
+          mbim_message_command_done_get_raw_information_buffer (self, NULL) :
+          mbim_message_indicate_status_get_raw_information_buffer (self, NULL))) {
+        g_set_error (error,
+                     MBIM_CORE_ERROR,
+                     MBIM_CORE_ERROR_INVALID_MESSAGE,
+                     "Message does not have information buffer");
+        return FALSE;
+    }
+
+    memset (allocated, 0, sizeof (gpointer) * n_fields);
+
+    for (i = 0; i < n_fields; i++) {
+        const MbimFieldInfo   *field = &fields[i];
+        const MbimFieldOutput *output = &outputs[i];
+
+        if (field->condition_field >= 0 && !field_condition_matches (field, values[field->condition_field])) {
+            /* Only fields returning pointers may be optional */
+            if (output->size)
+                *output->size = 0;
+            if (output->value)
+                *((gpointer *)output->value) = NULL;
+            continue;
+        }
+
+        if (!parse_field (self, field, output, values, &values[i], &allocated[i], &offset, error)) {
+            success = FALSE;
+            break;
+        }
+    }
+
+    /* Memory allocated variables as output, only on success */
+    for (i = 0; i < n_fields; i++) {
+        if (!field_format_is_allocated (fields[i].format))
+            continue;
+        if (!success)
+            field_free_allocated (&fields[i], allocated[i]);
+        else if (outputs[i].value)
+            *((gpointer *)outputs[i].value) = allocated[i];
+    }
+
+    return success;
+}
+
+static void
+print_byte_array (GString      *str,
+                  const guint8 *buffer,
+                  guint32       buffer_size)
+{
+    guint i;
+
+    g_string_append (str, "'");
+    for (i = 0; i  < buffer_size; i++)
+        g_string_append_printf (str, "%02x%s", buffer[i], (i == (buffer_size - 1)) ? "" : ":" );
+    g_string_append (str, "'");
+}
+
+static void
+print_ip_array (GString        *str,
+                const guint8   *addresses,
+                guint           n_addresses,
+                GSocketFamily   family)
+{
+    gsize address_size;
+    guint i;
+
+    address_size = (family == G_SOCKET_FAMILY_IPV4) ? sizeof (MbimIPv4) : sizeof (MbimIPv6);
+
+    g_string_append (str, "'");
+    if (addresses) {
+        for (i = 0; i < n_addresses; i++) {
+            g_autoptr(GInetAddress)  addr = NULL;
+            g_autofree gchar        *tmpstr = NULL;
+
+            addr = g_inet_address_new_from_bytes (&addresses[i * address_size], family);
+            tmpstr = g_inet_address_to_string (addr);
+            g_string_append_printf (str, "%s", tmpstr);
+            if (i < (n_addresses - 1))
+                g_string_append (str, ", ");
+        }
+    }
+    g_string_append (str, "'");
+}
+
+static void
+print_integer (GString             *str,
+               const MbimFieldInfo *field,
+               guint64              value)
+{
+    if (field->get_string) {
+        g_string_append_printf (str, "'%s'", field->get_string ((guint)value));
+    } else if (field->build_string_from_mask) {
+        g_autofree gchar *tmpstr = NULL;
+
+        tmpstr = field->build_string_from_mask ((guint)value);
+        g_string_append_printf (str, "'%s'", tmpstr);
+    } else if (field->format == MBIM_FIELD_FORMAT_GUINT64)
+        g_string_append_printf (str, "'%" G_GUINT64_FORMAT "'", value);
+    else
+        g_string_append_printf (str, "'%" G_GUINT32_FORMAT "'", (guint32)value);
+}
+
+static gboolean
+print_struct (const MbimMessage    *self,
+              const MbimFieldInfo  *field,
+              const gchar          *line_prefix,
+              guint32              *offset,
+              GString              *str,
+              GError              **error)
+{
+    const MbimStructInfo *info = field->struct_info;
+    gpointer              tmp;
+    g_autofree gchar     *new_line_prefix = NULL;
+    g_autofree gchar     *struct_str = NULL;
+    guint32               bytes_read = 0;
+
+    tmp = info->read (self, *offset, &bytes_read, error);
+    if (!tmp)
+        return FALSE;
+    *offset += bytes_read;
+
+    g_string_append (str, "{\n");
+    new_line_prefix = g_strdup_printf ("%s    ", line_prefix);
+    struct_str = info->print (tmp, new_line_prefix);
+    g_string_append (str, struct_str);
+    g_string_append_printf (str, "%s  }\n", line_prefix);
+    info->free (tmp);
+    return TRUE;
+}
+
+static gboolean
+print_struct_array (const MbimMessage    *self,
+                    const MbimFieldInfo  *field,
+                    guint32               array_size,
+                    const gchar          *line_prefix,
+                    guint32              *offset,
+                    GString              *str,
+                    GError              **error)
+{
+    const MbimStructInfo *info = field->struct_info;
+    gpointer             *tmp = NULL;
+    g_autofree gchar     *new_line_prefix = NULL;
+    gboolean              refs;
+    guint                 i;
+
+    refs = (field->format == MBIM_FIELD_FORMAT_REF_STRUCT_ARRAY);
+    if (!info->read_array (self, array_size, *offset, refs, (gpointer *)&tmp, error))
+        return FALSE;
+    *offset += refs ? (8 * array_size) : 4;
+
+    new_line_prefix = g_strdup_printf ("%s        ", line_prefix);
+    g_string_append (str, "'{\n");
+    for (i = 0; i < array_size; i++) {
+        g_autofree gchar *struct_str = NULL;
+
+        g_string_append_printf (str, "%s    [%u] = {\n", line_prefix, i);
+        struct_str = info->print (tmp[i], new_line_prefix);
+        g_string_append (str, struct_str);
+        g_string_append_printf (str, "%s    },\n", line_prefix);
+    }
+    g_string_append_printf (str, "%s  }'", line_prefix);
+    info->array_free (tmp);
+    return TRUE;
+}
+
+static gboolean
+print_field (const MbimMessage    *self,
+             const MbimFieldInfo  *field,
+             const gchar          *line_prefix,
+             const guint32        *values,
+             guint32              *value,
+             guint32              *offset,
+             GString              *str,
+             GError              **error)
+{
+    guint32 array_size = 0;
+
+    if (field->array_size_field >= 0)
+        array_size = values[field->array_size_field];
+
+    switch (field->format) {
+    case MBIM_FIELD_FORMAT_BYTE_ARRAY:
+    case MBIM_FIELD_FORMAT_UNSIZED_BYTE_ARRAY:
+    case MBIM_FIELD_FORMAT_REF_BYTE_ARRAY:
+    case MBIM_FIELD_FORMAT_UICC_REF_BYTE_ARRAY:
+    case MBIM_FIELD_FORMAT_REF_BYTE_ARRAY_NO_OFFSET: {
+        const guint8 *tmp;
+        guint32       tmpsize = 0;
+        gboolean      has_offset;
+        gboolean      has_length;
+        guint32       field_size;
+
+        has_offset = (field->format == MBIM_FIELD_FORMAT_REF_BYTE_ARRAY ||
+                      field->format == MBIM_FIELD_FORMAT_UICC_REF_BYTE_ARRAY);
+        has_length = (has_offset || field->format == MBIM_FIELD_FORMAT_REF_BYTE_ARRAY_NO_OFFSET);
+
+        if (field->format == MBIM_FIELD_FORMAT_BYTE_ARRAY) {
+            if (!_mbim_message_read_byte_array (self, 0, *offset, FALSE, FALSE, field->array_size, &tmp, NULL, error, FALSE))
+                return FALSE;
+            tmpsize = field->array_size;
+        } else if (!_mbim_message_read_byte_array (self, 0, *offset, has_offset, has_length, 0, &tmp, &tmpsize, error,
+                                                   field->format == MBIM_FIELD_FORMAT_UICC_REF_BYTE_ARRAY))
+            return FALSE;
+
+        if (field->format == MBIM_FIELD_FORMAT_BYTE_ARRAY)
+            field_size = field->array_size;
+        else if (field->format == MBIM_FIELD_FORMAT_UNSIZED_BYTE_ARRAY)
+            field_size = tmpsize;
+        else if (field->format == MBIM_FIELD_FORMAT_REF_BYTE_ARRAY_NO_OFFSET)
+            field_size = 4;
+        else
+            field_size = 8;
+        *offset += field_size;
+
+        print_byte_array (str, tmp, tmpsize);
+        return TRUE;
+    }
+
+    case MBIM_FIELD_FORMAT_UUID: {
+        const MbimUuid   *tmp;
+        g_autofree gchar *tmpstr = NULL;
+
+        if (!_mbim_message_read_uuid (self, *offset, &tmp, error))
+            return FALSE;
+        *offset += 16;
+        tmpstr = mbim_uuid_get_printable (tmp);
+        g_string_append_printf (str, "'%s'", tmpstr);
+        return TRUE;
+    }
+
+    case MBIM_FIELD_FORMAT_GUINT32: {
+        guint32 tmp;
+
+        if (!_mbim_message_read_guint32 (self, *offset, &tmp, error))
+            return FALSE;
+        *offset += 4;
+        if (field->always_read) {
+            *value = tmp;
+            g_string_append_printf (str, "'%" G_GUINT32_FORMAT "'", tmp);
+        } else
+            print_integer (str, field, tmp);
+        return TRUE;
+    }
+
+    case MBIM_FIELD_FORMAT_GUINT64: {
+        guint64 tmp;
+
+        if (!_mbim_message_read_guint64 (self, *offset, &tmp, error))
+            return FALSE;
+        *offset += 8;
+        print_integer (str, field, tmp);
+        return TRUE;
+    }
+
+    case MBIM_FIELD_FORMAT_STRING: {
+        g_autofree gchar *tmp = NULL;
+
+        if (!_mbim_message_read_string (self, 0, *offset, &tmp, error))
+            return FALSE;
+        *offset += 8;
+        g_string_append_printf (str, "'%s'", tmp);
+        return TRUE;
+    }
+
+    case MBIM_FIELD_FORMAT_STRING_ARRAY: {
+        g_auto(GStrv) tmp = NULL;
+        guint         i;
+
+        if (!_mbim_message_read_string_array (self, array_size, 0, *offset, &tmp, error))
+            return FALSE;
+        *offset += (8 * array_size);
+
+        g_string_append (str, "'");
+        for (i = 0; i < array_size; i++) {
+            g_string_append (str, tmp[i]);
+            if (i < (array_size - 1))
+                g_string_append (str, ", ");
+        }
+        g_string_append (str, "'");
+        return TRUE;
+    }
+
+    case MBIM_FIELD_FORMAT_STRUCT:
+        return print_struct (self, field, line_prefix, offset, str, error);
+
+    case MBIM_FIELD_FORMAT_STRUCT_ARRAY:
+    case MBIM_FIELD_FORMAT_REF_STRUCT_ARRAY:
+        return print_struct_array (self, field, array_size, line_prefix, offset, str, error);
+
+    case MBIM_FIELD_FORMAT_IPV4:
+    case MBIM_FIELD_FORMAT_REF_IPV4: {
+        const MbimIPv4 *tmp;
+
+        if (!_mbim_message_read_ipv4 (self, *offset, field->format == MBIM_FIELD_FORMAT_REF_IPV4, &tmp, error))
+            return FALSE;
+        *offset += 4;
+        print_ip_array (str, (const guint8 *)tmp, 1, G_SOCKET_FAMILY_IPV4);
+        return TRUE;
+    }
+
+    case MBIM_FIELD_FORMAT_IPV4_ARRAY: {
+        g_autofree MbimIPv4 *tmp = NULL;
+
+        if (!_mbim_message_read_ipv4_array (self, array_size, *offset, &tmp, error))
+            return FALSE;
+        *offset += 4;
+        print_ip_array (str, (const guint8 *)tmp, array_size, G_SOCKET_FAMILY_IPV4);
+        return TRUE;
+    }
+
+    case MBIM_FIELD_FORMAT_IPV6:
+    case MBIM_FIELD_FORMAT_REF_IPV6: {
+        const MbimIPv6 *tmp;
+
+        if (!_mbim_message_read_ipv6 (self, *offset, field->format == MBIM_FIELD_FORMAT_REF_IPV6, &tmp, error))
+            return FALSE;
+        *offset += (field->format == MBIM_FIELD_FORMAT_REF_IPV6) ? 4 : 16;
+        print_ip_array (str, (const guint8 *)tmp, 1, G_SOCKET_FAMILY_IPV6);
+        return TRUE;
+    }
+
+    case MBIM_FIELD_FORMAT_IPV6_ARRAY: {
+        g_autofree MbimIPv6 *tmp = NULL;
+
+        if (!_mbim_message_read_ipv6_array (self, array_size, *offset, &tmp, error))
+            return FALSE;
+        *offset += 4;
+        print_ip_array (str, (const guint8 *)tmp, array_size, G_SOCKET_FAMILY_IPV6);
+        return TRUE;
+    }
+
+    default:
+        g_assert_not_reached ();
+        return FALSE;
+    }
+}
+
+gchar *
+_mbim_message_print_fields (const MbimMessage   *self,
+                            const gchar         *line_prefix,
+                            const MbimFieldInfo *fields,
+                            guint                n_fields,
+                            gboolean             is_response)
+{
+    GString *str;
+    GError  *inner_error = NULL;
+    guint32  values[MBIM_FIELDS_MAX];
+    guint32  offset = 0;
+    guint    i;
+
+    g_assert (n_fields <= MBIM_FIELDS_MAX);
+
+    if (is_response && !mbim_message_response_get_result (self, MBIM_MESSAGE_TYPE_COMMAND_DONE, NULL))
+        return NULL;
+
+    str = g_string_new ("");
+
+    for (i = 0; i < n_fields; i++) {
+        const MbimFieldInfo *field = &fields[i];
+
+        g_string_append_printf (str, "%s  %s = ", line_prefix, field->name);
+        if ((field->condition_field < 0 || field_condition_matches (field, values[field->condition_field])) &&
+            !print_field (self, field, line_prefix, values, &values[i], &offset, str, &inner_error))
+            break;
+        g_string_append (str, "\n");
+    }
+
+    if (inner_error) {
+        g_string_append_printf (str, "n/a: %s", inner_error->message);
+        g_clear_error (&inner_error);
+    }
+
+    return g_string_free (str, FALSE);
+}
+
 /*****************************************************************************/
 /* Struct builder interface
  *
@@ -1256,7 +2076,8 @@ mbim_message_ref (MbimMessage *self)
 {
     g_return_val_if_fail (self != NULL, NULL);
 
-    return (MbimMessage *) g_byte_array_ref ((GByteArray *)self);
+    g_atomic_int_inc (&self->ref_count);
+    return self;
 }
 
 void
@@ -1264,7 +2085,13 @@ mbim_message_unref (MbimMessage *self)
 {
     g_return_if_fail (self != NULL);
 
-    g_byte_array_unref ((GByteArray *)self);
+    if (g_atomic_int_dec_and_test (&self->ref_count)) {
+        if (self->bytes)
+            g_bytes_unref (self->bytes);
+        else
+            g_free (self->data);
+        g_slice_free (MbimMessage, self);
+    }
 }
 
 MbimMessageType
@@ -1297,6 +2124,7 @@ mbim_message_set_transaction_id (MbimMessage *self,
 {
     g_return_if_fail (self != NULL);
 
+    message_ensure_writable (self);
     ((struct header *)(self->data))->transaction_id = GUINT32_TO_LE (transaction_id);
 }
 
@@ -1304,22 +2132,67 @@ MbimMessage *
 mbim_message_new (const guint8 *data,
                   guint32       data_length)
 {
-    GByteArray *out;
+    guint8 *copy;
 
     /* Create output MbimMessage */
-    out = g_byte_array_sized_new (data_length);
-    g_byte_array_append (out, data, data_length);
+    copy = g_malloc (data_length);
+    memcpy (copy, data, data_length);
 
-    return (MbimMessage *)out;
+    return message_new_take (copy, data_length);
+}
+
+MbimMessage *
+mbim_message_new_from_bytes (GBytes  *bytes,
+                             GError **error)
+{
+    MbimMessage   *self;
+    const guint8  *data;
+    gsize          size;
+    guint32        message_length;
+
+    g_return_val_if_fail (bytes != NULL, NULL);
+
+    data = g_bytes_get_data (bytes, &size);
+
+    /* Validate the header once, so that the message accessors can rely on it */
+    if (size < sizeof (struct header)) {
+        g_set_error (error,
+                     MBIM_CORE_ERROR,
+                     MBIM_CORE_ERROR_INVALID_MESSAGE,
+                     "Message too short: %" G_GSIZE_FORMAT " < %" G_GSIZE_FORMAT,
+                     size, sizeof (struct header));
+        return NULL;
+    }
+
+    message_length = GUINT32_FROM_LE (((const struct header *)data)->length);
+    if (message_length < sizeof (struct header) || message_length > size) {
+        g_set_error (error,
+                     MBIM_CORE_ERROR,
+                     MBIM_CORE_ERROR_INVALID_MESSAGE,
+                     "Invalid message length: %u (%" G_GSIZE_FORMAT " bytes available)",
+                     message_length, size);
+        return NULL;
+    }
+
+    self = g_slice_new0 (MbimMessage);
+    self->ref_count = 1;
+    self->bytes = g_bytes_ref (bytes);
+    self->data = (guint8 *) data;
+    self->len = message_length;
+    self->service = -1;
+    return self;
 }
 
 MbimMessage *
 mbim_message_dup (const MbimMessage *self)
 {
+    MbimMessage *copy;
+
     g_return_val_if_fail (self != NULL, NULL);
 
-    return mbim_message_new (((GByteArray *)self)->data,
-                             MBIM_MESSAGE_GET_MESSAGE_LENGTH (self));
+    copy = mbim_message_new (self->data, MBIM_MESSAGE_GET_MESSAGE_LENGTH (self));
+    copy->service = g_atomic_int_get (&self->service);
+    return copy;
 }
 
 const guint8 *
@@ -1342,6 +2215,61 @@ mbim_message_get_raw (const MbimMessage  *self,
     return self->data;
 }
 
+typedef gchar * (* GetPrintableFieldsFunc) (const MbimMessage  *message,
+                                            const gchar        *line_prefix,
+                                            GError            **error);
+
+/* Services built in the library, indexed by MbimService */
+static const GetPrintableFieldsFunc get_printable_fields_funcs [MBIM_SERVICE_LAST] = {
+    [MBIM_SERVICE_BASIC_CONNECT] = __mbim_message_basic_connect_get_printable_fields,
+#if defined MBIM_SERVICE_SMS_ENABLED
+    [MBIM_SERVICE_SMS] = __mbim_message_sms_get_printable_fields,
+#endif
+#if defined MBIM_SERVICE_USSD_ENABLED
+    [MBIM_SERVICE_USSD] = __mbim_message_ussd_get_printable_fields,
+#endif
+#if defined MBIM_SERVICE_PHONEBOOK_ENABLED
+    [MBIM_SERVICE_PHONEBOOK] = __mbim_message_phonebook_get_printable_fields,
+#endif
+#if defined MBIM_SERVICE_STK_ENABLED
+    [MBIM_SERVICE_STK] = __mbim_message_stk_get_printable_fields,
+#endif
+#if defined MBIM_SERVICE_AUTH_ENABLED
+    [MBIM_SERVICE_AUTH] = __mbim_message_auth_get_printable_fields,
+#endif
+#if defined MBIM_SERVICE_DSS_ENABLED
+    [MBIM_SERVICE_DSS] = __mbim_message_dss_get_printable_fields,
+#endif
+#if defined MBIM_SERVICE_MS_FIRMWARE_ID_ENABLED
+    [MBIM_SERVICE_MS_FIRMWARE_ID] = __mbim_message_ms_firmware_id_get_printable_fields,
+#endif
+#if defined MBIM_SERVICE_MS_HOST_SHUTDOWN_ENABLED
+    [MBIM_SERVICE_MS_HOST_SHUTDOWN] = __mbim_message_ms_host_shutdown_get_printable_fields,
+#endif
+#if defined MBIM_SERVICE_MS_SAR_ENABLED
+    [MBIM_SERVICE_MS_SAR] = __mbim_message_ms_sar_get_printable_fields,
+#endif
+    [MBIM_SERVICE_PROXY_CONTROL] = __mbim_message_proxy_control_get_printable_fields,
+#if defined MBIM_SERVICE_QMI_ENABLED
+    [MBIM_SERVICE_QMI] = __mbim_message_qmi_get_printable_fields,
+#endif
+#if defined MBIM_SERVICE_ATDS_ENABLED
+    [MBIM_SERVICE_ATDS] = __mbim_message_atds_get_printable_fields,
+#endif
+#if defined MBIM_SERVICE_INTEL_FIRMWARE_UPDATE_ENABLED
+    [MBIM_SERVICE_INTEL_FIRMWARE_UPDATE] = __mbim_message_intel_firmware_update_get_printable_fields,
+#endif
+#if defined MBIM_SERVICE_QDU_ENABLED
+    [MBIM_SERVICE_QDU] = __mbim_message_qdu_get_printable_fields,
+#endif
+#if defined MBIM_SERVICE_MS_BASIC_CONNECT_EXTENSIONS_ENABLED
+    [MBIM_SERVICE_MS_BASIC_CONNECT_EXTENSIONS] = __mbim_message_ms_basic_connect_extensions_get_printable_fields,
+#endif
+#if defined MBIM_SERVICE_MS_UICC_LOW_LEVEL_ACCESS_ENABLED
+    [MBIM_SERVICE_MS_UICC_LOW_LEVEL_ACCESS] = __mbim_message_ms_uicc_low_level_access_get_printable_fields,
+#endif
+};
+
 gchar *
 mbim_message_get_printable (const MbimMessage *self,
                             const gchar       *line_prefix,
@@ -1519,64 +2447,8 @@ mbim_message_get_printable (const MbimMessage *self,
         g_autofree gchar  *fields_printable = NULL;
         g_autoptr(GError)  error = NULL;
 
-        switch (service_read_fields) {
-        case MBIM_SERVICE_BASIC_CONNECT:
-            fields_printable = __mbim_message_basic_connect_get_printable_fields (self, line_prefix, &error);
-            break;
-        case MBIM_SERVICE_SMS:
-            fields_printable = __mbim_message_sms_get_printable_fields (self, line_prefix, &error);
-            break;
-        case MBIM_SERVICE_USSD:
-            fields_printable = __mbim_message_ussd_get_printable_fields (self, line_prefix, &error);
-            break;
-        case MBIM_SERVICE_PHONEBOOK:
-            fields_printable = __mbim_message_phonebook_get_printable_fields (self, line_prefix, &error);
-            break;
-        case MBIM_SERVICE_STK:
-            fields_printable = __mbim_message_stk_get_printable_fields (self, line_prefix, &error);
-            break;
-        case MBIM_SERVICE_AUTH:
-            fields_printable = __mbim_message_auth_get_printable_fields (self, line_prefix, &error);
-            break;
-        case MBIM_SERVICE_DSS:
-            fields_printable = __mbim_message_dss_get_printable_fields (self, line_prefix, &error);
-            break;
-        case MBIM_SERVICE_MS_FIRMWARE_ID:
-            fields_printable = __mbim_message_ms_firmware_id_get_printable_fields (self, line_prefix, &error);
-            break;
-        case MBIM_SERVICE_MS_HOST_SHUTDOWN:
-            fields_printable = __mbim_message_ms_host_shutdown_get_printable_fields (self, line_prefix, &error);
-            break;
-        case MBIM_SERVICE_MS_SAR:
-            fields_printable = __mbim_message_ms_sar_get_printable_fields (self, line_prefix, &error);
-            break;
-        case MBIM_SERVICE_PROXY_CONTROL:
-            fields_printable = __mbim_message_proxy_control_get_printable_fields (self, line_prefix, &error);
-            break;
-        case MBIM_SERVICE_QMI:
-            fields_printable = __mbim_message_qmi_get_printable_fields (self, line_prefix, &error);
-            break;
-        case MBIM_SERVICE_ATDS:
-            fields_printable = __mbim_message_atds_get_printable_fields (self, line_prefix, &error);
-            break;
-        case MBIM_SERVICE_INTEL_FIRMWARE_UPDATE:
-            fields_printable = __mbim_message_intel_firmware_update_get_printable_fields (self, line_prefix, &error);
-            break;
-        case MBIM_SERVICE_QDU:
-            fields_printable = __mbim_message_qdu_get_printable_fields (self, line_prefix, &error);
-            break;
-        case MBIM_SERVICE_MS_BASIC_CONNECT_EXTENSIONS:
-            fields_printable = __mbim_message_ms_basic_connect_extensions_get_printable_fields (self, line_prefix, &error);
-            break;
-        case MBIM_SERVICE_MS_UICC_LOW_LEVEL_ACCESS:
-            fields_printable = __mbim_message_ms_uicc_low_level_access_get_printable_fields (self, line_prefix, &error);
-            break;
-        case MBIM_SERVICE_INVALID:
-        case MBIM_SERVICE_LAST:
-            g_assert_not_reached ();
-        default:
-            break;
-        }
+        if (service_read_fields < MBIM_SERVICE_LAST && get_printable_fields_funcs[service_read_fields])
+            fields_printable = get_printable_fields_funcs[service_read_fields] (self, line_prefix, &error);
 
         if (error)
             g_string_append_printf (printable,
@@ -1690,7 +2562,7 @@ _mbim_message_fragment_collector_add (MbimMessage        *self,
     buffer = _mbim_message_fragment_get_payload (fragment, &buffer_len);
     if (buffer_len) {
         /* Concatenate information buffers */
-        g_byte_array_append ((GByteArray *)self, buffer, buffer_len);
+        message_append (self, buffer, buffer_len);
         /* Update the whole message length */
         ((struct header *)(self->data))->length =
             GUINT32_TO_LE (MBIM_MESSAGE_GET_MESSAGE_LENGTH (self) + buffer_len);
@@ -1762,7 +2634,7 @@ _mbim_message_split_fragments (const MbimMessage *self,
                                total_fragments);
 
     /* Initialize data walkers */
-    data = ((struct full_message *)(((GByteArray *)self)->data))->message.fragment.buffer;
+    data = ((struct full_message *)(self->data))->message.fragment.buffer;
     data_length = total_payload_length;
 
     /* Create fragment infos */
@@ -1800,7 +2672,7 @@ MbimMessage *
 mbim_message_open_new (guint32 transaction_id,
                        guint32 max_control_transfer)
 {
-    GByteArray *self;
+    MbimMessage *self;
 
     self = _mbim_message_allocate (MBIM_MESSAGE_TYPE_OPEN,
                                    transaction_id,
@@ -1809,7 +2681,7 @@ mbim_message_open_new (guint32 transaction_id,
     /* Open header */
     ((struct full_message *)(self->data))->message.open.max_control_transfer = GUINT32_TO_LE (max_control_transfer);
 
-    return (MbimMessage *)self;
+    return self;
 }
 
 guint32
@@ -1828,7 +2700,7 @@ MbimMessage *
 mbim_message_open_done_new (guint32         transaction_id,
                             MbimStatusError error_status_code)
 {
-    GByteArray *self;
+    MbimMessage *self;
 
     self = _mbim_message_allocate (MBIM_MESSAGE_TYPE_OPEN_DONE,
                                    transaction_id,
@@ -1837,7 +2709,7 @@ mbim_message_open_done_new (guint32         transaction_id,
     /* Open header */
     ((struct full_message *)(self->data))->message.open_done.status_code = GUINT32_TO_LE (error_status_code);
 
-    return (MbimMessage *)self;
+    return self;
 }
 
 MbimStatusError
@@ -1872,9 +2744,9 @@ mbim_message_open_done_get_result (const MbimMessage  *self,
 MbimMessage *
 mbim_message_close_new (guint32 transaction_id)
 {
-    return (MbimMessage *) _mbim_message_allocate (MBIM_MESSAGE_TYPE_CLOSE,
-                                                   transaction_id,
-                                                   0);
+    return _mbim_message_allocate (MBIM_MESSAGE_TYPE_CLOSE,
+                                   transaction_id,
+                                   0);
 }
 
 /*****************************************************************************/
@@ -1884,7 +2756,7 @@ MbimMessage *
 mbim_message_close_done_new (guint32         transaction_id,
                              MbimStatusError error_status_code)
 {
-    GByteArray *self;
+    MbimMessage *self;
 
     self = _mbim_message_allocate (MBIM_MESSAGE_TYPE_CLOSE_DONE,
                                    transaction_id,
@@ -1893,7 +2765,7 @@ mbim_message_close_done_new (guint32         transaction_id,
     /* Open header */
     ((struct full_message *)(self->data))->message.close_done.status_code = GUINT32_TO_LE (error_status_code);
 
-    return (MbimMessage *)self;
+    return self;
 }
 
 MbimStatusError
@@ -1929,7 +2801,7 @@ MbimMessage *
 mbim_message_error_new (guint32           transaction_id,
                         MbimProtocolError error_status_code)
 {
-    GByteArray *self;
+    MbimMessage *self;
 
     self = _mbim_message_allocate (MBIM_MESSAGE_TYPE_HOST_ERROR,
                                    transaction_id,
@@ -1938,14 +2810,14 @@ mbim_message_error_new (guint32           transaction_id,
     /* Open header */
     ((struct full_message *)(self->data))->message.error.error_status_code = GUINT32_TO_LE (error_status_code);
 
-    return (MbimMessage *)self;
+    return self;
 }
 
 MbimMessage *
 mbim_message_function_error_new (guint32           transaction_id,
                                  MbimProtocolError error_status_code)
 {
-    GByteArray *self;
+    MbimMessage *self;
 
     self = _mbim_message_allocate (MBIM_MESSAGE_TYPE_FUNCTION_ERROR,
                                    transaction_id,
@@ -1954,7 +2826,7 @@ mbim_message_function_error_new (guint32           transaction_id,
     /* Open header */
     ((struct full_message *)(self->data))->message.error.error_status_code = GUINT32_TO_LE (error_status_code);
 
-    return (MbimMessage *)self;
+    return self;
 }
 
 MbimProtocolError
@@ -1987,6 +2859,56 @@ mbim_message_error_get_error (const MbimMessage *self)
                         mbim_protocol_error_get_string (error_status_code));
 }
 
+/*****************************************************************************/
+/* Interned service */
+
+static MbimService
+message_get_service (const MbimMessage *self,
+                     const MbimUuid    *service_id)
+{
+    gint service;
+
+    service = g_atomic_int_get (&self->service);
+    if (service >= 0)
+        return (MbimService) service;
+
+    /* Only standard services are cached, as custom ones may be registered or
+     * unregistered at any time */
+    service = (gint) mbim_uuid_to_service (service_id);
+    if (service > MBIM_SERVICE_INVALID && service < MBIM_SERVICE_LAST)
+        g_atomic_int_set (&((MbimMessage *)self)->service, service);
+    return (MbimService) service;
+}
+
+void
+_mbim_message_intern_service (const MbimMessage *self)
+{
+    /* Only the first fragment has the service UUID */
+    if (MBIM_MESSAGE_IS_FRAGMENT (self) && MBIM_MESSAGE_FRAGMENT_GET_CURRENT (self) != 0)
+        return;
+
+    switch (MBIM_MESSAGE_GET_MESSAGE_TYPE (self)) {
+    case MBIM_MESSAGE_TYPE_COMMAND:
+        mbim_message_command_get_service (self);
+        break;
+    case MBIM_MESSAGE_TYPE_COMMAND_DONE:
+        mbim_message_command_done_get_service (self);
+        break;
+    case MBIM_MESSAGE_TYPE_INDICATE_STATUS:
+        mbim_message_indicate_status_get_service (self);
+        break;
+    case MBIM_MESSAGE_TYPE_INVALID:
+    case MBIM_MESSAGE_TYPE_OPEN:
+    case MBIM_MESSAGE_TYPE_CLOSE:
+    case MBIM_MESSAGE_TYPE_HOST_ERROR:
+    case MBIM_MESSAGE_TYPE_OPEN_DONE:
+    case MBIM_MESSAGE_TYPE_CLOSE_DONE:
+    case MBIM_MESSAGE_TYPE_FUNCTION_ERROR:
+    default:
+        break;
+    }
+}
+
 /*****************************************************************************/
 /* 'Command' message interface */
 
@@ -1996,7 +2918,7 @@ mbim_message_command_new (guint32                transaction_id,
                           guint32                cid,
                           MbimMessageCommandType command_type)
 {
-    GByteArray *self;
+    MbimMessage *self;
     const MbimUuid *service_id;
 
     /* Known service required */
@@ -2017,7 +2939,7 @@ mbim_message_command_new (guint32                transaction_id,
     ((struct full_message *)(self->data))->message.command.command_type  = GUINT32_TO_LE (command_type);
     ((struct full_message *)(self->data))->message.command.buffer_length = 0;
 
-    return (MbimMessage *)self;
+    return self;
 }
 
 void
@@ -2025,7 +2947,10 @@ mbim_message_command_append (MbimMessage  *self,
                              const guint8 *buffer,
                              guint32       buffer_size)
 {
-    g_byte_array_append ((GByteArray *)self, buffer, buffer_size);
+    g_return_if_fail (self != NULL);
+    g_return_if_fail (!self->prepared);
+
+    message_append (self, buffer, buffer_size);
 
     /* Update message and buffer length */
     ((struct header *)(self->data))->length =
@@ -2034,13 +2959,31 @@ mbim_message_command_append (MbimMessage  *self,
         GUINT32_TO_LE (GUINT32_FROM_LE (((struct full_message *)(self->data))->message.command.buffer_length) + buffer_size);
 }
 
+void
+mbim_message_command_prepare (MbimMessage *self)
+{
+    g_return_if_fail (self != NULL);
+    g_return_if_fail (MBIM_MESSAGE_GET_MESSAGE_TYPE (self) == MBIM_MESSAGE_TYPE_COMMAND);
+
+    self->prepared = TRUE;
+}
+
+gboolean
+mbim_message_command_is_prepared (const MbimMessage *self)
+{
+    g_return_val_if_fail (self != NULL, FALSE);
+    g_return_val_if_fail (MBIM_MESSAGE_GET_MESSAGE_TYPE (self) == MBIM_MESSAGE_TYPE_COMMAND, FALSE);
+
+    return self->prepared;
+}
+
 MbimService
 mbim_message_command_get_service (const MbimMessage *self)
 {
     g_return_val_if_fail (self != NULL, MBIM_SERVICE_INVALID);
     g_return_val_if_fail (MBIM_MESSAGE_GET_MESSAGE_TYPE (self) == MBIM_MESSAGE_TYPE_COMMAND, MBIM_SERVICE_INVALID);
 
-    return mbim_uuid_to_service ((const MbimUuid *)&(((struct full_message *)(self->data))->message.command.service_id));
+    return message_get_service (self, (const MbimUuid *)&(((struct full_message *)(self->data))->message.command.service_id));
 }
 
 const MbimUuid *
@@ -2097,7 +3040,7 @@ mbim_message_command_done_get_service (const MbimMessage *self)
     g_return_val_if_fail (self != NULL, MBIM_SERVICE_INVALID);
     g_return_val_if_fail (MBIM_MESSAGE_GET_MESSAGE_TYPE (self) == MBIM_MESSAGE_TYPE_COMMAND_DONE, MBIM_SERVICE_INVALID);
 
-    return mbim_uuid_to_service ((const MbimUuid *)&(((struct full_message *)(self->data))->message.command_done.service_id));
+    return message_get_service (self, (const MbimUuid *)&(((struct full_message *)(self->data))->message.command_done.service_id));
 }
 
 const MbimUuid *
@@ -2171,7 +3114,7 @@ mbim_message_indicate_status_get_service (const MbimMessage *self)
     g_return_val_if_fail (self != NULL, MBIM_SERVICE_INVALID);
     g_return_val_if_fail (MBIM_MESSAGE_GET_MESSAGE_TYPE (self) == MBIM_MESSAGE_TYPE_INDICATE_STATUS, MBIM_SERVICE_INVALID);
 
-    return mbim_uuid_to_service ((const MbimUuid *)&(((struct full_message *)(self->data))->message.indicate_status.service_id));
+    return message_get_service (self, (const MbimUuid *)&(((struct full_message *)(self->data))->message.indicate_status.service_id));
 }
 
 const MbimUuid *
@@ -132,6 +132,29 @@ typedef enum { /*< since=1.0 >*/
 MbimMessage *mbim_message_new (const guint8 *data,
                                guint32       data_length);
 
+/**
+ * mbim_message_new_from_bytes:
+ * @bytes: a #GBytes with the contents of the message.
+ * @error: return location for error or %NULL.
+ *
+ * Create a #MbimMessage referencing the memory in @bytes, without copying it.
+ *
+ * The message header is validated once, and the message length is taken from
+ * it, so @bytes may hold additional trailing data. Memory not owned by the
+ * caller (e.g. a borrowed view) may be wrapped with g_bytes_new_static() or
+ * g_bytes_new_with_free_func().
+ *
+ * The contents are only copied if the message is modified later on (e.g. with
+ * mbim_message_set_transaction_id()) while @bytes is still referenced by
+ * someone else.
+ *
+ * Returns: (transfer full): a newly created #MbimMessage, which should be freed with mbim_message_unref(), or %NULL if @error is set.
+ *
+ * Since: 1.26
+ */
+MbimMessage *mbim_message_new_from_bytes (GBytes  *bytes,
+                                          GError **error);
+
 /**
  * mbim_message_dup:
  * @self: a #MbimMessage to duplicate.
@@ -500,6 +523,35 @@ void mbim_message_command_append (MbimMessage  *self,
                                   const guint8 *buffer,
                                   guint32       buffer_size);
 
+/**
+ * mbim_message_command_prepare:
+ * @self: a #MbimMessage of type %MBIM_MESSAGE_TYPE_COMMAND.
+ *
+ * Flags @self as a prepared command, so that the same message can be built
+ * once and then submitted any number of times with mbim_device_command().
+ *
+ * The contents of a prepared command are immutable: nothing else may be
+ * appended to it. Every time it is submitted, the #MbimDevice assigns a new
+ * transaction ID to the message, rewriting the header in place without
+ * reallocating the message.
+ *
+ * Since: 1.26
+ */
+void mbim_message_command_prepare (MbimMessage *self);
+
+/**
+ * mbim_message_command_is_prepared:
+ * @self: a #MbimMessage of type %MBIM_MESSAGE_TYPE_COMMAND.
+ *
+ * Checks whether @self was flagged as a prepared command with
+ * mbim_message_command_prepare().
+ *
+ * Returns: %TRUE if @self is a prepared command, %FALSE otherwise.
+ *
+ * Since: 1.26
+ */
+gboolean mbim_message_command_is_prepared (const MbimMessage *self);
+
 /**
  * mbim_message_command_get_service:
  * @self: a #MbimMessage.
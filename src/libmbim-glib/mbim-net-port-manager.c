@@ -57,6 +57,9 @@ struct _MbimNetPortManagerPrivate {
 
 #define VLAN_DATA_TYPE "vlan"
 
+/* Enough for the replies to a whole batch of requests read at once */
+#define NETLINK_BUFFER_SIZE 8192
+
 /*****************************************************************************/
 
 static gchar *
@@ -363,49 +366,74 @@ netlink_message_cb (GSocket                *socket,
                     MbimNetPortManager *self)
 {
     GError          *error = NULL;
-    gchar            buf[512];
+    gchar            buf[NETLINK_BUFFER_SIZE];
     int              bytes_received;
     unsigned int     buffer_len;
     struct nlmsghdr *hdr;
+    g_autoptr(MbimNetPortManager) self_ref = NULL;
 
     if (condition & G_IO_HUP || condition & G_IO_ERR) {
         g_warning ("[netlink] socket connection closed.");
         return G_SOURCE_REMOVE;
     }
 
-    bytes_received = g_socket_receive (socket, buf, sizeof (buf), NULL, &error);
-
-    if (bytes_received < 0) {
-        g_warning ("[netlink] socket i/o failure: %s", error->message);
-        g_error_free (error);
-        return G_SOURCE_REMOVE;
-    }
+    /* The kernel acknowledges each request of a batch separately, so read
+     * everything available before going back to the main loop; completing the
+     * transactions may release the last reference to the manager otherwise */
+    self_ref = g_object_ref (self);
+    while (TRUE) {
+        bytes_received = g_socket_receive_with_blocking (socket, buf, sizeof (buf), FALSE, NULL, &error);
+
+        if (bytes_received < 0) {
+            if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+                g_error_free (error);
+                return G_SOURCE_CONTINUE;
+            }
+            g_warning ("[netlink] socket i/o failure: %s", error->message);
+            g_error_free (error);
+            return G_SOURCE_REMOVE;
+        }
 
-    buffer_len = (unsigned int ) bytes_received;
-    for (hdr = (struct nlmsghdr *) buf; NLMSG_OK (hdr, buffer_len);
-         NLMSG_NEXT (hdr, buffer_len)) {
-        Transaction     *tr;
-        struct nlmsgerr *err;
+        buffer_len = (unsigned int ) bytes_received;
+        for (hdr = (struct nlmsghdr *) buf; NLMSG_OK (hdr, buffer_len);
+             hdr = NLMSG_NEXT (hdr, buffer_len)) {
+            Transaction     *tr;
+            struct nlmsgerr *err;
 
-        if (hdr->nlmsg_type != NLMSG_ERROR)
-            continue;
+            if (hdr->nlmsg_type != NLMSG_ERROR)
+                continue;
 
-        tr = g_hash_table_lookup (self->priv->transactions,
-                                  GUINT_TO_POINTER (hdr->nlmsg_seq));
-        if (!tr)
-            continue;
+            tr = g_hash_table_lookup (self->priv->transactions,
+                                      GUINT_TO_POINTER (hdr->nlmsg_seq));
+            if (!tr)
+                continue;
 
-        err = NLMSG_DATA (buf);
-        transaction_complete (tr, err->error);
+            /* The error is reported as a negative errno, or 0 in an ACK */
+            err = NLMSG_DATA (hdr);
+            transaction_complete (tr, -err->error);
+        }
     }
-    return G_SOURCE_CONTINUE;
 }
 
 /*****************************************************************************/
 
+static gboolean
+session_id_reserved (GArray *reserved,
+                     guint   session_id)
+{
+    guint i;
+
+    for (i = 0; reserved && i < reserved->len; i++) {
+        if (g_array_index (reserved, guint, i) == session_id)
+            return TRUE;
+    }
+    return FALSE;
+}
+
 static gboolean
 get_first_free_session_id (MbimNetPortManager *self,
                            const gchar        *ifname_prefix,
+                           GArray             *reserved,
                            guint              *session_id)
 {
     guint i;
@@ -416,6 +444,10 @@ get_first_free_session_id (MbimNetPortManager *self,
     for (i = 1; i <= MBIM_DEVICE_SESSION_ID_MAX; i++) {
         g_autofree gchar *ifname = NULL;
 
+        /* Skip those already taken by other links of the same batch */
+        if (session_id_reserved (reserved, i))
+            continue;
+
         ifname = session_id_to_ifname (ifname_prefix, i);
         if (!if_nametoindex (ifname)) {
             *session_id = i;
@@ -426,6 +458,31 @@ get_first_free_session_id (MbimNetPortManager *self,
     return FALSE;
 }
 
+static gboolean
+get_base_if_index (MbimNetPortManager  *self,
+                   const gchar         *base_ifname,
+                   guint               *base_if_index,
+                   GError             **error)
+{
+    /* validate interface to use */
+    if (g_strcmp0 (self->priv->iface, base_ifname) != 0) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                     "Invalid network interface %s: expected %s",
+                     base_ifname, self->priv->iface);
+        return FALSE;
+    }
+
+    *base_if_index = if_nametoindex (base_ifname);
+    if (!*base_if_index) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                     "%s interface is not available",
+                     base_ifname);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
 /*****************************************************************************/
 
 typedef struct {
@@ -486,7 +543,7 @@ mbim_net_port_manager_add_link (MbimNetPortManager  *self,
     g_task_set_task_data (task, ctx, (GDestroyNotify) add_link_context_free);
 
     if (ctx->session_id == MBIM_DEVICE_SESSION_ID_AUTOMATIC) {
-        if (!get_first_free_session_id (self, ifname_prefix, &ctx->session_id)) {
+        if (!get_first_free_session_id (self, ifname_prefix, NULL, &ctx->session_id)) {
             g_task_return_new_error (task, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
                                      "Failed to find an available session ID");
             g_object_unref (task);
@@ -496,20 +553,8 @@ mbim_net_port_manager_add_link (MbimNetPortManager  *self,
     } else
         g_debug ("Using static session ID %u", ctx->session_id);
 
-    /* validate interface to use */
-    if (g_strcmp0 (self->priv->iface, base_ifname) != 0) {
-        g_task_return_new_error (task, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
-                                 "Invalid network interface %s: expected %s",
-                                 base_ifname, self->priv->iface);
-        g_object_unref (task);
-        return;
-    }
-
-    base_if_index = if_nametoindex (base_ifname);
-    if (!base_if_index) {
-        g_task_return_new_error (task, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
-                                 "%s interface is not available",
-                                 base_ifname);
+    if (!get_base_if_index (self, base_ifname, &base_if_index, &error)) {
+        g_task_return_error (task, error);
         g_object_unref (task);
         return;
     }
@@ -587,6 +632,256 @@ mbim_net_port_manager_del_link (MbimNetPortManager  *self,
     g_object_unref (task);
 }
 
+/*****************************************************************************/
+/* Link batches
+ *
+ * All the requests of a batch are sent in a single datagram, each one with its
+ * own transaction; the kernel processes them in order and acknowledges each
+ * one separately, so the batch completes once all transactions have. */
+
+typedef struct {
+    GArray    *session_ids;
+    GPtrArray *ifnames;
+    guint      n_pending;
+    GError    *error;
+} LinkBatchContext;
+
+static void
+link_batch_context_free (LinkBatchContext *ctx)
+{
+    g_assert (!ctx->error);
+    if (ctx->session_ids)
+        g_array_unref (ctx->session_ids);
+    g_ptr_array_unref (ctx->ifnames);
+    g_slice_free (LinkBatchContext, ctx);
+}
+
+static void
+link_batch_transaction_ready (MbimNetPortManager *self,
+                              GAsyncResult       *res,
+                              GTask              *task)
+{
+    LinkBatchContext *ctx;
+    GError           *error = NULL;
+    guint             i;
+
+    ctx = g_task_get_task_data (task);
+    i = GPOINTER_TO_UINT (g_task_get_task_data (G_TASK (res)));
+
+    /* Keep the first error, but wait for all transactions to complete */
+    if (!g_task_propagate_boolean (G_TASK (res), &error)) {
+        if (ctx->session_ids)
+            g_prefix_error (&error, "Failed to add link with session id %u: ",
+                            g_array_index (ctx->session_ids, guint, i));
+        else
+            g_prefix_error (&error, "Failed to delete link %s: ",
+                            (const gchar *) g_ptr_array_index (ctx->ifnames, i));
+        g_debug ("%s", error->message);
+        if (!ctx->error)
+            ctx->error = error;
+        else
+            g_error_free (error);
+    }
+
+    g_assert (ctx->n_pending > 0);
+    if (--ctx->n_pending == 0) {
+        if (ctx->error)
+            g_task_return_error (task, g_steal_pointer (&ctx->error));
+        else
+            g_task_return_boolean (task, TRUE);
+    }
+    g_object_unref (task);
+}
+
+static void
+link_batch_send (MbimNetPortManager *self,
+                 GPtrArray          *msgs,
+                 guint               timeout,
+                 GTask              *task)
+{
+    LinkBatchContext      *ctx;
+    g_autoptr(GByteArray)  buffer = NULL;
+    g_autoptr(GPtrArray)   transactions = NULL;
+    GError                *error = NULL;
+    gssize                 bytes_sent;
+    guint                  i;
+
+    ctx = g_task_get_task_data (task);
+    ctx->n_pending = msgs->len;
+
+    buffer = g_byte_array_new ();
+    transactions = g_ptr_array_sized_new (msgs->len);
+
+    for (i = 0; i < msgs->len; i++) {
+        NetlinkMessage *msg;
+        GTask          *transaction_task;
+
+        msg = g_ptr_array_index (msgs, i);
+
+        /* Each transaction completes its own task, which then reports to the
+         * batch task; the transaction index is given as task data */
+        transaction_task = g_task_new (self, NULL, (GAsyncReadyCallback) link_batch_transaction_ready, g_object_ref (task));
+        g_task_set_task_data (transaction_task, GUINT_TO_POINTER (i), NULL);
+        g_ptr_array_add (transactions, transaction_new (self, msg, timeout, transaction_task));
+        g_object_unref (transaction_task);
+
+        /* Messages are already aligned, as all attributes are */
+        g_assert (msg->len == NLMSG_ALIGN (msg->len));
+        g_byte_array_append (buffer, msg->data, msg->len);
+    }
+
+    bytes_sent = g_socket_send (self->priv->socket,
+                                (const gchar *) buffer->data,
+                                buffer->len,
+                                g_task_get_cancellable (task),
+                                &error);
+    if (bytes_sent < 0) {
+        for (i = 0; i < transactions->len; i++)
+            transaction_complete_with_error (g_ptr_array_index (transactions, i), g_error_copy (error));
+        g_error_free (error);
+    }
+}
+
+GPtrArray *
+mbim_net_port_manager_add_links_finish (MbimNetPortManager  *self,
+                                        GArray             **session_ids,
+                                        GAsyncResult        *res,
+                                        GError             **error)
+{
+    LinkBatchContext *ctx;
+
+    if (!g_task_propagate_boolean (G_TASK (res), error))
+        return NULL;
+
+    ctx = g_task_get_task_data (G_TASK (res));
+    if (session_ids)
+        *session_ids = g_array_ref (ctx->session_ids);
+    return g_ptr_array_ref (ctx->ifnames);
+}
+
+void
+mbim_net_port_manager_add_links (MbimNetPortManager  *self,
+                                 const guint         *session_ids,
+                                 guint                n_session_ids,
+                                 const gchar         *base_ifname,
+                                 const gchar         *ifname_prefix,
+                                 guint                timeout,
+                                 GCancellable        *cancellable,
+                                 GAsyncReadyCallback  callback,
+                                 gpointer             user_data)
+{
+    g_autoptr(GPtrArray)  msgs = NULL;
+    g_autoptr(GArray)     reserved = NULL;
+    LinkBatchContext     *ctx;
+    GTask                *task;
+    GError               *error = NULL;
+    guint                 base_if_index;
+    guint                 i;
+
+    task = g_task_new (self, cancellable, callback, user_data);
+
+    ctx = g_slice_new0 (LinkBatchContext);
+    ctx->session_ids = g_array_sized_new (FALSE, FALSE, sizeof (guint), n_session_ids);
+    ctx->ifnames = g_ptr_array_new_with_free_func (g_free);
+    g_task_set_task_data (task, ctx, (GDestroyNotify) link_batch_context_free);
+
+    if (!get_base_if_index (self, base_ifname, &base_if_index, &error)) {
+        g_task_return_error (task, error);
+        g_object_unref (task);
+        return;
+    }
+
+    /* Automatic session ids are allocated around all the explicit ones of the
+     * batch, not only around the ones requested before them */
+    reserved = g_array_sized_new (FALSE, FALSE, sizeof (guint), n_session_ids);
+    for (i = 0; i < n_session_ids; i++) {
+        if (session_ids[i] != MBIM_DEVICE_SESSION_ID_AUTOMATIC)
+            g_array_append_val (reserved, session_ids[i]);
+    }
+
+    msgs = g_ptr_array_new_with_free_func ((GDestroyNotify) netlink_message_free);
+    for (i = 0; i < n_session_ids; i++) {
+        guint  session_id;
+        guint  vlan_id;
+        gchar *ifname;
+
+        session_id = session_ids[i];
+        if (session_id == MBIM_DEVICE_SESSION_ID_AUTOMATIC) {
+            if (!get_first_free_session_id (self, ifname_prefix, reserved, &session_id)) {
+                g_task_return_new_error (task, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                                         "Failed to find an available session ID");
+                g_object_unref (task);
+                return;
+            }
+            g_array_append_val (reserved, session_id);
+        }
+
+        ifname = session_id_to_ifname (ifname_prefix, session_id);
+        vlan_id = session_id_to_vlan_id (session_id);
+        g_debug ("Using session ID %u, ifname '%s' and vlan id %u in batch", session_id, ifname, vlan_id);
+        g_ptr_array_add (msgs, netlink_message_new_link (vlan_id, ifname, base_if_index));
+        g_array_append_val (ctx->session_ids, session_id);
+        g_ptr_array_add (ctx->ifnames, ifname);
+    }
+
+    if (msgs->len == 0)
+        g_task_return_boolean (task, TRUE);
+    else
+        link_batch_send (self, msgs, timeout, task);
+    g_object_unref (task);
+}
+
+gboolean
+mbim_net_port_manager_del_links_finish (MbimNetPortManager  *self,
+                                        GAsyncResult        *res,
+                                        GError             **error)
+{
+    return g_task_propagate_boolean (G_TASK (res), error);
+}
+
+void
+mbim_net_port_manager_del_links (MbimNetPortManager  *self,
+                                 const gchar * const *ifnames,
+                                 guint                timeout,
+                                 GCancellable        *cancellable,
+                                 GAsyncReadyCallback  callback,
+                                 gpointer             user_data)
+{
+    g_autoptr(GPtrArray)  msgs = NULL;
+    LinkBatchContext     *ctx;
+    GTask                *task;
+    guint                 i;
+
+    task = g_task_new (self, cancellable, callback, user_data);
+
+    ctx = g_slice_new0 (LinkBatchContext);
+    ctx->ifnames = g_ptr_array_new_with_free_func (g_free);
+    g_task_set_task_data (task, ctx, (GDestroyNotify) link_batch_context_free);
+
+    msgs = g_ptr_array_new_with_free_func ((GDestroyNotify) netlink_message_free);
+    for (i = 0; ifnames && ifnames[i]; i++) {
+        guint ifindex;
+
+        ifindex = if_nametoindex (ifnames[i]);
+        if (ifindex == 0) {
+            g_task_return_new_error (task, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                                     "Failed to retrieve interface index for interface %s",
+                                     ifnames[i]);
+            g_object_unref (task);
+            return;
+        }
+
+        g_ptr_array_add (msgs, netlink_message_del_link (ifindex));
+        g_ptr_array_add (ctx->ifnames, g_strdup (ifnames[i]));
+    }
+
+    if (msgs->len == 0)
+        g_task_return_boolean (task, TRUE);
+    else
+        link_batch_send (self, msgs, timeout, task);
+    g_object_unref (task);
+}
+
 /*****************************************************************************/
 
 gboolean
@@ -606,18 +901,6 @@ mbim_net_port_manager_list_links (MbimNetPortManager  *self,
 
 /*****************************************************************************/
 
-typedef struct {
-    GPtrArray *links;
-    guint      link_i;
-} DelAllLinksContext;
-
-static void
-del_all_links_context_free (DelAllLinksContext *ctx)
-{
-    g_clear_pointer (&ctx->links, g_ptr_array_unref);
-    g_slice_free (DelAllLinksContext, ctx);
-}
-
 gboolean
 mbim_net_port_manager_del_all_links_finish (MbimNetPortManager  *self,
                                             GAsyncResult       *res,
@@ -626,49 +909,18 @@ mbim_net_port_manager_del_all_links_finish (MbimNetPortManager  *self,
     return g_task_propagate_boolean (G_TASK (res), error);
 }
 
-static void delete_next_link (GTask *task);
-
 static void
-port_manager_del_link_ready (MbimNetPortManager *self,
-                             GAsyncResult      *res,
-                             GTask             *task)
+port_manager_del_links_ready (MbimNetPortManager *self,
+                              GAsyncResult       *res,
+                              GTask              *task)
 {
-    DelAllLinksContext *ctx;
-    GError             *error = NULL;
+    GError *error = NULL;
 
-    ctx = g_task_get_task_data (task);
-
-    if (!mbim_net_port_manager_del_link_finish (self, res, &error)) {
+    if (!mbim_net_port_manager_del_links_finish (self, res, &error))
         g_task_return_error (task, error);
-        g_object_unref (task);
-        return;
-    }
-
-    g_ptr_array_remove_index_fast (ctx->links, 0);
-    delete_next_link (task);
-}
-
-static void
-delete_next_link (GTask *task)
-{
-    MbimNetPortManager *self;
-    DelAllLinksContext *ctx;
-
-    self = g_task_get_source_object (task);
-    ctx = g_task_get_task_data (task);
-
-    if (!ctx->links || ctx->links->len == 0) {
+    else
         g_task_return_boolean (task, TRUE);
-        g_object_unref (task);
-        return;
-    }
-
-    mbim_net_port_manager_del_link (self,
-                                    g_ptr_array_index (ctx->links, 0),
-                                    5,
-                                    g_task_get_cancellable (task),
-                                    (GAsyncReadyCallback)port_manager_del_link_ready,
-                                    task);
+    g_object_unref (task);
 }
 
 void
@@ -678,21 +930,32 @@ mbim_net_port_manager_del_all_links (MbimNetPortManager   *self,
                                      GAsyncReadyCallback   callback,
                                      gpointer              user_data)
 {
-    GTask              *task;
-    DelAllLinksContext *ctx;
-    GError             *error = NULL;
+    g_autoptr(GPtrArray)  links = NULL;
+    GTask                *task;
+    GError               *error = NULL;
 
     task = g_task_new (self, cancellable, callback, user_data);
-    ctx = g_slice_new0 (DelAllLinksContext);
-    g_task_set_task_data (task, ctx, (GDestroyNotify)del_all_links_context_free);
 
-    if (!mbim_net_port_manager_list_links (self, base_ifname, &ctx->links, &error)) {
+    if (!mbim_net_port_manager_list_links (self, base_ifname, &links, &error)) {
         g_task_return_error (task, error);
         g_object_unref (task);
         return;
     }
 
-    delete_next_link (task);
+    if (!links || links->len == 0) {
+        g_task_return_boolean (task, TRUE);
+        g_object_unref (task);
+        return;
+    }
+
+    /* Delete all links at once, the names are copied right away */
+    g_ptr_array_add (links, NULL);
+    mbim_net_port_manager_del_links (self,
+                                     (const gchar * const *) links->pdata,
+                                     5,
+                                     cancellable,
+                                     (GAsyncReadyCallback) port_manager_del_links_ready,
+                                     task);
 }
 
 /*****************************************************************************/
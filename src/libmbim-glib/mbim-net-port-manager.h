@@ -84,6 +84,30 @@ gboolean  mbim_net_port_manager_del_link_finish (MbimNetPortManager   *self,
                                                  GAsyncResult         *res,
                                                  GError              **error);
 
+void       mbim_net_port_manager_add_links        (MbimNetPortManager   *self,
+                                                   const guint          *session_ids,
+                                                   guint                 n_session_ids,
+                                                   const gchar          *base_ifname,
+                                                   const gchar          *ifname_prefix,
+                                                   guint                 timeout,
+                                                   GCancellable         *cancellable,
+                                                   GAsyncReadyCallback   callback,
+                                                   gpointer              user_data);
+GPtrArray *mbim_net_port_manager_add_links_finish (MbimNetPortManager   *self,
+                                                   GArray              **session_ids,
+                                                   GAsyncResult         *res,
+                                                   GError              **error);
+
+void      mbim_net_port_manager_del_links        (MbimNetPortManager   *self,
+                                                  const gchar * const  *ifnames,
+                                                  guint                 timeout,
+                                                  GCancellable         *cancellable,
+                                                  GAsyncReadyCallback   callback,
+                                                  gpointer              user_data);
+gboolean  mbim_net_port_manager_del_links_finish (MbimNetPortManager   *self,
+                                                  GAsyncResult         *res,
+                                                  GError              **error);
+
 void      mbim_net_port_manager_del_all_links        (MbimNetPortManager   *self,
                                                       const gchar          *base_ifname,
                                                       GCancellable         *cancellable,
@@ -22,6 +22,7 @@
  * Copyright (C) 2014 Smith Micro Software, Inc.
  */
 
+#include <config.h>
 #include <string.h>
 #include "mbim-proxy-helpers.h"
 #include "mbim-message-private.h"
@@ -321,6 +322,51 @@ _mbim_proxy_helper_service_subscribe_list_dup (MbimEventEntry **in,
 
 /*****************************************************************************/
 
+gboolean
+_mbim_proxy_helper_service_subscribe_list_contains (const MbimEventEntry * const *list,
+                                                    gsize                         list_size,
+                                                    const MbimUuid               *service_id,
+                                                    guint32                       cid)
+{
+    gsize i, j;
+
+    for (i = 0; i < list_size; i++) {
+        if (!mbim_uuid_cmp (&list[i]->device_service_id, service_id))
+            continue;
+
+        /* No CIDs given means all CIDs of the service */
+        if (list[i]->cids_count == 0)
+            return TRUE;
+
+        for (j = 0; j < list[i]->cids_count; j++) {
+            if (list[i]->cids[j] == cid)
+                return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/*****************************************************************************/
+
+/* Nearest-rank percentile of the given samples, sorted in ascending order */
+guint32
+_mbim_proxy_helper_percentile (const guint32 *sorted,
+                               guint          n_sorted,
+                               guint          percentile)
+{
+    guint rank;
+
+    if (n_sorted == 0)
+        return 0;
+
+    percentile = MIN (percentile, 100);
+    rank = (guint) (((guint64) percentile * n_sorted + 99) / 100);
+    return sorted[MAX (rank, 1) - 1];
+}
+
+/*****************************************************************************/
+
 MbimEventEntry **
 _mbim_proxy_helper_service_subscribe_list_new_standard (gsize *out_size)
 {
@@ -331,6 +377,7 @@ _mbim_proxy_helper_service_subscribe_list_new_standard (gsize *out_size)
     g_assert (out_size != NULL);
 
 #define STANDARD_SERVICES_LIST_SIZE 5
+    /* Allocate for all standard services, even if some are not built */
     out = g_new0 (MbimEventEntry *, STANDARD_SERVICES_LIST_SIZE + 1);
 
     /* Basic connect service */
@@ -414,3 +461,76 @@ _mbim_proxy_helper_service_subscribe_list_new_standard (gsize *out_size)
     *out_size = i;
     return out;
 }
+
+/*****************************************************************************/
+
+GVariant *
+_mbim_proxy_helper_service_subscribe_list_to_variant (const MbimEventEntry * const *list,
+                                                      gsize                         list_size)
+{
+    GVariantBuilder builder;
+    gsize           i;
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ayau)"));
+    for (i = 0; i < list_size; i++) {
+        GVariantBuilder cids;
+        guint32         j;
+
+        g_variant_builder_init (&cids, G_VARIANT_TYPE ("au"));
+        for (j = 0; j < list[i]->cids_count; j++)
+            g_variant_builder_add (&cids, "u", list[i]->cids[j]);
+
+        g_variant_builder_add (&builder, "(@ayau)",
+                               g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE,
+                                                          &list[i]->device_service_id,
+                                                          sizeof (MbimUuid),
+                                                          1),
+                               &cids);
+    }
+
+    return g_variant_builder_end (&builder);
+}
+
+MbimEventEntry **
+_mbim_proxy_helper_service_subscribe_list_from_variant (GVariant *variant,
+                                                        gsize    *out_size)
+{
+    MbimEventEntry **out;
+    gsize            n_entries;
+    gsize            i;
+
+    g_assert (out_size != NULL);
+
+    if (!g_variant_is_of_type (variant, G_VARIANT_TYPE ("a(ayau)"))) {
+        *out_size = 0;
+        return NULL;
+    }
+
+    n_entries = g_variant_n_children (variant);
+    out = g_new0 (MbimEventEntry *, n_entries + 1);
+    for (i = 0; i < n_entries; i++) {
+        g_autoptr(GVariant)  service_id = NULL;
+        g_autoptr(GVariant)  cids = NULL;
+        const guint8        *service_id_data;
+        const guint32       *cids_data;
+        gsize                service_id_size = 0;
+        gsize                cids_count = 0;
+        MbimEventEntry      *entry;
+
+        g_variant_get_child (variant, i, "(@ay@au)", &service_id, &cids);
+        service_id_data = g_variant_get_fixed_array (service_id, &service_id_size, 1);
+        cids_data = g_variant_get_fixed_array (cids, &cids_count, sizeof (guint32));
+
+        entry = g_new0 (MbimEventEntry, 1);
+        if (service_id_size == sizeof (MbimUuid))
+            memcpy (&entry->device_service_id, service_id_data, sizeof (MbimUuid));
+        entry->cids_count = (guint32) cids_count;
+        entry->cids = g_new (guint32, cids_count);
+        if (cids_count)
+            memcpy (entry->cids, cids_data, sizeof (guint32) * cids_count);
+        out[i] = entry;
+    }
+
+    *out_size = n_entries;
+    return out;
+}
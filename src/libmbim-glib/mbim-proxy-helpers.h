@@ -55,6 +55,17 @@ MbimEventEntry **_mbim_proxy_helper_service_subscribe_list_dup          (MbimEve
                                                                          gsize            original_size,
                                                                          gsize           *out_size);
 MbimEventEntry **_mbim_proxy_helper_service_subscribe_list_new_standard (gsize           *out_size);
+gboolean         _mbim_proxy_helper_service_subscribe_list_contains     (const MbimEventEntry * const *list,
+                                                                         gsize                         list_size,
+                                                                         const MbimUuid               *service_id,
+                                                                         guint32                       cid);
+guint32          _mbim_proxy_helper_percentile                          (const guint32                *sorted,
+                                                                         guint                         n_sorted,
+                                                                         guint                         percentile);
+GVariant        *_mbim_proxy_helper_service_subscribe_list_to_variant   (const MbimEventEntry * const *list,
+                                                                         gsize                         list_size);
+MbimEventEntry **_mbim_proxy_helper_service_subscribe_list_from_variant (GVariant                     *variant,
+                                                                         gsize                        *out_size);
 
 G_END_DECLS
 
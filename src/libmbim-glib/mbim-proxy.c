@@ -22,18 +22,27 @@
  * Copyright (C) 2014 Smith Micro Software, Inc.
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <sys/file.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <fcntl.h>
 
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <gio/gunixsocketaddress.h>
+#include <gio/gunixfdlist.h>
+#include <gio/gunixfdmessage.h>
 
 #include "config.h"
 #include "mbim-device.h"
+#include "mbim-device-private.h"
 #include "mbim-utils.h"
 #include "mbim-helpers.h"
 #include "mbim-proxy.h"
@@ -43,6 +52,7 @@
 #include "mbim-error-types.h"
 #include "mbim-basic-connect.h"
 #include "mbim-proxy-helpers.h"
+#include "mbim-indication-ring.h"
 
 /* The mbim-proxy may be used for bulk data transfer, such as modem
  * firmware upgrade, and the BUFFER_SIZE should be at least equal
@@ -51,6 +61,38 @@
  */
 #define BUFFER_SIZE 4096
 
+/* Default maximum number of messages queued for each client */
+#define DEFAULT_CLIENT_QUEUE_MAX 256
+
+/* Timeout of the commands sent to the device on behalf of clients; clients
+ * that declare their own timeout in the proxy configuration get twice that,
+ * within these limits, so that their commands may take a bit longer than the
+ * open operation */
+#define DEFAULT_COMMAND_TIMEOUT_SECS 300
+#define MIN_COMMAND_TIMEOUT_SECS     30
+
+/* Default maximum number of commands sent to each device and not yet
+ * completed; any other command waits in the queue of its client */
+#define DEFAULT_DEVICE_MAX_IN_FLIGHT 8
+
+/* Default size of the ring of indications shared with the clients of each
+ * device that request it */
+#define DEFAULT_INDICATION_RING_SIZE (256 * 1024)
+
+/* Number of the last command latencies kept to report percentiles */
+#define LATENCY_SAMPLES 1024
+
+/* Maximum number of client structures kept for reuse */
+#define CLIENT_POOL_MAX 64
+
+/* Maximum number of fragmented commands being received at a time from each
+ * client, and maximum size of all of them together */
+#define CLIENT_FRAGMENT_COLLECTORS_MAX      8
+#define CLIENT_FRAGMENT_COLLECTED_BYTES_MAX (1024 * 1024)
+
+/* User database watched to forget the allowed user when it changes */
+#define PASSWD_PATH "/etc/passwd"
+
 G_DEFINE_TYPE (MbimProxy, mbim_proxy, G_TYPE_OBJECT)
 
 enum {
@@ -63,37 +105,298 @@ enum {
 static GParamSpec *properties[PROP_LAST];
 
 struct _MbimProxyPrivate {
-    /* Unix socket service */
+    /* Main context where the proxy was created */
+    GMainContext *context;
+
+    /* Unix socket service, and the sockets it listens in */
     GSocketService *socket_service;
+    GPtrArray      *listening_sockets;
+
+    /* Id of the last client accepted */
+    gulong last_client_id;
+
+    /* User allowed to connect besides root, looked up only when not valid,
+     * and the monitor of the user database invalidating it. The user, the
+     * valid flag and the serial bumped on each invalidation are protected by
+     * the proxy lock */
+    gboolean      allowed_uid_valid;
+    uid_t         allowed_uid;
+    guint         allowed_uid_serial;
+    GFileMonitor *passwd_monitor;
+
+    /* Client output queue limits */
+    guint                client_queue_max;
+    MbimProxyQueuePolicy client_queue_policy;
+
+    /* Command scheduling limits, 0 if unlimited */
+    guint device_max_in_flight;
+    guint client_max_in_flight;
+    guint client_max_rate;
+
+    /* Size of the indication rings, 0 if disabled */
+    guint32 indication_ring_size;
+
+    /* Whether each device gets its own thread */
+    gboolean device_threads;
+
+    /* Time devices without clients are kept open, 0 if forever */
+    guint device_grace_period;
+
+    /* Clients by id, devices by path, devices being opened, and the threads
+     * of the devices; all of them accessed with the lock held */
+    GMutex      lock;
+    GHashTable *clients;
+    GHashTable *devices;
+    GHashTable *opening_devices;
+    GPtrArray  *workers;
+
+    /* Statistics reported through the proxy control service, accessed with
+     * the stats lock held, as they are updated from all device threads */
+    GMutex   stats_lock;
+    guint64  commands_forwarded;
+    guint64  indications_forwarded;
+    guint64  indications_dropped;
+    guint32  latencies[LATENCY_SAMPLES];
+    guint    n_latencies;
+    guint    latencies_next;
+};
 
-    /* Clients */
-    GList *clients;
+static void          track_device           (MbimProxy *self, MbimDevice *device);
+static void          untrack_device         (MbimProxy *self, MbimDevice *device);
+static MbimDevice   *lookup_device_for_path (MbimProxy *self, const gchar *path);
+static GMainContext *device_peek_context    (MbimProxy *self, MbimDevice *device);
+static MbimIndicationRing *device_peek_indication_ring (MbimDevice *device, guint32 size, GError **error);
+static gboolean      device_take_warm       (MbimDevice *device);
+static void          device_peek_statistics (MbimDevice *device, guint32 *n_clients, guint32 *n_in_flight, guint32 *n_waiting);
 
-    /* Devices */
-    GList *devices;
-    GList *opening_devices;
-};
+/* Notify property changes in the main context of the proxy, as clients and
+ * devices may be untracked from device threads */
+
+typedef struct {
+    MbimProxy  *self;
+    GParamSpec *pspec;
+} NotifyContext;
+
+static void
+notify_context_free (NotifyContext *ctx)
+{
+    g_object_unref (ctx->self);
+    g_slice_free (NotifyContext, ctx);
+}
+
+static gboolean
+notify_cb (NotifyContext *ctx)
+{
+    g_object_notify_by_pspec (G_OBJECT (ctx->self), ctx->pspec);
+    return FALSE;
+}
 
-static void        track_device         (MbimProxy *self, MbimDevice *device);
-static void        untrack_device       (MbimProxy *self, MbimDevice *device);
-static MbimDevice *peek_device_for_path (MbimProxy *self, const gchar *path);
+static void
+proxy_notify (MbimProxy  *self,
+              GParamSpec *pspec)
+{
+    NotifyContext *ctx;
+
+    ctx = g_slice_new (NotifyContext);
+    ctx->self = g_object_ref (self);
+    ctx->pspec = pspec;
+    g_main_context_invoke_full (self->priv->context,
+                                G_PRIORITY_DEFAULT,
+                                (GSourceFunc) notify_cb,
+                                ctx,
+                                (GDestroyNotify) notify_context_free);
+}
 
 /*****************************************************************************/
 
 guint
 mbim_proxy_get_n_clients (MbimProxy *self)
 {
+    guint n;
+
     g_return_val_if_fail (MBIM_IS_PROXY (self), 0);
 
-    return g_list_length (self->priv->clients);
+    g_mutex_lock (&self->priv->lock);
+    n = g_hash_table_size (self->priv->clients);
+    g_mutex_unlock (&self->priv->lock);
+    return n;
 }
 
 guint
 mbim_proxy_get_n_devices (MbimProxy *self)
 {
+    guint n;
+
     g_return_val_if_fail (MBIM_IS_PROXY (self), 0);
 
-    return g_list_length (self->priv->devices);
+    g_mutex_lock (&self->priv->lock);
+    n = g_hash_table_size (self->priv->devices);
+    g_mutex_unlock (&self->priv->lock);
+    return n;
+}
+
+void
+mbim_proxy_set_device_threads (MbimProxy *self,
+                               gboolean   enabled)
+{
+    g_return_if_fail (MBIM_IS_PROXY (self));
+
+    self->priv->device_threads = enabled;
+}
+
+void
+mbim_proxy_set_client_queue_limits (MbimProxy            *self,
+                                    guint                 max_messages,
+                                    MbimProxyQueuePolicy  policy)
+{
+    g_return_if_fail (MBIM_IS_PROXY (self));
+    g_return_if_fail (max_messages > 0);
+
+    self->priv->client_queue_max = max_messages;
+    self->priv->client_queue_policy = policy;
+}
+
+void
+mbim_proxy_set_command_limits (MbimProxy *self,
+                               guint      device_max_in_flight,
+                               guint      client_max_in_flight,
+                               guint      client_max_rate)
+{
+    g_return_if_fail (MBIM_IS_PROXY (self));
+
+    self->priv->device_max_in_flight = device_max_in_flight;
+    self->priv->client_max_in_flight = client_max_in_flight;
+    self->priv->client_max_rate = client_max_rate;
+}
+
+void
+mbim_proxy_set_indication_ring_size (MbimProxy *self,
+                                     guint32    size)
+{
+    g_return_if_fail (MBIM_IS_PROXY (self));
+
+    self->priv->indication_ring_size = size;
+}
+
+void
+mbim_proxy_set_device_grace_period (MbimProxy *self,
+                                    guint      seconds)
+{
+    g_return_if_fail (MBIM_IS_PROXY (self));
+
+    self->priv->device_grace_period = seconds;
+}
+
+/*****************************************************************************/
+/* Statistics */
+
+static void
+stats_update (MbimProxy *self,
+              guint      commands,
+              guint      indications,
+              guint      dropped)
+{
+    g_mutex_lock (&self->priv->stats_lock);
+    self->priv->commands_forwarded += commands;
+    self->priv->indications_forwarded += indications;
+    self->priv->indications_dropped += dropped;
+    g_mutex_unlock (&self->priv->stats_lock);
+}
+
+static void
+stats_add_latency (MbimProxy *self,
+                   gint64     usecs)
+{
+    g_mutex_lock (&self->priv->stats_lock);
+    self->priv->latencies[self->priv->latencies_next] = (guint32) CLAMP (usecs, 0, G_MAXUINT32);
+    self->priv->latencies_next = (self->priv->latencies_next + 1) % LATENCY_SAMPLES;
+    self->priv->n_latencies = MIN (self->priv->n_latencies + 1, LATENCY_SAMPLES);
+    g_mutex_unlock (&self->priv->stats_lock);
+}
+
+/*****************************************************************************/
+/* Allowed users
+ *
+ * Looking up the allowed user may go through slow user database backends, so
+ * it's done once and only repeated after the user database changes or when
+ * explicitly requested. */
+
+static gboolean
+check_user_allowed (MbimProxy  *self,
+                    uid_t       uid,
+                    GError    **error)
+{
+    gboolean valid;
+    uid_t    allowed_uid;
+    guint    serial;
+
+    /* Root user is always allowed */
+    if (uid == 0)
+        return TRUE;
+
+    g_mutex_lock (&self->priv->lock);
+    valid = self->priv->allowed_uid_valid;
+    allowed_uid = self->priv->allowed_uid;
+    serial = self->priv->allowed_uid_serial;
+    g_mutex_unlock (&self->priv->lock);
+
+    /* The lookup is done without the lock, and its result is only cached if
+     * the cache wasn't invalidated meanwhile */
+    if (!valid) {
+        if (!mbim_helpers_get_allowed_user (&allowed_uid, error))
+            return FALSE;
+        g_mutex_lock (&self->priv->lock);
+        if (serial == self->priv->allowed_uid_serial) {
+            self->priv->allowed_uid = allowed_uid;
+            self->priv->allowed_uid_valid = TRUE;
+        }
+        g_mutex_unlock (&self->priv->lock);
+    }
+
+    if (uid == allowed_uid)
+        return TRUE;
+
+    g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED, "Not enough privileges");
+    return FALSE;
+}
+
+void
+mbim_proxy_invalidate_user_cache (MbimProxy *self)
+{
+    g_return_if_fail (MBIM_IS_PROXY (self));
+
+    g_debug ("allowed user will be looked up again");
+    g_mutex_lock (&self->priv->lock);
+    self->priv->allowed_uid_valid = FALSE;
+    self->priv->allowed_uid_serial++;
+    g_mutex_unlock (&self->priv->lock);
+}
+
+static void
+passwd_changed_cb (GFileMonitor      *monitor,
+                   GFile             *file,
+                   GFile             *other_file,
+                   GFileMonitorEvent  event_type,
+                   MbimProxy         *self)
+{
+    mbim_proxy_invalidate_user_cache (self);
+}
+
+static void
+setup_passwd_monitor (MbimProxy *self)
+{
+#if defined MBIM_USERNAME_ENABLED
+    g_autoptr(GFile)  file = NULL;
+    g_autoptr(GError) error = NULL;
+
+    file = g_file_new_for_path (PASSWD_PATH);
+    self->priv->passwd_monitor = g_file_monitor_file (file, G_FILE_MONITOR_NONE, NULL, &error);
+    if (!self->priv->passwd_monitor) {
+        g_debug ("couldn't monitor '%s': %s", PASSWD_PATH, error->message);
+        return;
+    }
+    g_signal_connect (self->priv->passwd_monitor, "changed", G_CALLBACK (passwd_changed_cb), self);
+#endif
 }
 
 /*****************************************************************************/
@@ -104,28 +407,173 @@ typedef struct {
     gulong        id;
 
     MbimProxy *self; /* not full ref */
+    GMainContext *context; /* not full ref */
     GSocketConnection *connection;
+    gboolean seqpacket;
     GSource *connection_readable_source;
     GByteArray *buffer;
 
+    /* Messages pending to be written, bytes of the first one already
+     * written, and bytes of all of them */
+    GQueue   output_queue;
+    gsize    output_offset;
+    gsize    output_queue_bytes;
+    GSource *connection_writable_source;
+
+    /* File descriptors to send along with the given queued message */
+    GUnixFDList *output_fds;
+    MbimMessage *output_fds_message;
+
+    /* Eventfd signaled when indications are published in the ring of the
+     * device, or -1 if the client doesn't use the ring */
+    gint ring_eventfd;
+
+    /* Whether the last indications seen are replayed on subscription */
+    gboolean replay_indications;
+
+    /* Commands waiting to be sent to the device, and commands sent and not
+     * yet completed */
+    GQueue pending_requests;
+    guint  n_in_flight;
+
+    /* Snapshot of the queues for the statistics, set atomically by the thread
+     * handling the client so that it can be read from any other one */
+    guint stats_queue_length;
+    guint stats_queue_bytes;
+    guint stats_in_flight;
+    guint stats_pending;
+
+    /* Rate limit token bucket */
+    gdouble tokens;
+    gint64  tokens_updated;
+
+    /* Requests not yet completed, not full refs */
+    GQueue requests;
+
+    /* Fragmented commands being received, by transaction id */
+    GHashTable *fragment_collectors; /* FragmentCollector */
+
+    /* Timeout declared in the proxy configuration, 0 if none */
+    guint32 timeout_secs;
+
     /* Only one proxy config allowed at a time */
     gboolean config_ongoing;
 
+    /* Whether messages are being parsed, and the handover to the thread of
+     * the device waiting for the parsing to stop */
+    gboolean parsing;
+    gpointer handover;
+
     MbimDevice *device;
-    guint indication_id;
     MbimEventEntry **mbim_event_entry_array;
     gsize mbim_event_entry_array_size;
 } Client;
 
-static gboolean connection_readable_cb (GSocket *socket, GIOCondition condition, Client *client);
-static void     track_client           (MbimProxy *self, Client *client);
-static void     untrack_client         (MbimProxy *self, Client *client);
+static gboolean connection_readable_cb      (GSocket *socket, GIOCondition condition, Client *client);
+static void     client_attach_readable_source (Client *client);
+static void     track_client                (MbimProxy *self, Client *client);
+static void     untrack_client              (MbimProxy *self, Client *client);
+static void     device_update_client_routes (MbimDevice *device, Client *client, gboolean add);
+static void     device_drop_client_commands (MbimDevice *device, Client *client);
+static void     device_track_client         (MbimDevice *device, Client *client, gboolean add);
+static void     device_track_ring_client    (MbimDevice *device, Client *client, gboolean add);
+static void     device_replay_indications   (MbimDevice *device, Client *client, const MbimEventEntry * const *previous, gsize previous_size);
+static void     client_cancel_requests      (Client *client);
+static void     parse_request               (MbimProxy *self, Client *client);
+
+typedef struct {
+    MbimMessage *message;
+    gint64       started;
+} FragmentCollector;
 
 static void
-client_disconnect (Client *client)
+fragment_collector_free (FragmentCollector *collector)
+{
+    mbim_message_unref (collector->message);
+    g_slice_free (FragmentCollector, collector);
+}
+
+/* Client structures, along with their fragment collectors table, are reused,
+ * as short-lived clients come and go all the time; clients may be freed in
+ * any device thread */
+
+G_LOCK_DEFINE_STATIC (client_pool);
+static Client *client_pool[CLIENT_POOL_MAX];
+static guint   client_pool_size;
+
+static Client *
+client_alloc (void)
+{
+    Client     *client = NULL;
+    GHashTable *fragment_collectors;
+
+    G_LOCK (client_pool);
+    if (client_pool_size > 0)
+        client = client_pool[--client_pool_size];
+    G_UNLOCK (client_pool);
+
+    if (!client) {
+        client = g_slice_new0 (Client);
+        client->fragment_collectors = g_hash_table_new_full (g_direct_hash,
+                                                             g_direct_equal,
+                                                             NULL,
+                                                             (GDestroyNotify) fragment_collector_free);
+        return client;
+    }
+
+    fragment_collectors = client->fragment_collectors;
+    memset (client, 0, sizeof (Client));
+    client->fragment_collectors = fragment_collectors;
+    return client;
+}
+
+static void
+client_release (Client *client)
+{
+    g_hash_table_remove_all (client->fragment_collectors);
+
+    G_LOCK (client_pool);
+    if (client_pool_size < CLIENT_POOL_MAX) {
+        client_pool[client_pool_size++] = client;
+        client = NULL;
+    }
+    G_UNLOCK (client_pool);
+
+    if (client) {
+        g_hash_table_unref (client->fragment_collectors);
+        g_slice_free (Client, client);
+    }
+}
+
+static void
+client_set_event_entry_array (Client          *client,
+                              MbimEventEntry **mbim_event_entry_array,
+                              gsize            mbim_event_entry_array_size)
 {
+    if (client->device)
+        device_update_client_routes (client->device, client, FALSE);
+
     g_clear_pointer (&client->mbim_event_entry_array, mbim_event_entry_array_free);
-    client->mbim_event_entry_array_size = 0;
+    client->mbim_event_entry_array = mbim_event_entry_array;
+    client->mbim_event_entry_array_size = mbim_event_entry_array ? mbim_event_entry_array_size : 0;
+
+    if (client->device)
+        device_update_client_routes (client->device, client, TRUE);
+}
+
+static void
+client_publish_statistics (Client *client)
+{
+    g_atomic_int_set (&client->stats_queue_length, (gint) g_queue_get_length (&client->output_queue));
+    g_atomic_int_set (&client->stats_queue_bytes, (gint) MIN (client->output_queue_bytes, G_MAXUINT32));
+    g_atomic_int_set (&client->stats_in_flight, (gint) client->n_in_flight);
+    g_atomic_int_set (&client->stats_pending, (gint) g_queue_get_length (&client->pending_requests));
+}
+
+static void
+client_disconnect (Client *client)
+{
+    client_set_event_entry_array (client, NULL, 0);
 
     if (client->connection_readable_source) {
         g_source_destroy (client->connection_readable_source);
@@ -133,6 +581,28 @@ client_disconnect (Client *client)
         client->connection_readable_source = 0;
     }
 
+    if (client->connection_writable_source) {
+        g_source_destroy (client->connection_writable_source);
+        g_source_unref (client->connection_writable_source);
+        client->connection_writable_source = NULL;
+    }
+
+    g_queue_clear_full (&client->output_queue, (GDestroyNotify) mbim_message_unref);
+    client->output_offset = 0;
+    client->output_queue_bytes = 0;
+    client_publish_statistics (client);
+    g_clear_object (&client->output_fds);
+    client->output_fds_message = NULL;
+
+    if (client->ring_eventfd >= 0) {
+        if (client->device)
+            device_track_ring_client (client->device, client, FALSE);
+        close (client->ring_eventfd);
+        client->ring_eventfd = -1;
+    }
+
+    g_hash_table_remove_all (client->fragment_collectors);
+
     if (client->connection) {
         g_debug ("[client %lu] connection closed", client->id);
         g_output_stream_close (g_io_stream_get_output_stream (G_IO_STREAM (client->connection)), NULL, NULL);
@@ -141,30 +611,21 @@ client_disconnect (Client *client)
     }
 }
 
-static void client_indication_cb (MbimDevice *device,
-                                  MbimMessage *message,
-                                  Client *client);
-
 static void
 client_set_device (Client *client,
                    MbimDevice *device)
 {
     if (client->device) {
-        if (g_signal_handler_is_connected (client->device, client->indication_id))
-            g_signal_handler_disconnect (client->device, client->indication_id);
+        device_drop_client_commands (client->device, client);
+        device_track_client (client->device, client, FALSE);
         g_object_unref (client->device);
     }
 
     if (device) {
         client->device = g_object_ref (device);
-        client->indication_id = g_signal_connect (client->device,
-                                                  MBIM_DEVICE_SIGNAL_INDICATE_STATUS,
-                                                  G_CALLBACK (client_indication_cb),
-                                                  client);
-    } else {
+        device_track_client (client->device, client, TRUE);
+    } else
         client->device = NULL;
-        client->indication_id = 0;
-    }
 }
 
 static void
@@ -179,10 +640,9 @@ client_unref (Client *client)
         if (client->buffer)
             g_byte_array_unref (client->buffer);
 
-        if (client->mbim_event_entry_array)
-            mbim_event_entry_array_free (client->mbim_event_entry_array);
+        client_set_event_entry_array (client, NULL, 0);
 
-        g_slice_free (Client, client);
+        client_release (client);
     }
 }
 
@@ -193,6 +653,161 @@ client_ref (Client *client)
     return client;
 }
 
+static gboolean connection_writable_cb (GSocket      *socket,
+                                       GIOCondition  condition,
+                                       Client       *client);
+
+/* Messages carrying file descriptors are sent as a whole along with them */
+static gssize
+client_write_with_fds (Client       *client,
+                       MbimMessage  *message,
+                       GError      **error)
+{
+    GOutputVector          vector;
+    GSocketControlMessage *scm;
+    gssize                 written;
+
+    vector.buffer = message->data;
+    vector.size = message->len;
+    scm = g_unix_fd_message_new_with_fd_list (client->output_fds);
+    written = g_socket_send_message (g_socket_connection_get_socket (client->connection),
+                                     NULL,
+                                     &vector,
+                                     1,
+                                     &scm,
+                                     1,
+                                     G_SOCKET_MSG_NONE,
+                                     NULL,
+                                     error);
+    g_object_unref (scm);
+
+    if (written >= 0) {
+        g_clear_object (&client->output_fds);
+        client->output_fds_message = NULL;
+    }
+    return written;
+}
+
+/* Write as much of the output queue as possible without blocking, and wait
+ * for the socket to be writable again if anything is left. */
+static gboolean
+client_flush (Client  *client,
+              GError **error)
+{
+    GPollableOutputStream *stream;
+
+    stream = G_POLLABLE_OUTPUT_STREAM (g_io_stream_get_output_stream (G_IO_STREAM (client->connection)));
+
+    while (!g_queue_is_empty (&client->output_queue)) {
+        MbimMessage       *message;
+        gssize             written;
+        g_autoptr(GError)  inner_error = NULL;
+
+        message = g_queue_peek_head (&client->output_queue);
+        if (message == client->output_fds_message && client->output_offset == 0)
+            written = client_write_with_fds (client, message, &inner_error);
+        else
+            written = g_pollable_output_stream_write_nonblocking (stream,
+                                                                  &message->data[client->output_offset],
+                                                                  message->len - client->output_offset,
+                                                                  NULL,
+                                                                  &inner_error);
+        if (written < 0) {
+            if (g_error_matches (inner_error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+                break;
+            g_propagate_prefixed_error (error, g_steal_pointer (&inner_error), "Cannot send message to client: ");
+            client_publish_statistics (client);
+            return FALSE;
+        }
+
+        client->output_offset += written;
+        if (client->output_offset < message->len)
+            continue;
+
+        client->output_queue_bytes -= message->len;
+        mbim_message_unref (g_queue_pop_head (&client->output_queue));
+        client->output_offset = 0;
+    }
+
+    client_publish_statistics (client);
+
+    if (g_queue_is_empty (&client->output_queue)) {
+        if (client->connection_writable_source) {
+            g_source_destroy (client->connection_writable_source);
+            g_source_unref (client->connection_writable_source);
+            client->connection_writable_source = NULL;
+        }
+        return TRUE;
+    }
+
+    if (!client->connection_writable_source) {
+        client->connection_writable_source = g_socket_create_source (g_socket_connection_get_socket (client->connection),
+                                                                     G_IO_OUT | G_IO_ERR | G_IO_HUP,
+                                                                     NULL);
+        g_source_set_callback (client->connection_writable_source,
+                               (GSourceFunc)connection_writable_cb,
+                               client,
+                               NULL);
+        g_source_attach (client->connection_writable_source, client->context);
+    }
+    return TRUE;
+}
+
+static gboolean
+message_is_same_indication (MbimMessage *a,
+                            MbimMessage *b)
+{
+    return (MBIM_MESSAGE_GET_MESSAGE_TYPE (a) == MBIM_MESSAGE_TYPE_INDICATE_STATUS &&
+            MBIM_MESSAGE_GET_MESSAGE_TYPE (b) == MBIM_MESSAGE_TYPE_INDICATE_STATUS &&
+            mbim_message_indicate_status_get_cid (a) == mbim_message_indicate_status_get_cid (b) &&
+            mbim_uuid_cmp (mbim_message_indicate_status_get_service_id (a),
+                           mbim_message_indicate_status_get_service_id (b)));
+}
+
+/* Apply the queue policy when the output queue of the client is full. Returns
+ * TRUE if the message was handled, or FALSE if the client must be
+ * disconnected. */
+static gboolean
+client_queue_full (Client      *client,
+                   MbimMessage *message)
+{
+    MbimProxyQueuePolicy  policy;
+    GList                *l;
+
+    policy = client->self->priv->client_queue_policy;
+
+    /* Responses are never dropped */
+    if (policy == MBIM_PROXY_QUEUE_POLICY_DISCONNECT ||
+        MBIM_MESSAGE_GET_MESSAGE_TYPE (message) != MBIM_MESSAGE_TYPE_INDICATE_STATUS) {
+        g_warning ("[client %lu] output queue full (%u messages), disconnecting",
+                   client->id, g_queue_get_length (&client->output_queue));
+        return FALSE;
+    }
+
+    /* Replace the oldest queued indication of the same service and CID, as
+     * long as its write didn't start yet */
+    if (policy == MBIM_PROXY_QUEUE_POLICY_COALESCE) {
+        for (l = client->output_queue.head; l; l = g_list_next (l)) {
+            if (l == client->output_queue.head && client->output_offset > 0)
+                continue;
+            if (message_is_same_indication (l->data, message)) {
+                g_debug ("[client %lu] output queue full, coalescing indication", client->id);
+                client->output_queue_bytes -= ((MbimMessage *)(l->data))->len;
+                client->output_queue_bytes += message->len;
+                mbim_message_unref (l->data);
+                l->data = mbim_message_ref (message);
+                client_publish_statistics (client);
+                stats_update (client->self, 0, 1, 1);
+                return TRUE;
+            }
+        }
+    }
+
+    g_debug ("[client %lu] output queue full, dropping indication", client->id);
+    stats_update (client->self, 0, 0, 1);
+    return TRUE;
+}
+
 static gboolean
 client_send_message (Client       *client,
                      MbimMessage  *message,
@@ -206,17 +821,46 @@ client_send_message (Client       *client,
         return FALSE;
     }
 
-    if (!g_output_stream_write_all (g_io_stream_get_output_stream (G_IO_STREAM (client->connection)),
-                                    message->data,
-                                    message->len,
-                                    NULL, /* bytes_written */
-                                    NULL, /* cancellable */
-                                    error)) {
-        g_prefix_error (error, "Cannot send message to client: ");
-        return FALSE;
+    if (g_queue_get_length (&client->output_queue) >= client->self->priv->client_queue_max) {
+        if (!client_queue_full (client, message)) {
+            g_set_error (error,
+                         MBIM_CORE_ERROR,
+                         MBIM_CORE_ERROR_FAILED,
+                         "Cannot send message: client output queue full");
+            return FALSE;
+        }
+        return TRUE;
     }
 
-    return TRUE;
+    g_queue_push_tail (&client->output_queue, mbim_message_ref (message));
+    client->output_queue_bytes += message->len;
+    if (MBIM_MESSAGE_GET_MESSAGE_TYPE (message) == MBIM_MESSAGE_TYPE_INDICATE_STATUS)
+        stats_update (client->self, 0, 1, 0);
+    return client_flush (client, error);
+}
+
+GArray *
+mbim_proxy_get_client_queue_depths (MbimProxy *self)
+{
+    GArray         *depths;
+    GHashTableIter  iter;
+    Client         *client;
+
+    g_return_val_if_fail (MBIM_IS_PROXY (self), NULL);
+
+    g_mutex_lock (&self->priv->lock);
+    depths = g_array_sized_new (FALSE, FALSE, sizeof (guint), g_hash_table_size (self->priv->clients));
+    g_hash_table_iter_init (&iter, self->priv->clients);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&client)) {
+        guint depth;
+
+        /* Clients handled in device threads may be updating their queue, so
+         * this is just the last snapshot they published */
+        depth = (guint) g_atomic_int_get (&client->stats_queue_length);
+        g_array_append_val (depths, depth);
+    }
+    g_mutex_unlock (&self->priv->lock);
+    return depths;
 }
 
 /*****************************************************************************/
@@ -226,21 +870,35 @@ static void
 track_client (MbimProxy *self,
               Client *client)
 {
-    self->priv->clients = g_list_append (self->priv->clients, client_ref (client));
-    g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_N_CLIENTS]);
+    g_mutex_lock (&self->priv->lock);
+    g_hash_table_insert (self->priv->clients, GSIZE_TO_POINTER (client->id), client_ref (client));
+    g_mutex_unlock (&self->priv->lock);
+    proxy_notify (self, properties[PROP_N_CLIENTS]);
 }
 
 static void
 untrack_client (MbimProxy *self,
                 Client *client)
 {
+    gboolean tracked = FALSE;
+
+    /* Commands not yet sent to the device are no longer needed, and the ones
+     * already sent don't need to wait for the response */
+    if (client->device)
+        device_drop_client_commands (client->device, client);
+    client_cancel_requests (client);
+
     /* Disconnect the client explicitly when untracking */
     client_disconnect (client);
 
-    if (g_list_find (self->priv->clients, client)) {
-        self->priv->clients = g_list_remove (self->priv->clients, client);
+    g_mutex_lock (&self->priv->lock);
+    if (g_hash_table_lookup (self->priv->clients, GSIZE_TO_POINTER (client->id)) == client)
+        tracked = g_hash_table_steal (self->priv->clients, GSIZE_TO_POINTER (client->id));
+    g_mutex_unlock (&self->priv->lock);
+
+    if (tracked) {
         client_unref (client);
-        g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_N_CLIENTS]);
+        proxy_notify (self, properties[PROP_N_CLIENTS]);
     }
 }
 
@@ -253,49 +911,9 @@ forward_indication (Client      *client,
 {
     g_autoptr(GError) error = NULL;
 
-    if (!client_send_message (client, message, &error))
+    if (!client_send_message (client, message, &error)) {
         g_warning ("[client %lu] couldn't forward indication: %s", client->id, error->message);
-}
-
-static void
-client_indication_cb (MbimDevice *device,
-                      MbimMessage *message,
-                      Client *client)
-{
-    MbimEventEntry *entry;
-    guint           i;
-
-    /* if client doesn't have a subscribe list, we're done. */
-    if (!client->mbim_event_entry_array)
-        return;
-
-    /* Look for the event list associated to the service */
-    entry = NULL;
-    for (i = 0; i < client->mbim_event_entry_array_size; i++) {
-        if (mbim_uuid_cmp (mbim_message_indicate_status_get_service_id (message),
-                           &client->mbim_event_entry_array[i]->device_service_id)) {
-            entry = client->mbim_event_entry_array[i];
-            break;
-        }
-    }
-
-    /* if client didn't subscribe to anything in this service, we're done */
-    if (!entry)
-        return;
-
-    /* if client subscribed using the wildcard, no need to match specific cid */
-    if (entry->cids_count == 0) {
-        forward_indication (client, message);
-        return;
-    }
-
-    /* Look for the specific cid in the event list */
-    for (i = 0; i < entry->cids_count; i++) {
-        if (mbim_message_indicate_status_get_cid (message) == entry->cids[i]) {
-            /* exact match in the subscription */
-            forward_indication (client, message);
-            return;
-        }
+        untrack_client (client->self, client);
     }
 }
 
@@ -308,8 +926,20 @@ typedef struct {
     MbimMessage *message;
     MbimMessage *response;
     guint32 original_transaction_id;
+    /* Whether the command counts towards the scheduling limits */
+    gboolean scheduled;
+    /* When the command was sent to the device */
+    gint64 dispatched;
+    /* Cancelled if the client goes away */
+    GCancellable *cancellable;
+    GList        *client_link;
     /* Only used in proxy config */
     guint32 timeout_secs;
+    /* Only used in subscribe list updates, to replay indications once
+     * responded; the previous list of the client tells which CIDs are new */
+    gboolean replay;
+    MbimEventEntry **replay_previous;
+    gsize replay_previous_size;
 } Request;
 
 static void
@@ -332,6 +962,10 @@ request_complete_and_free (Request *request)
 
     if (request->message)
         mbim_message_unref (request->message);
+    if (request->replay_previous)
+        mbim_event_entry_array_free (request->replay_previous);
+    g_queue_delete_link (&request->client->requests, request->client_link);
+    g_object_unref (request->cancellable);
     client_unref (request->client);
     g_object_unref (request->self);
     g_slice_free (Request, request);
@@ -349,10 +983,40 @@ request_new (MbimProxy   *self,
     request->client = client_ref (client);
     request->message = mbim_message_ref (message);
     request->original_transaction_id = mbim_message_get_transaction_id (message);
+    request->cancellable = g_cancellable_new ();
+
+    g_queue_push_tail (&client->requests, request);
+    request->client_link = g_queue_peek_tail_link (&client->requests);
 
     return request;
 }
 
+static void
+client_cancel_requests (Client *client)
+{
+    GList *cancellables = NULL;
+    GList *l;
+
+    /* Requests may complete right away when cancelled, so don't iterate the
+     * list being modified */
+    for (l = client->requests.head; l; l = g_list_next (l))
+        cancellables = g_list_prepend (cancellables, g_object_ref (((Request *)(l->data))->cancellable));
+
+    if (cancellables)
+        g_debug ("[client %lu] cancelling %u ongoing requests", client->id, g_queue_get_length (&client->requests));
+
+    g_list_foreach (cancellables, (GFunc) g_cancellable_cancel, NULL);
+    g_list_free_full (cancellables, g_object_unref);
+}
+
+static guint
+client_get_command_timeout (Client *client)
+{
+    if (!client->timeout_secs || client->timeout_secs >= DEFAULT_COMMAND_TIMEOUT_SECS / 2)
+        return DEFAULT_COMMAND_TIMEOUT_SECS;
+    return MAX (2 * client->timeout_secs, MIN_COMMAND_TIMEOUT_SECS);
+}
+
 /*****************************************************************************/
 /* Internal proxy device opening operation */
 
@@ -413,18 +1077,12 @@ static OpeningDevice *
 peek_opening_device_info (MbimProxy  *self,
                           MbimDevice *device)
 {
-    GList *l;
-
-    /* If already being opened, queue it up */
-    for (l = self->priv->opening_devices; l; l = g_list_next (l)) {
-        OpeningDevice *info;
-
-        info = (OpeningDevice *)(l->data);
-        if (device == info->device)
-            return info;
-    }
+    OpeningDevice *info;
 
-    return NULL;
+    g_mutex_lock (&self->priv->lock);
+    info = g_hash_table_lookup (self->priv->opening_devices, device);
+    g_mutex_unlock (&self->priv->lock);
+    return info;
 }
 
 static void
@@ -438,7 +1096,9 @@ complete_opening_device (MbimProxy    *self,
     if (!info)
         return;
 
-    self->priv->opening_devices = g_list_remove (self->priv->opening_devices, info);
+    g_mutex_lock (&self->priv->lock);
+    g_hash_table_steal (self->priv->opening_devices, device);
+    g_mutex_unlock (&self->priv->lock);
     opening_device_complete_and_free (info, error);
 }
 
@@ -498,7 +1158,9 @@ internal_open (GTask *task)
     info = g_slice_new0 (OpeningDevice);
     info->device = g_object_ref (ctx->device);
     info->pending = g_list_append (info->pending, task);
-    self->priv->opening_devices = g_list_prepend (self->priv->opening_devices, info);
+    g_mutex_lock (&self->priv->lock);
+    g_hash_table_insert (self->priv->opening_devices, info->device, info);
+    g_mutex_unlock (&self->priv->lock);
 
     /* Note: for now, only the first timeout request is taken into account */
 
@@ -569,6 +1231,14 @@ internal_device_open (MbimProxy           *self,
     ctx->timeout_secs = timeout_secs;
     g_task_set_task_data (task, ctx, (GDestroyNotify) internal_device_open_context_free);
 
+    /* Used until very recently, so no need to check it */
+    if (mbim_device_is_open (device) && device_take_warm (device)) {
+        g_debug ("[%s] device still open after grace period", mbim_device_get_path (device));
+        g_task_return_boolean (task, TRUE);
+        g_object_unref (task);
+        return;
+    }
+
     /* If the device is flagged as already open, we still want to check
      * whether that's totally true, and we do that with a standard command
      * (loading caps in this case). */
@@ -649,26 +1319,37 @@ process_internal_proxy_close (MbimProxy   *self,
 /* Proxy config */
 
 static MbimMessage *
-build_proxy_control_command_done (MbimMessage     *message,
-                                  MbimStatusError  status)
+build_proxy_control_command_done_with_buffer (MbimMessage     *message,
+                                              MbimStatusError  status,
+                                              const guint8    *buffer,
+                                              guint32          buffer_length)
 {
     MbimMessage *response;
     struct command_done_message *command_done;
 
-    response = (MbimMessage *) _mbim_message_allocate (MBIM_MESSAGE_TYPE_COMMAND_DONE,
-                                                       mbim_message_get_transaction_id (message),
-                                                       sizeof (struct command_done_message));
+    response = _mbim_message_allocate (MBIM_MESSAGE_TYPE_COMMAND_DONE,
+                                       mbim_message_get_transaction_id (message),
+                                       sizeof (struct command_done_message) + buffer_length);
     command_done = &(((struct full_message *)(response->data))->message.command_done);
     command_done->fragment_header.total   = GUINT32_TO_LE (1);
     command_done->fragment_header.current = 0;
     memcpy (command_done->service_id, MBIM_UUID_PROXY_CONTROL, sizeof (MbimUuid));
     command_done->command_id  = GUINT32_TO_LE (mbim_message_command_get_cid (message));
     command_done->status_code = GUINT32_TO_LE (status);
-    command_done->buffer_length = 0;
+    command_done->buffer_length = GUINT32_TO_LE (buffer_length);
+    if (buffer_length)
+        memcpy (command_done->buffer, buffer, buffer_length);
 
     return response;
 }
 
+static MbimMessage *
+build_proxy_control_command_done (MbimMessage     *message,
+                                  MbimStatusError  status)
+{
+    return build_proxy_control_command_done_with_buffer (message, status, NULL, 0);
+}
+
 static void
 proxy_config_internal_device_open_ready (MbimProxy    *self,
                                          GAsyncResult *res,
@@ -694,6 +1375,129 @@ proxy_config_internal_device_open_ready (MbimProxy    *self,
     request_complete_and_free (request);
 }
 
+/* Clients are handled in the same context as their device, which may be
+ * running in its own thread; if so, the client is handed over to that thread,
+ * which then completes the configuration. */
+
+typedef struct {
+    Request    *request;
+    MbimDevice *device;
+} ClientHandover;
+
+static void
+client_handover_free (ClientHandover *handover)
+{
+    /* Never dispatched, e.g. because the device thread was stopped */
+    if (handover->request) {
+        untrack_client (handover->request->self, handover->request->client);
+        request_complete_and_free (handover->request);
+    }
+    g_object_unref (handover->device);
+    g_slice_free (ClientHandover, handover);
+}
+
+static void
+client_set_device_and_open (Request    *request,
+                            MbimDevice *device)
+{
+    client_set_device (request->client, device);
+    internal_device_open (request->self,
+                          device,
+                          request->timeout_secs,
+                          (GAsyncReadyCallback)proxy_config_internal_device_open_ready,
+                          request);
+}
+
+static gboolean
+client_handover_cb (ClientHandover *handover)
+{
+    Request *request;
+    Client  *client;
+
+    request = g_steal_pointer (&handover->request);
+    client = request->client;
+
+    /* Untracked while being handed over */
+    if (!client->connection) {
+        request_complete_and_free (request);
+        return FALSE;
+    }
+
+    g_debug ("[client %lu] handed over to the thread of device '%s'",
+             client->id, mbim_device_get_path (handover->device));
+
+    client_attach_readable_source (client);
+    if (!g_queue_is_empty (&client->output_queue)) {
+        g_autoptr(GError) error = NULL;
+
+        if (!client_flush (client, &error)) {
+            g_warning ("[client %lu] error writing to ostream: %s", client->id, error->message);
+            untrack_client (request->self, client);
+            request_complete_and_free (request);
+            return FALSE;
+        }
+    }
+
+    client_ref (client);
+    client_set_device_and_open (request, handover->device);
+
+    /* Keep on parsing what the client sent after the configuration */
+    if (client->connection && client->buffer && client->buffer->len > 0)
+        parse_request (client->self, client);
+    client_unref (client);
+    return FALSE;
+}
+
+static void
+client_handover_start (ClientHandover *handover)
+{
+    g_main_context_invoke_full (handover->request->client->context,
+                                G_PRIORITY_DEFAULT,
+                                (GSourceFunc) client_handover_cb,
+                                handover,
+                                (GDestroyNotify) client_handover_free);
+}
+
+static void
+client_attach_device (Request    *request,
+                      MbimDevice *device)
+{
+    Client         *client;
+    GMainContext   *context;
+    ClientHandover *handover;
+
+    client = request->client;
+    context = device_peek_context (request->self, device);
+    if (context == client->context) {
+        client_set_device_and_open (request, device);
+        return;
+    }
+
+    /* Stop handling the client in this context */
+    if (client->connection_readable_source) {
+        g_source_destroy (client->connection_readable_source);
+        g_source_unref (client->connection_readable_source);
+        client->connection_readable_source = NULL;
+    }
+    if (client->connection_writable_source) {
+        g_source_destroy (client->connection_writable_source);
+        g_source_unref (client->connection_writable_source);
+        client->connection_writable_source = NULL;
+    }
+    client->context = context;
+
+    handover = g_slice_new (ClientHandover);
+    handover->request = request;
+    handover->device = g_object_ref (device);
+
+    /* The client must not be used in this context once handed over */
+    if (client->parsing) {
+        client->handover = handover;
+        return;
+    }
+    client_handover_start (handover);
+}
+
 static void
 device_new_ready (GObject      *source,
                   GAsyncResult *res,
@@ -714,23 +1518,18 @@ device_new_ready (GObject      *source,
     }
 
     /* Store device in the proxy independently */
-    existing = peek_device_for_path (request->self, mbim_device_get_path (device));
+    existing = lookup_device_for_path (request->self, mbim_device_get_path (device));
     if (existing) {
         /* Race condition, we created two MbimDevices for the same port, just skip ours, no big deal */
-        client_set_device (request->client, existing);
+        client_attach_device (request, existing);
+        g_object_unref (existing);
     } else {
         /* Keep the newly added device in the proxy */
         track_device (request->self, device);
         /* Also keep track of the device in the client */
-        client_set_device (request->client, device);
+        client_attach_device (request, device);
     }
     g_object_unref (device);
-
-    internal_device_open (request->self,
-                          request->client->device,
-                          request->timeout_secs,
-                          (GAsyncReadyCallback)proxy_config_internal_device_open_ready,
-                          request);
 }
 
 static gboolean
@@ -790,6 +1589,18 @@ process_internal_proxy_config (MbimProxy   *self,
         return TRUE;
     }
 
+    /* Read requested timeout value */
+    if (!_mbim_message_read_guint32 (message, 8, &request->timeout_secs, &error)) {
+        g_warning ("[client %lu,0x%08x] cannot configure proxy: couldn't read timeout from request: %s",
+                   request->client->id, request->original_transaction_id, error->message);
+        request->response = build_proxy_control_command_done (message, MBIM_STATUS_ERROR_INVALID_PARAMETERS);
+        request_complete_and_free (request);
+        return TRUE;
+    }
+
+    /* The same timeout applies to the commands of the client */
+    client->timeout_secs = request->timeout_secs;
+
     /* Only allow subsequent requests with the same path */
     if (client->device) {
         if (g_str_equal (path, mbim_device_get_path (client->device))) {
@@ -805,25 +1616,12 @@ process_internal_proxy_config (MbimProxy   *self,
         return TRUE;
     }
 
-    /* Read requested timeout value */
-    if (!_mbim_message_read_guint32 (message, 8, &request->timeout_secs, &error)) {
-        g_warning ("[client %lu,0x%08x] cannot configure proxy: couldn't read timeout from request: %s",
-                   request->client->id, request->original_transaction_id, error->message);
-        request->response = build_proxy_control_command_done (message, MBIM_STATUS_ERROR_INVALID_PARAMETERS);
-        request_complete_and_free (request);
-        return TRUE;
-    }
-
     /* Check if some other client already handled the same device */
-    device = peek_device_for_path (self, path);
+    device = lookup_device_for_path (self, path);
     if (device) {
         /* Keep reference and continue */
-        client_set_device (client, device);
-        internal_device_open (self,
-                              device,
-                              request->timeout_secs,
-                              (GAsyncReadyCallback)proxy_config_internal_device_open_ready,
-                              request);
+        client_attach_device (request, device);
+        g_object_unref (device);
         return TRUE;
     }
 
@@ -839,29 +1637,299 @@ process_internal_proxy_config (MbimProxy   *self,
     return TRUE;
 }
 
+static MbimStatusError
+client_setup_indication_ring (MbimProxy  *self,
+                              Client     *client,
+                              GError    **error)
+{
+    MbimIndicationRing     *ring;
+    g_autoptr(GUnixFDList)  fds = NULL;
+    gint                    ring_fd;
+    gint                    event_fd;
+
+    /* File descriptors can only be passed along with a datagram */
+    if (!client->seqpacket || !self->priv->indication_ring_size) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_UNSUPPORTED,
+                     "indication rings not supported in this connection");
+        return MBIM_STATUS_ERROR_OPERATION_NOT_ALLOWED;
+    }
+
+    if (!client->device) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_WRONG_STATE,
+                     "proxy not configured");
+        return MBIM_STATUS_ERROR_NOT_INITIALIZED;
+    }
+
+    if (client->ring_eventfd >= 0) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_WRONG_STATE,
+                     "indication ring already setup");
+        return MBIM_STATUS_ERROR_BUSY;
+    }
+
+    ring = device_peek_indication_ring (client->device, self->priv->indication_ring_size, error);
+    if (!ring)
+        return MBIM_STATUS_ERROR_FAILURE;
+
+    ring_fd = _mbim_indication_ring_dup_readonly_fd (ring, error);
+    if (ring_fd < 0)
+        return MBIM_STATUS_ERROR_FAILURE;
+
+    event_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd < 0) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                     "couldn't create eventfd: %s", g_strerror (errno));
+        close (ring_fd);
+        return MBIM_STATUS_ERROR_FAILURE;
+    }
+
+    /* The list keeps its own copies */
+    fds = g_unix_fd_list_new ();
+    if (g_unix_fd_list_append (fds, ring_fd, error) < 0 ||
+        g_unix_fd_list_append (fds, event_fd, error) < 0) {
+        close (ring_fd);
+        close (event_fd);
+        return MBIM_STATUS_ERROR_FAILURE;
+    }
+    close (ring_fd);
+
+    client->ring_eventfd = event_fd;
+    client->output_fds = g_steal_pointer (&fds);
+    device_track_ring_client (client->device, client, TRUE);
+    return MBIM_STATUS_ERROR_NONE;
+}
+
+static gboolean
+process_internal_proxy_indication_ring (MbimProxy   *self,
+                                        Client      *client,
+                                        MbimMessage *message)
+{
+    Request           *request;
+    MbimStatusError    status;
+    g_autoptr(GError)  error = NULL;
+
+    request = request_new (self, client, message);
+
+    if (mbim_message_command_get_command_type (message) != MBIM_MESSAGE_COMMAND_TYPE_SET) {
+        g_warning ("[client %lu,0x%08x] cannot setup indication ring: invalid request type",
+                   client->id, request->original_transaction_id);
+        request->response = build_proxy_control_command_done (message, MBIM_STATUS_ERROR_INVALID_PARAMETERS);
+        request_complete_and_free (request);
+        return TRUE;
+    }
+
+    status = client_setup_indication_ring (self, client, &error);
+    if (status != MBIM_STATUS_ERROR_NONE)
+        g_debug ("[client %lu,0x%08x] cannot setup indication ring: %s",
+                 client->id, request->original_transaction_id, error->message);
+    else
+        g_debug ("[client %lu,0x%08x] indication ring setup",
+                 client->id, request->original_transaction_id);
+
+    /* The ring and the eventfd are sent along with the response */
+    request->response = build_proxy_control_command_done (message, status);
+    if (status == MBIM_STATUS_ERROR_NONE)
+        client->output_fds_message = request->response;
+    request_complete_and_free (request);
+    return TRUE;
+}
+
+/*****************************************************************************/
+/* Proxy indication replay */
+
+static gboolean
+process_internal_proxy_indication_replay (MbimProxy   *self,
+                                          Client      *client,
+                                          MbimMessage *message)
+{
+    Request         *request;
+    MbimStatusError  status = MBIM_STATUS_ERROR_NONE;
+
+    request = request_new (self, client, message);
+
+    if (mbim_message_command_get_command_type (message) != MBIM_MESSAGE_COMMAND_TYPE_SET) {
+        g_warning ("[client %lu,0x%08x] cannot enable indication replay: invalid request type",
+                   client->id, request->original_transaction_id);
+        status = MBIM_STATUS_ERROR_INVALID_PARAMETERS;
+    } else if (!client->device) {
+        g_debug ("[client %lu,0x%08x] cannot enable indication replay: proxy not configured",
+                 client->id, request->original_transaction_id);
+        status = MBIM_STATUS_ERROR_NOT_INITIALIZED;
+    } else
+        g_debug ("[client %lu,0x%08x] indication replay enabled",
+                 client->id, request->original_transaction_id);
+
+    request->response = build_proxy_control_command_done (message, status);
+    request_complete_and_free (request);
+
+    /* Replay what the client is already subscribed to right after the
+     * response; the client may have been untracked while responding */
+    if (status == MBIM_STATUS_ERROR_NONE && client->connection && client->device) {
+        client->replay_indications = TRUE;
+        device_replay_indications (client->device, client, NULL, 0);
+    }
+    return TRUE;
+}
+
+/*****************************************************************************/
+/* Proxy statistics */
+
+static gint
+latency_cmp (gconstpointer a,
+             gconstpointer b)
+{
+    guint32 value_a = *((const guint32 *)a);
+    guint32 value_b = *((const guint32 *)b);
+
+    return (value_a > value_b) - (value_a < value_b);
+}
+
+/* Each item of the per-device and per-client arrays is given as an offset
+ * and length pair, with the item itself in the variable buffer */
+static void
+statistics_append_item (MbimStructBuilder *builder,
+                        MbimStructBuilder *item)
+{
+    GByteArray *raw;
+
+    raw = _mbim_struct_builder_complete (item);
+    _mbim_struct_builder_append_byte_array (builder, TRUE, TRUE, TRUE, raw->data, raw->len, FALSE);
+    g_byte_array_unref (raw);
+}
+
+static GByteArray *
+build_statistics (MbimProxy *self)
+{
+    MbimProxyPrivate  *priv = self->priv;
+    MbimStructBuilder *builder;
+    guint32            latencies[LATENCY_SAMPLES];
+    guint              n_latencies;
+    guint64            commands_forwarded;
+    guint64            indications_forwarded;
+    guint64            indications_dropped;
+    GHashTableIter     iter;
+    const gchar       *path;
+    MbimDevice        *device;
+    Client            *client;
+
+    g_mutex_lock (&priv->stats_lock);
+    commands_forwarded = priv->commands_forwarded;
+    indications_forwarded = priv->indications_forwarded;
+    indications_dropped = priv->indications_dropped;
+    n_latencies = priv->n_latencies;
+    memcpy (latencies, priv->latencies, n_latencies * sizeof (guint32));
+    g_mutex_unlock (&priv->stats_lock);
+
+    qsort (latencies, n_latencies, sizeof (guint32), latency_cmp);
+
+    builder = _mbim_struct_builder_new ();
+
+    g_mutex_lock (&priv->lock);
+
+    _mbim_struct_builder_append_guint32 (builder, g_hash_table_size (priv->clients));
+    _mbim_struct_builder_append_guint32 (builder, g_hash_table_size (priv->devices));
+    _mbim_struct_builder_append_guint64 (builder, commands_forwarded);
+    _mbim_struct_builder_append_guint64 (builder, indications_forwarded);
+    _mbim_struct_builder_append_guint64 (builder, indications_dropped);
+    _mbim_struct_builder_append_guint32 (builder, _mbim_proxy_helper_percentile (latencies, n_latencies, 50));
+    _mbim_struct_builder_append_guint32 (builder, _mbim_proxy_helper_percentile (latencies, n_latencies, 90));
+    _mbim_struct_builder_append_guint32 (builder, _mbim_proxy_helper_percentile (latencies, n_latencies, 99));
+
+    /* Devices and clients handled in device threads may be updating their
+     * state, so these are just the last snapshots they published */
+    _mbim_struct_builder_append_guint32 (builder, g_hash_table_size (priv->devices));
+    g_hash_table_iter_init (&iter, priv->devices);
+    while (g_hash_table_iter_next (&iter, (gpointer *)&path, (gpointer *)&device)) {
+        MbimStructBuilder *item;
+        guint32            n_clients;
+        guint32            n_in_flight;
+        guint32            n_waiting;
+
+        device_peek_statistics (device, &n_clients, &n_in_flight, &n_waiting);
+        item = _mbim_struct_builder_new ();
+        _mbim_struct_builder_append_string (item, path);
+        _mbim_struct_builder_append_guint32 (item, n_clients);
+        _mbim_struct_builder_append_guint32 (item, n_in_flight);
+        _mbim_struct_builder_append_guint32 (item, n_waiting);
+        statistics_append_item (builder, item);
+    }
+
+    _mbim_struct_builder_append_guint32 (builder, g_hash_table_size (priv->clients));
+    g_hash_table_iter_init (&iter, priv->clients);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&client)) {
+        MbimStructBuilder *item;
+
+        item = _mbim_struct_builder_new ();
+        _mbim_struct_builder_append_guint32 (item, (guint32) client->id);
+        _mbim_struct_builder_append_guint32 (item, (guint32) g_atomic_int_get (&client->stats_queue_length));
+        _mbim_struct_builder_append_guint32 (item, (guint32) g_atomic_int_get (&client->stats_queue_bytes));
+        _mbim_struct_builder_append_guint32 (item, (guint32) g_atomic_int_get (&client->stats_in_flight));
+        _mbim_struct_builder_append_guint32 (item, (guint32) g_atomic_int_get (&client->stats_pending));
+        statistics_append_item (builder, item);
+    }
+
+    g_mutex_unlock (&priv->lock);
+
+    return _mbim_struct_builder_complete (builder);
+}
+
+static gboolean
+process_internal_proxy_statistics (MbimProxy   *self,
+                                   Client      *client,
+                                   MbimMessage *message)
+{
+    Request              *request;
+    g_autoptr(GByteArray) statistics = NULL;
+
+    request = request_new (self, client, message);
+
+    if (mbim_message_command_get_command_type (message) != MBIM_MESSAGE_COMMAND_TYPE_QUERY) {
+        g_warning ("[client %lu,0x%08x] cannot query statistics: invalid request type",
+                   client->id, request->original_transaction_id);
+        request->response = build_proxy_control_command_done (message, MBIM_STATUS_ERROR_INVALID_PARAMETERS);
+        request_complete_and_free (request);
+        return TRUE;
+    }
+
+    statistics = build_statistics (self);
+    request->response = build_proxy_control_command_done_with_buffer (message,
+                                                                      MBIM_STATUS_ERROR_NONE,
+                                                                      statistics->data,
+                                                                      statistics->len);
+    request_complete_and_free (request);
+    return TRUE;
+}
+
 /*****************************************************************************/
 /* Subscriber list */
 
 static void
-track_service_subscribe_list (Client      *client,
-                              MbimMessage *message)
+track_service_subscribe_list (Request *request)
 {
+    Client                        *client = request->client;
     g_autoptr(GError)              error = NULL;
     g_autoptr(MbimEventEntryArray) mbim_event_entry_array = NULL;
     gsize                          mbim_event_entry_array_size;
 
-    mbim_event_entry_array = _mbim_proxy_helper_service_subscribe_request_parse (message, &mbim_event_entry_array_size, &error);
+    mbim_event_entry_array = _mbim_proxy_helper_service_subscribe_request_parse (request->message, &mbim_event_entry_array_size, &error);
     if (error) {
         g_warning ("[client %lu] invalid subscribe request message: %s", client->id, error->message);
         return;
     }
 
+    /* Indications are replayed once the request is responded, and the
+     * previous list is needed to know which CIDs are new */
+    if (client->replay_indications) {
+        request->replay = TRUE;
+        if (client->mbim_event_entry_array)
+            request->replay_previous = _mbim_proxy_helper_service_subscribe_list_dup (client->mbim_event_entry_array,
+                                                                                      client->mbim_event_entry_array_size,
+                                                                                      &request->replay_previous_size);
+    }
+
     /* On each new request from the client, it should provide the FULL list of
      * events it's subscribed to, so we can safely recreate the whole array each
      * time. */
-    g_clear_pointer (&client->mbim_event_entry_array, mbim_event_entry_array_free);
-    client->mbim_event_entry_array = g_steal_pointer (&mbim_event_entry_array);
-    client->mbim_event_entry_array_size = mbim_event_entry_array_size;
+    client_set_event_entry_array (client, g_steal_pointer (&mbim_event_entry_array), mbim_event_entry_array_size);
 
     if (mbim_utils_get_traces_enabled ()) {
         g_debug ("[client %lu] service subscribe list built", client->id);
@@ -874,17 +1942,21 @@ static void
 device_service_subscribe_list_set_complete (Request         *request,
                                             MbimStatusError  status)
 {
-    struct command_done_message *command_done;
-    guint32                      raw_len;
-    const guint8                *raw_data;
+    struct command_done_message    *command_done;
+    guint32                         raw_len;
+    const guint8                   *raw_data;
+    Client                         *client;
+    gboolean                        replay;
+    g_autoptr(MbimEventEntryArray)  previous = NULL;
+    gsize                           previous_size;
 
     /* The raw message data to send back as response to client */
     raw_data = mbim_message_command_get_raw_information_buffer (request->message, &raw_len);
 
-    request->response = (MbimMessage *)_mbim_message_allocate (MBIM_MESSAGE_TYPE_COMMAND_DONE,
-                                                               mbim_message_get_transaction_id (request->message),
-                                                               sizeof (struct command_done_message) +
-                                                               raw_len);
+    request->response = _mbim_message_allocate (MBIM_MESSAGE_TYPE_COMMAND_DONE,
+                                                mbim_message_get_transaction_id (request->message),
+                                                sizeof (struct command_done_message) +
+                                                raw_len);
     command_done = &(((struct full_message *)(request->response->data))->message.command_done);
     command_done->fragment_header.total = GUINT32_TO_LE (1);
     command_done->fragment_header.current = 0;
@@ -894,7 +1966,18 @@ device_service_subscribe_list_set_complete (Request         *request,
     command_done->buffer_length = GUINT32_TO_LE (raw_len);
     memcpy (&command_done->buffer[0], raw_data, raw_len);
 
+    client = client_ref (request->client);
+    replay = (request->replay && status == MBIM_STATUS_ERROR_NONE);
+    previous = g_steal_pointer (&request->replay_previous);
+    previous_size = request->replay_previous_size;
     request_complete_and_free (request);
+
+    /* Replay the indications of the CIDs just subscribed to right after the
+     * response, as with the indication replay request; the client may have
+     * been untracked while responding */
+    if (replay && client->connection && client->device)
+        device_replay_indications (client->device, client, (const MbimEventEntry * const *)previous, previous_size);
+    client_unref (client);
 }
 
 static void
@@ -947,7 +2030,7 @@ process_device_service_subscribe_list (MbimProxy   *self,
              request->client->id, request->original_transaction_id);
 
     /* trace the service subscribe list for the client */
-    track_service_subscribe_list (client, message);
+    track_service_subscribe_list (request);
 
     /* merge all service subscribe list for all clients to set on device */
     updated = merge_client_service_subscribe_lists (self, client->device, &updated_size);
@@ -966,7 +2049,7 @@ process_device_service_subscribe_list (MbimProxy   *self,
              request->client->id, request->original_transaction_id);
     mbim_device_command (client->device,
                          request_message,
-                         300,
+                         client_get_command_timeout (client),
                          NULL,
                          (GAsyncReadyCallback)device_service_subscribe_list_set_ready,
                          request);
@@ -976,6 +2059,9 @@ process_device_service_subscribe_list (MbimProxy   *self,
 /*****************************************************************************/
 /* Standard command */
 
+static void device_schedule_command (Request *request);
+static void device_command_finished (MbimDevice *device, Request *request);
+
 static void
 device_command_ready (MbimDevice   *device,
                       GAsyncResult *res,
@@ -983,6 +2069,9 @@ device_command_ready (MbimDevice   *device,
 {
     g_autoptr(GError) error = NULL;
 
+    if (request->scheduled)
+        device_command_finished (device, request);
+
     request->response = mbim_device_command_finish (device, res, &error);
     if (!request->response) {
         /* Translate a MbimDevice wrong state error into a Not-Opened function error. */
@@ -1001,6 +2090,8 @@ device_command_ready (MbimDevice   *device,
         return;
     }
 
+    stats_add_latency (request->self, g_get_monotonic_time () - request->dispatched);
+
     /* replace reponse transaction id with the requested transaction id */
     g_debug ("[client %lu,0x%08x] response from device received",
              request->client->id, request->original_transaction_id);
@@ -1008,48 +2099,154 @@ device_command_ready (MbimDevice   *device,
     request_complete_and_free (request);
 }
 
-static gboolean
-process_command (MbimProxy   *self,
-                 Client      *client,
-                 MbimMessage *message)
+static void
+request_dispatch (Request *request)
 {
-    Request     *request;
+    Client      *client;
+    MbimMessage *message;
     const gchar *command;
     const gchar *command_type;
     const gchar *service;
 
+    client = request->client;
+    message = request->message;
+
     command = mbim_cid_get_printable (mbim_message_command_get_service (message),
                                       mbim_message_command_get_cid (message));
     command_type = mbim_message_command_type_get_string (mbim_message_command_get_command_type (message));
     service = mbim_service_get_string (mbim_message_command_get_service (message));
 
-    /* create request holder */
-    request = request_new (self, client, message);
-
     g_debug ("[client %lu,0x%08x] forwarding request to device: %s, %s, %s",
              client->id, request->original_transaction_id,
              service      ? service      : "unknown service",
              command_type ? command_type : "unknown command type",
              command      ? command      : "unknown command");
 
-    if (_mbim_message_fragment_get_current (message) == _mbim_message_fragment_get_total (message) - 1)
-        /* replace command transaction id with internal proxy transaction id to avoid collision */
-        mbim_message_set_transaction_id (message, mbim_device_get_next_transaction_id (client->device));
-    else
-        /* avoid incrementing transaction until the last fragment is processed */
-        mbim_message_set_transaction_id (message, mbim_device_get_transaction_id (client->device));
+    /* replace command transaction id with internal proxy transaction id to avoid collision */
+    mbim_message_set_transaction_id (message, mbim_device_get_next_transaction_id (client->device));
+
+    request->dispatched = g_get_monotonic_time ();
+    stats_update (request->self, 1, 0, 0);
 
     /* The timeout needs to be big enough for any kind of transaction to
      * complete, otherwise the remote clients will lose the reply if they
-     * configured a timeout bigger than this internal one. We should likely
-     * make this value configurable per-client, instead of a hardcoded value.
-     */
+     * configured a timeout bigger than this internal one. */
     mbim_device_command (client->device,
                          message,
-                         300,
-                         NULL,
+                         client_get_command_timeout (client),
+                         request->cancellable,
                          (GAsyncReadyCallback)device_command_ready,
                          request);
+}
+
+/* Commands received in multiple fragments are reassembled before being
+ * forwarded, so that each one gets its own transaction id in the device and
+ * the device fragments it again as needed. Returns the full command once the
+ * last fragment is received.
+ *
+ * Each client may only have a few commands being reassembled at a time, up
+ * to a total size; commands not completed within the command timeout are
+ * dropped, as the client would have given up on them anyway. */
+
+/* Drops the stale collectors, and returns the size of the remaining ones */
+static gsize
+client_expire_fragment_collectors (Client *client)
+{
+    GHashTableIter     iter;
+    FragmentCollector *collector;
+    gint64             limit;
+    gsize              collected = 0;
+
+    limit = g_get_monotonic_time () - (gint64) client_get_command_timeout (client) * G_USEC_PER_SEC;
+
+    g_hash_table_iter_init (&iter, client->fragment_collectors);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &collector)) {
+        if (collector->started < limit) {
+            g_debug ("[client %lu,0x%08x] fragmented command timed out",
+                     client->id, mbim_message_get_transaction_id (collector->message));
+            g_hash_table_iter_remove (&iter);
+            continue;
+        }
+        collected += mbim_message_get_message_length (collector->message);
+    }
+
+    return collected;
+}
+
+static MbimMessage *
+client_collect_fragment (Client      *client,
+                         MbimMessage *fragment)
+{
+    FragmentCollector *collector;
+    MbimMessage       *message;
+    gpointer           key;
+    gsize              collected;
+    g_autoptr(GError)  error = NULL;
+
+    collected = client_expire_fragment_collectors (client);
+
+    key = GUINT_TO_POINTER (mbim_message_get_transaction_id (fragment));
+    collector = g_hash_table_lookup (client->fragment_collectors, key);
+    if (collected + mbim_message_get_message_length (fragment) > CLIENT_FRAGMENT_COLLECTED_BYTES_MAX) {
+        g_set_error (&error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                     "too many bytes in fragmented commands (%" G_GSIZE_FORMAT ")", collected);
+        if (collector)
+            g_hash_table_remove (client->fragment_collectors, key);
+    } else if (!collector) {
+        if (g_hash_table_size (client->fragment_collectors) >= CLIENT_FRAGMENT_COLLECTORS_MAX)
+            g_set_error (&error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                         "too many fragmented commands (%u)", g_hash_table_size (client->fragment_collectors));
+        else {
+            message = _mbim_message_fragment_collector_init (fragment, &error);
+            if (message) {
+                collector = g_slice_new (FragmentCollector);
+                collector->message = message;
+                collector->started = g_get_monotonic_time ();
+                g_hash_table_insert (client->fragment_collectors, key, collector);
+            }
+        }
+    } else if (!_mbim_message_fragment_collector_add (collector->message, fragment, &error))
+        g_hash_table_remove (client->fragment_collectors, key);
+
+    if (error) {
+        g_autoptr(MbimMessage) response = NULL;
+        g_autoptr(GError)      inner_error = NULL;
+
+        g_debug ("[client %lu,0x%08x] invalid fragment: %s",
+                 client->id, mbim_message_get_transaction_id (fragment), error->message);
+        response = mbim_message_function_error_new (mbim_message_get_transaction_id (fragment),
+                                                    MBIM_PROTOCOL_ERROR_FRAGMENT_OUT_OF_SEQUENCE);
+        if (!client_send_message (client, response, &inner_error)) {
+            g_warning ("[client %lu] couldn't report invalid fragment: %s", client->id, inner_error->message);
+            untrack_client (client->self, client);
+        }
+        return NULL;
+    }
+
+    if (!_mbim_message_fragment_collector_complete (collector->message))
+        return NULL;
+
+    message = mbim_message_ref (collector->message);
+    g_hash_table_remove (client->fragment_collectors, key);
+    return message;
+}
+
+static gboolean
+process_command (MbimProxy   *self,
+                 Client      *client,
+                 MbimMessage *message)
+{
+    g_autoptr(MbimMessage) collected = NULL;
+
+    if (_mbim_message_fragment_get_total (message) > 1) {
+        collected = client_collect_fragment (client, message);
+        if (!collected)
+            return TRUE;
+        message = collected;
+    }
+
+    /* create request holder */
+    device_schedule_command (request_new (self, client, message));
     return TRUE;
 }
 
@@ -1071,6 +2268,15 @@ process_message (MbimProxy   *self,
         if (mbim_message_command_get_service (message) == MBIM_SERVICE_PROXY_CONTROL &&
             mbim_message_command_get_cid (message) == MBIM_CID_PROXY_CONTROL_CONFIGURATION)
             return process_internal_proxy_config (self, client, message);
+        if (mbim_message_command_get_service (message) == MBIM_SERVICE_PROXY_CONTROL &&
+            mbim_message_command_get_cid (message) == MBIM_CID_PROXY_CONTROL_INDICATION_RING)
+            return process_internal_proxy_indication_ring (self, client, message);
+        if (mbim_message_command_get_service (message) == MBIM_SERVICE_PROXY_CONTROL &&
+            mbim_message_command_get_cid (message) == MBIM_CID_PROXY_CONTROL_INDICATION_REPLAY)
+            return process_internal_proxy_indication_replay (self, client, message);
+        if (mbim_message_command_get_service (message) == MBIM_SERVICE_PROXY_CONTROL &&
+            mbim_message_command_get_cid (message) == MBIM_CID_PROXY_CONTROL_STATISTICS)
+            return process_internal_proxy_statistics (self, client, message);
         /* device service subscribe list message? */
         if (mbim_message_command_get_service (message) == MBIM_SERVICE_BASIC_CONNECT &&
             mbim_message_command_get_cid (message) == MBIM_CID_BASIC_CONNECT_DEVICE_SERVICE_SUBSCRIBE_LIST)
@@ -1096,6 +2302,15 @@ static void
 parse_request (MbimProxy *self,
                Client    *client)
 {
+    GMainContext *context;
+    gpointer      handover;
+
+    /* Once the client is handed over to the thread of its device, the rest
+     * of the buffer is parsed there */
+    context = client->context;
+    client->parsing = TRUE;
+    client_ref (client);
+
     do {
         g_autoptr(MbimMessage) message = NULL;
         guint32                len = 0;
@@ -1103,19 +2318,93 @@ parse_request (MbimProxy *self,
         if (client->buffer->len >= sizeof (struct header) &&
             (len = GUINT32_FROM_LE (((struct header *)client->buffer->data)->length)) > client->buffer->len) {
             /* have not received complete message */
-            return;
+            break;
         }
 
         if (!len)
-            return;
+            break;
+
+        if (len == client->buffer->len) {
+            g_autoptr(GBytes) bytes = NULL;
+
+            /* The buffer holds exactly one message (the usual case), so hand
+             * the buffer memory over to the message instead of copying it */
+            bytes = g_byte_array_free_to_bytes (client->buffer);
+            client->buffer = NULL;
+            message = mbim_message_new_from_bytes (bytes, NULL);
+        } else {
+            message = mbim_message_new (client->buffer->data, len);
+            g_byte_array_remove_range (client->buffer, 0, len);
+        }
 
-        message = mbim_message_new (client->buffer->data, len);
         if (!message)
-            return;
+            break;
 
-        g_byte_array_remove_range (client->buffer, 0, len);
         process_message (self, client, message);
-    } while (client->buffer->len > 0);
+    } while (client->context == context && client->buffer && client->buffer->len > 0);
+
+    client->parsing = FALSE;
+    handover = g_steal_pointer (&client->handover);
+
+    /* If being handed over, the request in the handover keeps the client
+     * alive, so it's never freed here */
+    client_unref (client);
+    if (handover)
+        client_handover_start (handover);
+}
+
+/* Clients connected through the seqpacket socket send each message or
+ * fragment as a single datagram, which is received as a whole in a buffer of
+ * its exact size, so that it becomes the message without any reframing. */
+static gboolean
+client_read_datagram (Client  *client,
+                      GSocket *socket)
+{
+    g_autoptr(GError) error = NULL;
+    gssize            available;
+    gssize            r;
+
+    /* Size of the next datagram; 0 for an empty datagram, which is received
+     * and discarded below, or if the client closed the connection */
+    available = mbim_helpers_peek_datagram_size (socket, &error);
+    if (available < 0) {
+        if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+            return TRUE;
+        g_warning ("[client %lu] %s", client->id, error->message);
+        untrack_client (client->self, client);
+        return FALSE;
+    }
+
+    /* Datagrams are never merged, so the buffer is always empty here */
+    if (G_UNLIKELY (!client->buffer))
+        client->buffer = g_byte_array_sized_new (MAX (available, BUFFER_SIZE));
+    g_byte_array_set_size (client->buffer, (guint) available);
+
+    r = g_socket_receive_with_blocking (socket,
+                                        (gchar *) client->buffer->data,
+                                        (gsize) available,
+                                        FALSE,
+                                        NULL,
+                                        &error);
+    g_byte_array_set_size (client->buffer, MAX (r, 0));
+
+    if (r < 0) {
+        if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+            return TRUE;
+        g_warning ("[client %lu] error reading from socket: %s", client->id, error->message);
+        untrack_client (client->self, client);
+        return FALSE;
+    }
+
+    if (r < (gssize) sizeof (struct header) ||
+        GUINT32_FROM_LE (((struct header *)client->buffer->data)->length) != (guint32) r) {
+        g_warning ("[client %lu] discarding %" G_GSSIZE_FORMAT " bytes of invalid datagram", client->id, r);
+        g_byte_array_set_size (client->buffer, 0);
+        return TRUE;
+    }
+
+    parse_request (client->self, client);
+    return TRUE;
 }
 
 static gboolean
@@ -1124,9 +2413,9 @@ connection_readable_cb (GSocket *socket,
                         Client *client)
 {
     MbimProxy         *self;
-    guint8             buffer[BUFFER_SIZE];
     g_autoptr(GError)  error = NULL;
     gssize             r;
+    guint              prev_len;
 
     /* Recover proxy pointer soon */
     self = client->self;
@@ -1139,11 +2428,22 @@ connection_readable_cb (GSocket *socket,
     if (!(condition & G_IO_IN || condition & G_IO_PRI))
         return TRUE;
 
+    if (client->seqpacket)
+        return client_read_datagram (client, socket);
+
+    /* Read directly at the end of the client buffer */
+    if (G_UNLIKELY (!client->buffer))
+        client->buffer = g_byte_array_sized_new (BUFFER_SIZE);
+    prev_len = client->buffer->len;
+    g_byte_array_set_size (client->buffer, prev_len + BUFFER_SIZE);
+
     r = g_input_stream_read (g_io_stream_get_input_stream (G_IO_STREAM (client->connection)),
-                             buffer,
+                             &client->buffer->data[prev_len],
                              BUFFER_SIZE,
                              NULL,
                              &error);
+    g_byte_array_set_size (client->buffer, prev_len + MAX (r, 0));
+
     if (r < 0) {
         g_warning ("[client %lu] error reading from istream: %s", client->id, error ? error->message : "unknown");
         /* Close the device */
@@ -1154,24 +2454,86 @@ connection_readable_cb (GSocket *socket,
     if (r == 0)
         return TRUE;
 
-    /* else, r > 0 */
-    if (!G_UNLIKELY (client->buffer))
-        client->buffer = g_byte_array_sized_new (r);
-    g_byte_array_append (client->buffer, buffer, r);
-
     /* Try to parse input messages */
     parse_request (self, client);
 
     return TRUE;
 }
 
+static void
+client_attach_readable_source (Client *client)
+{
+    client->connection_readable_source = g_socket_create_source (g_socket_connection_get_socket (client->connection),
+                                                                 G_IO_IN | G_IO_PRI | G_IO_ERR | G_IO_HUP,
+                                                                 NULL);
+    g_source_set_callback (client->connection_readable_source,
+                           (GSourceFunc)connection_readable_cb,
+                           client,
+                           NULL);
+    g_source_attach (client->connection_readable_source, client->context);
+}
+
+static gboolean
+connection_writable_cb (GSocket      *socket,
+                        GIOCondition  condition,
+                        Client       *client)
+{
+    g_autoptr(GError) error = NULL;
+
+    if (condition & G_IO_HUP || condition & G_IO_ERR) {
+        untrack_client (client->self, client);
+        return FALSE;
+    }
+
+    /* The source is removed by the flush once the queue is empty */
+    if (!client_flush (client, &error)) {
+        g_warning ("[client %lu] error writing to ostream: %s", client->id, error->message);
+        untrack_client (client->self, client);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static Client *
+client_new (MbimProxy         *self,
+            GSocketConnection *connection,
+            gulong             id)
+{
+    Client          *client;
+    MbimEventEntry **mbim_event_entry_array;
+    gsize            mbim_event_entry_array_size;
+
+    client = client_alloc ();
+    client->self = self;
+    client->context = self->priv->context;
+    client->ref_count = 1;
+    client->id = id;
+    client->connection = g_object_ref (connection);
+    client->seqpacket = (g_socket_get_socket_type (g_socket_connection_get_socket (connection)) == G_SOCKET_TYPE_SEQPACKET);
+    client->ring_eventfd = -1;
+    /* Datagrams carrying file descriptors are sent with the socket API, which
+     * must never block either */
+    if (client->seqpacket)
+        g_socket_set_blocking (g_socket_connection_get_socket (connection), FALSE);
+    g_queue_init (&client->output_queue);
+    g_queue_init (&client->pending_requests);
+    g_queue_init (&client->requests);
+
+    /* By default, a new client has all the standard services enabled for indications */
+    mbim_event_entry_array = _mbim_proxy_helper_service_subscribe_list_new_standard (&mbim_event_entry_array_size);
+    client_set_event_entry_array (client, mbim_event_entry_array, mbim_event_entry_array_size);
+
+    return client;
+}
+
 static void
 incoming_cb (GSocketService    *service,
              GSocketConnection *connection,
              GObject           *unused,
              MbimProxy         *self)
 {
-    static gulong            client_id = 0;
+    gulong                   client_id;
     Client                  *client;
     g_autoptr(GCredentials)  credentials = NULL;
     g_autoptr(GError)        error = NULL;
@@ -1179,7 +2541,7 @@ incoming_cb (GSocketService    *service,
 
     /* Each new incoming request updates the client id, even if the request is
      * not accepted */
-    client_id++;
+    client_id = ++self->priv->last_client_id;
 
     g_debug ("[client %lu] connection open...", client_id);
 
@@ -1195,29 +2557,15 @@ incoming_cb (GSocketService    *service,
         return;
     }
 
-    if (!mbim_helpers_check_user_allowed (uid, &error)) {
+    if (!check_user_allowed (self, uid, &error)) {
         g_warning ("[client %lu] not allowed: %s", client_id, error->message);
         return;
     }
 
     /* Create client */
-    client = g_slice_new0 (Client);
-    client->self = self;
-    client->ref_count = 1;
-    client->id = client_id;
-    client->connection = g_object_ref (connection);
-
-    /* By default, a new client has all the standard services enabled for indications */
-    client->mbim_event_entry_array = _mbim_proxy_helper_service_subscribe_list_new_standard (&client->mbim_event_entry_array_size);
+    client = client_new (self, connection, client_id);
 
-    client->connection_readable_source = g_socket_create_source (g_socket_connection_get_socket (client->connection),
-                                                                 G_IO_IN | G_IO_PRI | G_IO_ERR | G_IO_HUP,
-                                                                 NULL);
-    g_source_set_callback (client->connection_readable_source,
-                           (GSourceFunc)connection_readable_cb,
-                           client,
-                           NULL);
-    g_source_attach (client->connection_readable_source, g_main_context_get_thread_default ());
+    client_attach_readable_source (client);
 
     /* Keep the client info around */
     track_client (self, client);
@@ -1226,14 +2574,16 @@ incoming_cb (GSocketService    *service,
 }
 
 static gboolean
-setup_socket_service (MbimProxy  *self,
-                      GError    **error)
+add_listening_socket (MbimProxy    *self,
+                      GSocketType   socket_type,
+                      const gchar  *socket_path,
+                      GError      **error)
 {
     g_autoptr(GSocketAddress) socket_address = NULL;
     g_autoptr(GSocket)        socket = NULL;
 
     socket = g_socket_new (G_SOCKET_FAMILY_UNIX,
-                           G_SOCKET_TYPE_STREAM,
+                           socket_type,
                            G_SOCKET_PROTOCOL_DEFAULT,
                            error);
     if (!socket)
@@ -1241,29 +2591,107 @@ setup_socket_service (MbimProxy  *self,
 
     /* Bind to address */
     socket_address = (g_unix_socket_address_new_with_type (
-                          MBIM_PROXY_SOCKET_PATH,
+                          socket_path,
                           -1,
                           G_UNIX_SOCKET_ADDRESS_ABSTRACT));
     if (!g_socket_bind (socket, socket_address, TRUE, error))
         return FALSE;
 
-    g_debug ("creating UNIX socket service...");
-
     /* Listen */
     if (!g_socket_listen (socket, error))
         return FALSE;
 
-    /* Create socket service */
-    self->priv->socket_service = g_socket_service_new ();
-    g_signal_connect (self->priv->socket_service, "incoming", G_CALLBACK (incoming_cb), self);
     if (!g_socket_listener_add_socket (G_SOCKET_LISTENER (self->priv->socket_service),
                                        socket,
                                        NULL, /* don't pass an object, will take a reference */
                                        error)) {
-        g_prefix_error (error, "Error adding socket at '%s' to socket service: ", MBIM_PROXY_SOCKET_PATH);
+        g_prefix_error (error, "Error adding socket at '%s' to socket service: ", socket_path);
+        return FALSE;
+    }
+
+    g_ptr_array_add (self->priv->listening_sockets, g_object_ref (socket));
+    return TRUE;
+}
+
+static gboolean
+add_inherited_socket (MbimProxy  *self,
+                      gint        fd,
+                      GError    **error)
+{
+    g_autoptr(GSocket) socket = NULL;
+    gint               dup_fd;
+
+    /* The caller keeps its own descriptor */
+    dup_fd = fcntl (fd, F_DUPFD_CLOEXEC, 3);
+    if (dup_fd < 0) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                     "Couldn't duplicate listening socket %d: %s", fd, g_strerror (errno));
+        return FALSE;
+    }
+
+    socket = g_socket_new_from_fd (dup_fd, error);
+    if (!socket) {
+        close (dup_fd);
+        g_prefix_error (error, "Invalid listening socket %d: ", fd);
+        return FALSE;
+    }
+
+    if (g_socket_get_family (socket) != G_SOCKET_FAMILY_UNIX ||
+        (g_socket_get_socket_type (socket) != G_SOCKET_TYPE_STREAM &&
+         g_socket_get_socket_type (socket) != G_SOCKET_TYPE_SEQPACKET)) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_INVALID_ARGS,
+                     "Invalid listening socket %d: not a UNIX stream or seqpacket socket", fd);
+        return FALSE;
+    }
+
+    if (!g_socket_listener_add_socket (G_SOCKET_LISTENER (self->priv->socket_service),
+                                       socket,
+                                       NULL, /* don't pass an object, will take a reference */
+                                       error)) {
+        g_prefix_error (error, "Error adding socket %d to socket service: ", fd);
         return FALSE;
     }
 
+    g_ptr_array_add (self->priv->listening_sockets, g_object_ref (socket));
+    g_debug ("listening in inherited %s socket %d",
+             g_socket_get_socket_type (socket) == G_SOCKET_TYPE_SEQPACKET ? "seqpacket" : "stream",
+             fd);
+    return TRUE;
+}
+
+static gboolean
+setup_socket_service (MbimProxy   *self,
+                      const gint  *fds,
+                      guint        n_fds,
+                      GError     **error)
+{
+    g_autoptr(GError) seqpacket_error = NULL;
+    guint             i;
+
+    g_debug ("creating UNIX socket service...");
+
+    /* Create socket service */
+    self->priv->socket_service = g_socket_service_new ();
+    g_signal_connect (self->priv->socket_service, "incoming", G_CALLBACK (incoming_cb), self);
+
+    /* Sockets already listening, e.g. passed by the service manager */
+    if (n_fds > 0) {
+        for (i = 0; i < n_fds; i++) {
+            if (!add_inherited_socket (self, fds[i], error))
+                return FALSE;
+        }
+        g_debug ("starting UNIX socket service with %u inherited sockets...", n_fds);
+        g_socket_service_start (self->priv->socket_service);
+        return TRUE;
+    }
+
+    if (!add_listening_socket (self, G_SOCKET_TYPE_STREAM, MBIM_PROXY_SOCKET_PATH, error))
+        return FALSE;
+
+    /* The seqpacket socket is optional, clients fallback to the stream one */
+    if (!add_listening_socket (self, G_SOCKET_TYPE_SEQPACKET, MBIM_PROXY_SEQPACKET_SOCKET_PATH, &seqpacket_error))
+        g_warning ("couldn't listen at '%s': %s", MBIM_PROXY_SEQPACKET_SOCKET_PATH, seqpacket_error->message);
+
     g_debug ("starting UNIX socket service at '%s'...", MBIM_PROXY_SOCKET_PATH);
     g_socket_service_start (self->priv->socket_service);
     return TRUE;
@@ -1275,202 +2703,1087 @@ setup_socket_service (MbimProxy  *self,
 #define DEVICE_CONTEXT_TAG "device-context-tag"
 static GQuark device_context_quark;
 
+/* Device threads
+ *
+ * Optionally, each device runs in its own thread with its own main context,
+ * along with all the clients using it, so that a device blocking or flooding
+ * its clients doesn't delay the other devices. Clients are accepted in the
+ * main context of the proxy, and handed over to the thread of the device once
+ * they configure it. */
+
+typedef struct {
+    GThread      *thread;
+    GMainContext *context;
+    GMainLoop    *loop;
+} DeviceWorker;
+
+static gpointer
+device_worker_thread (DeviceWorker *worker)
+{
+    g_main_context_push_thread_default (worker->context);
+    g_main_loop_run (worker->loop);
+    g_main_context_pop_thread_default (worker->context);
+    return NULL;
+}
+
+static DeviceWorker *
+device_worker_new (MbimDevice  *device,
+                   GError     **error)
+{
+    DeviceWorker     *worker;
+    g_autofree gchar *name = NULL;
+
+    worker = g_slice_new0 (DeviceWorker);
+    worker->context = g_main_context_new ();
+    worker->loop = g_main_loop_new (worker->context, FALSE);
+
+    name = g_path_get_basename (mbim_device_get_path (device));
+    worker->thread = g_thread_try_new (name, (GThreadFunc) device_worker_thread, worker, error);
+    if (!worker->thread) {
+        g_main_loop_unref (worker->loop);
+        g_main_context_unref (worker->context);
+        g_slice_free (DeviceWorker, worker);
+        return NULL;
+    }
+
+    return worker;
+}
+
+static gboolean
+device_worker_quit_cb (DeviceWorker *worker)
+{
+    g_main_loop_quit (worker->loop);
+    return FALSE;
+}
+
+/* Must not be called from the thread being stopped */
+static void
+device_worker_stop (DeviceWorker *worker)
+{
+    if (!worker->thread)
+        return;
+
+    /* Quitting from within the loop, as it may not be running yet */
+    g_main_context_invoke (worker->context, (GSourceFunc) device_worker_quit_cb, worker);
+    g_thread_join (worker->thread);
+    worker->thread = NULL;
+}
+
+static void
+device_worker_free (DeviceWorker *worker)
+{
+    device_worker_stop (worker);
+    g_main_loop_unref (worker->loop);
+    g_main_context_unref (worker->context);
+    g_slice_free (DeviceWorker, worker);
+}
+
+static gboolean
+device_worker_free_cb (DeviceWorker *worker)
+{
+    device_worker_free (worker);
+    return FALSE;
+}
+
 typedef struct {
-    /* Combined events array */
+    /* Thread of the device, if any; set and unset with the proxy lock held */
+    DeviceWorker    *worker;
+    /* Combined events array, and whether it needs to be rebuilt */
     MbimEventEntry **mbim_event_entry_array;
     gsize            mbim_event_entry_array_size;
+    gboolean         mbim_event_entry_array_outdated;
+    /* Clients using the device, not full refs */
+    GHashTable      *clients;
+    /* Indication routes, RouteKey -> GPtrArray of Clients */
+    GHashTable      *routes;
+    /* Command scheduling */
+    MbimProxy       *self; /* not full ref */
+    GQueue           waiting_clients; /* full refs */
+    guint            n_in_flight;
+    GSource         *schedule_timeout_source;
+    /* Snapshot for the statistics, set atomically in the thread of the
+     * device so that it can be read from any other one */
+    guint            stats_clients;
+    guint            stats_in_flight;
+    guint            stats_waiting;
+    /* Ring where indications are published for the clients that requested
+     * it, and those clients, not full refs */
+    MbimIndicationRing *ring;
+    GPtrArray          *ring_clients;
+    /* Grace period while the device has no clients, and whether a client
+     * arrived during it */
+    GSource         *grace_source;
+    gboolean         warm;
+    /* Last indication received for each service and CID, RouteKey ->
+     * MbimMessage */
+    GHashTable      *last_indications;
 } DeviceContext;
 
 static void
 device_context_free (DeviceContext *ctx)
 {
+    if (ctx->schedule_timeout_source) {
+        g_source_destroy (ctx->schedule_timeout_source);
+        g_source_unref (ctx->schedule_timeout_source);
+    }
+    if (ctx->grace_source) {
+        g_source_destroy (ctx->grace_source);
+        g_source_unref (ctx->grace_source);
+    }
+    g_queue_clear_full (&ctx->waiting_clients, (GDestroyNotify) client_unref);
     mbim_event_entry_array_free (ctx->mbim_event_entry_array);
+    g_hash_table_unref (ctx->clients);
+    g_hash_table_unref (ctx->routes);
+    g_clear_pointer (&ctx->ring, _mbim_indication_ring_free);
+    g_ptr_array_unref (ctx->ring_clients);
+    g_hash_table_unref (ctx->last_indications);
     g_slice_free (DeviceContext, ctx);
 }
 
-static DeviceContext *
-device_context_get (MbimDevice *device)
-{
-    DeviceContext *ctx;
-
-    if (G_UNLIKELY (!device_context_quark))
-        device_context_quark = g_quark_from_static_string (DEVICE_CONTEXT_TAG);
-
-    ctx = g_object_get_qdata (G_OBJECT (device), device_context_quark);
-    if (!ctx) {
-        ctx = g_slice_new0 (DeviceContext);
-        ctx->mbim_event_entry_array = _mbim_proxy_helper_service_subscribe_list_new_standard (&ctx->mbim_event_entry_array_size);
+/* Indication routes
+ *
+ * Each device keeps the clients subscribed to each service and CID, so that
+ * indications are only forwarded to the clients that want them without looking
+ * at the subscribe list of each client. Clients subscribed to all the CIDs of
+ * a service are kept with CID 0, which is never a valid CID. The routes of a
+ * client are updated whenever its device or its subscribe list change.
+ *
+ * The routes also keep count of how many clients want each service and CID, so
+ * the combined subscribe list of the device only needs to be rebuilt when a
+ * route is created or removed, and not on every client change. */
 
-        g_debug ("[%s] initial device subscribe list...", mbim_device_get_path (device));
-        _mbim_proxy_helper_service_subscribe_list_debug ((const MbimEventEntry * const *)ctx->mbim_event_entry_array, ctx->mbim_event_entry_array_size);
+typedef struct {
+    MbimUuid service_id;
+    guint32  cid;
+} RouteKey;
 
-        g_object_set_qdata_full (G_OBJECT (device), device_context_quark, ctx, (GDestroyNotify)device_context_free);
-    }
+static guint
+route_key_hash (gconstpointer v)
+{
+    const RouteKey *key = v;
 
-    return ctx;
+    return (_mbim_uuid_hash (&key->service_id) * 31) + key->cid;
 }
 
-static MbimEventEntry **
-merge_client_service_subscribe_lists (MbimProxy  *self,
-                                      MbimDevice *device,
-                                      gsize      *out_size)
+static gboolean
+route_key_equal (gconstpointer a,
+                 gconstpointer b)
 {
-    GList                          *l;
-    g_autoptr(MbimEventEntryArray)  updated = NULL;
-    gsize                           updated_size = 0;
-    DeviceContext                  *ctx;
-
-    g_debug ("[%s] merging client service subscribe lists...", mbim_device_get_path (device));
-    ctx = device_context_get (device);
-    g_assert (ctx);
+    return (memcmp (a, b, sizeof (RouteKey)) == 0);
+}
 
-    g_assert (out_size != NULL);
+static void
+route_key_init (RouteKey       *key,
+                const MbimUuid *service_id,
+                guint32         cid)
+{
+    memset (key, 0, sizeof (RouteKey));
+    memcpy (&key->service_id, service_id, sizeof (MbimUuid));
+    key->cid = cid;
+}
 
-    /* Init default list */
-    updated = _mbim_proxy_helper_service_subscribe_list_new_standard (&updated_size);
+/* Returns TRUE if the route was created or removed */
+static gboolean
+routes_update (GHashTable     *routes,
+               const MbimUuid *service_id,
+               guint32         cid,
+               Client         *client,
+               gboolean        add)
+{
+    RouteKey   key;
+    GPtrArray *clients;
+
+    route_key_init (&key, service_id, cid);
+    clients = g_hash_table_lookup (routes, &key);
+
+    if (add) {
+        if (!clients) {
+            clients = g_ptr_array_new ();
+            g_ptr_array_add (clients, client);
+            g_hash_table_insert (routes, g_memdup (&key, sizeof (key)), clients);
+            return TRUE;
+        }
+        if (!g_ptr_array_find (clients, client, NULL))
+            g_ptr_array_add (clients, client);
+        return FALSE;
+    }
 
-    /* Lookup all clients with this device */
-    for (l = self->priv->clients; l; l = g_list_next (l)) {
-        Client *client;
+    if (clients && g_ptr_array_remove (clients, client) && !clients->len) {
+        g_hash_table_remove (routes, &key);
+        return TRUE;
+    }
+    return FALSE;
+}
 
-        client = l->data;
-        if (!client->mbim_event_entry_array)
-            continue;
+static gboolean
+service_is_standard (const MbimUuid *service_id)
+{
+    MbimService id;
 
-        /* Add per-client list */
-        if (client->device == device)
-            updated = _mbim_proxy_helper_service_subscribe_list_merge (updated, updated_size,
-                                                                       client->mbim_event_entry_array, client->mbim_event_entry_array_size,
-                                                                       &updated_size);
-    }
+    id = mbim_uuid_to_service (service_id);
+    return (id >= MBIM_SERVICE_BASIC_CONNECT && id <= MBIM_SERVICE_DSS);
+}
 
-    /* If lists are equal, ignore re-setting them up */
-    if (_mbim_proxy_helper_service_subscribe_list_cmp (
-            (const MbimEventEntry *const *)updated, updated_size,
-            (const MbimEventEntry *const *)ctx->mbim_event_entry_array, ctx->mbim_event_entry_array_size)) {
-        g_debug ("[%s] merged service subscribe list not updated", mbim_device_get_path (device));
-        return NULL;
-    }
+/* The combined subscribe list always has the standard list for the standard
+ * services, so only routes of other services may change it, and routes of
+ * specific CIDs don't change it while the whole service is subscribed. */
+static void
+device_route_changed (DeviceContext  *ctx,
+                      const MbimUuid *service_id,
+                      guint32         cid)
+{
+    RouteKey key;
 
-    /* Lists are different, update stored one */
-    g_clear_pointer (&ctx->mbim_event_entry_array, mbim_event_entry_array_free);
-    ctx->mbim_event_entry_array = g_steal_pointer (&updated);
-    ctx->mbim_event_entry_array_size = updated_size;
+    if (ctx->mbim_event_entry_array_outdated || service_is_standard (service_id))
+        return;
 
-    if (mbim_utils_get_traces_enabled ()) {
-        g_debug ("[%s] merged service subscribe list built", mbim_device_get_path (device));
-        _mbim_proxy_helper_service_subscribe_list_debug ((const MbimEventEntry * const *)ctx->mbim_event_entry_array,
-                                                         ctx->mbim_event_entry_array_size);
+    if (cid != 0) {
+        route_key_init (&key, service_id, 0);
+        if (g_hash_table_contains (ctx->routes, &key))
+            return;
     }
 
-    *out_size = ctx->mbim_event_entry_array_size;
-    return ctx->mbim_event_entry_array;
+    ctx->mbim_event_entry_array_outdated = TRUE;
 }
 
+static DeviceContext *device_context_get (MbimDevice *device);
+
 static void
-reset_client_service_subscribe_lists (MbimProxy  *self,
-                                      MbimDevice *device)
+device_update_client_routes (MbimDevice *device,
+                             Client     *client,
+                             gboolean    add)
 {
     DeviceContext *ctx;
-    GList         *l;
+    gsize          i;
 
-    g_debug ("[%s] reseting client service subscribe lists...", mbim_device_get_path (device));
     ctx = device_context_get (device);
-    g_assert (ctx);
 
-    /* make sure that all clients of this device don't track any event registered */
-    for (l = self->priv->clients; l; l = g_list_next (l)) {
-        Client *client;
+    for (i = 0; i < client->mbim_event_entry_array_size; i++) {
+        const MbimEventEntry *entry;
+        gsize                 j;
 
-        client = l->data;
-        if (!client->mbim_event_entry_array)
+        entry = client->mbim_event_entry_array[i];
+
+        /* Only the first entry of each service applies */
+        for (j = 0; j < i; j++) {
+            if (mbim_uuid_cmp (&client->mbim_event_entry_array[j]->device_service_id, &entry->device_service_id))
+                break;
+        }
+        if (j < i)
             continue;
 
-        if (client->device == device) {
-            g_clear_pointer (&client->mbim_event_entry_array, mbim_event_entry_array_free);
-            client->mbim_event_entry_array = _mbim_proxy_helper_service_subscribe_list_new_standard (&client->mbim_event_entry_array_size);
+        /* Subscribed to all CIDs of the service? */
+        if (entry->cids_count == 0) {
+            if (routes_update (ctx->routes, &entry->device_service_id, 0, client, add))
+                device_route_changed (ctx, &entry->device_service_id, 0);
+            continue;
         }
-    }
 
-    /* And reset the device-specific merged list */
-    g_clear_pointer (&ctx->mbim_event_entry_array, mbim_event_entry_array_free);
-    ctx->mbim_event_entry_array = _mbim_proxy_helper_service_subscribe_list_new_standard (&ctx->mbim_event_entry_array_size);
+        for (j = 0; j < entry->cids_count; j++) {
+            if (routes_update (ctx->routes, &entry->device_service_id, entry->cids[j], client, add))
+                device_route_changed (ctx, &entry->device_service_id, entry->cids[j]);
+        }
+    }
 }
 
+/* Grace period
+ *
+ * Optionally, a device left without clients is kept open for a while, along
+ * with its routes and merged subscribe list, and then closed and released.
+ * A client arriving during the grace period uses the device right away,
+ * without checking it again, as it was in use until very recently. */
+
 static void
-proxy_device_error_cb (MbimDevice *device,
-                       GError     *error,
-                       MbimProxy  *self)
+device_release_close_ready (MbimDevice   *device,
+                            GAsyncResult *res)
 {
-    if (g_error_matches (error, MBIM_PROTOCOL_ERROR, MBIM_PROTOCOL_ERROR_NOT_OPENED)) {
-        g_debug ("[%s] reports as being closed...", mbim_device_get_path (device));
-        reset_client_service_subscribe_lists (self, device);
-        mbim_device_close_force (device, NULL);
-    }
+    g_autoptr(GError) error = NULL;
+
+    if (!mbim_device_close_finish (device, res, &error))
+        g_debug ("[%s] couldn't close released device: %s", mbim_device_get_path (device), error->message);
+    else
+        g_debug ("[%s] released device closed", mbim_device_get_path (device));
 }
 
-static MbimDevice *
-peek_device_for_path (MbimProxy   *self,
-                      const gchar *path)
+static gboolean
+device_grace_period_cb (MbimDevice *device)
 {
-    GList *l;
+    DeviceContext *ctx;
 
-    for (l = self->priv->devices; l; l = g_list_next (l)) {
-        /* Return if found */
-        if (g_str_equal (mbim_device_get_path ((MbimDevice *)l->data), path))
-            return (MbimDevice *)l->data;
-    }
+    ctx = device_context_get (device);
+    g_clear_pointer (&ctx->grace_source, g_source_unref);
 
-    return NULL;
+    if (!ctx->self || g_hash_table_size (ctx->clients) > 0)
+        return FALSE;
+
+    g_debug ("[%s] grace period expired, releasing device...", mbim_device_get_path (device));
+    untrack_device (ctx->self, device);
+    if (mbim_device_is_open (device))
+        mbim_device_close (device, 5, NULL, (GAsyncReadyCallback) device_release_close_ready, NULL);
+    return FALSE;
 }
 
 static void
-proxy_device_removed_cb (MbimDevice *device,
-                         MbimProxy  *self)
+device_start_grace_period (MbimDevice    *device,
+                           DeviceContext *ctx)
 {
-    untrack_device (self, device);
+    if (!ctx->self || !ctx->self->priv->device_grace_period || ctx->grace_source)
+        return;
+
+    g_debug ("[%s] no clients left, keeping device open for %u seconds",
+             mbim_device_get_path (device), ctx->self->priv->device_grace_period);
+    ctx->grace_source = g_timeout_source_new_seconds (ctx->self->priv->device_grace_period);
+    g_source_set_callback (ctx->grace_source,
+                           (GSourceFunc) device_grace_period_cb,
+                           g_object_ref (device),
+                           (GDestroyNotify) g_object_unref);
+    g_source_attach (ctx->grace_source, device_peek_context (ctx->self, device));
 }
 
 static void
-untrack_device (MbimProxy  *self,
-                MbimDevice *device)
+device_stop_grace_period (MbimDevice    *device,
+                          DeviceContext *ctx)
 {
-    GList *l;
-    GList *to_remove = NULL;
+    if (!ctx->grace_source)
+        return;
 
-    g_debug ("[%s] untracking device...", mbim_device_get_path (device));
+    g_debug ("[%s] client arrived during grace period", mbim_device_get_path (device));
+    g_source_destroy (ctx->grace_source);
+    g_clear_pointer (&ctx->grace_source, g_source_unref);
+    ctx->warm = TRUE;
+}
+
+static gboolean
+device_take_warm (MbimDevice *device)
+{
+    DeviceContext *ctx;
+    gboolean       warm;
+
+    ctx = device_context_get (device);
+    warm = ctx->warm;
+    ctx->warm = FALSE;
+    return warm;
+}
+
+static void
+device_context_publish_statistics (DeviceContext *ctx)
+{
+    g_atomic_int_set (&ctx->stats_clients, (gint) g_hash_table_size (ctx->clients));
+    g_atomic_int_set (&ctx->stats_in_flight, (gint) ctx->n_in_flight);
+    g_atomic_int_set (&ctx->stats_waiting, (gint) g_queue_get_length (&ctx->waiting_clients));
+}
+
+/* Called with the proxy lock held, possibly from a thread other than the one
+ * of the device, so the context is never created here and only the published
+ * snapshot is read */
+static void
+device_peek_statistics (MbimDevice *device,
+                        guint32    *n_clients,
+                        guint32    *n_in_flight,
+                        guint32    *n_waiting)
+{
+    DeviceContext *ctx = NULL;
+
+    if (device_context_quark)
+        ctx = g_object_get_qdata (G_OBJECT (device), device_context_quark);
+
+    *n_clients = ctx ? (guint32) g_atomic_int_get (&ctx->stats_clients) : 0;
+    *n_in_flight = ctx ? (guint32) g_atomic_int_get (&ctx->stats_in_flight) : 0;
+    *n_waiting = ctx ? (guint32) g_atomic_int_get (&ctx->stats_waiting) : 0;
+}
+
+static void
+device_track_client (MbimDevice *device,
+                     Client     *client,
+                     gboolean    add)
+{
+    DeviceContext *ctx;
+
+    ctx = device_context_get (device);
+    if (add) {
+        g_hash_table_add (ctx->clients, client);
+        device_stop_grace_period (device, ctx);
+    } else {
+        g_hash_table_remove (ctx->clients, client);
+        if (g_hash_table_size (ctx->clients) == 0)
+            device_start_grace_period (device, ctx);
+    }
+    device_context_publish_statistics (ctx);
+
+    device_update_client_routes (device, client, add);
+}
+
+/* Indication rings
+ *
+ * Clients connected through the seqpacket socket may request the indications
+ * of their device through a ring in shared memory instead of through the
+ * socket. Each indication is then written once in the ring of the device,
+ * whatever the number of clients reading it, and the clients are just woken up
+ * through their own eventfd. Indications not fitting in the ring are still
+ * sent through the socket. As the ring is shared, every indication of the
+ * device is published in it, and each client filters them against its own
+ * subscribe list. */
+
+static MbimIndicationRing *
+device_peek_indication_ring (MbimDevice  *device,
+                             guint32      size,
+                             GError     **error)
+{
+    DeviceContext *ctx;
+
+    ctx = device_context_get (device);
+    if (!ctx->ring)
+        ctx->ring = _mbim_indication_ring_new (size, error);
+    return ctx->ring;
+}
+
+static void
+device_track_ring_client (MbimDevice *device,
+                          Client     *client,
+                          gboolean    add)
+{
+    DeviceContext *ctx;
+
+    ctx = device_context_get (device);
+    if (add)
+        g_ptr_array_add (ctx->ring_clients, client);
+    else
+        g_ptr_array_remove_fast (ctx->ring_clients, client);
+}
+
+static gboolean
+device_publish_indication (DeviceContext *ctx,
+                           MbimMessage   *message)
+{
+    const guint8 *raw;
+    guint32       raw_length;
+    guint64       value = 1;
+    guint         i;
+
+    if (!ctx->ring || !ctx->ring_clients->len)
+        return FALSE;
+
+    raw = mbim_message_get_raw (message, &raw_length, NULL);
+    if (!raw || !_mbim_indication_ring_publish (ctx->ring, raw, raw_length))
+        return FALSE;
+
+    for (i = 0; i < ctx->ring_clients->len; i++) {
+        Client *client;
+
+        client = g_ptr_array_index (ctx->ring_clients, i);
+        if (write (client->ring_eventfd, &value, sizeof (value)) < 0 && errno != EAGAIN)
+            g_warning ("[client %lu] couldn't signal indication ring: %s", client->id, g_strerror (errno));
+    }
+    return TRUE;
+}
+
+/* Indication replay
+ *
+ * The last indication of each state CID is kept, as it reflects the current
+ * state of the device for that CID, e.g. registration or signal. The clients
+ * that ask for it get those indications right away when subscribing, instead
+ * of having to query the device for the same information. Indications that
+ * report events instead of state (SMS, USSD, STK, DSS, vendor services...)
+ * are never kept, as replaying them would report the same event twice. */
+
+static gboolean
+indication_is_state (const MbimUuid *service_id,
+                     guint32         cid)
+{
+    MbimService service;
+
+    service = mbim_uuid_to_service (service_id);
+
+    if (service == MBIM_SERVICE_BASIC_CONNECT) {
+        switch (cid) {
+        case MBIM_CID_BASIC_CONNECT_SUBSCRIBER_READY_STATUS:
+        case MBIM_CID_BASIC_CONNECT_RADIO_STATE:
+        case MBIM_CID_BASIC_CONNECT_REGISTER_STATE:
+        case MBIM_CID_BASIC_CONNECT_PACKET_SERVICE:
+        case MBIM_CID_BASIC_CONNECT_SIGNAL_STATE:
+        case MBIM_CID_BASIC_CONNECT_CONNECT:
+        case MBIM_CID_BASIC_CONNECT_PROVISIONED_CONTEXTS:
+        case MBIM_CID_BASIC_CONNECT_IP_CONFIGURATION:
+        case MBIM_CID_BASIC_CONNECT_EMERGENCY_MODE:
+            return TRUE;
+        default:
+            return FALSE;
+        }
+    }
+
+    if (service == MBIM_SERVICE_MS_BASIC_CONNECT_EXTENSIONS) {
+        switch (cid) {
+        case MBIM_CID_MS_BASIC_CONNECT_EXTENSIONS_PROVISIONED_CONTEXTS:
+        case MBIM_CID_MS_BASIC_CONNECT_EXTENSIONS_LTE_ATTACH_INFO:
+        case MBIM_CID_MS_BASIC_CONNECT_EXTENSIONS_SLOT_INFO_STATUS:
+            return TRUE;
+        default:
+            return FALSE;
+        }
+    }
+
+    return FALSE;
+}
+
+static void
+device_cache_indication (DeviceContext  *ctx,
+                         const MbimUuid *service_id,
+                         MbimMessage    *message)
+{
+    RouteKey *key;
+
+    if (!indication_is_state (service_id, mbim_message_indicate_status_get_cid (message)))
+        return;
+
+    key = g_new (RouteKey, 1);
+    route_key_init (key, service_id, mbim_message_indicate_status_get_cid (message));
+    g_hash_table_replace (ctx->last_indications, key, mbim_message_ref (message));
+}
+
+static void
+device_replay_indications (MbimDevice                   *device,
+                           Client                       *client,
+                           const MbimEventEntry * const *previous,
+                           gsize                         previous_size)
+{
+    DeviceContext        *ctx;
+    GHashTableIter        iter;
+    RouteKey             *key;
+    MbimMessage          *message;
+    g_autoptr(GPtrArray)  replay = NULL;
+    guint                 i;
+
+    ctx = device_context_get (device);
+    replay = g_ptr_array_new_with_free_func ((GDestroyNotify) mbim_message_unref);
+
+    /* Only the CIDs the client was not already subscribed to */
+    g_hash_table_iter_init (&iter, ctx->last_indications);
+    while (g_hash_table_iter_next (&iter, (gpointer *)&key, (gpointer *)&message)) {
+        if (!_mbim_proxy_helper_service_subscribe_list_contains ((const MbimEventEntry * const *)client->mbim_event_entry_array,
+                                                                 client->mbim_event_entry_array_size,
+                                                                 &key->service_id, key->cid))
+            continue;
+        if (previous && _mbim_proxy_helper_service_subscribe_list_contains (previous, previous_size,
+                                                                            &key->service_id, key->cid))
+            continue;
+        g_ptr_array_add (replay, mbim_message_ref (message));
+    }
+
+    if (replay->len > 0)
+        g_debug ("[client %lu] replaying %u indications", client->id, replay->len);
+
+    /* Forwarding may end up untracking the client */
+    for (i = 0; i < replay->len && client->connection; i++)
+        forward_indication (client, g_ptr_array_index (replay, i));
+}
+
+static void
+forward_indication_to_route (DeviceContext  *ctx,
+                             const MbimUuid *service_id,
+                             guint32         cid,
+                             MbimMessage    *message,
+                             gboolean        published)
+{
+    RouteKey             key;
+    GPtrArray           *clients;
+    g_autoptr(GPtrArray) targets = NULL;
+    guint                i;
+
+    route_key_init (&key, service_id, cid);
+    clients = g_hash_table_lookup (ctx->routes, &key);
+    if (!clients)
+        return;
+
+    /* Forwarding may end up untracking clients, which updates the routes */
+    targets = g_ptr_array_new_full (clients->len, (GDestroyNotify) client_unref);
+    for (i = 0; i < clients->len; i++) {
+        Client *client;
+
+        /* Already got it through the ring */
+        client = g_ptr_array_index (clients, i);
+        if (published && client->ring_eventfd >= 0)
+            continue;
+        g_ptr_array_add (targets, client_ref (client));
+    }
+
+    for (i = 0; i < targets->len; i++)
+        forward_indication (g_ptr_array_index (targets, i), message);
+}
+
+static void
+proxy_device_indication_cb (MbimDevice  *device,
+                            MbimMessage *message,
+                            MbimProxy   *self)
+{
+    DeviceContext  *ctx;
+    const MbimUuid *service_id;
+    gboolean        published;
+
+    ctx = device_context_get (device);
+    service_id = mbim_message_indicate_status_get_service_id (message);
+
+    device_cache_indication (ctx, service_id, message);
+    published = device_publish_indication (ctx, message);
+    if (published)
+        stats_update (self, 0, ctx->ring_clients->len, 0);
+
+    /* Clients subscribed to all CIDs of the service, and then clients
+     * subscribed to the specific CID */
+    forward_indication_to_route (ctx, service_id, 0, message, published);
+    forward_indication_to_route (ctx, service_id, mbim_message_indicate_status_get_cid (message), message, published);
+}
+
+static DeviceContext *
+device_context_get (MbimDevice *device)
+{
+    DeviceContext *ctx;
+
+    if (G_UNLIKELY (!device_context_quark))
+        device_context_quark = g_quark_from_static_string (DEVICE_CONTEXT_TAG);
+
+    ctx = g_object_get_qdata (G_OBJECT (device), device_context_quark);
+    if (!ctx) {
+        ctx = g_slice_new0 (DeviceContext);
+        g_queue_init (&ctx->waiting_clients);
+        ctx->clients = g_hash_table_new (g_direct_hash, g_direct_equal);
+        ctx->ring_clients = g_ptr_array_new ();
+        ctx->routes = g_hash_table_new_full (route_key_hash,
+                                             route_key_equal,
+                                             g_free,
+                                             (GDestroyNotify) g_ptr_array_unref);
+        ctx->last_indications = g_hash_table_new_full (route_key_hash,
+                                                       route_key_equal,
+                                                       g_free,
+                                                       (GDestroyNotify) mbim_message_unref);
+        ctx->mbim_event_entry_array = _mbim_proxy_helper_service_subscribe_list_new_standard (&ctx->mbim_event_entry_array_size);
+
+        g_debug ("[%s] initial device subscribe list...", mbim_device_get_path (device));
+        _mbim_proxy_helper_service_subscribe_list_debug ((const MbimEventEntry * const *)ctx->mbim_event_entry_array, ctx->mbim_event_entry_array_size);
+
+        g_object_set_qdata_full (G_OBJECT (device), device_context_quark, ctx, (GDestroyNotify)device_context_free);
+    }
+
+    return ctx;
+}
+
+/* Command scheduling
+ *
+ * Commands are sent to each device in round-robin order across its clients,
+ * one command of each client at a time, so that a client flooding the proxy
+ * doesn't starve the other clients of the same device. The commands of each
+ * client wait in its own queue whenever the device already has too many
+ * commands in flight, or the client is over its own in-flight or rate limits. */
+
+static void device_schedule_commands (DeviceContext *ctx);
+
+static gboolean
+device_schedule_timeout_cb (DeviceContext *ctx)
+{
+    g_clear_pointer (&ctx->schedule_timeout_source, g_source_unref);
+    device_schedule_commands (ctx);
+    return FALSE;
+}
+
+/* Token bucket refilled at the configured rate, allowing bursts of up to one
+ * second worth of commands */
+static gboolean
+client_rate_check (Client *client,
+                   gint64  now,
+                   gint64 *wait_us)
+{
+    guint rate;
+
+    rate = client->self->priv->client_max_rate;
+    if (!rate)
+        return TRUE;
+
+    if (!client->tokens_updated)
+        client->tokens = rate;
+    else
+        client->tokens = MIN ((gdouble) rate,
+                              client->tokens + (gdouble) (now - client->tokens_updated) * rate / G_USEC_PER_SEC);
+    client->tokens_updated = now;
+
+    if (client->tokens >= 1.0)
+        return TRUE;
+
+    *wait_us = (gint64) ((1.0 - client->tokens) * G_USEC_PER_SEC / rate) + 1;
+    return FALSE;
+}
+
+static void
+device_schedule_commands (DeviceContext *ctx)
+{
+    MbimProxyPrivate *priv;
+    guint             n_skipped = 0;
+    gint64            now;
+    gint64            wait_us = G_MAXINT64;
+
+    if (!ctx->self)
+        return;
+
+    priv = ctx->self->priv;
+    now = g_get_monotonic_time ();
+
+    while (n_skipped < g_queue_get_length (&ctx->waiting_clients) &&
+           (!priv->device_max_in_flight || ctx->n_in_flight < priv->device_max_in_flight)) {
+        Client  *client;
+        Request *request;
+        gint64   client_wait_us = 0;
+
+        client = g_queue_pop_head (&ctx->waiting_clients);
+
+        /* Clients over their in-flight limit are scheduled again when one of
+         * their commands completes */
+        if (priv->client_max_in_flight && client->n_in_flight >= priv->client_max_in_flight) {
+            g_queue_push_tail (&ctx->waiting_clients, client);
+            n_skipped++;
+            continue;
+        }
+
+        if (!client_rate_check (client, now, &client_wait_us)) {
+            g_queue_push_tail (&ctx->waiting_clients, client);
+            wait_us = MIN (wait_us, client_wait_us);
+            n_skipped++;
+            continue;
+        }
+
+        request = g_queue_pop_head (&client->pending_requests);
+        request->scheduled = TRUE;
+        client->n_in_flight++;
+        if (priv->client_max_rate)
+            client->tokens -= 1.0;
+        ctx->n_in_flight++;
+        n_skipped = 0;
+
+        client_publish_statistics (client);
+
+        /* Back to the end of the line if it has more commands */
+        if (!g_queue_is_empty (&client->pending_requests))
+            g_queue_push_tail (&ctx->waiting_clients, client);
+        else
+            client_unref (client);
+
+        request_dispatch (request);
+    }
+    device_context_publish_statistics (ctx);
+
+    /* Wait for the first rate limited client to be allowed again */
+    if (wait_us != G_MAXINT64 && !ctx->schedule_timeout_source) {
+        ctx->schedule_timeout_source = g_timeout_source_new ((guint) MAX (1, wait_us / 1000));
+        g_source_set_callback (ctx->schedule_timeout_source,
+                               (GSourceFunc) device_schedule_timeout_cb,
+                               ctx,
+                               NULL);
+        g_source_attach (ctx->schedule_timeout_source, g_main_context_get_thread_default ());
+    }
+}
+
+static void
+device_schedule_command (Request *request)
+{
+    DeviceContext *ctx;
+    Client        *client;
+
+    client = request->client;
+    ctx = device_context_get (client->device);
+
+    /* Device no longer tracked, nothing to schedule against */
+    if (!ctx->self) {
+        request_dispatch (request);
+        return;
+    }
+
+    if (g_queue_is_empty (&client->pending_requests))
+        g_queue_push_tail (&ctx->waiting_clients, client_ref (client));
+    g_queue_push_tail (&client->pending_requests, request);
+    client_publish_statistics (client);
+
+    device_schedule_commands (ctx);
+}
+
+static void
+device_command_finished (MbimDevice *device,
+                         Request    *request)
+{
+    DeviceContext *ctx;
+
+    ctx = device_context_get (device);
+
+    request->scheduled = FALSE;
+    request->client->n_in_flight--;
+    ctx->n_in_flight--;
+    client_publish_statistics (request->client);
+
+    /* No-op if the device was untracked while the command was in flight */
+    device_schedule_commands (ctx);
+}
+
+static void
+device_drop_client_commands (MbimDevice *device,
+                             Client     *client)
+{
+    DeviceContext *ctx;
+    Request       *request;
+
+    if (g_queue_is_empty (&client->pending_requests))
+        return;
+
+    ctx = device_context_get (device);
+    g_debug ("[client %lu] dropping %u commands not yet sent to the device",
+             client->id, g_queue_get_length (&client->pending_requests));
+
+    g_queue_remove (&ctx->waiting_clients, client);
+    while ((request = g_queue_pop_head (&client->pending_requests)) != NULL)
+        request_complete_and_free (request);
+    client_publish_statistics (client);
+    device_context_publish_statistics (ctx);
+    client_unref (client);
+}
+
+static void
+device_context_unset_proxy (MbimDevice *device)
+{
+    DeviceContext *ctx;
+
+    ctx = device_context_get (device);
+    ctx->self = NULL;
+    ctx->warm = FALSE;
+    if (ctx->schedule_timeout_source) {
+        g_source_destroy (ctx->schedule_timeout_source);
+        g_clear_pointer (&ctx->schedule_timeout_source, g_source_unref);
+    }
+    if (ctx->grace_source) {
+        g_source_destroy (ctx->grace_source);
+        g_clear_pointer (&ctx->grace_source, g_source_unref);
+    }
+}
+
+static MbimEventEntry **
+merge_client_service_subscribe_lists (MbimProxy  *self,
+                                      MbimDevice *device,
+                                      gsize      *out_size)
+{
+    g_autoptr(MbimEventEntryArray)  updated = NULL;
+    gsize                           updated_size = 0;
+    DeviceContext                  *ctx;
+    GHashTableIter                  iter;
+    RouteKey                       *key;
+
+    ctx = device_context_get (device);
+    g_assert (ctx);
+
+    g_assert (out_size != NULL);
+
+    if (!ctx->mbim_event_entry_array_outdated) {
+        g_debug ("[%s] merged service subscribe list not updated", mbim_device_get_path (device));
+        return NULL;
+    }
+
+    g_debug ("[%s] merging client service subscribe lists...", mbim_device_get_path (device));
+
+    /* Init default list, and add the routes of all the other services */
+    updated = _mbim_proxy_helper_service_subscribe_list_new_standard (&updated_size);
+
+    g_hash_table_iter_init (&iter, ctx->routes);
+    while (g_hash_table_iter_next (&iter, (gpointer *)&key, NULL)) {
+        MbimEventEntry  entry;
+        MbimEventEntry *merge[] = { &entry, NULL };
+
+        if (service_is_standard (&key->service_id))
+            continue;
+
+        memcpy (&entry.device_service_id, &key->service_id, sizeof (MbimUuid));
+        entry.cids_count = (key->cid != 0) ? 1 : 0;
+        entry.cids = (key->cid != 0) ? &key->cid : NULL;
+        updated = _mbim_proxy_helper_service_subscribe_list_merge (updated, updated_size,
+                                                                   merge, 1,
+                                                                   &updated_size);
+    }
+
+    /* Update stored one */
+    g_clear_pointer (&ctx->mbim_event_entry_array, mbim_event_entry_array_free);
+    ctx->mbim_event_entry_array = g_steal_pointer (&updated);
+    ctx->mbim_event_entry_array_size = updated_size;
+    ctx->mbim_event_entry_array_outdated = FALSE;
+
+    if (mbim_utils_get_traces_enabled ()) {
+        g_debug ("[%s] merged service subscribe list built", mbim_device_get_path (device));
+        _mbim_proxy_helper_service_subscribe_list_debug ((const MbimEventEntry * const *)ctx->mbim_event_entry_array,
+                                                         ctx->mbim_event_entry_array_size);
+    }
+
+    *out_size = ctx->mbim_event_entry_array_size;
+    return ctx->mbim_event_entry_array;
+}
+
+static void
+reset_client_service_subscribe_lists (MbimProxy  *self,
+                                      MbimDevice *device)
+{
+    DeviceContext  *ctx;
+    GHashTableIter  iter;
+    Client         *client;
+
+    g_debug ("[%s] reseting client service subscribe lists...", mbim_device_get_path (device));
+    ctx = device_context_get (device);
+    g_assert (ctx);
+
+    /* make sure that all clients of this device don't track any event registered */
+    g_hash_table_iter_init (&iter, ctx->clients);
+    while (g_hash_table_iter_next (&iter, (gpointer *)&client, NULL)) {
+        MbimEventEntry **mbim_event_entry_array;
+        gsize            mbim_event_entry_array_size;
+
+        if (!client->mbim_event_entry_array)
+            continue;
+
+        mbim_event_entry_array = _mbim_proxy_helper_service_subscribe_list_new_standard (&mbim_event_entry_array_size);
+        client_set_event_entry_array (client, mbim_event_entry_array, mbim_event_entry_array_size);
+    }
+
+    /* The device state is unknown from now on */
+    g_hash_table_remove_all (ctx->last_indications);
+
+    /* And reset the device-specific merged list, which now matches the
+     * routes again */
+    g_clear_pointer (&ctx->mbim_event_entry_array, mbim_event_entry_array_free);
+    ctx->mbim_event_entry_array = _mbim_proxy_helper_service_subscribe_list_new_standard (&ctx->mbim_event_entry_array_size);
+    ctx->mbim_event_entry_array_outdated = FALSE;
+}
+
+static void
+proxy_device_error_cb (MbimDevice *device,
+                       GError     *error,
+                       MbimProxy  *self)
+{
+    if (g_error_matches (error, MBIM_PROTOCOL_ERROR, MBIM_PROTOCOL_ERROR_NOT_OPENED)) {
+        g_debug ("[%s] reports as being closed...", mbim_device_get_path (device));
+        reset_client_service_subscribe_lists (self, device);
+        mbim_device_close_force (device, NULL);
+    }
+}
+
+static MbimDevice *
+lookup_device_for_path (MbimProxy   *self,
+                        const gchar *path)
+{
+    MbimDevice *device;
+
+    g_mutex_lock (&self->priv->lock);
+    device = g_hash_table_lookup (self->priv->devices, path);
+    if (device)
+        g_object_ref (device);
+    g_mutex_unlock (&self->priv->lock);
+    return device;
+}
+
+static GMainContext *
+device_peek_context (MbimProxy  *self,
+                     MbimDevice *device)
+{
+    DeviceContext *ctx;
+    GMainContext  *context;
+
+    ctx = device_context_get (device);
+
+    g_mutex_lock (&self->priv->lock);
+    context = ctx->worker ? ctx->worker->context : self->priv->context;
+    g_mutex_unlock (&self->priv->lock);
+    return context;
+}
+
+static void
+proxy_device_removed_cb (MbimDevice *device,
+                         MbimProxy  *self)
+{
+    untrack_device (self, device);
+}
+
+static void
+untrack_device (MbimProxy  *self,
+                MbimDevice *device)
+{
+    DeviceContext  *ctx;
+    DeviceWorker   *worker;
+    GHashTableIter  iter;
+    Client         *client;
+    GList          *l;
+    GList          *to_remove = NULL;
+    gboolean        tracked;
 
-    if (!g_list_find (self->priv->devices, device))
+    g_debug ("[%s] untracking device...", mbim_device_get_path (device));
+
+    g_mutex_lock (&self->priv->lock);
+    tracked = (g_hash_table_lookup (self->priv->devices, mbim_device_get_path (device)) == device);
+    g_mutex_unlock (&self->priv->lock);
+    if (!tracked)
         return;
 
     /* Disconnect right away */
     g_signal_handlers_disconnect_by_func (device, proxy_device_error_cb, self);
     g_signal_handlers_disconnect_by_func (device, proxy_device_removed_cb, self);
+    g_signal_handlers_disconnect_by_func (device, proxy_device_indication_cb, self);
 
     /* If pending openings ongoing, complete them with error */
     cancel_opening_device (self, device);
 
+    /* Stop scheduling commands */
+    device_context_unset_proxy (device);
+
     /* Lookup all clients with this device */
-    for (l = self->priv->clients; l; l = g_list_next (l)) {
-        if (((Client *)(l->data))->device == device)
-            to_remove = g_list_append (to_remove, l->data);
-    }
+    ctx = device_context_get (device);
+    g_hash_table_iter_init (&iter, ctx->clients);
+    while (g_hash_table_iter_next (&iter, (gpointer *)&client, NULL))
+        to_remove = g_list_prepend (to_remove, client_ref (client));
 
     /* Remove all these clients */
     for (l = to_remove; l; l = g_list_next (l))
         untrack_client (self, (Client *)(l->data));
-    g_list_free (to_remove);
+    g_list_free_full (to_remove, (GDestroyNotify) client_unref);
 
     /* And finally, remove the device */
-    self->priv->devices = g_list_remove (self->priv->devices, device);
+    g_mutex_lock (&self->priv->lock);
+    g_hash_table_steal (self->priv->devices, mbim_device_get_path (device));
+    worker = g_steal_pointer (&ctx->worker);
+    if (worker)
+        g_ptr_array_remove_fast (self->priv->workers, worker);
+    g_mutex_unlock (&self->priv->lock);
+
+    /* The thread of the device is stopped from the main context, as this may
+     * be running in that same thread */
+    if (worker) {
+        GSource *source;
+
+        source = g_idle_source_new ();
+        g_source_set_callback (source, (GSourceFunc) device_worker_free_cb, worker, NULL);
+        g_source_attach (source, self->priv->context);
+        g_source_unref (source);
+    }
+
     g_object_unref (device);
-    g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_N_DEVICES]);
+    proxy_notify (self, properties[PROP_N_DEVICES]);
 }
 
 static void
 track_device (MbimProxy *self,
               MbimDevice *device)
 {
+    DeviceContext *ctx;
+    DeviceWorker  *worker = NULL;
+
+    ctx = device_context_get (device);
+    ctx->self = self;
+
+    if (self->priv->device_threads) {
+        g_autoptr(GError) error = NULL;
+
+        worker = device_worker_new (device, &error);
+        if (!worker)
+            g_warning ("[%s] couldn't create device thread, using the main one: %s",
+                       mbim_device_get_path (device), error->message);
+    }
+
     g_signal_connect (device,
                       MBIM_DEVICE_SIGNAL_REMOVED,
                       G_CALLBACK (proxy_device_removed_cb),
@@ -1481,22 +3794,817 @@ track_device (MbimProxy *self,
                       G_CALLBACK (proxy_device_error_cb),
                       self);
 
-    self->priv->devices = g_list_append (self->priv->devices, g_object_ref (device));
-    g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_N_DEVICES]);
+    g_signal_connect (device,
+                      MBIM_DEVICE_SIGNAL_INDICATE_STATUS,
+                      G_CALLBACK (proxy_device_indication_cb),
+                      self);
+
+    g_mutex_lock (&self->priv->lock);
+    g_hash_table_insert (self->priv->devices, (gpointer) mbim_device_get_path (device), g_object_ref (device));
+    if (worker) {
+        ctx->worker = worker;
+        g_ptr_array_add (self->priv->workers, worker);
+    }
+    g_mutex_unlock (&self->priv->lock);
+    proxy_notify (self, properties[PROP_N_DEVICES]);
+}
+
+/*****************************************************************************/
+/* Handoff
+ *
+ * A running proxy may hand over its listening sockets, its open devices and
+ * its idle clients to a new proxy process, e.g. when upgrading it, so that
+ * neither the sessions of the devices nor the connections of the clients are
+ * lost. The state is sent over a seqpacket socket as a sequence of records,
+ * one per datagram, each one a GVariant with the kind of the record and its
+ * properties, along with the descriptor it refers to, if any:
+ *
+ *   start:    version
+ *   listener: (descriptor of the listening socket)
+ *   device:   path, transaction-id (descriptor of the device file)
+ *   client:   id, device, timeout, indication-replay, subscribe-list, buffer
+ *             (descriptor of the client socket)
+ *   end:      n-devices, n-clients
+ *
+ * The merged subscribe list of each device is rebuilt from the lists of the
+ * clients handed over along with it. */
+
+#define HANDOFF_VERSION      1
+#define HANDOFF_RECORD_TYPE  "(sa{sv})"
+#define HANDOFF_MAX_RECORD   (64 * 1024)
+#define HANDOFF_TIMEOUT_SECS 10
+
+static gboolean
+handoff_send_record (GSocket      *socket,
+                     const gchar  *kind,
+                     GVariant     *record_properties,
+                     gint          fd,
+                     GError      **error)
+{
+    g_autoptr(GVariant)     record = NULL;
+    g_autoptr(GUnixFDList)  fds = NULL;
+    GSocketControlMessage  *scm = NULL;
+    GOutputVector           vector;
+    gssize                  written;
+
+    record = g_variant_ref_sink (g_variant_new ("(s@a{sv})", kind, record_properties));
+    vector.buffer = g_variant_get_data (record);
+    vector.size = g_variant_get_size (record);
+    if (vector.size > HANDOFF_MAX_RECORD) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                     "Couldn't send %s record: too big", kind);
+        return FALSE;
+    }
+
+    /* The list keeps its own copy */
+    if (fd >= 0) {
+        fds = g_unix_fd_list_new ();
+        if (g_unix_fd_list_append (fds, fd, error) < 0)
+            return FALSE;
+        scm = g_unix_fd_message_new_with_fd_list (fds);
+    }
+
+    written = g_socket_send_message (socket,
+                                     NULL,
+                                     &vector,
+                                     1,
+                                     scm ? &scm : NULL,
+                                     scm ? 1 : 0,
+                                     G_SOCKET_MSG_NONE,
+                                     NULL,
+                                     error);
+    if (scm)
+        g_object_unref (scm);
+
+    if (written < 0) {
+        g_prefix_error (error, "Couldn't send %s record: ", kind);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static GVariant *
+handoff_receive_record (GSocket  *socket,
+                        gint     *out_fd,
+                        GError  **error)
+{
+    gchar                  *buffer;
+    GInputVector            vector;
+    GSocketControlMessage **messages = NULL;
+    gint                    n_messages = 0;
+    gint                    flags = 0;
+    gssize                  received;
+    gint                    i;
+
+    *out_fd = -1;
+
+    buffer = g_malloc (HANDOFF_MAX_RECORD);
+    vector.buffer = buffer;
+    vector.size = HANDOFF_MAX_RECORD;
+    received = g_socket_receive_message (socket,
+                                         NULL,
+                                         &vector,
+                                         1,
+                                         &messages,
+                                         &n_messages,
+                                         &flags,
+                                         NULL,
+                                         error);
+
+    /* Keep the first descriptor received, and never leak any other one */
+    for (i = 0; i < n_messages; i++) {
+        if (G_IS_UNIX_FD_MESSAGE (messages[i])) {
+            g_autofree gint *fds = NULL;
+            gint             n_fds = 0;
+            gint             j;
+
+            fds = g_unix_fd_message_steal_fds (G_UNIX_FD_MESSAGE (messages[i]), &n_fds);
+            for (j = 0; j < n_fds; j++) {
+                if (*out_fd < 0)
+                    *out_fd = fds[j];
+                else
+                    close (fds[j]);
+            }
+        }
+        g_object_unref (messages[i]);
+    }
+    g_free (messages);
+
+    if (received <= 0 || (flags & MSG_TRUNC)) {
+        if (received == 0)
+            g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                         "Handoff connection closed");
+        else if (received > 0)
+            g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                         "Handoff record too big");
+        else
+            g_prefix_error (error, "Couldn't receive handoff record: ");
+        if (*out_fd >= 0) {
+            close (*out_fd);
+            *out_fd = -1;
+        }
+        g_free (buffer);
+        return NULL;
+    }
+
+    return g_variant_ref_sink (g_variant_new_from_data (G_VARIANT_TYPE (HANDOFF_RECORD_TYPE),
+                                                        buffer,
+                                                        (gsize) received,
+                                                        FALSE,
+                                                        g_free,
+                                                        buffer));
+}
+
+/* Only a proxy of the same user may hand over its state */
+static gboolean
+handoff_check_peer (GSocket  *socket,
+                    GError  **error)
+{
+    g_autoptr(GCredentials) credentials = NULL;
+    uid_t                   uid;
+
+    credentials = g_socket_get_credentials (socket, error);
+    if (!credentials) {
+        g_prefix_error (error, "Handoff not allowed: error getting socket credentials: ");
+        return FALSE;
+    }
+
+    uid = g_credentials_get_unix_user (credentials, error);
+    if (uid == (uid_t) -1) {
+        g_prefix_error (error, "Handoff not allowed: error getting unix user id: ");
+        return FALSE;
+    }
+
+    if (uid != getuid ()) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                     "Handoff not allowed: different user");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Descriptors of listeners and clients must be sockets, and those of devices
+ * character devices; the descriptor is closed if it's not the expected one */
+static gboolean
+handoff_check_fd (gint          fd,
+                  mode_t        type,
+                  const gchar  *kind,
+                  GError      **error)
+{
+    struct stat st;
+
+    if (fstat (fd, &st) < 0 || (st.st_mode & S_IFMT) != type) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_INVALID_MESSAGE,
+                     "Invalid %s record: unexpected descriptor type", kind);
+        close (fd);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Clients waiting for a response, with messages pending to be written, or
+ * using state that can't be handed over, are just disconnected, and will
+ * connect to the new proxy on their own */
+static gboolean
+handoff_client_is_idle (Client *client)
+{
+    return (client->connection &&
+            !client->config_ongoing &&
+            !client->handover &&
+            client->ring_eventfd < 0 &&
+            g_queue_is_empty (&client->requests) &&
+            g_queue_is_empty (&client->output_queue) &&
+            g_hash_table_size (client->fragment_collectors) == 0 &&
+            (!client->buffer || client->buffer->len <= BUFFER_SIZE));
+}
+
+static GVariant *
+handoff_client_properties (Client *client)
+{
+    GVariantBuilder builder;
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add (&builder, "{sv}", "id", g_variant_new_uint64 (client->id));
+    if (client->device)
+        g_variant_builder_add (&builder, "{sv}", "device", g_variant_new_string (mbim_device_get_path (client->device)));
+    g_variant_builder_add (&builder, "{sv}", "timeout", g_variant_new_uint32 (client->timeout_secs));
+    g_variant_builder_add (&builder, "{sv}", "indication-replay", g_variant_new_boolean (client->replay_indications));
+    if (client->mbim_event_entry_array)
+        g_variant_builder_add (&builder, "{sv}", "subscribe-list",
+                               _mbim_proxy_helper_service_subscribe_list_to_variant ((const MbimEventEntry * const *)client->mbim_event_entry_array,
+                                                                                     client->mbim_event_entry_array_size));
+    /* Partial message received so far */
+    if (client->buffer && client->buffer->len > 0)
+        g_variant_builder_add (&builder, "{sv}", "buffer",
+                               g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE, client->buffer->data, client->buffer->len, 1));
+    return g_variant_builder_end (&builder);
+}
+
+/* Release everything without closing the devices, as the descriptors are now
+ * owned by the new proxy as well */
+static void
+handoff_release (MbimProxy *self)
+{
+    g_autoptr(GPtrArray) devices = NULL;
+    g_autoptr(GPtrArray) clients = NULL;
+    GHashTableIter       iter;
+    gpointer             value;
+    guint                i;
+
+    devices = g_ptr_array_new_with_free_func (g_object_unref);
+    clients = g_ptr_array_new_with_free_func ((GDestroyNotify) client_unref);
+
+    g_mutex_lock (&self->priv->lock);
+    g_hash_table_iter_init (&iter, self->priv->devices);
+    while (g_hash_table_iter_next (&iter, NULL, &value))
+        g_ptr_array_add (devices, g_object_ref (value));
+    g_hash_table_iter_init (&iter, self->priv->clients);
+    while (g_hash_table_iter_next (&iter, NULL, &value))
+        g_ptr_array_add (clients, client_ref (value));
+    g_mutex_unlock (&self->priv->lock);
+
+    for (i = 0; i < devices->len; i++) {
+        MbimDevice *device;
+
+        device = g_ptr_array_index (devices, i);
+        untrack_device (self, device);
+        mbim_device_close_force (device, NULL);
+    }
+
+    for (i = 0; i < clients->len; i++)
+        untrack_client (self, g_ptr_array_index (clients, i));
+
+    g_socket_listener_close (G_SOCKET_LISTENER (self->priv->socket_service));
+    g_clear_object (&self->priv->socket_service);
+    g_ptr_array_set_size (self->priv->listening_sockets, 0);
+}
+
+gboolean
+mbim_proxy_handoff (MbimProxy  *self,
+                    GSocket    *socket,
+                    GError    **error)
+{
+    g_autoptr(GPtrArray) devices = NULL;
+    g_autoptr(GPtrArray) clients = NULL;
+    g_autoptr(GPtrArray) handed_devices = NULL;
+    GVariantBuilder      builder;
+    GHashTableIter       iter;
+    gpointer             value;
+    guint                n_clients = 0;
+    guint                i;
+    gboolean             success = FALSE;
+
+    g_return_val_if_fail (MBIM_IS_PROXY (self), FALSE);
+    g_return_val_if_fail (G_IS_SOCKET (socket), FALSE);
+
+    if (g_socket_get_family (socket) != G_SOCKET_FAMILY_UNIX ||
+        g_socket_get_socket_type (socket) != G_SOCKET_TYPE_SEQPACKET) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_INVALID_ARGS,
+                     "Invalid handoff socket: not a UNIX seqpacket socket");
+        return FALSE;
+    }
+
+    if (!self->priv->socket_service) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_WRONG_STATE,
+                     "Proxy already handed off");
+        return FALSE;
+    }
+
+    g_debug ("handing off proxy...");
+
+    /* Stop accepting clients; new connections wait in the listening sockets
+     * until the new proxy accepts them */
+    g_socket_service_stop (self->priv->socket_service);
+
+    /* Stop all device threads, so that clients and devices don't change while
+     * being handed off */
+    for (i = 0; i < self->priv->workers->len; i++)
+        device_worker_stop (g_ptr_array_index (self->priv->workers, i));
+
+    devices = g_ptr_array_new_with_free_func (g_object_unref);
+    clients = g_ptr_array_new_with_free_func ((GDestroyNotify) client_unref);
+    handed_devices = g_ptr_array_new ();
+
+    g_mutex_lock (&self->priv->lock);
+    g_hash_table_iter_init (&iter, self->priv->devices);
+    while (g_hash_table_iter_next (&iter, NULL, &value))
+        g_ptr_array_add (devices, g_object_ref (value));
+    g_hash_table_iter_init (&iter, self->priv->clients);
+    while (g_hash_table_iter_next (&iter, NULL, &value))
+        g_ptr_array_add (clients, client_ref (value));
+    g_mutex_unlock (&self->priv->lock);
+
+    g_socket_set_blocking (socket, TRUE);
+    g_socket_set_timeout (socket, HANDOFF_TIMEOUT_SECS);
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add (&builder, "{sv}", "version", g_variant_new_uint32 (HANDOFF_VERSION));
+    if (!handoff_send_record (socket, "start", g_variant_builder_end (&builder), -1, error))
+        goto out;
+
+    for (i = 0; i < self->priv->listening_sockets->len; i++) {
+        g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+        if (!handoff_send_record (socket,
+                                  "listener",
+                                  g_variant_builder_end (&builder),
+                                  g_socket_get_fd (g_ptr_array_index (self->priv->listening_sockets, i)),
+                                  error))
+            goto out;
+    }
+
+    /* Devices go first, so that their clients can be attached to them */
+    for (i = 0; i < devices->len; i++) {
+        MbimDevice *device;
+        gint        fd;
+
+        device = g_ptr_array_index (devices, i);
+        fd = _mbim_device_peek_fd (device);
+        if (fd < 0 || !mbim_device_is_open (device) || peek_opening_device_info (self, device)) {
+            g_debug ("[%s] device not open, not handed off", mbim_device_get_path (device));
+            continue;
+        }
+
+        g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+        g_variant_builder_add (&builder, "{sv}", "path", g_variant_new_string (mbim_device_get_path (device)));
+        g_variant_builder_add (&builder, "{sv}", "transaction-id", g_variant_new_uint32 (mbim_device_get_transaction_id (device)));
+        if (!handoff_send_record (socket, "device", g_variant_builder_end (&builder), fd, error))
+            goto out;
+        g_ptr_array_add (handed_devices, device);
+    }
+
+    for (i = 0; i < clients->len; i++) {
+        Client *client;
+
+        client = g_ptr_array_index (clients, i);
+        if (!handoff_client_is_idle (client) ||
+            (client->device && !g_ptr_array_find (handed_devices, client->device, NULL))) {
+            g_debug ("[client %lu] client busy, not handed off", client->id);
+            continue;
+        }
+
+        if (!handoff_send_record (socket,
+                                  "client",
+                                  handoff_client_properties (client),
+                                  g_socket_get_fd (g_socket_connection_get_socket (client->connection)),
+                                  error))
+            goto out;
+        n_clients++;
+    }
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add (&builder, "{sv}", "n-devices", g_variant_new_uint32 (handed_devices->len));
+    g_variant_builder_add (&builder, "{sv}", "n-clients", g_variant_new_uint32 (n_clients));
+    if (!handoff_send_record (socket, "end", g_variant_builder_end (&builder), -1, error))
+        goto out;
+
+    g_debug ("proxy handed off with %u devices and %u clients", handed_devices->len, n_clients);
+    success = TRUE;
+
+out:
+    handoff_release (self);
+    return success;
+}
+
+/* Devices handed off are opened again without the open message, as they are
+ * already in session, and their clients attached once ready */
+
+typedef struct {
+    MbimProxy  *self;
+    gchar      *path;
+    gint        fd;
+    guint32     transaction_id;
+    GList      *clients; /* full refs */
+    MbimDevice *device;
+} HandoffDevice;
+
+static void
+handoff_device_free (HandoffDevice *handoff)
+{
+    if (handoff->fd >= 0)
+        close (handoff->fd);
+    /* Clients not attached are disconnected */
+    g_list_free_full (handoff->clients, (GDestroyNotify) client_unref);
+    g_clear_object (&handoff->device);
+    g_object_unref (handoff->self);
+    g_free (handoff->path);
+    g_slice_free (HandoffDevice, handoff);
+}
+
+static HandoffDevice *
+handoff_device_new (MbimProxy  *self,
+                    GVariant   *record_properties,
+                    gint        fd,
+                    GError    **error)
+{
+    HandoffDevice *handoff;
+    const gchar   *path = NULL;
+
+    if (!g_variant_lookup (record_properties, "path", "&s", &path)) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_INVALID_MESSAGE,
+                     "Invalid device record: no path");
+        close (fd);
+        return NULL;
+    }
+
+    if (!handoff_check_fd (fd, S_IFCHR, "device", error))
+        return NULL;
+
+    handoff = g_slice_new0 (HandoffDevice);
+    handoff->self = g_object_ref (self);
+    handoff->path = g_strdup (path);
+    handoff->fd = fd;
+    handoff->transaction_id = 0x01;
+    g_variant_lookup (record_properties, "transaction-id", "u", &handoff->transaction_id);
+    return handoff;
+}
+
+static Client *
+handoff_client_new (MbimProxy  *self,
+                    GVariant   *record_properties,
+                    gint        fd,
+                    GError    **error)
+{
+    g_autoptr(GSocket)            socket = NULL;
+    g_autoptr(GSocketConnection)  connection = NULL;
+    g_autoptr(GVariant)           subscribe_list = NULL;
+    g_autoptr(GVariant)           buffer = NULL;
+    Client                       *client;
+    guint64                       id = 0;
+
+    if (!g_variant_lookup (record_properties, "id", "t", &id) || !id) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_INVALID_MESSAGE,
+                     "Invalid client record: no id");
+        close (fd);
+        return NULL;
+    }
+
+    if (!handoff_check_fd (fd, S_IFSOCK, "client", error))
+        return NULL;
+
+    socket = g_socket_new_from_fd (fd, error);
+    if (!socket) {
+        close (fd);
+        g_prefix_error (error, "Invalid client socket: ");
+        return NULL;
+    }
+    connection = g_socket_connection_factory_create_connection (socket);
+
+    client = client_new (self, connection, (gulong) id);
+    self->priv->last_client_id = MAX (self->priv->last_client_id, client->id);
+
+    g_variant_lookup (record_properties, "timeout", "u", &client->timeout_secs);
+    g_variant_lookup (record_properties, "indication-replay", "b", &client->replay_indications);
+
+    subscribe_list = g_variant_lookup_value (record_properties, "subscribe-list", G_VARIANT_TYPE ("a(ayau)"));
+    if (subscribe_list) {
+        MbimEventEntry **mbim_event_entry_array;
+        gsize            mbim_event_entry_array_size = 0;
+
+        mbim_event_entry_array = _mbim_proxy_helper_service_subscribe_list_from_variant (subscribe_list, &mbim_event_entry_array_size);
+        client_set_event_entry_array (client, mbim_event_entry_array, mbim_event_entry_array_size);
+    }
+
+    buffer = g_variant_lookup_value (record_properties, "buffer", G_VARIANT_TYPE_BYTESTRING);
+    if (buffer) {
+        const guint8 *data;
+        gsize         len = 0;
+
+        data = g_variant_get_fixed_array (buffer, &len, 1);
+        client->buffer = g_byte_array_sized_new (MAX (len, BUFFER_SIZE));
+        g_byte_array_append (client->buffer, data, len);
+    }
+
+    return client;
+}
+
+static void
+handoff_client_attach (MbimProxy  *self,
+                       Client     *client,
+                       MbimDevice *device)
+{
+    MbimEventEntry **mbim_event_entry_array;
+    gsize            mbim_event_entry_array_size;
+
+    /* Handled in the same context as the device from now on */
+    client->context = device_peek_context (self, device);
+
+    /* The subscribe list is set again so that the routes of the device are
+     * updated */
+    mbim_event_entry_array = g_steal_pointer (&client->mbim_event_entry_array);
+    mbim_event_entry_array_size = client->mbim_event_entry_array_size;
+    client->mbim_event_entry_array_size = 0;
+    client_set_device (client, device);
+    client_set_event_entry_array (client, mbim_event_entry_array, mbim_event_entry_array_size);
+
+    client_attach_readable_source (client);
+    track_client (self, client);
+}
+
+static void
+handoff_device_open_ready (MbimProxy     *self,
+                           GAsyncResult  *res,
+                           HandoffDevice *handoff)
+{
+    g_autoptr(GError)  error = NULL;
+    DeviceContext     *ctx;
+    GList             *l;
+    gsize              size = 0;
+
+    if (!internal_device_open_finish (self, res, &error)) {
+        g_warning ("[%s] couldn't open handed off device: %s", handoff->path, error->message);
+        handoff_device_free (handoff);
+        return;
+    }
+
+    /* From now on, the session is managed as usual */
+    g_object_set (handoff->device, MBIM_DEVICE_IN_SESSION, FALSE, NULL);
+
+    for (l = handoff->clients; l; l = g_list_next (l))
+        handoff_client_attach (self, (Client *)(l->data), handoff->device);
+
+    /* The merged subscribe list already set in the device is the one of all
+     * its clients */
+    merge_client_service_subscribe_lists (self, handoff->device, &size);
+
+    ctx = device_context_get (handoff->device);
+    if (g_hash_table_size (ctx->clients) == 0)
+        device_start_grace_period (handoff->device, ctx);
+
+    g_debug ("[%s] handed off device ready with %u clients",
+             handoff->path, g_list_length (handoff->clients));
+    handoff_device_free (handoff);
+}
+
+static gboolean
+handoff_device_open_cb (HandoffDevice *handoff)
+{
+    internal_device_open (handoff->self,
+                          handoff->device,
+                          HANDOFF_TIMEOUT_SECS,
+                          (GAsyncReadyCallback) handoff_device_open_ready,
+                          handoff);
+    return FALSE;
+}
+
+static void
+handoff_device_new_ready (GObject       *source,
+                          GAsyncResult  *res,
+                          HandoffDevice *handoff)
+{
+    g_autoptr(GError)  error = NULL;
+    MbimDevice        *existing;
+
+    handoff->device = mbim_device_new_finish (res, &error);
+    if (!handoff->device) {
+        g_warning ("[%s] couldn't create handed off device: %s", handoff->path, error->message);
+        handoff_device_free (handoff);
+        return;
+    }
+
+    /* A client may have configured the same device meanwhile; if so, the
+     * handed off descriptor is no longer needed */
+    existing = lookup_device_for_path (handoff->self, mbim_device_get_path (handoff->device));
+    if (existing) {
+        g_debug ("[%s] device already in use, handed off descriptor and clients discarded", handoff->path);
+        g_object_unref (existing);
+        handoff_device_free (handoff);
+        return;
+    }
+
+    /* Opened without sending the open message, continuing with the same
+     * transaction ids */
+    g_object_set (handoff->device,
+                  MBIM_DEVICE_IN_SESSION,     TRUE,
+                  MBIM_DEVICE_TRANSACTION_ID, handoff->transaction_id,
+                  NULL);
+    _mbim_device_adopt_fd (handoff->device, handoff->fd);
+    handoff->fd = -1;
+
+    track_device (handoff->self, handoff->device);
+    g_main_context_invoke (device_peek_context (handoff->self, handoff->device),
+                           (GSourceFunc) handoff_device_open_cb,
+                           handoff);
+}
+
+static void
+handoff_device_start (HandoffDevice *handoff)
+{
+    g_autoptr(GFile) file = NULL;
+
+    file = g_file_new_for_path (handoff->path);
+    mbim_device_new (file,
+                     NULL,
+                     (GAsyncReadyCallback) handoff_device_new_ready,
+                     handoff);
+}
+
+static HandoffDevice *
+handoff_device_lookup (GList       *devices,
+                       const gchar *path)
+{
+    GList *l;
+
+    for (l = devices; l; l = g_list_next (l)) {
+        if (g_str_equal (((HandoffDevice *)(l->data))->path, path))
+            return l->data;
+    }
+    return NULL;
+}
+
+MbimProxy *
+mbim_proxy_new_from_handoff (GSocket  *socket,
+                             GError  **error)
+{
+    g_autoptr(MbimProxy)  self = NULL;
+    g_autoptr(GArray)     listeners = NULL;
+    GList                *devices = NULL;
+    GList                *clients = NULL;
+    GList                *l;
+    gboolean              started = FALSE;
+    gboolean              finished = FALSE;
+    gboolean              success = FALSE;
+    guint                 i;
+
+    g_return_val_if_fail (G_IS_SOCKET (socket), NULL);
+
+    if (!mbim_helpers_check_user_allowed (getuid(), error))
+        return NULL;
+
+    if (!handoff_check_peer (socket, error))
+        return NULL;
+
+    self = g_object_new (MBIM_TYPE_PROXY, NULL);
+    listeners = g_array_new (FALSE, FALSE, sizeof (gint));
+
+    g_socket_set_blocking (socket, TRUE);
+    g_socket_set_timeout (socket, HANDOFF_TIMEOUT_SECS);
+
+    g_debug ("receiving handed off proxy...");
+
+    while (!finished) {
+        g_autoptr(GVariant)  record = NULL;
+        g_autoptr(GVariant)  record_properties = NULL;
+        const gchar         *kind;
+        gint                 fd = -1;
+
+        record = handoff_receive_record (socket, &fd, error);
+        if (!record)
+            goto out;
+
+        g_variant_get (record, "(&s@a{sv})", &kind, &record_properties);
+
+        if (!started) {
+            guint32 version = 0;
+
+            if (!g_str_equal (kind, "start") ||
+                !g_variant_lookup (record_properties, "version", "u", &version) ||
+                version != HANDOFF_VERSION) {
+                g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_UNSUPPORTED,
+                             "Unsupported handoff version");
+                if (fd >= 0)
+                    close (fd);
+                goto out;
+            }
+            started = TRUE;
+        } else if (g_str_equal (kind, "listener") && fd >= 0) {
+            if (!handoff_check_fd (fd, S_IFSOCK, "listener", error))
+                goto out;
+            g_array_append_val (listeners, fd);
+            fd = -1;
+        } else if (g_str_equal (kind, "device") && fd >= 0) {
+            HandoffDevice *handoff;
+
+            handoff = handoff_device_new (self, record_properties, fd, error);
+            fd = -1;
+            if (!handoff)
+                goto out;
+            devices = g_list_append (devices, handoff);
+        } else if (g_str_equal (kind, "client") && fd >= 0) {
+            HandoffDevice *handoff = NULL;
+            const gchar   *path = NULL;
+            Client        *client;
+
+            client = handoff_client_new (self, record_properties, fd, error);
+            fd = -1;
+            if (!client)
+                goto out;
+
+            /* Clients of a device wait for it to be ready */
+            if (g_variant_lookup (record_properties, "device", "&s", &path)) {
+                handoff = handoff_device_lookup (devices, path);
+                if (!handoff) {
+                    g_debug ("[client %lu] device '%s' not handed off, disconnecting", client->id, path);
+                    client_unref (client);
+                    continue;
+                }
+                handoff->clients = g_list_append (handoff->clients, client);
+            } else
+                clients = g_list_append (clients, client);
+        } else if (g_str_equal (kind, "end"))
+            finished = TRUE;
+        else
+            g_debug ("ignoring unknown handoff record '%s'", kind);
+
+        if (fd >= 0)
+            close (fd);
+    }
+
+    if (listeners->len == 0) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                     "No listening sockets handed off");
+        goto out;
+    }
+
+    if (!setup_socket_service (self, (const gint *) listeners->data, listeners->len, error))
+        goto out;
+
+    /* Clients without device are ready right away */
+    for (l = clients; l; l = g_list_next (l)) {
+        client_attach_readable_source ((Client *)(l->data));
+        track_client (self, (Client *)(l->data));
+    }
+
+    g_debug ("proxy handed off with %u devices and %u clients without device",
+             g_list_length (devices), g_list_length (clients));
+
+    for (l = devices; l; l = g_list_next (l))
+        handoff_device_start ((HandoffDevice *)(l->data));
+    g_clear_pointer (&devices, g_list_free);
+    success = TRUE;
+
+out:
+    for (i = 0; i < listeners->len; i++)
+        close (g_array_index (listeners, gint, i));
+    g_list_free_full (devices, (GDestroyNotify) handoff_device_free);
+    g_list_free_full (clients, (GDestroyNotify) client_unref);
+
+    if (!success)
+        return NULL;
+    return g_steal_pointer (&self);
 }
 
 /*****************************************************************************/
 
 MbimProxy *
 mbim_proxy_new (GError **error)
+{
+    return mbim_proxy_new_from_fds (NULL, 0, error);
+}
+
+MbimProxy *
+mbim_proxy_new_from_fds (const gint  *fds,
+                         guint        n_fds,
+                         GError     **error)
 {
     g_autoptr(MbimProxy) self = NULL;
 
+    g_return_val_if_fail (fds || !n_fds, NULL);
+
     if (!mbim_helpers_check_user_allowed (getuid(), error))
         return NULL;
 
     self = g_object_new (MBIM_TYPE_PROXY, NULL);
-    if (!setup_socket_service (self, error))
+    if (!setup_socket_service (self, fds, n_fds, error))
         return NULL;
 
     return g_steal_pointer (&self);
@@ -1506,6 +4614,27 @@ static void
 mbim_proxy_init (MbimProxy *self)
 {
     self->priv = G_TYPE_INSTANCE_GET_PRIVATE (self, MBIM_TYPE_PROXY, MbimProxyPrivate);
+    self->priv->context = g_main_context_ref_thread_default ();
+    self->priv->client_queue_max = DEFAULT_CLIENT_QUEUE_MAX;
+    self->priv->client_queue_policy = MBIM_PROXY_QUEUE_POLICY_COALESCE;
+    self->priv->device_max_in_flight = DEFAULT_DEVICE_MAX_IN_FLIGHT;
+    self->priv->indication_ring_size = DEFAULT_INDICATION_RING_SIZE;
+
+    self->priv->clients = g_hash_table_new_full (g_direct_hash,
+                                                 g_direct_equal,
+                                                 NULL,
+                                                 (GDestroyNotify) client_unref);
+    /* The device keeps its own path while tracked */
+    self->priv->devices = g_hash_table_new_full (g_str_hash,
+                                                 g_str_equal,
+                                                 NULL,
+                                                 g_object_unref);
+    self->priv->opening_devices = g_hash_table_new (g_direct_hash, g_direct_equal);
+    self->priv->listening_sockets = g_ptr_array_new_with_free_func (g_object_unref);
+    setup_passwd_monitor (self);
+    self->priv->workers = g_ptr_array_new_with_free_func ((GDestroyNotify) device_worker_free);
+    g_mutex_init (&self->priv->lock);
+    g_mutex_init (&self->priv->stats_lock);
 }
 
 static void
@@ -1518,10 +4647,10 @@ get_property (GObject    *object,
 
     switch (prop_id) {
     case PROP_N_CLIENTS:
-        g_value_set_uint (value, g_list_length (self->priv->clients));
+        g_value_set_uint (value, mbim_proxy_get_n_clients (self));
         break;
     case PROP_N_DEVICES:
-        g_value_set_uint (value, g_list_length (self->priv->devices));
+        g_value_set_uint (value, mbim_proxy_get_n_devices (self));
         break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
@@ -1533,18 +4662,32 @@ static void
 dispose (GObject *object)
 {
     MbimProxyPrivate *priv = MBIM_PROXY (object)->priv;
+    GHashTableIter    iter;
+    MbimDevice       *device;
+    guint             i;
+
+    /* This table should always be empty when disposing */
+    g_assert (g_hash_table_size (priv->opening_devices) == 0);
 
-    /* This list should always be empty when disposing */
-    g_assert (priv->opening_devices == NULL);
+    /* Stop all device threads first, so that clients and devices are only
+     * used from here on; the contexts are kept until finalized, as sources of
+     * clients and devices may still be attached to them */
+    for (i = 0; i < priv->workers->len; i++)
+        device_worker_stop (g_ptr_array_index (priv->workers, i));
 
-    if (priv->clients) {
-        g_list_free_full (priv->clients, (GDestroyNotify) client_unref);
-        priv->clients = NULL;
+    g_hash_table_remove_all (priv->clients);
+
+    g_hash_table_iter_init (&iter, priv->devices);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&device)) {
+        device_context_unset_proxy (device);
+        device_context_get (device)->worker = NULL;
     }
+    g_hash_table_remove_all (priv->devices);
 
-    if (priv->devices) {
-        g_list_free_full (priv->devices, g_object_unref);
-        priv->devices = NULL;
+    if (priv->passwd_monitor) {
+        g_signal_handlers_disconnect_by_func (priv->passwd_monitor, passwd_changed_cb, object);
+        g_file_monitor_cancel (priv->passwd_monitor);
+        g_clear_object (&priv->passwd_monitor);
     }
 
     if (priv->socket_service) {
@@ -1558,6 +4701,23 @@ dispose (GObject *object)
     G_OBJECT_CLASS (mbim_proxy_parent_class)->dispose (object);
 }
 
+static void
+finalize (GObject *object)
+{
+    MbimProxyPrivate *priv = MBIM_PROXY (object)->priv;
+
+    g_ptr_array_unref (priv->workers);
+    g_hash_table_unref (priv->clients);
+    g_hash_table_unref (priv->devices);
+    g_hash_table_unref (priv->opening_devices);
+    g_ptr_array_unref (priv->listening_sockets);
+    g_mutex_clear (&priv->lock);
+    g_mutex_clear (&priv->stats_lock);
+    g_main_context_unref (priv->context);
+
+    G_OBJECT_CLASS (mbim_proxy_parent_class)->finalize (object);
+}
+
 static void
 mbim_proxy_class_init (MbimProxyClass *proxy_class)
 {
@@ -1568,6 +4728,7 @@ mbim_proxy_class_init (MbimProxyClass *proxy_class)
     /* Virtual methods */
     object_class->get_property = get_property;
     object_class->dispose = dispose;
+    object_class->finalize = finalize;
 
     /**
      * MbimProxy:mbim-proxy-n-clients
@@ -67,6 +67,20 @@ typedef struct _MbimProxyPrivate MbimProxyPrivate;
  */
 #define MBIM_PROXY_SOCKET_PATH "mbim-proxy"
 
+/**
+ * MBIM_PROXY_SEQPACKET_SOCKET_PATH:
+ *
+ * Symbol defining the abstract socket name where the #MbimProxy will listen
+ * for clients using a %G_SOCKET_TYPE_SEQPACKET socket, where each message or
+ * fragment is transferred as a single datagram.
+ *
+ * Clients should fallback to %MBIM_PROXY_SOCKET_PATH if this socket isn't
+ * available.
+ *
+ * Since: 1.26
+ */
+#define MBIM_PROXY_SEQPACKET_SOCKET_PATH "mbim-proxy-seqpacket"
+
 /**
  * MBIM_PROXY_N_CLIENTS:
  *
@@ -117,6 +131,77 @@ G_DEFINE_AUTOPTR_CLEANUP_FUNC (MbimProxy, g_object_unref)
  */
 MbimProxy *mbim_proxy_new (GError **error);
 
+/**
+ * mbim_proxy_new_from_fds:
+ * @fds: (array length=n_fds) (nullable): UNIX sockets already bound and
+ *  listening.
+ * @n_fds: number of elements in @fds.
+ * @error: Return location for error or %NULL.
+ *
+ * Creates a #MbimProxy object accepting clients in the given sockets, instead
+ * of creating its own ones at %MBIM_PROXY_SOCKET_PATH and
+ * %MBIM_PROXY_SEQPACKET_SOCKET_PATH. This allows the proxy to be started on
+ * demand by a service manager owning the listening sockets.
+ *
+ * Both %G_SOCKET_TYPE_STREAM and %G_SOCKET_TYPE_SEQPACKET sockets are
+ * supported. The descriptors are duplicated, so the caller keeps ownership of
+ * @fds. If @n_fds is 0, this is equivalent to mbim_proxy_new().
+ *
+ * Returns: (transfer full): a newly created #MbimProxy, or #NULL if @error is set.
+ *
+ * Since: 1.26
+ */
+MbimProxy *mbim_proxy_new_from_fds (const gint  *fds,
+                                    guint        n_fds,
+                                    GError     **error);
+
+/**
+ * mbim_proxy_new_from_handoff:
+ * @socket: a connected %G_SOCKET_TYPE_SEQPACKET UNIX socket.
+ * @error: Return location for error or %NULL.
+ *
+ * Creates a #MbimProxy object taking over the listening sockets, devices and
+ * clients of another proxy, which hands them off with mbim_proxy_handoff()
+ * through the other end of @socket.
+ *
+ * The devices handed off are not opened again, so their MBIM sessions and any
+ * ongoing data session are kept, and their clients keep on using the same
+ * connection. The devices are ready for their clients once this function has
+ * returned and the main context of the proxy runs again.
+ *
+ * Returns: (transfer full): a newly created #MbimProxy, or #NULL if @error is set.
+ *
+ * Since: 1.26
+ */
+MbimProxy *mbim_proxy_new_from_handoff (GSocket  *socket,
+                                        GError  **error);
+
+/**
+ * mbim_proxy_handoff:
+ * @self: a #MbimProxy.
+ * @socket: a connected %G_SOCKET_TYPE_SEQPACKET UNIX socket.
+ * @error: Return location for error or %NULL.
+ *
+ * Hands off the listening sockets, the open devices and the clients of @self
+ * to the proxy created with mbim_proxy_new_from_handoff() through the other
+ * end of @socket, e.g. to replace the running proxy with a new version
+ * without closing the devices or disconnecting their clients.
+ *
+ * Clients with commands not yet completed, with messages not yet written, or
+ * using an indication ring are not handed off, and are disconnected instead.
+ *
+ * Whether successful or not, @self no longer has listening sockets, devices or
+ * clients once this function returns, and the devices are released without
+ * being closed. The caller should just dispose @self.
+ *
+ * Returns: %TRUE if the proxy was handed off, %FALSE if @error is set.
+ *
+ * Since: 1.26
+ */
+gboolean mbim_proxy_handoff (MbimProxy  *self,
+                             GSocket    *socket,
+                             GError    **error);
+
 /**
  * mbim_proxy_get_n_clients: (skip)
  * @self: a #MbimProxy.
@@ -141,6 +226,165 @@ guint mbim_proxy_get_n_clients (MbimProxy *self);
  */
 guint mbim_proxy_get_n_devices (MbimProxy *self);
 
+/**
+ * mbim_proxy_set_device_threads:
+ * @self: a #MbimProxy.
+ * @enabled: %TRUE to run each device in its own thread.
+ *
+ * Sets whether each device added to the proxy from now on runs in its own
+ * thread, along with all the clients using it.
+ *
+ * Clients are accepted in the main context of the proxy and handed over to the
+ * thread of their device once they configure it, so that a device blocking or
+ * flooding its clients with indications doesn't delay the other devices.
+ *
+ * By default all devices and clients run in the main context of the proxy.
+ *
+ * Since: 1.26
+ */
+void mbim_proxy_set_device_threads (MbimProxy *self,
+                                    gboolean   enabled);
+
+/**
+ * MbimProxyQueuePolicy:
+ * @MBIM_PROXY_QUEUE_POLICY_DROP_INDICATIONS: Drop new indications.
+ * @MBIM_PROXY_QUEUE_POLICY_DISCONNECT: Disconnect the client.
+ * @MBIM_PROXY_QUEUE_POLICY_COALESCE: Replace an already queued indication of
+ *  the same service and CID with the new one, or drop the new one if there is
+ *  none.
+ *
+ * What to do when a message is sent to a client whose output queue is full.
+ * Responses are never dropped; if a response doesn't fit, the client is
+ * disconnected regardless of the policy.
+ *
+ * Since: 1.26
+ */
+typedef enum { /*< since=1.26 >*/
+    MBIM_PROXY_QUEUE_POLICY_DROP_INDICATIONS = 0,
+    MBIM_PROXY_QUEUE_POLICY_DISCONNECT       = 1,
+    MBIM_PROXY_QUEUE_POLICY_COALESCE         = 2
+} MbimProxyQueuePolicy;
+
+/**
+ * mbim_proxy_set_client_queue_limits:
+ * @self: a #MbimProxy.
+ * @max_messages: maximum number of messages queued for each client, must be
+ *  greater than 0.
+ * @policy: a #MbimProxyQueuePolicy.
+ *
+ * Sets how many messages may be pending to be written to each client, and
+ * what to do when that limit is reached.
+ *
+ * Messages are written to clients without blocking, so a client that doesn't
+ * read its socket only grows its own queue and never delays the proxy or other
+ * clients.
+ *
+ * Since: 1.26
+ */
+void mbim_proxy_set_client_queue_limits (MbimProxy            *self,
+                                         guint                 max_messages,
+                                         MbimProxyQueuePolicy  policy);
+
+/**
+ * mbim_proxy_set_command_limits:
+ * @self: a #MbimProxy.
+ * @device_max_in_flight: maximum number of commands sent to each device and
+ *  not yet completed, or 0 for no limit.
+ * @client_max_in_flight: maximum number of commands of each client sent to
+ *  the device and not yet completed, or 0 for no limit.
+ * @client_max_rate: maximum number of commands per second sent to the device
+ *  on behalf of each client, or 0 for no limit.
+ *
+ * Sets the limits used when scheduling the commands of the clients sharing a
+ * device.
+ *
+ * Commands over these limits wait in the proxy, and are sent to the device in
+ * round-robin order across clients as soon as the limits allow it, so that a
+ * client sending lots of commands doesn't delay the commands of the other
+ * clients of the same device.
+ *
+ * By default each device has up to 8 commands in flight, and clients are not
+ * limited.
+ *
+ * Since: 1.26
+ */
+void mbim_proxy_set_command_limits (MbimProxy *self,
+                                    guint      device_max_in_flight,
+                                    guint      client_max_in_flight,
+                                    guint      client_max_rate);
+
+/**
+ * mbim_proxy_set_indication_ring_size:
+ * @self: a #MbimProxy.
+ * @size: size in bytes of the ring of each device, or 0 to disable rings.
+ *
+ * Sets the size of the shared memory ring where the indications of each
+ * device are published for the clients that request it with
+ * %MBIM_CID_PROXY_CONTROL_INDICATION_RING.
+ *
+ * Each indication is written once in the ring, instead of once per client
+ * socket, which benefits clients that just monitor high rates of indications.
+ * Clients reading the ring too slowly lose the oldest indications instead of
+ * delaying the proxy. The size is rounded up to a power of two.
+ *
+ * By default rings are 256 KiB.
+ *
+ * Since: 1.26
+ */
+void mbim_proxy_set_indication_ring_size (MbimProxy *self,
+                                          guint32    size);
+
+/**
+ * mbim_proxy_set_device_grace_period:
+ * @self: a #MbimProxy.
+ * @seconds: time a device without clients is kept open, or 0 to keep it open
+ *  for as long as the proxy runs.
+ *
+ * Sets how long a device is kept open once its last client is gone.
+ *
+ * During this grace period the proxy keeps the MBIM session of the device and
+ * its merged subscribe list, and a client configuring the device meanwhile can
+ * use it right away, without the proxy checking the device again. Once the
+ * grace period expires without clients, the device is closed and released.
+ *
+ * By default devices are kept open for as long as the proxy runs, and checked
+ * again every time a client configures them.
+ *
+ * Since: 1.26
+ */
+void mbim_proxy_set_device_grace_period (MbimProxy *self,
+                                         guint      seconds);
+
+/**
+ * mbim_proxy_invalidate_user_cache:
+ * @self: a #MbimProxy.
+ *
+ * Makes the proxy look up again the user allowed to connect besides root when
+ * the next client connects.
+ *
+ * The allowed user is looked up only once and then cached, and the cache is
+ * already invalidated when the user database in <literal>/etc/passwd</literal>
+ * changes; this method allows forcing the lookup, e.g. when the user database
+ * is provided by some other service.
+ *
+ * Since: 1.26
+ */
+void mbim_proxy_invalidate_user_cache (MbimProxy *self);
+
+/**
+ * mbim_proxy_get_client_queue_depths: (skip)
+ * @self: a #MbimProxy.
+ *
+ * Get the number of messages pending to be written to each client currently
+ * connected to the proxy.
+ *
+ * Returns: (transfer full) (element-type guint): a #GArray of #guint values,
+ * one per client. The returned value should be freed with g_array_unref().
+ *
+ * Since: 1.26
+ */
+GArray *mbim_proxy_get_client_queue_depths (MbimProxy *self);
+
 G_END_DECLS
 
 #endif /* MBIM_PROXY_H */
@@ -28,6 +28,7 @@
 #include <string.h>
 
 #include "mbim-uuid.h"
+#include "mbim-cid.h"
 #include "generated/mbim-enum-types.h"
 
 /*****************************************************************************/
@@ -247,208 +248,239 @@ static const MbimUuid uuid_ms_uicc_low_level_access = {
     .e = { 0xf4, 0xd4, 0x4b, 0xd0, 0x93, 0x67 }
 };
 
-static GList *mbim_custom_service_list = NULL;
+/* Known services, indexed by MbimService; always complete, even for the
+ * services not built in the library */
+static const MbimUuid *service_uuids[MBIM_SERVICE_LAST] = {
+    [MBIM_SERVICE_INVALID] = &uuid_invalid,
+    [MBIM_SERVICE_BASIC_CONNECT] = &uuid_basic_connect,
+    [MBIM_SERVICE_SMS] = &uuid_sms,
+    [MBIM_SERVICE_USSD] = &uuid_ussd,
+    [MBIM_SERVICE_PHONEBOOK] = &uuid_phonebook,
+    [MBIM_SERVICE_STK] = &uuid_stk,
+    [MBIM_SERVICE_AUTH] = &uuid_auth,
+    [MBIM_SERVICE_DSS] = &uuid_dss,
+    [MBIM_SERVICE_MS_FIRMWARE_ID] = &uuid_ms_firmware_id,
+    [MBIM_SERVICE_MS_HOST_SHUTDOWN] = &uuid_ms_host_shutdown,
+    [MBIM_SERVICE_MS_SAR] = &uuid_ms_sar,
+    [MBIM_SERVICE_PROXY_CONTROL] = &uuid_proxy_control,
+    [MBIM_SERVICE_QMI] = &uuid_qmi,
+    [MBIM_SERVICE_ATDS] = &uuid_atds,
+    [MBIM_SERVICE_INTEL_FIRMWARE_UPDATE] = &uuid_intel_firmware_update,
+    [MBIM_SERVICE_QDU] = &uuid_qdu,
+    [MBIM_SERVICE_MS_BASIC_CONNECT_EXTENSIONS] = &uuid_ms_basic_connect_extensions,
+    [MBIM_SERVICE_MS_UICC_LOW_LEVEL_ACCESS] = &uuid_ms_uicc_low_level_access,
+};
+
+/* Known services are kept in two hash tables, one indexed by UUID (both
+ * standard and custom services) and one indexed by custom service id. The
+ * tables are only modified when registering or unregistering custom services,
+ * so lookups just take the reader lock and don't block each other.
+ *
+ * Custom service entries are never freed: unregistering a service just
+ * tombstones its entry, so that the UUID and nickname returned by the lookups
+ * stay valid after the lock is released, even if another thread unregisters
+ * the service meanwhile. */
+static GRWLock     services_lock;
+static GHashTable *services_by_uuid;
+static GHashTable *custom_services;
+static guint       custom_service_id_last = 100;
 
 typedef struct {
     guint service_id;
     MbimUuid uuid;
-    gchar *nickname;
+    const gchar *nickname;
+    gboolean unregistered;
 } MbimCustomService;
 
+guint
+_mbim_uuid_hash (gconstpointer v)
+{
+    const guint8 *p = v;
+    guint32       h = 2166136261u;
+    guint         i;
+
+    /* FNV-1a */
+    for (i = 0; i < sizeof (MbimUuid); i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static gboolean
+uuid_equal (gconstpointer a,
+            gconstpointer b)
+{
+    return mbim_uuid_cmp (a, b);
+}
+
+static void
+services_init (void)
+{
+    static gsize initialized = 0;
+
+    if (g_once_init_enter (&initialized)) {
+        guint i;
+
+        services_by_uuid = g_hash_table_new (_mbim_uuid_hash, uuid_equal);
+        for (i = MBIM_SERVICE_BASIC_CONNECT; i < MBIM_SERVICE_LAST; i++)
+            g_hash_table_insert (services_by_uuid, (gpointer) service_uuids[i], GUINT_TO_POINTER (i));
+        custom_services = g_hash_table_new (g_direct_hash, g_direct_equal);
+        g_once_init_leave (&initialized, 1);
+    }
+}
+
 guint
 mbim_register_custom_service (const MbimUuid *uuid,
                               const gchar *nickname)
 {
     MbimCustomService *s;
-    GList *l;
-    guint service_id = 100;
-
-    for (l = mbim_custom_service_list; l != NULL; l = l->next) {
-        s = (MbimCustomService *)l->data;
-        if (mbim_uuid_cmp (&s->uuid, uuid))
-            return s->service_id;
-        else
-            service_id = MAX (service_id, s->service_id);
+    guint              service_id;
+
+    services_init ();
+
+    g_rw_lock_writer_lock (&services_lock);
+
+    service_id = GPOINTER_TO_UINT (g_hash_table_lookup (services_by_uuid, uuid));
+    if (service_id != MBIM_SERVICE_INVALID) {
+        g_rw_lock_writer_unlock (&services_lock);
+        return service_id;
     }
 
-    /* create a new custom service */
+    /* create a new custom service; ids are never reused so that a stale id
+     * of an already unregistered service never matches a new one */
     s = g_slice_new (MbimCustomService);
-    s->service_id = service_id + 1;
+    s->service_id = ++custom_service_id_last;
     memcpy (&s->uuid, uuid, sizeof (MbimUuid));
-    s->nickname = g_strdup (nickname);
+    s->nickname = g_intern_string (nickname);
+    s->unregistered = FALSE;
 
-    mbim_custom_service_list = g_list_append (mbim_custom_service_list, s);
-    return s->service_id;
+    g_hash_table_insert (custom_services, GUINT_TO_POINTER (s->service_id), s);
+    g_hash_table_insert (services_by_uuid, &s->uuid, GUINT_TO_POINTER (s->service_id));
+    service_id = s->service_id;
+
+    g_rw_lock_writer_unlock (&services_lock);
+    return service_id;
 }
 
 gboolean
 mbim_unregister_custom_service (const guint id)
 {
     MbimCustomService *s;
-    GList *l;
-
-    for (l = mbim_custom_service_list; l != NULL; l = l->next) {
-        s = (MbimCustomService *)l->data;
-        if (s->service_id == id) {
-            g_free (s->nickname);
-            g_slice_free (MbimCustomService, s);
-            mbim_custom_service_list = \
-                g_list_delete_link (mbim_custom_service_list, l);
-            return TRUE;
-        }
-    }
 
-    return FALSE;
+    if (id < MBIM_SERVICE_LAST)
+        return FALSE;
+
+    services_init ();
+
+    g_rw_lock_writer_lock (&services_lock);
+    s = g_hash_table_lookup (custom_services, GUINT_TO_POINTER (id));
+    if (s && !s->unregistered) {
+        /* tombstone, the entry may still be in use by a lookup */
+        g_hash_table_remove (services_by_uuid, &s->uuid);
+        s->unregistered = TRUE;
+        /* still under the lock, so that CIDs can't be registered for the
+         * service while it's being removed */
+        _mbim_cid_unregister_custom_service_cids (id);
+    } else
+        s = NULL;
+    g_rw_lock_writer_unlock (&services_lock);
+
+    return !!s;
+}
+
+static MbimCustomService *
+custom_service_lookup_unlocked (guint id)
+{
+    MbimCustomService *s;
+
+    s = g_hash_table_lookup (custom_services, GUINT_TO_POINTER (id));
+    return (s && !s->unregistered) ? s : NULL;
+}
+
+static MbimCustomService *
+custom_service_lookup (guint id)
+{
+    MbimCustomService *s;
+
+    services_init ();
+
+    g_rw_lock_reader_lock (&services_lock);
+    s = custom_service_lookup_unlocked (id);
+    g_rw_lock_reader_unlock (&services_lock);
+
+    /* entries are never freed, so it's safe to use it after unlocking */
+    return s;
 }
 
 gboolean
 mbim_service_id_is_custom (const guint id)
 {
-    GList *l;
-
     if (id < MBIM_SERVICE_LAST)
         return FALSE;
 
-    for (l = mbim_custom_service_list; l != NULL; l = l->next) {
-        if (((MbimCustomService *)l->data)->service_id == id)
-            return TRUE;
-    }
+    return !!custom_service_lookup (id);
+}
+
+void
+_mbim_custom_services_lock (void)
+{
+    services_init ();
+    g_rw_lock_reader_lock (&services_lock);
+}
+
+void
+_mbim_custom_services_unlock (void)
+{
+    g_rw_lock_reader_unlock (&services_lock);
+}
+
+gboolean
+_mbim_service_id_is_custom_unlocked (const guint id)
+{
+    if (id < MBIM_SERVICE_LAST)
+        return FALSE;
 
-    return FALSE;
+    return !!custom_service_lookup_unlocked (id);
 }
 
 const gchar *
 mbim_service_lookup_name (guint service)
 {
-    GList *l;
+    MbimCustomService *s;
 
     if (service < MBIM_SERVICE_LAST)
         return mbim_service_get_string (service);
 
-    for (l = mbim_custom_service_list; l != NULL; l = l->next) {
-        if (service == ((MbimCustomService *)l->data)->service_id)
-            return ((MbimCustomService *)l->data)->nickname;
-    }
-    return NULL;
+    s = custom_service_lookup (service);
+    return s ? s->nickname : NULL;
 }
 
 const MbimUuid *
 mbim_uuid_from_service (MbimService service)
 {
-    GList *l;
+    MbimCustomService *s;
 
-    g_return_val_if_fail (service < MBIM_SERVICE_LAST || mbim_service_id_is_custom (service), &uuid_invalid);
+    if (service < MBIM_SERVICE_LAST)
+        return service_uuids[service];
 
-    switch (service) {
-    case MBIM_SERVICE_INVALID:
-        return &uuid_invalid;
-    case MBIM_SERVICE_BASIC_CONNECT:
-        return &uuid_basic_connect;
-    case MBIM_SERVICE_SMS:
-        return &uuid_sms;
-    case MBIM_SERVICE_USSD:
-        return &uuid_ussd;
-    case MBIM_SERVICE_PHONEBOOK:
-        return &uuid_phonebook;
-    case MBIM_SERVICE_STK:
-        return &uuid_stk;
-    case MBIM_SERVICE_AUTH:
-        return &uuid_auth;
-    case MBIM_SERVICE_DSS:
-        return &uuid_dss;
-    case MBIM_SERVICE_MS_FIRMWARE_ID:
-        return &uuid_ms_firmware_id;
-    case MBIM_SERVICE_MS_HOST_SHUTDOWN:
-        return &uuid_ms_host_shutdown;
-    case MBIM_SERVICE_MS_SAR:
-        return &uuid_ms_sar;
-    case MBIM_SERVICE_PROXY_CONTROL:
-        return &uuid_proxy_control;
-    case MBIM_SERVICE_QMI:
-        return &uuid_qmi;
-    case MBIM_SERVICE_ATDS:
-        return &uuid_atds;
-    case MBIM_SERVICE_QDU:
-        return &uuid_qdu;
-    case MBIM_SERVICE_INTEL_FIRMWARE_UPDATE:
-        return &uuid_intel_firmware_update;
-    case MBIM_SERVICE_MS_BASIC_CONNECT_EXTENSIONS:
-        return &uuid_ms_basic_connect_extensions;
-    case MBIM_SERVICE_MS_UICC_LOW_LEVEL_ACCESS:
-        return &uuid_ms_uicc_low_level_access;
-    case MBIM_SERVICE_LAST:
-        g_assert_not_reached ();
-    default:
-        for (l = mbim_custom_service_list; l != NULL; l = l->next) {
-            if (service == ((MbimCustomService *)l->data)->service_id)
-                return &((MbimCustomService *)l->data)->uuid;
-        }
-        g_return_val_if_reached (NULL);
-    }
+    s = custom_service_lookup (service);
+    g_return_val_if_fail (s != NULL, &uuid_invalid);
+    return &s->uuid;
 }
 
 MbimService
 mbim_uuid_to_service (const MbimUuid *uuid)
 {
-    GList *l;
-
-    if (mbim_uuid_cmp (uuid, &uuid_basic_connect))
-        return MBIM_SERVICE_BASIC_CONNECT;
-
-    if (mbim_uuid_cmp (uuid, &uuid_sms))
-        return MBIM_SERVICE_SMS;
-
-    if (mbim_uuid_cmp (uuid, &uuid_ussd))
-        return MBIM_SERVICE_USSD;
-
-    if (mbim_uuid_cmp (uuid, &uuid_phonebook))
-        return MBIM_SERVICE_PHONEBOOK;
-
-    if (mbim_uuid_cmp (uuid, &uuid_stk))
-        return MBIM_SERVICE_STK;
-
-    if (mbim_uuid_cmp (uuid, &uuid_auth))
-        return MBIM_SERVICE_AUTH;
-
-    if (mbim_uuid_cmp (uuid, &uuid_dss))
-        return MBIM_SERVICE_DSS;
-
-    if (mbim_uuid_cmp (uuid, &uuid_ms_firmware_id))
-        return MBIM_SERVICE_MS_FIRMWARE_ID;
+    MbimService service;
 
-    if (mbim_uuid_cmp (uuid, &uuid_ms_host_shutdown))
-        return MBIM_SERVICE_MS_HOST_SHUTDOWN;
+    services_init ();
 
-    if (mbim_uuid_cmp (uuid, &uuid_ms_sar))
-        return MBIM_SERVICE_MS_SAR;
-
-    if (mbim_uuid_cmp (uuid, &uuid_proxy_control))
-        return MBIM_SERVICE_PROXY_CONTROL;
-
-    if (mbim_uuid_cmp (uuid, &uuid_qmi))
-        return MBIM_SERVICE_QMI;
-
-    if (mbim_uuid_cmp (uuid, &uuid_atds))
-        return MBIM_SERVICE_ATDS;
-
-    if (mbim_uuid_cmp (uuid, &uuid_intel_firmware_update))
-        return MBIM_SERVICE_INTEL_FIRMWARE_UPDATE;
-
-    if (mbim_uuid_cmp (uuid, &uuid_qdu))
-        return MBIM_SERVICE_QDU;
-
-    if (mbim_uuid_cmp (uuid, &uuid_ms_basic_connect_extensions))
-        return MBIM_SERVICE_MS_BASIC_CONNECT_EXTENSIONS;
-
-    if (mbim_uuid_cmp (uuid, &uuid_ms_uicc_low_level_access))
-        return MBIM_SERVICE_MS_UICC_LOW_LEVEL_ACCESS;
-
-    for (l = mbim_custom_service_list; l != NULL; l = l->next) {
-        if (mbim_uuid_cmp (&((MbimCustomService *)l->data)->uuid, uuid))
-            return ((MbimCustomService *)l->data)->service_id;
-    }
+    g_rw_lock_reader_lock (&services_lock);
+    service = GPOINTER_TO_UINT (g_hash_table_lookup (services_by_uuid, uuid));
+    g_rw_lock_reader_unlock (&services_lock);
 
-    return MBIM_SERVICE_INVALID;
+    return service;
 }
 
 /*****************************************************************************/
@@ -362,9 +362,12 @@ const gchar *mbim_service_lookup_name (guint service);
  * @uuid: MbimUuid structure corresponding to service
  * @nickname: a printable name for service
  *
- * Register a custom service
+ * Register a custom service.
  *
- * Returns: TRUE if service has been registered, FALSE otherwise.
+ * If @uuid is already known, the id of the existing service is returned. Custom
+ * services may be registered and unregistered while other threads look them up.
+ *
+ * Returns: the id of the service.
  *
  * Since: 1.10
  */
@@ -395,6 +398,24 @@ gboolean mbim_unregister_custom_service (const guint id);
  */
 gboolean mbim_service_id_is_custom (const guint id);
 
+#if defined (LIBMBIM_GLIB_COMPILATION)
+
+/* Hold the custom services lock, so that no service is registered or
+ * unregistered meanwhile; _mbim_service_id_is_custom_unlocked() must only
+ * be called with the lock held. */
+G_GNUC_INTERNAL
+void _mbim_custom_services_lock (void);
+G_GNUC_INTERNAL
+void _mbim_custom_services_unlock (void);
+G_GNUC_INTERNAL
+gboolean _mbim_service_id_is_custom_unlocked (const guint id);
+
+/* FNV-1a hash of a #MbimUuid, to be used as GHashFunc */
+G_GNUC_INTERNAL
+guint _mbim_uuid_hash (gconstpointer v);
+
+#endif
+
 /**
  * mbim_uuid_from_service:
  * @service: a #MbimService.
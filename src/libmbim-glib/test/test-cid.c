@@ -41,6 +41,7 @@ test_cid_basic_connect (void)
                  TRUE, TRUE, TRUE);
 }
 
+#if defined MBIM_SERVICE_SMS_ENABLED
 static void
 test_cid_sms (void)
 {
@@ -52,7 +53,9 @@ test_cid_sms (void)
                  MBIM_CID_SMS_MESSAGE_STORE_STATUS,
                  FALSE, TRUE, TRUE);
 }
+#endif
 
+#if defined MBIM_SERVICE_USSD_ENABLED
 static void
 test_cid_ussd (void)
 {
@@ -60,7 +63,9 @@ test_cid_ussd (void)
                  MBIM_CID_USSD,
                  TRUE, FALSE, TRUE);
 }
+#endif
 
+#if defined MBIM_SERVICE_PHONEBOOK_ENABLED
 static void
 test_cid_phonebook (void)
 {
@@ -72,7 +77,9 @@ test_cid_phonebook (void)
                  MBIM_CID_PHONEBOOK_WRITE,
                  TRUE, FALSE, FALSE);
 }
+#endif
 
+#if defined MBIM_SERVICE_STK_ENABLED
 static void
 test_cid_stk (void)
 {
@@ -84,7 +91,9 @@ test_cid_stk (void)
                  MBIM_CID_STK_ENVELOPE,
                  TRUE, TRUE, FALSE);
 }
+#endif
 
+#if defined MBIM_SERVICE_AUTH_ENABLED
 static void
 test_cid_auth (void)
 {
@@ -96,7 +105,9 @@ test_cid_auth (void)
                  MBIM_CID_AUTH_SIM,
                  FALSE, TRUE, FALSE);
 }
+#endif
 
+#if defined MBIM_SERVICE_DSS_ENABLED
 static void
 test_cid_dss (void)
 {
@@ -104,7 +115,9 @@ test_cid_dss (void)
                  MBIM_CID_DSS_CONNECT,
                  TRUE, FALSE, FALSE);
 }
+#endif
 
+#if defined MBIM_SERVICE_MS_FIRMWARE_ID_ENABLED
 static void
 test_cid_ms_firmware_id (void)
 {
@@ -112,7 +125,9 @@ test_cid_ms_firmware_id (void)
                  MBIM_CID_MS_FIRMWARE_ID_GET,
                  FALSE, TRUE, FALSE);
 }
+#endif
 
+#if defined MBIM_SERVICE_MS_HOST_SHUTDOWN_ENABLED
 static void
 test_cid_ms_host_shutdown (void)
 {
@@ -120,7 +135,9 @@ test_cid_ms_host_shutdown (void)
                  MBIM_CID_MS_HOST_SHUTDOWN_NOTIFY,
                  TRUE, FALSE, FALSE);
 }
+#endif
 
+#if defined MBIM_SERVICE_MS_SAR_ENABLED
 static void
 test_cid_ms_sar (void)
 {
@@ -128,21 +145,83 @@ test_cid_ms_sar (void)
                  MBIM_CID_MS_SAR_CONFIG,
                  TRUE, TRUE, TRUE);
 }
+#endif
+
+static void
+test_cid_custom (void)
+{
+    static const MbimUuid uuid_custom = {
+        .a = { 0x43, 0x49, 0x44, 0x73 },
+        .b = { 0x20, 0x63 },
+        .c = { 0x75, 0x73 },
+        .d = { 0x74, 0x6f },
+        .e = { 0x6d, 0x20, 0x74, 0x65, 0x73, 0x74 }
+    };
+    static const MbimCidCapability capabilities[] = {
+        MBIM_CID_CAPABILITY_QUERY,
+        MBIM_CID_CAPABILITY_SET | MBIM_CID_CAPABILITY_QUERY | MBIM_CID_CAPABILITY_NOTIFY,
+    };
+    static const gchar *names[] = { "first", "second" };
+    guint        service;
+    const gchar *name;
+
+    service = mbim_register_custom_service (&uuid_custom, "custom-cids");
+
+    /* unknown until registered */
+    test_common (service, 1, FALSE, FALSE, FALSE);
+    g_assert (!mbim_register_custom_service_cids (MBIM_SERVICE_SMS, capabilities, names, G_N_ELEMENTS (capabilities)));
+
+    g_assert (mbim_register_custom_service_cids (service, capabilities, names, G_N_ELEMENTS (capabilities)));
+    test_common (service, 1, FALSE, TRUE, FALSE);
+    test_common (service, 2, TRUE, TRUE, TRUE);
+    test_common (service, 3, FALSE, FALSE, FALSE);
+    name = mbim_cid_get_printable (service, 2);
+    g_assert_cmpstr (name, ==, "second");
+    g_assert_cmpuint (mbim_cid_get_capabilities (MBIM_SERVICE_BASIC_CONNECT, MBIM_CID_BASIC_CONNECT_DEVICE_CAPS), ==, MBIM_CID_CAPABILITY_QUERY);
+
+    /* removed with the service */
+    g_assert (mbim_unregister_custom_service (service));
+    test_common (service, 2, FALSE, FALSE, FALSE);
+    g_assert (mbim_cid_get_printable (service, 2) == NULL);
+    /* but names looked up before are still valid */
+    g_assert_cmpstr (name, ==, "second");
+    /* and no CIDs can be registered for it anymore */
+    g_assert (!mbim_register_custom_service_cids (service, capabilities, names, G_N_ELEMENTS (capabilities)));
+}
 
 int main (int argc, char **argv)
 {
     g_test_init (&argc, &argv, NULL);
 
     g_test_add_func ("/libmbim-glib/cid/basic-connect",    test_cid_basic_connect);
+#if defined MBIM_SERVICE_SMS_ENABLED
     g_test_add_func ("/libmbim-glib/cid/sms",              test_cid_sms);
+#endif
+#if defined MBIM_SERVICE_USSD_ENABLED
     g_test_add_func ("/libmbim-glib/cid/ussd",             test_cid_ussd);
+#endif
+#if defined MBIM_SERVICE_PHONEBOOK_ENABLED
     g_test_add_func ("/libmbim-glib/cid/phonebook",        test_cid_phonebook);
+#endif
+#if defined MBIM_SERVICE_STK_ENABLED
     g_test_add_func ("/libmbim-glib/cid/stk",              test_cid_stk);
+#endif
+#if defined MBIM_SERVICE_AUTH_ENABLED
     g_test_add_func ("/libmbim-glib/cid/auth",             test_cid_auth);
+#endif
+#if defined MBIM_SERVICE_DSS_ENABLED
     g_test_add_func ("/libmbim-glib/cid/dss",              test_cid_dss);
+#endif
+#if defined MBIM_SERVICE_MS_FIRMWARE_ID_ENABLED
     g_test_add_func ("/libmbim-glib/cid/ms-firmware-id",   test_cid_ms_firmware_id);
+#endif
+#if defined MBIM_SERVICE_MS_HOST_SHUTDOWN_ENABLED
     g_test_add_func ("/libmbim-glib/cid/ms-host-shutdown", test_cid_ms_host_shutdown);
+#endif
+#if defined MBIM_SERVICE_MS_SAR_ENABLED
     g_test_add_func ("/libmbim-glib/cid/ms-sar",           test_cid_ms_sar);
+#endif
+    g_test_add_func ("/libmbim-glib/cid/custom",           test_cid_custom);
 
     return g_test_run ();
 }
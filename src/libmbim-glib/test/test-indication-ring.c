@@ -0,0 +1,314 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details:
+ */
+
+#include <config.h>
+#include <string.h>
+
+#include "mbim-indication-ring.h"
+
+/*****************************************************************************/
+
+static void
+fill_message (guint8  *buffer,
+              guint32  length,
+              guint    seed)
+{
+    guint32 i;
+
+    for (i = 0; i < length; i++)
+        buffer[i] = (guint8) (seed + i);
+}
+
+static void
+assert_message (GBytes  *bytes,
+                guint32  length,
+                guint    seed)
+{
+    g_autofree guint8 *expected = NULL;
+
+    g_assert (bytes != NULL);
+    expected = g_malloc (length);
+    fill_message (expected, length, seed);
+    g_assert_cmpmem (g_bytes_get_data (bytes, NULL), g_bytes_get_size (bytes), expected, length);
+}
+
+static void
+ring_new_pair (guint32              size,
+               MbimIndicationRing **producer,
+               MbimIndicationRing **consumer)
+{
+    GError *error = NULL;
+    gint    fd;
+
+    *producer = _mbim_indication_ring_new (size, &error);
+    g_assert_no_error (error);
+    g_assert (*producer != NULL);
+
+    fd = _mbim_indication_ring_dup_readonly_fd (*producer, &error);
+    g_assert_no_error (error);
+    g_assert_cmpint (fd, >=, 0);
+
+    *consumer = _mbim_indication_ring_new_from_fd (fd, &error);
+    g_assert_no_error (error);
+    g_assert (*consumer != NULL);
+}
+
+/*****************************************************************************/
+
+static void
+test_indication_ring_publish_read (void)
+{
+    g_autoptr(MbimIndicationRing) producer = NULL;
+    g_autoptr(MbimIndicationRing) consumer = NULL;
+    guint8                        buffer[64];
+    guint                         n_overruns = 0;
+    guint                         i;
+
+    ring_new_pair (4096, &producer, &consumer);
+
+    g_assert (_mbim_indication_ring_read (consumer, &n_overruns) == NULL);
+
+    for (i = 0; i < 3; i++) {
+        fill_message (buffer, 48 + i, i);
+        g_assert (_mbim_indication_ring_publish (producer, buffer, 48 + i));
+    }
+
+    for (i = 0; i < 3; i++) {
+        g_autoptr(GBytes) bytes = NULL;
+
+        bytes = _mbim_indication_ring_read (consumer, &n_overruns);
+        assert_message (bytes, 48 + i, i);
+    }
+
+    g_assert (_mbim_indication_ring_read (consumer, &n_overruns) == NULL);
+    g_assert_cmpuint (n_overruns, ==, 0);
+}
+
+static void
+test_indication_ring_wrap (void)
+{
+    g_autoptr(MbimIndicationRing) producer = NULL;
+    g_autoptr(MbimIndicationRing) consumer = NULL;
+    guint8                        buffer[100];
+    guint                         n_overruns = 0;
+    guint                         i;
+
+    ring_new_pair (4096, &producer, &consumer);
+
+    /* Records of odd sizes end up split at the end of the data area */
+    for (i = 0; i < 500; i++) {
+        g_autoptr(GBytes) bytes = NULL;
+
+        fill_message (buffer, 93, i);
+        g_assert (_mbim_indication_ring_publish (producer, buffer, 93));
+
+        bytes = _mbim_indication_ring_read (consumer, &n_overruns);
+        assert_message (bytes, 93, i);
+    }
+
+    g_assert (_mbim_indication_ring_read (consumer, &n_overruns) == NULL);
+    g_assert_cmpuint (n_overruns, ==, 0);
+}
+
+static void
+test_indication_ring_overrun (void)
+{
+    g_autoptr(MbimIndicationRing) producer = NULL;
+    g_autoptr(MbimIndicationRing) consumer = NULL;
+    g_autoptr(GBytes)             first = NULL;
+    guint8                        buffer[100];
+    guint                         n_overruns = 0;
+    guint                         n_read = 1;
+    guint                         i;
+
+    ring_new_pair (4096, &producer, &consumer);
+
+    /* Way more than what fits in the ring */
+    for (i = 0; i < 200; i++) {
+        fill_message (buffer, 100, i);
+        g_assert (_mbim_indication_ring_publish (producer, buffer, 100));
+    }
+
+    /* The consumer skips to the oldest message available, and from then on
+     * reads all the remaining ones in order */
+    first = _mbim_indication_ring_read (consumer, &n_overruns);
+    g_assert (first != NULL);
+    g_assert_cmpuint (n_overruns, ==, 1);
+
+    while (TRUE) {
+        g_autoptr(GBytes) bytes = NULL;
+
+        bytes = _mbim_indication_ring_read (consumer, &n_overruns);
+        if (!bytes)
+            break;
+        n_read++;
+    }
+
+    g_assert_cmpuint (n_overruns, ==, 1);
+    g_assert_cmpuint (n_read, >, 0);
+    g_assert_cmpuint (n_read, <, 200);
+    assert_message (first, 100, 200 - n_read);
+}
+
+static void
+test_indication_ring_too_big (void)
+{
+    g_autoptr(MbimIndicationRing) producer = NULL;
+    g_autoptr(MbimIndicationRing) consumer = NULL;
+    g_autofree guint8            *buffer = NULL;
+    guint                         n_overruns = 0;
+
+    ring_new_pair (4096, &producer, &consumer);
+
+    buffer = g_malloc0 (4096);
+    g_assert (!_mbim_indication_ring_publish (producer, buffer, 4096));
+    g_assert (!_mbim_indication_ring_publish (producer, buffer, 2048));
+    g_assert (_mbim_indication_ring_publish (producer, buffer, 1024));
+
+    g_assert (_mbim_indication_ring_read (consumer, &n_overruns) != NULL);
+    g_assert (_mbim_indication_ring_read (consumer, &n_overruns) == NULL);
+}
+
+static void
+test_indication_ring_late_consumer (void)
+{
+    g_autoptr(MbimIndicationRing) producer = NULL;
+    g_autoptr(MbimIndicationRing) consumer = NULL;
+    g_autoptr(GBytes)             bytes = NULL;
+    GError                       *error = NULL;
+    guint8                        buffer[64];
+    guint                         n_overruns = 0;
+    gint                          fd;
+
+    producer = _mbim_indication_ring_new (4096, &error);
+    g_assert_no_error (error);
+
+    fill_message (buffer, sizeof (buffer), 1);
+    g_assert (_mbim_indication_ring_publish (producer, buffer, sizeof (buffer)));
+
+    /* Messages published before the consumer attached are never read */
+    fd = _mbim_indication_ring_dup_readonly_fd (producer, &error);
+    g_assert_no_error (error);
+    consumer = _mbim_indication_ring_new_from_fd (fd, &error);
+    g_assert_no_error (error);
+    g_assert (_mbim_indication_ring_read (consumer, &n_overruns) == NULL);
+
+    fill_message (buffer, sizeof (buffer), 2);
+    g_assert (_mbim_indication_ring_publish (producer, buffer, sizeof (buffer)));
+
+    bytes = _mbim_indication_ring_read (consumer, &n_overruns);
+    assert_message (bytes, sizeof (buffer), 2);
+    g_assert_cmpuint (n_overruns, ==, 0);
+}
+
+/* Concurrent producer and consumer: every record read must be complete and
+ * uncorrupted, and records must be read in order, even if some are lost
+ * because the consumer is slower than the producer. */
+
+#define STRESS_N_RECORDS 1000000
+
+typedef struct {
+    MbimIndicationRing *producer;
+    volatile gint       started;
+} StressContext;
+
+static guint32
+stress_record_length (guint32 seq)
+{
+    return sizeof (guint32) + 4 + (seq % 193);
+}
+
+static gpointer
+stress_producer_thread (StressContext *ctx)
+{
+    guint8  buffer[256];
+    guint32 seq;
+
+    /* Don't run ahead of the consumer before it starts reading */
+    while (!g_atomic_int_get (&ctx->started))
+        g_thread_yield ();
+
+    for (seq = 0; seq < STRESS_N_RECORDS; seq++) {
+        guint32 length;
+
+        length = stress_record_length (seq);
+        memcpy (buffer, &seq, sizeof (seq));
+        fill_message (&buffer[sizeof (seq)], length - sizeof (seq), seq);
+        g_assert (_mbim_indication_ring_publish (ctx->producer, buffer, length));
+    }
+    return NULL;
+}
+
+static void
+test_indication_ring_stress (void)
+{
+    g_autoptr(MbimIndicationRing) producer = NULL;
+    g_autoptr(MbimIndicationRing) consumer = NULL;
+    StressContext                 ctx;
+    GThread                      *thread;
+    guint8                        expected[256];
+    guint                         n_overruns = 0;
+    guint                         n_read = 0;
+    gint64                        last = -1;
+
+    ring_new_pair (4096, &producer, &consumer);
+
+    ctx.producer = producer;
+    ctx.started = FALSE;
+    thread = g_thread_new ("producer", (GThreadFunc) stress_producer_thread, &ctx);
+
+    while (last < STRESS_N_RECORDS - 1) {
+        g_autoptr(GBytes)  bytes = NULL;
+        const guint8      *data;
+        gsize              length;
+        guint32            seq;
+
+        g_atomic_int_set (&ctx.started, TRUE);
+        bytes = _mbim_indication_ring_read (consumer, &n_overruns);
+        if (!bytes) {
+            g_thread_yield ();
+            continue;
+        }
+
+        data = g_bytes_get_data (bytes, &length);
+        g_assert_cmpuint (length, >=, sizeof (seq));
+        memcpy (&seq, data, sizeof (seq));
+        g_assert_cmpint ((gint64) seq, >, last);
+        g_assert_cmpuint (length, ==, stress_record_length (seq));
+        fill_message (expected, length - sizeof (seq), seq);
+        g_assert_cmpmem (&data[sizeof (seq)], length - sizeof (seq), expected, length - sizeof (seq));
+
+        last = seq;
+        n_read++;
+    }
+
+    g_thread_join (thread);
+
+    g_assert (_mbim_indication_ring_read (consumer, &n_overruns) == NULL);
+    g_assert_cmpuint (n_read, >, 0);
+    g_assert_cmpuint (n_read + n_overruns, <=, STRESS_N_RECORDS);
+}
+
+int main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/libmbim-glib/indication-ring/publish-read",  test_indication_ring_publish_read);
+    g_test_add_func ("/libmbim-glib/indication-ring/wrap",          test_indication_ring_wrap);
+    g_test_add_func ("/libmbim-glib/indication-ring/overrun",       test_indication_ring_overrun);
+    g_test_add_func ("/libmbim-glib/indication-ring/too-big",       test_indication_ring_too_big);
+    g_test_add_func ("/libmbim-glib/indication-ring/late-consumer", test_indication_ring_late_consumer);
+    g_test_add_func ("/libmbim-glib/indication-ring/stress",        test_indication_ring_stress);
+
+    return g_test_run ();
+}
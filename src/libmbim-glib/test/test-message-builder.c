@@ -22,11 +22,21 @@
 #include "mbim-enums.h"
 #include "mbim-common.h"
 #include "mbim-basic-connect.h"
+#if defined MBIM_SERVICE_USSD_ENABLED
 #include "mbim-ussd.h"
+#endif
+#if defined MBIM_SERVICE_AUTH_ENABLED
 #include "mbim-auth.h"
+#endif
+#if defined MBIM_SERVICE_STK_ENABLED
 #include "mbim-stk.h"
+#endif
+#if defined MBIM_SERVICE_DSS_ENABLED
 #include "mbim-dss.h"
+#endif
+#if defined MBIM_SERVICE_MS_HOST_SHUTDOWN_ENABLED
 #include "mbim-ms-host-shutdown.h"
+#endif
 
 #if defined ENABLE_TEST_MESSAGE_TRACES
 static void
@@ -500,6 +510,7 @@ test_message_builder_basic_connect_device_service_subscribe_list_set (void)
     mbim_message_unref (message);
 }
 
+#if defined MBIM_SERVICE_USSD_ENABLED
 static void
 test_message_builder_ussd_set (void)
 {
@@ -569,7 +580,9 @@ test_message_builder_ussd_set (void)
 
     mbim_message_unref (message);
 }
+#endif
 
+#if defined MBIM_SERVICE_AUTH_ENABLED
 static void
 test_message_builder_auth_akap_query (void)
 {
@@ -649,7 +662,9 @@ test_message_builder_auth_akap_query (void)
 
     mbim_message_unref (message);
 }
+#endif
 
+#if defined MBIM_SERVICE_STK_ENABLED
 static void
 test_message_builder_stk_pac_set (void)
 {
@@ -867,6 +882,7 @@ test_message_builder_stk_envelope_set (void)
 
     mbim_message_unref (message);
 }
+#endif
 
 static void
 test_message_builder_basic_connect_ip_packet_filters_set_none (void)
@@ -1121,6 +1137,7 @@ test_message_builder_basic_connect_ip_packet_filters_set_two (void)
     mbim_packet_filter_array_free (filters);
 }
 
+#if defined MBIM_SERVICE_DSS_ENABLED
 static void
 test_message_builder_dss_connect_set (void)
 {
@@ -1188,6 +1205,7 @@ test_message_builder_dss_connect_set (void)
 
     mbim_message_unref (message);
 }
+#endif
 
 static void
 test_message_builder_basic_connect_multicarrier_providers_set (void)
@@ -1297,6 +1315,7 @@ test_message_builder_basic_connect_multicarrier_providers_set (void)
     mbim_provider_array_free (providers);
 }
 
+#if defined MBIM_SERVICE_MS_HOST_SHUTDOWN_ENABLED
 static void
 test_message_builder_ms_host_shutdown_notify_set (void)
 {
@@ -1345,6 +1364,7 @@ test_message_builder_ms_host_shutdown_notify_set (void)
 
     mbim_message_unref (message);
 }
+#endif
 
 int main (int argc, char **argv)
 {
@@ -1356,17 +1376,27 @@ int main (int argc, char **argv)
     g_test_add_func ("/libmbim-glib/message/builder/basic-connect/connect/set", test_message_builder_basic_connect_connect_set);
     g_test_add_func ("/libmbim-glib/message/builder/basic-connect/service-activation/set", test_message_builder_basic_connect_service_activation_set);
     g_test_add_func ("/libmbim-glib/message/builder/basic-connect/device-service-subscribe-list/set", test_message_builder_basic_connect_device_service_subscribe_list_set);
+#if defined MBIM_SERVICE_USSD_ENABLED
     g_test_add_func ("/libmbim-glib/message/builder/ussd/set", test_message_builder_ussd_set);
+#endif
+#if defined MBIM_SERVICE_AUTH_ENABLED
     g_test_add_func ("/libmbim-glib/message/builder/auth/akap/query", test_message_builder_auth_akap_query);
+#endif
+#if defined MBIM_SERVICE_STK_ENABLED
     g_test_add_func ("/libmbim-glib/message/builder/stk/pac/set", test_message_builder_stk_pac_set);
     g_test_add_func ("/libmbim-glib/message/builder/stk/terminal-response/set", test_message_builder_stk_terminal_response_set);
     g_test_add_func ("/libmbim-glib/message/builder/stk/envelope/set", test_message_builder_stk_envelope_set);
+#endif
     g_test_add_func ("/libmbim-glib/message/builder/basic-connect/ip-packet-filters/set/none", test_message_builder_basic_connect_ip_packet_filters_set_none);
     g_test_add_func ("/libmbim-glib/message/builder/basic-connect/ip-packet-filters/set/one", test_message_builder_basic_connect_ip_packet_filters_set_one);
     g_test_add_func ("/libmbim-glib/message/builder/basic-connect/ip-packet-filters/set/two", test_message_builder_basic_connect_ip_packet_filters_set_two);
+#if defined MBIM_SERVICE_DSS_ENABLED
     g_test_add_func ("/libmbim-glib/message/builder/dss/connect/set", test_message_builder_dss_connect_set);
+#endif
     g_test_add_func ("/libmbim-glib/message/builder/basic-connect/multicarrier-providers/set", test_message_builder_basic_connect_multicarrier_providers_set);
+#if defined MBIM_SERVICE_MS_HOST_SHUTDOWN_ENABLED
     g_test_add_func ("/libmbim-glib/message/builder/ms-host-shutdown/notify/set", test_message_builder_ms_host_shutdown_notify_set);
+#endif
 
     return g_test_run ();
 }
@@ -17,11 +17,21 @@
 #include <string.h>
 
 #include "mbim-basic-connect.h"
+#if defined MBIM_SERVICE_SMS_ENABLED
 #include "mbim-sms.h"
+#endif
+#if defined MBIM_SERVICE_USSD_ENABLED
 #include "mbim-ussd.h"
+#endif
+#if defined MBIM_SERVICE_AUTH_ENABLED
 #include "mbim-auth.h"
+#endif
+#if defined MBIM_SERVICE_STK_ENABLED
 #include "mbim-stk.h"
+#endif
+#if defined MBIM_SERVICE_MS_FIRMWARE_ID_ENABLED
 #include "mbim-ms-firmware-id.h"
+#endif
 #include "mbim-message.h"
 #include "mbim-cid.h"
 #include "mbim-common.h"
@@ -672,6 +682,7 @@ test_message_parser_provisioned_contexts (void)
     g_assert_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_INVALID_MESSAGE);
 }
 
+#if defined MBIM_SERVICE_SMS_ENABLED
 static void
 test_message_parser_sms_read_zero_pdu (void)
 {
@@ -914,7 +925,9 @@ test_message_parser_sms_read_multiple_pdu (void)
     g_assert_cmpuint (pdu_messages[idx]->pdu_data_size, ==, sizeof (expected_pdu_idx7));
     g_assert (memcmp (pdu_messages[idx]->pdu_data, expected_pdu_idx7, sizeof (expected_pdu_idx7)) == 0);
 }
+#endif
 
+#if defined MBIM_SERVICE_USSD_ENABLED
 static void
 test_message_parser_ussd (void)
 {
@@ -985,7 +998,9 @@ test_message_parser_ussd (void)
     g_assert_cmpuint (ussd_payload_size, ==, sizeof (expected_payload));
     g_assert (memcmp (ussd_payload, expected_payload, sizeof (expected_payload)) == 0);
 }
+#endif
 
+#if defined MBIM_SERVICE_AUTH_ENABLED
 static void
 test_message_parser_auth_akap (void)
 {
@@ -1097,7 +1112,9 @@ test_message_parser_auth_akap (void)
                         sizeof (expected_auts));
     g_assert (memcmp (auts, expected_auts, sizeof (expected_auts)) == 0);
 }
+#endif
 
+#if defined MBIM_SERVICE_STK_ENABLED
 static void
 test_message_parser_stk_pac_notification (void)
 {
@@ -1459,6 +1476,7 @@ test_message_parser_stk_envelope_response (void)
                         sizeof (expected_databuffer));
     g_assert (memcmp (databuffer, expected_databuffer, sizeof (expected_databuffer)) == 0);
 }
+#endif
 
 static void
 test_message_parser_basic_connect_ip_packet_filters_none (void)
@@ -1687,6 +1705,7 @@ test_message_parser_basic_connect_ip_packet_filters_two (void)
     g_assert (memcmp (filters[1]->packet_mask, expected_mask2, sizeof (expected_mask2)) == 0);
 }
 
+#if defined MBIM_SERVICE_MS_FIRMWARE_ID_ENABLED
 static void
 test_message_parser_ms_firmware_id_get (void)
 {
@@ -1735,6 +1754,7 @@ test_message_parser_ms_firmware_id_get (void)
 
     g_assert (mbim_uuid_cmp (firmware_id, &expected_firmware_id));
 }
+#endif
 
 static void
 test_message_parser_basic_connect_connect_short (void)
@@ -1867,19 +1887,29 @@ int main (int argc, char **argv)
     g_test_add_func ("/libmbim-glib/message/parser/basic-connect/service-activation", test_message_parser_basic_connect_service_activation);
     g_test_add_func ("/libmbim-glib/message/parser/basic-connect/register-state", test_message_parser_basic_connect_register_state);
     g_test_add_func ("/libmbim-glib/message/parser/basic-connect/provisioned-contexts", test_message_parser_provisioned_contexts);
+#if defined MBIM_SERVICE_SMS_ENABLED
     g_test_add_func ("/libmbim-glib/message/parser/sms/read/zero-pdu", test_message_parser_sms_read_zero_pdu);
     g_test_add_func ("/libmbim-glib/message/parser/sms/read/single-pdu", test_message_parser_sms_read_single_pdu);
     g_test_add_func ("/libmbim-glib/message/parser/sms/read/multiple-pdu", test_message_parser_sms_read_multiple_pdu);
+#endif
+#if defined MBIM_SERVICE_USSD_ENABLED
     g_test_add_func ("/libmbim-glib/message/parser/ussd", test_message_parser_ussd);
+#endif
+#if defined MBIM_SERVICE_AUTH_ENABLED
     g_test_add_func ("/libmbim-glib/message/parser/auth/akap", test_message_parser_auth_akap);
+#endif
+#if defined MBIM_SERVICE_STK_ENABLED
     g_test_add_func ("/libmbim-glib/message/parser/stk/pac/notification", test_message_parser_stk_pac_notification);
     g_test_add_func ("/libmbim-glib/message/parser/stk/pac/response", test_message_parser_stk_pac_response);
     g_test_add_func ("/libmbim-glib/message/parser/stk/terminal/response", test_message_parser_stk_terminal_response);
     g_test_add_func ("/libmbim-glib/message/parser/stk/envelope/response", test_message_parser_stk_envelope_response);
+#endif
     g_test_add_func ("/libmbim-glib/message/parser/basic-connect/ip-packet-filters/none", test_message_parser_basic_connect_ip_packet_filters_none);
     g_test_add_func ("/libmbim-glib/message/parser/basic-connect/ip-packet-filters/one", test_message_parser_basic_connect_ip_packet_filters_one);
     g_test_add_func ("/libmbim-glib/message/parser/basic-connect/ip-packet-filters/two", test_message_parser_basic_connect_ip_packet_filters_two);
+#if defined MBIM_SERVICE_MS_FIRMWARE_ID_ENABLED
     g_test_add_func ("/libmbim-glib/message/parser/ms-firmware-id/get", test_message_parser_ms_firmware_id_get);
+#endif
     g_test_add_func ("/libmbim-glib/message/parser/basic-connect/connect/short", test_message_parser_basic_connect_connect_short);
     g_test_add_func ("/libmbim-glib/message/parser/basic-connect/visible-providers/overflow", test_message_parser_basic_connect_visible_providers_overflow);
 
@@ -18,6 +18,9 @@
 
 #include "mbim-message.h"
 #include "mbim-cid.h"
+#include "mbim-enums.h"
+#include "mbim-basic-connect.h"
+#include "mbim-error-types.h"
 
 static void
 test_message_open (void)
@@ -182,6 +185,7 @@ static void
 test_message_command_done (void)
 {
     MbimMessage *message;
+    MbimMessage *copy;
     const guint8 buffer [] =  { 0x03, 0x00, 0x00, 0x80,
                                 0x3c, 0x00, 0x00, 0x00,
                                 0x01, 0x00, 0x00, 0x00,
@@ -218,9 +222,212 @@ test_message_command_done (void)
     g_assert_cmpuint (len, ==, sizeof (expected_information_buffer));
     g_assert (memcmp (&expected_information_buffer, out_information_buffer, sizeof (expected_information_buffer)) == 0);
 
+    /* The service looked up above is kept in copies */
+    copy = mbim_message_dup (message);
+    g_assert_cmpuint (mbim_message_command_done_get_service (copy), ==, MBIM_SERVICE_BASIC_CONNECT);
+    mbim_message_unref (copy);
+
+    mbim_message_unref (message);
+}
+
+static void
+test_message_command_prepared (void)
+{
+    MbimMessage  *message;
+    const guint8 *raw_before;
+    const guint8 *raw_after;
+    guint32       len;
+
+    message = mbim_message_command_new (0,
+                                        MBIM_SERVICE_BASIC_CONNECT,
+                                        MBIM_CID_BASIC_CONNECT_SIGNAL_STATE,
+                                        MBIM_MESSAGE_COMMAND_TYPE_QUERY);
+    g_assert (message != NULL);
+    g_assert (!mbim_message_command_is_prepared (message));
+
+    mbim_message_command_prepare (message);
+    g_assert (mbim_message_command_is_prepared (message));
+
+    /* Rewriting the transaction ID must be done in place */
+    raw_before = mbim_message_get_raw (message, &len, NULL);
+    mbim_message_set_transaction_id (message, 1);
+    mbim_message_set_transaction_id (message, 2);
+    raw_after = mbim_message_get_raw (message, &len, NULL);
+    g_assert (raw_before == raw_after);
+    g_assert_cmpuint (len, ==, 48);
+    g_assert_cmpuint (mbim_message_get_transaction_id (message), ==, 2);
+
     mbim_message_unref (message);
 }
 
+static const guint8 signal_state_response [] = {
+    /* header */
+    0x03, 0x00, 0x00, 0x80, /* type */
+    0x44, 0x00, 0x00, 0x00, /* length */
+    0x01, 0x00, 0x00, 0x00, /* transaction id */
+    /* fragment header */
+    0x01, 0x00, 0x00, 0x00, /* total */
+    0x00, 0x00, 0x00, 0x00, /* current */
+    /* command_done_message */
+    0xa2, 0x89, 0xcc, 0x33, /* service id */
+    0xbc, 0xbb, 0x8b, 0x4f,
+    0xb6, 0xb0, 0x13, 0x3e,
+    0xc2, 0xaa, 0xe6, 0xdf,
+    0x0b, 0x00, 0x00, 0x00, /* command id */
+    0x00, 0x00, 0x00, 0x00, /* status code */
+    0x14, 0x00, 0x00, 0x00, /* buffer length */
+    /* information buffer */
+    0x14, 0x00, 0x00, 0x00, /* rssi */
+    0x63, 0x00, 0x00, 0x00, /* error rate */
+    0x05, 0x00, 0x00, 0x00, /* signal strength interval */
+    0x00, 0x00, 0x00, 0x00, /* rssi threshold */
+    0xff, 0xff, 0xff, 0xff  /* error rate threshold */
+};
+
+static void
+test_message_printable (void)
+{
+    MbimMessage      *message;
+    g_autofree gchar *printable = NULL;
+
+    message = mbim_message_new (signal_state_response, sizeof (signal_state_response));
+    printable = mbim_message_get_printable (message, ">>>>>> ", FALSE);
+    g_assert (printable != NULL);
+
+    g_assert (strstr (printable,
+                      ">>>>>> Fields:\n"
+                      ">>>>>>   Rssi = '20'\n"
+                      ">>>>>>   ErrorRate = '99'\n"
+                      ">>>>>>   SignalStrengthInterval = '5'\n"
+                      ">>>>>>   RssiThreshold = '0'\n"
+                      ">>>>>>   ErrorRateThreshold = '4294967295'\n") != NULL);
+
+    mbim_message_unref (message);
+}
+
+/* Run with -m perf to compare the message backends of the code generator */
+static void
+test_message_printable_perf (void)
+{
+    MbimMessage *message;
+    guint        i;
+    gdouble      elapsed;
+
+    message = mbim_message_new (signal_state_response, sizeof (signal_state_response));
+
+    g_test_timer_start ();
+    for (i = 0; i < 100000; i++) {
+        g_autofree gchar *printable = NULL;
+
+        printable = mbim_message_get_printable (message, ">>>>>> ", FALSE);
+    }
+    elapsed = g_test_timer_elapsed ();
+    g_test_minimized_result (elapsed, "printed 100000 messages in %.3f seconds", elapsed);
+
+    mbim_message_unref (message);
+}
+
+static void
+test_message_parse_perf (void)
+{
+    MbimMessage *message;
+    guint        i;
+    gdouble      elapsed;
+
+    message = mbim_message_new (signal_state_response, sizeof (signal_state_response));
+
+    g_test_timer_start ();
+    for (i = 0; i < 1000000; i++) {
+        guint32 rssi = 0;
+
+        g_assert (mbim_message_signal_state_response_parse (message, &rssi, NULL, NULL, NULL, NULL, NULL));
+    }
+    elapsed = g_test_timer_elapsed ();
+    g_test_minimized_result (elapsed, "parsed 1000000 messages in %.3f seconds", elapsed);
+
+    mbim_message_unref (message);
+}
+
+static void
+test_message_build_perf (void)
+{
+    guint   i;
+    gdouble elapsed;
+
+    g_test_timer_start ();
+    for (i = 0; i < 1000000; i++) {
+        MbimMessage *message;
+
+        message = mbim_message_connect_set_new (1,
+                                                MBIM_ACTIVATION_COMMAND_ACTIVATE,
+                                                "internet",
+                                                "user",
+                                                "password",
+                                                MBIM_COMPRESSION_NONE,
+                                                MBIM_AUTH_PROTOCOL_PAP,
+                                                MBIM_CONTEXT_IP_TYPE_IPV4,
+                                                mbim_uuid_from_context_type (MBIM_CONTEXT_TYPE_INTERNET),
+                                                NULL);
+        mbim_message_unref (message);
+    }
+    elapsed = g_test_timer_elapsed ();
+    g_test_minimized_result (elapsed, "built 1000000 messages in %.3f seconds", elapsed);
+}
+
+static void
+test_message_from_bytes (void)
+{
+    g_autoptr(GBytes)  bytes = NULL;
+    g_autoptr(GError)  error = NULL;
+    MbimMessage       *message;
+    const guint8       buffer [] = { 0x02, 0x00, 0x00, 0x80,
+                                     0x10, 0x00, 0x00, 0x00,
+                                     0x01, 0x00, 0x00, 0x00,
+                                     0x00, 0x00, 0x00, 0x00,
+                                     /* trailing data, not part of the message */
+                                     0xff, 0xff, 0xff, 0xff };
+    const guint8      *raw;
+    guint32            len;
+
+    /* Wrap the static buffer without copying it */
+    bytes = g_bytes_new_static (buffer, sizeof (buffer));
+    message = mbim_message_new_from_bytes (bytes, &error);
+    g_assert_no_error (error);
+    g_assert (message != NULL);
+
+    g_assert_cmpuint (mbim_message_get_transaction_id         (message), ==, 1);
+    g_assert_cmpuint (mbim_message_get_message_type           (message), ==, MBIM_MESSAGE_TYPE_CLOSE_DONE);
+    g_assert_cmpuint (mbim_message_get_message_length         (message), ==, 16);
+    g_assert_cmpuint (mbim_message_close_done_get_status_code (message), ==, MBIM_STATUS_ERROR_NONE);
+
+    raw = mbim_message_get_raw (message, &len, &error);
+    g_assert_no_error (error);
+    g_assert (raw == buffer);
+    g_assert_cmpuint (len, ==, 16);
+
+    /* Modifying the message must not modify the wrapped memory */
+    mbim_message_set_transaction_id (message, 2);
+    g_assert_cmpuint (mbim_message_get_transaction_id (message), ==, 2);
+    g_assert_cmpuint (buffer[8], ==, 0x01);
+
+    mbim_message_unref (message);
+
+    /* Too short to hold a header */
+    g_clear_pointer (&bytes, g_bytes_unref);
+    bytes = g_bytes_new_static (buffer, 8);
+    message = mbim_message_new_from_bytes (bytes, &error);
+    g_assert_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_INVALID_MESSAGE);
+    g_assert (message == NULL);
+    g_clear_error (&error);
+
+    /* Header reports more data than available */
+    g_clear_pointer (&bytes, g_bytes_unref);
+    bytes = g_bytes_new_static (buffer, 12);
+    message = mbim_message_new_from_bytes (bytes, &error);
+    g_assert_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_INVALID_MESSAGE);
+    g_assert (message == NULL);
+}
+
 int main (int argc, char **argv)
 {
     g_test_init (&argc, &argv, NULL);
@@ -232,7 +439,16 @@ int main (int argc, char **argv)
     g_test_add_func ("/libmbim-glib/message/command/empty",          test_message_command_empty);
     g_test_add_func ("/libmbim-glib/message/command/not-empty",      test_message_command_not_empty);
     g_test_add_func ("/libmbim-glib/message/command/custom-service", test_message_command_custom_service);
+    g_test_add_func ("/libmbim-glib/message/command/prepared",       test_message_command_prepared);
     g_test_add_func ("/libmbim-glib/message/command-done",           test_message_command_done);
+    g_test_add_func ("/libmbim-glib/message/printable",              test_message_printable);
+    if (g_test_perf ())
+        g_test_add_func ("/libmbim-glib/message/printable/perf",     test_message_printable_perf);
+    if (g_test_perf ())
+        g_test_add_func ("/libmbim-glib/message/parse/perf",         test_message_parse_perf);
+    if (g_test_perf ())
+        g_test_add_func ("/libmbim-glib/message/build/perf",         test_message_build_perf);
+    g_test_add_func ("/libmbim-glib/message/from-bytes",             test_message_from_bytes);
 
     return g_test_run ();
 }
@@ -403,6 +403,111 @@ test_merge_list_merged_services (void)
     mbim_event_entry_array_free (expected);
 }
 
+static void
+test_contains (void)
+{
+    MbimEventEntry **list;
+    gsize list_size;
+
+    list_size = 2;
+    list = g_new0 (MbimEventEntry *, list_size + 1);
+    list[0] = g_new0 (MbimEventEntry, 1);
+    memcpy (&list[0]->device_service_id, MBIM_UUID_BASIC_CONNECT, sizeof (MbimUuid));
+    list[0]->cids_count = 2;
+    list[0]->cids = g_new0 (guint32, list[0]->cids_count);
+    list[0]->cids[0] = MBIM_CID_BASIC_CONNECT_REGISTER_STATE;
+    list[0]->cids[1] = MBIM_CID_BASIC_CONNECT_SIGNAL_STATE;
+    list[1] = g_new0 (MbimEventEntry, 1);
+    memcpy (&list[1]->device_service_id, MBIM_UUID_QMI, sizeof (MbimUuid));
+    list[1]->cids_count = 0;
+    list[1]->cids = NULL;
+
+    /* Specific CIDs */
+    g_assert (_mbim_proxy_helper_service_subscribe_list_contains ((const MbimEventEntry * const *)list, list_size,
+                                                                  MBIM_UUID_BASIC_CONNECT, MBIM_CID_BASIC_CONNECT_SIGNAL_STATE));
+    g_assert (!_mbim_proxy_helper_service_subscribe_list_contains ((const MbimEventEntry * const *)list, list_size,
+                                                                   MBIM_UUID_BASIC_CONNECT, MBIM_CID_BASIC_CONNECT_CONNECT));
+
+    /* All CIDs of the service */
+    g_assert (_mbim_proxy_helper_service_subscribe_list_contains ((const MbimEventEntry * const *)list, list_size,
+                                                                  MBIM_UUID_QMI, MBIM_CID_QMI_MSG));
+
+    /* Service not in the list */
+    g_assert (!_mbim_proxy_helper_service_subscribe_list_contains ((const MbimEventEntry * const *)list, list_size,
+                                                                   MBIM_UUID_ATDS, MBIM_CID_ATDS_SIGNAL));
+
+    /* Empty list */
+    g_assert (!_mbim_proxy_helper_service_subscribe_list_contains (NULL, 0,
+                                                                   MBIM_UUID_BASIC_CONNECT, MBIM_CID_BASIC_CONNECT_SIGNAL_STATE));
+
+    mbim_event_entry_array_free (list);
+}
+
+static void
+test_percentile (void)
+{
+    guint32 samples[100];
+    guint32 single = 42;
+    guint   i;
+
+    for (i = 0; i < G_N_ELEMENTS (samples); i++)
+        samples[i] = (i + 1) * 10;
+
+    g_assert_cmpuint (_mbim_proxy_helper_percentile (samples, G_N_ELEMENTS (samples), 50), ==, 500);
+    g_assert_cmpuint (_mbim_proxy_helper_percentile (samples, G_N_ELEMENTS (samples), 90), ==, 900);
+    g_assert_cmpuint (_mbim_proxy_helper_percentile (samples, G_N_ELEMENTS (samples), 99), ==, 990);
+    g_assert_cmpuint (_mbim_proxy_helper_percentile (samples, G_N_ELEMENTS (samples), 100), ==, 1000);
+    g_assert_cmpuint (_mbim_proxy_helper_percentile (samples, G_N_ELEMENTS (samples), 0), ==, 10);
+
+    /* Few samples */
+    g_assert_cmpuint (_mbim_proxy_helper_percentile (samples, 3, 50), ==, 20);
+    g_assert_cmpuint (_mbim_proxy_helper_percentile (samples, 3, 99), ==, 30);
+    g_assert_cmpuint (_mbim_proxy_helper_percentile (&single, 1, 50), ==, 42);
+
+    /* No samples */
+    g_assert_cmpuint (_mbim_proxy_helper_percentile (NULL, 0, 50), ==, 0);
+}
+
+static void
+test_variant (void)
+{
+    MbimEventEntry      **list;
+    MbimEventEntry      **parsed;
+    gsize                 list_size;
+    gsize                 parsed_size = 0;
+    g_autoptr(GVariant)   variant = NULL;
+    g_autoptr(GVariant)   other = NULL;
+
+    list_size = 2;
+    list = g_new0 (MbimEventEntry *, list_size + 1);
+    list[0] = g_new0 (MbimEventEntry, 1);
+    memcpy (&list[0]->device_service_id, MBIM_UUID_BASIC_CONNECT, sizeof (MbimUuid));
+    list[0]->cids_count = 2;
+    list[0]->cids = g_new0 (guint32, list[0]->cids_count);
+    list[0]->cids[0] = MBIM_CID_BASIC_CONNECT_REGISTER_STATE;
+    list[0]->cids[1] = MBIM_CID_BASIC_CONNECT_SIGNAL_STATE;
+    list[1] = g_new0 (MbimEventEntry, 1);
+    memcpy (&list[1]->device_service_id, MBIM_UUID_QMI, sizeof (MbimUuid));
+    list[1]->cids_count = 0;
+    list[1]->cids = NULL;
+
+    variant = g_variant_ref_sink (_mbim_proxy_helper_service_subscribe_list_to_variant ((const MbimEventEntry * const *)list, list_size));
+    g_assert (g_variant_is_of_type (variant, G_VARIANT_TYPE ("a(ayau)")));
+
+    parsed = _mbim_proxy_helper_service_subscribe_list_from_variant (variant, &parsed_size);
+    g_assert (parsed != NULL);
+    g_assert (_mbim_proxy_helper_service_subscribe_list_cmp ((const MbimEventEntry * const *)parsed, parsed_size,
+                                                             (const MbimEventEntry * const *)list, list_size));
+
+    /* Unexpected types are ignored */
+    other = g_variant_ref_sink (g_variant_new_uint32 (0));
+    g_assert (_mbim_proxy_helper_service_subscribe_list_from_variant (other, &parsed_size) == NULL);
+    g_assert_cmpuint (parsed_size, ==, 0);
+
+    mbim_event_entry_array_free (parsed);
+    mbim_event_entry_array_free (list);
+}
+
 /*****************************************************************************/
 
 int main (int argc, char **argv)
@@ -418,6 +523,9 @@ int main (int argc, char **argv)
     g_test_add_func ("/libmbim-glib/proxy/merge/same-service",         test_merge_list_same_service);
     g_test_add_func ("/libmbim-glib/proxy/merge/different-services",   test_merge_list_different_services);
     g_test_add_func ("/libmbim-glib/proxy/merge/merged-services",      test_merge_list_merged_services);
+    g_test_add_func ("/libmbim-glib/proxy/contains",                   test_contains);
+    g_test_add_func ("/libmbim-glib/proxy/percentile",                 test_percentile);
+    g_test_add_func ("/libmbim-glib/proxy/variant",                    test_variant);
 
     return g_test_run ();
 }
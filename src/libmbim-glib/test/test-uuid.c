@@ -190,7 +190,9 @@ test_uuid_custom (void)
         .d = { 0x20, 0x63 },
         .e = { 0x75, 0x73, 0x74, 0x6f, 0x6d, 0x21 }
     };
-    guint service;
+    guint           service;
+    const gchar    *name;
+    const MbimUuid *uuid;
 
     /* SERVICE_AUTH is not a custom service */
     g_assert (!mbim_service_id_is_custom (MBIM_SERVICE_AUTH));
@@ -200,10 +202,25 @@ test_uuid_custom (void)
     g_assert (g_strcmp0 (mbim_service_lookup_name (service), nick) == 0);
     g_assert (mbim_uuid_cmp (mbim_uuid_from_service (service), &uuid_custom));
     g_assert (mbim_uuid_to_service (&uuid_custom) == service);
+
+    /* registering the same UUID again gives the same service */
+    g_assert_cmpuint (mbim_register_custom_service (&uuid_custom, nick), ==, service);
+    /* standard services are never registered as custom */
+    g_assert_cmpuint (mbim_register_custom_service (MBIM_UUID_BASIC_CONNECT, nick), ==, MBIM_SERVICE_BASIC_CONNECT);
+
+    name = mbim_service_lookup_name (service);
+    uuid = mbim_uuid_from_service (service);
     g_assert (mbim_unregister_custom_service (service));
+    g_assert (!mbim_unregister_custom_service (service));
+    g_assert (mbim_uuid_to_service (&uuid_custom) == MBIM_SERVICE_INVALID);
 
     /* once removed service is not custom */
     g_assert (!mbim_service_id_is_custom (service));
+    g_assert (mbim_service_lookup_name (service) == NULL);
+
+    /* but the values looked up before removing it are still valid */
+    g_assert_cmpstr (name, ==, nick);
+    g_assert (mbim_uuid_cmp (uuid, &uuid_custom));
 }
 
 /*****************************************************************************/
@@ -25,10 +25,13 @@
 #include <stdlib.h>
 #include <locale.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
 
 #include <glib.h>
 #include <glib/gprintf.h>
 #include <gio/gio.h>
+#include <gio/gunixsocketaddress.h>
 #include <glib-unix.h>
 
 #include <libmbim-glib.h>
@@ -36,11 +39,21 @@
 #define PROGRAM_NAME    "mbim-proxy"
 #define PROGRAM_VERSION PACKAGE_VERSION
 
-#define EMPTY_TIMEOUT_DEFAULT 300
+#define EMPTY_TIMEOUT_DEFAULT   300
+#define QUEUE_SIZE_DEFAULT      256
+#define DEVICE_COMMANDS_DEFAULT 8
+#define RING_SIZE_DEFAULT       256
+
+/* First descriptor passed by the service manager in socket activation */
+#define LISTEN_FDS_START 3
+
+/* Abstract socket where a new proxy connects to take over the running one */
+#define HANDOFF_SOCKET_PATH "mbim-proxy-handoff"
 
 /* Globals */
 static GMainLoop *loop;
 static MbimProxy *proxy;
+static GSocketService *handoff_service;
 static guint timeout_id;
 static guint client_connected_once = FALSE;
 
@@ -48,7 +61,17 @@ static guint client_connected_once = FALSE;
 static gboolean verbose_flag;
 static gboolean version_flag;
 static gboolean no_exit_flag;
+static gboolean device_threads_flag;
+static gboolean takeover_flag;
 static gint     empty_timeout = -1;
+static gint     queue_size = -1;
+static gchar   *queue_policy_str;
+static gint     device_commands = -1;
+static gint     client_commands;
+static gint     client_rate;
+static gint     ring_size = -1;
+static gint     ready_fd = -1;
+static gint     grace_period;
 
 static GOptionEntry main_entries[] = {
     { "no-exit", 0, 0, G_OPTION_ARG_NONE, &no_exit_flag,
@@ -59,6 +82,46 @@ static GOptionEntry main_entries[] = {
       "If no clients/devices, exit after this timeout. If set to 0, equivalent to --no-exit.",
       "[SECS]"
     },
+    { "device-threads", 0, 0, G_OPTION_ARG_NONE, &device_threads_flag,
+      "Run each device in its own thread",
+      NULL
+    },
+    { "device-grace-period", 0, 0, G_OPTION_ARG_INT, &grace_period,
+      "Close devices after this time without clients (default never)",
+      "[SECS]"
+    },
+    { "queue-size", 0, 0, G_OPTION_ARG_INT, &queue_size,
+      "Maximum number of messages queued for each client",
+      "[MESSAGES]"
+    },
+    { "queue-policy", 0, 0, G_OPTION_ARG_STRING, &queue_policy_str,
+      "What to do when a client queue is full: drop, disconnect or coalesce (default)",
+      "[POLICY]"
+    },
+    { "device-commands", 0, 0, G_OPTION_ARG_INT, &device_commands,
+      "Maximum number of commands in flight in each device. If set to 0, unlimited.",
+      "[COMMANDS]"
+    },
+    { "client-commands", 0, 0, G_OPTION_ARG_INT, &client_commands,
+      "Maximum number of commands in flight for each client (default unlimited)",
+      "[COMMANDS]"
+    },
+    { "client-rate", 0, 0, G_OPTION_ARG_INT, &client_rate,
+      "Maximum number of commands per second sent for each client (default unlimited)",
+      "[COMMANDS]"
+    },
+    { "indication-ring-size", 0, 0, G_OPTION_ARG_INT, &ring_size,
+      "Size of the indication ring shared with clients of each device. If set to 0, disabled.",
+      "[KIB]"
+    },
+    { "ready-fd", 0, 0, G_OPTION_ARG_INT, &ready_fd,
+      "Write to and close this file descriptor once ready to accept clients",
+      "[FD]"
+    },
+    { "takeover", 0, 0, G_OPTION_ARG_NONE, &takeover_flag,
+      "Take over the devices and clients of the running proxy, which then exits",
+      NULL
+    },
     { "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose_flag,
       "Run action with verbose logs, including the debug ones",
       NULL
@@ -81,6 +144,17 @@ quit_cb (gpointer user_data)
     return FALSE;
 }
 
+static gboolean
+reload_cb (gpointer user_data)
+{
+    if (proxy) {
+        g_debug ("Caught SIGHUP, reloading allowed user...");
+        mbim_proxy_invalidate_user_cache (proxy);
+    }
+
+    return TRUE;
+}
+
 static void
 log_handler (const gchar *log_domain,
              GLogLevelFlags log_level,
@@ -206,12 +280,192 @@ proxy_n_devices_changed (MbimProxy *_proxy)
     }
 }
 
+/*****************************************************************************/
+/* Startup */
+
+static guint
+get_activation_fds (gint **fds)
+{
+    const gchar *listen_pid;
+    const gchar *listen_fds;
+    guint64      pid = 0;
+    guint64      n_fds = 0;
+    guint        i;
+
+    /* Sockets passed by the service manager, only if meant for us */
+    listen_pid = g_getenv ("LISTEN_PID");
+    listen_fds = g_getenv ("LISTEN_FDS");
+    if (!listen_pid || !listen_fds ||
+        !g_ascii_string_to_unsigned (listen_pid, 10, 1, G_MAXINT, &pid, NULL) ||
+        !g_ascii_string_to_unsigned (listen_fds, 10, 1, G_MAXINT - LISTEN_FDS_START, &n_fds, NULL) ||
+        pid != (guint64) getpid ())
+        return 0;
+
+    /* Not to be inherited by any child */
+    g_unsetenv ("LISTEN_PID");
+    g_unsetenv ("LISTEN_FDS");
+    g_unsetenv ("LISTEN_FDNAMES");
+
+    *fds = g_new (gint, n_fds);
+    for (i = 0; i < n_fds; i++)
+        (*fds)[i] = LISTEN_FDS_START + i;
+    return (guint) n_fds;
+}
+
+static void
+notify_ready (void)
+{
+    const gchar *notify_socket;
+
+    /* Whoever spawned us waits for this before connecting */
+    if (ready_fd >= 0) {
+        static const gchar ready[] = "READY=1\n";
+
+        if (write (ready_fd, ready, sizeof (ready) - 1) < 0)
+            g_warning ("couldn't notify readiness: %s", g_strerror (errno));
+        close (ready_fd);
+        ready_fd = -1;
+    }
+
+    /* Service manager readiness notification */
+    notify_socket = g_getenv ("NOTIFY_SOCKET");
+    if (notify_socket && (notify_socket[0] == '/' || notify_socket[0] == '@')) {
+        g_autoptr(GSocket)        socket = NULL;
+        g_autoptr(GSocketAddress) address = NULL;
+        g_autoptr(GError)         error = NULL;
+
+        if (notify_socket[0] == '@')
+            address = g_unix_socket_address_new_with_type (notify_socket + 1, -1, G_UNIX_SOCKET_ADDRESS_ABSTRACT);
+        else
+            address = g_unix_socket_address_new (notify_socket);
+
+        socket = g_socket_new (G_SOCKET_FAMILY_UNIX, G_SOCKET_TYPE_DATAGRAM, G_SOCKET_PROTOCOL_DEFAULT, &error);
+        if (!socket || g_socket_send_to (socket, address, "READY=1", strlen ("READY=1"), NULL, &error) < 0)
+            g_warning ("couldn't notify readiness to the service manager: %s", error->message);
+        g_unsetenv ("NOTIFY_SOCKET");
+    }
+}
+
+/*****************************************************************************/
+/* Handoff */
+
+static gboolean
+handoff_incoming_cb (GSocketService    *service,
+                     GSocketConnection *connection,
+                     GObject           *unused,
+                     gpointer           user_data)
+{
+    g_autoptr(GCredentials) credentials = NULL;
+    g_autoptr(GError)       error = NULL;
+    uid_t                   uid;
+
+    /* Only another proxy of the same user may take over */
+    credentials = g_socket_get_credentials (g_socket_connection_get_socket (connection), &error);
+    if (!credentials) {
+        g_warning ("handoff not allowed: error getting socket credentials: %s", error->message);
+        return TRUE;
+    }
+    uid = g_credentials_get_unix_user (credentials, &error);
+    if (error || uid != getuid ()) {
+        g_warning ("handoff not allowed: %s", error ? error->message : "different user");
+        return TRUE;
+    }
+
+    /* The new proxy listens in its own handoff socket once it has taken over */
+    g_socket_service_stop (handoff_service);
+    g_socket_listener_close (G_SOCKET_LISTENER (handoff_service));
+
+    g_debug ("handing off to the new proxy...");
+    if (!mbim_proxy_handoff (proxy, g_socket_connection_get_socket (connection), &error))
+        g_warning ("couldn't hand off: %s", error->message);
+    else
+        g_debug ("handed off to the new proxy");
+
+    /* Nothing else to do either way */
+    if (timeout_id) {
+        g_source_remove (timeout_id);
+        timeout_id = 0;
+    }
+    g_main_loop_quit (loop);
+    return TRUE;
+}
+
+static void
+setup_handoff_service (void)
+{
+    g_autoptr(GSocket)        socket = NULL;
+    g_autoptr(GSocketAddress) address = NULL;
+    g_autoptr(GError)         error = NULL;
+
+    socket = g_socket_new (G_SOCKET_FAMILY_UNIX, G_SOCKET_TYPE_SEQPACKET, G_SOCKET_PROTOCOL_DEFAULT, &error);
+    if (socket) {
+        address = g_unix_socket_address_new_with_type (HANDOFF_SOCKET_PATH, -1, G_UNIX_SOCKET_ADDRESS_ABSTRACT);
+        if (g_socket_bind (socket, address, TRUE, &error) && g_socket_listen (socket, &error)) {
+            handoff_service = g_socket_service_new ();
+            if (g_socket_listener_add_socket (G_SOCKET_LISTENER (handoff_service), socket, NULL, &error)) {
+                g_signal_connect (handoff_service, "incoming", G_CALLBACK (handoff_incoming_cb), NULL);
+                g_socket_service_start (handoff_service);
+                g_debug ("listening for handoffs at '%s'", HANDOFF_SOCKET_PATH);
+                return;
+            }
+            g_clear_object (&handoff_service);
+        }
+    }
+
+    g_warning ("couldn't listen at '%s', the proxy can't be taken over: %s", HANDOFF_SOCKET_PATH, error->message);
+}
+
+static MbimProxy *
+takeover_proxy (GError **error)
+{
+    g_autoptr(GSocket)        socket = NULL;
+    g_autoptr(GSocketAddress) address = NULL;
+    g_autoptr(GCredentials)   credentials = NULL;
+    g_autoptr(GError)         inner_error = NULL;
+    uid_t                     uid;
+
+    socket = g_socket_new (G_SOCKET_FAMILY_UNIX, G_SOCKET_TYPE_SEQPACKET, G_SOCKET_PROTOCOL_DEFAULT, error);
+    if (!socket)
+        return NULL;
+
+    /* No proxy running, start from scratch */
+    address = g_unix_socket_address_new_with_type (HANDOFF_SOCKET_PATH, -1, G_UNIX_SOCKET_ADDRESS_ABSTRACT);
+    if (!g_socket_connect (socket, address, NULL, &inner_error)) {
+        g_debug ("no proxy to take over: %s", inner_error->message);
+        return mbim_proxy_new (error);
+    }
+
+    /* Only take over a proxy of the same user, as anyone may bind the
+     * abstract socket */
+    credentials = g_socket_get_credentials (socket, error);
+    if (!credentials) {
+        g_prefix_error (error, "takeover not allowed: error getting socket credentials: ");
+        return NULL;
+    }
+    uid = g_credentials_get_unix_user (credentials, error);
+    if (uid == (uid_t) -1) {
+        g_prefix_error (error, "takeover not allowed: ");
+        return NULL;
+    }
+    if (uid != getuid ()) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_PERMISSION_DENIED,
+                     "takeover not allowed: proxy running as a different user");
+        return NULL;
+    }
+
+    g_debug ("taking over the running proxy...");
+    return mbim_proxy_new_from_handoff (socket, error);
+}
+
 /*****************************************************************************/
 
 int main (int argc, char **argv)
 {
     g_autoptr(GError)         error = NULL;
     g_autoptr(GOptionContext) context = NULL;
+    g_autofree gint          *activation_fds = NULL;
+    guint                     n_activation_fds;
+    MbimProxyQueuePolicy      queue_policy;
 
     setlocale (LC_ALL, "");
 
@@ -233,20 +487,70 @@ int main (int argc, char **argv)
 
     /* Setup signals */
     g_unix_signal_add (SIGINT,  quit_cb, NULL);
-    g_unix_signal_add (SIGHUP,  quit_cb, NULL);
+    g_unix_signal_add (SIGHUP,  reload_cb, NULL);
     g_unix_signal_add (SIGTERM, quit_cb, NULL);
 
     /* Setup empty timeout */
     if (empty_timeout < 0)
         empty_timeout = EMPTY_TIMEOUT_DEFAULT;
 
-    /* Setup proxy */
-    proxy = mbim_proxy_new (&error);
+    /* Setup proxy, either taking over the running one, listening in its own
+     * sockets, or listening in the ones given by the service manager */
+    n_activation_fds = get_activation_fds (&activation_fds);
+    if (n_activation_fds > 0)
+        g_debug ("socket activated with %u sockets", n_activation_fds);
+    if (takeover_flag)
+        proxy = takeover_proxy (&error);
+    else
+        proxy = mbim_proxy_new_from_fds (activation_fds, n_activation_fds, &error);
     if (!proxy) {
         g_printerr ("error: %s\n", error->message);
         exit (EXIT_FAILURE);
     }
 
+    /* Setup device threads */
+    mbim_proxy_set_device_threads (proxy, device_threads_flag);
+
+    /* Setup how long devices without clients are kept open */
+    if (grace_period < 0) {
+        g_printerr ("error: invalid device grace period: must not be negative\n");
+        exit (EXIT_FAILURE);
+    }
+    mbim_proxy_set_device_grace_period (proxy, (guint) grace_period);
+
+    /* Setup client queue limits */
+    if (queue_size < 0)
+        queue_size = QUEUE_SIZE_DEFAULT;
+    else if (queue_size == 0) {
+        g_printerr ("error: invalid queue size: must be greater than 0\n");
+        exit (EXIT_FAILURE);
+    }
+    if (!queue_policy_str || g_str_equal (queue_policy_str, "coalesce"))
+        queue_policy = MBIM_PROXY_QUEUE_POLICY_COALESCE;
+    else if (g_str_equal (queue_policy_str, "drop"))
+        queue_policy = MBIM_PROXY_QUEUE_POLICY_DROP_INDICATIONS;
+    else if (g_str_equal (queue_policy_str, "disconnect"))
+        queue_policy = MBIM_PROXY_QUEUE_POLICY_DISCONNECT;
+    else {
+        g_printerr ("error: invalid queue policy: '%s'\n", queue_policy_str);
+        exit (EXIT_FAILURE);
+    }
+    mbim_proxy_set_client_queue_limits (proxy, (guint) queue_size, queue_policy);
+
+    /* Setup command scheduling limits */
+    if (device_commands < 0)
+        device_commands = DEVICE_COMMANDS_DEFAULT;
+    if (client_commands < 0 || client_rate < 0) {
+        g_printerr ("error: invalid client limits: must not be negative\n");
+        exit (EXIT_FAILURE);
+    }
+    mbim_proxy_set_command_limits (proxy, (guint) device_commands, (guint) client_commands, (guint) client_rate);
+
+    /* Setup indication rings */
+    if (ring_size < 0)
+        ring_size = RING_SIZE_DEFAULT;
+    mbim_proxy_set_indication_ring_size (proxy, (guint32) MIN (ring_size, G_MAXINT32 / 1024) * 1024);
+
     /* Don't exit the proxy when no clients/devices are found */
     if (!no_exit_flag && empty_timeout != 0) {
         g_debug ("proxy will exit after %d secs if unused", empty_timeout);
@@ -262,12 +566,19 @@ int main (int argc, char **argv)
     } else
         g_debug ("proxy will remain running if unused");
 
+    /* A newer proxy may take over this one */
+    setup_handoff_service ();
+
+    /* Clients may connect right away */
+    notify_ready ();
+
     /* Loop */
     loop = g_main_loop_new (NULL, FALSE);
     g_main_loop_run (loop);
     g_main_loop_unref (loop);
 
     /* Cleanup; releases socket and such */
+    g_clear_object (&handoff_service);
     g_object_unref (proxy);
 
     g_debug ("exiting 'mbim-proxy'...");
@@ -0,0 +1,230 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * mbimcli -- Command line interface to control MBIM devices
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <locale.h>
+#include <string.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include <libmbim-glib.h>
+#include <mbim-proxy-control.h>
+
+#include "mbimcli.h"
+
+/* Context */
+typedef struct {
+    MbimDevice *device;
+    GCancellable *cancellable;
+} Context;
+static Context *ctx;
+
+/* Options */
+static gboolean query_proxy_stats_flag;
+
+static GOptionEntry entries[] = {
+    { "query-proxy-stats", 0, 0, G_OPTION_ARG_NONE, &query_proxy_stats_flag,
+      "Query statistics of the proxy (requires --device-open-proxy)",
+      NULL
+    },
+    { NULL }
+};
+
+GOptionGroup *
+mbimcli_proxy_control_get_option_group (void)
+{
+   GOptionGroup *group;
+
+   group = g_option_group_new ("proxy-control",
+                               "Proxy Control options:",
+                               "Show Proxy Control Service options",
+                               NULL,
+                               NULL);
+   g_option_group_add_entries (group, entries);
+
+   return group;
+}
+
+gboolean
+mbimcli_proxy_control_options_enabled (void)
+{
+    static guint n_actions = 0;
+    static gboolean checked = FALSE;
+
+    if (checked)
+        return !!n_actions;
+
+    n_actions = query_proxy_stats_flag;
+
+    if (n_actions > 1) {
+        g_printerr ("error: too many Proxy Control actions requested\n");
+        exit (EXIT_FAILURE);
+    }
+
+    checked = TRUE;
+    return !!n_actions;
+}
+
+static void
+context_free (Context *context)
+{
+    if (!context)
+        return;
+
+    if (context->cancellable)
+        g_object_unref (context->cancellable);
+    if (context->device)
+        g_object_unref (context->device);
+    g_slice_free (Context, context);
+}
+
+static void
+shutdown (gboolean operation_status)
+{
+    /* Cleanup context and finish async operation */
+    context_free (ctx);
+    mbimcli_async_operation_done (operation_status);
+}
+
+static void
+query_proxy_stats_ready (MbimDevice   *device,
+                         GAsyncResult *res)
+{
+    g_autoptr(MbimMessage)                    response = NULL;
+    g_autoptr(GError)                         error = NULL;
+    guint32                                   n_clients;
+    guint32                                   n_devices;
+    guint64                                   commands_forwarded;
+    guint64                                   indications_forwarded;
+    guint64                                   indications_dropped;
+    guint32                                   latency_p50;
+    guint32                                   latency_p90;
+    guint32                                   latency_p99;
+    guint32                                   device_statistics_count;
+    g_autoptr(MbimProxyDeviceStatisticsArray) device_statistics = NULL;
+    guint32                                   client_statistics_count;
+    g_autoptr(MbimProxyClientStatisticsArray) client_statistics = NULL;
+    guint32                                   i;
+
+    response = mbim_device_command_finish (device, res, &error);
+    if (!response || !mbim_message_response_get_result (response, MBIM_MESSAGE_TYPE_COMMAND_DONE, &error)) {
+        g_printerr ("error: operation failed: %s\n", error->message);
+        shutdown (FALSE);
+        return;
+    }
+
+    if (!mbim_message_proxy_control_statistics_response_parse (
+            response,
+            &n_clients,
+            &n_devices,
+            &commands_forwarded,
+            &indications_forwarded,
+            &indications_dropped,
+            &latency_p50,
+            &latency_p90,
+            &latency_p99,
+            &device_statistics_count,
+            &device_statistics,
+            &client_statistics_count,
+            &client_statistics,
+            &error)) {
+        g_printerr ("error: couldn't parse response message: %s\n", error->message);
+        shutdown (FALSE);
+        return;
+    }
+
+    g_print ("[%s] Proxy statistics:\n"
+             "\t              Clients: %u\n"
+             "\t              Devices: %u\n"
+             "\t   Commands forwarded: %" G_GUINT64_FORMAT "\n"
+             "\tIndications forwarded: %" G_GUINT64_FORMAT "\n"
+             "\t  Indications dropped: %" G_GUINT64_FORMAT "\n"
+             "\t  Command latency p50: %u us\n"
+             "\t  Command latency p90: %u us\n"
+             "\t  Command latency p99: %u us\n",
+             mbim_device_get_path_display (device),
+             n_clients,
+             n_devices,
+             commands_forwarded,
+             indications_forwarded,
+             indications_dropped,
+             latency_p50,
+             latency_p90,
+             latency_p99);
+
+    for (i = 0; i < device_statistics_count; i++) {
+        g_print ("\tDevice [%u]:\n"
+                 "\t\t           Path: '%s'\n"
+                 "\t\t        Clients: %u\n"
+                 "\t\t      In flight: %u\n"
+                 "\t\tWaiting clients: %u\n",
+                 i,
+                 VALIDATE_UNKNOWN (device_statistics[i]->device_path),
+                 device_statistics[i]->clients,
+                 device_statistics[i]->in_flight,
+                 device_statistics[i]->waiting_clients);
+    }
+
+    for (i = 0; i < client_statistics_count; i++) {
+        g_print ("\tClient [%u]:\n"
+                 "\t\t             ID: %u\n"
+                 "\t\tQueued messages: %u\n"
+                 "\t\t   Queued bytes: %u\n"
+                 "\t\t      In flight: %u\n"
+                 "\t\t        Pending: %u\n",
+                 i,
+                 client_statistics[i]->client_id,
+                 client_statistics[i]->queued_messages,
+                 client_statistics[i]->queued_bytes,
+                 client_statistics[i]->in_flight,
+                 client_statistics[i]->pending);
+    }
+
+    shutdown (TRUE);
+}
+
+void
+mbimcli_proxy_control_run (MbimDevice   *device,
+                           GCancellable *cancellable)
+{
+    g_autoptr(MbimMessage) request = NULL;
+
+    /* Initialize context */
+    ctx = g_slice_new (Context);
+    ctx->device = g_object_ref (device);
+    ctx->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+
+    /* Request to query proxy statistics */
+    if (query_proxy_stats_flag) {
+        g_debug ("Asynchronously querying proxy statistics...");
+        request = mbim_message_proxy_control_statistics_query_new (NULL);
+        mbim_device_command (ctx->device,
+                             request,
+                             10,
+                             ctx->cancellable,
+                             (GAsyncReadyCallback)query_proxy_stats_ready,
+                             NULL);
+        return;
+    }
+
+    g_warn_if_reached ();
+}
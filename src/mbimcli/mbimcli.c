@@ -273,34 +273,68 @@ device_open_ready (MbimDevice   *dev,
         mbimcli_basic_connect_run (dev, cancellable);
         return;
     case MBIM_SERVICE_PHONEBOOK:
+#if defined MBIM_SERVICE_PHONEBOOK_ENABLED
         mbimcli_phonebook_run (dev, cancellable);
         return;
+#else
+        g_assert_not_reached ();
+#endif
     case MBIM_SERVICE_DSS:
+#if defined MBIM_SERVICE_DSS_ENABLED
         mbimcli_dss_run (dev, cancellable);
         return;
+#else
+        g_assert_not_reached ();
+#endif
     case MBIM_SERVICE_MS_FIRMWARE_ID:
+#if defined MBIM_SERVICE_MS_FIRMWARE_ID_ENABLED
         mbimcli_ms_firmware_id_run (dev, cancellable);
         return;
+#else
+        g_assert_not_reached ();
+#endif
     case MBIM_SERVICE_MS_HOST_SHUTDOWN:
+#if defined MBIM_SERVICE_MS_HOST_SHUTDOWN_ENABLED
         mbimcli_ms_host_shutdown_run (dev, cancellable);
         return;
+#else
+        g_assert_not_reached ();
+#endif
     case MBIM_SERVICE_MS_SAR:
+#if defined MBIM_SERVICE_MS_SAR_ENABLED
         mbimcli_ms_sar_run (dev, cancellable);
         return;
+#else
+        g_assert_not_reached ();
+#endif
     case MBIM_SERVICE_ATDS:
+#if defined MBIM_SERVICE_ATDS_ENABLED
         mbimcli_atds_run (dev, cancellable);
         return;
+#else
+        g_assert_not_reached ();
+#endif
     case MBIM_SERVICE_INTEL_FIRMWARE_UPDATE:
+#if defined MBIM_SERVICE_INTEL_FIRMWARE_UPDATE_ENABLED
         mbimcli_intel_firmware_update_run (dev, cancellable);
         return;
+#else
+        g_assert_not_reached ();
+#endif
     case MBIM_SERVICE_MS_BASIC_CONNECT_EXTENSIONS:
+#if defined MBIM_SERVICE_MS_BASIC_CONNECT_EXTENSIONS_ENABLED
         mbimcli_ms_basic_connect_extensions_run (dev, cancellable);
         return;
+#else
+        g_assert_not_reached ();
+#endif
+    case MBIM_SERVICE_PROXY_CONTROL:
+        mbimcli_proxy_control_run (dev, cancellable);
+        return;
     case MBIM_SERVICE_SMS:
     case MBIM_SERVICE_USSD:
     case MBIM_SERVICE_STK:
     case MBIM_SERVICE_AUTH:
-    case MBIM_SERVICE_PROXY_CONTROL:
     case MBIM_SERVICE_QMI:
     case MBIM_SERVICE_QDU:
     case MBIM_SERVICE_MS_UICC_LOW_LEVEL_ACCESS:
@@ -369,45 +403,66 @@ parse_actions (void)
         actions_enabled++;
     }
 
+#if defined MBIM_SERVICE_PHONEBOOK_ENABLED
     if (mbimcli_phonebook_options_enabled ()) {
         service = MBIM_SERVICE_PHONEBOOK;
         actions_enabled++;
     }
+#endif
 
+#if defined MBIM_SERVICE_DSS_ENABLED
     if (mbimcli_dss_options_enabled ()) {
         service = MBIM_SERVICE_DSS;
         actions_enabled++;
     }
+#endif
 
+#if defined MBIM_SERVICE_MS_FIRMWARE_ID_ENABLED
     if (mbimcli_ms_firmware_id_options_enabled ()) {
         service = MBIM_SERVICE_MS_FIRMWARE_ID;
         actions_enabled++;
     }
+#endif
 
+#if defined MBIM_SERVICE_MS_HOST_SHUTDOWN_ENABLED
     if (mbimcli_ms_host_shutdown_options_enabled ()) {
         service = MBIM_SERVICE_MS_HOST_SHUTDOWN;
         actions_enabled++;
     }
+#endif
 
+#if defined MBIM_SERVICE_MS_SAR_ENABLED
     if (mbimcli_ms_sar_options_enabled ()) {
         service = MBIM_SERVICE_MS_SAR;
         actions_enabled++;
     }
+#endif
 
+#if defined MBIM_SERVICE_ATDS_ENABLED
     if (mbimcli_atds_options_enabled ()) {
         service = MBIM_SERVICE_ATDS;
         actions_enabled++;
     }
+#endif
 
+#if defined MBIM_SERVICE_INTEL_FIRMWARE_UPDATE_ENABLED
     if (mbimcli_intel_firmware_update_options_enabled ()) {
         service = MBIM_SERVICE_INTEL_FIRMWARE_UPDATE;
         actions_enabled++;
     }
+#endif
 
+#if defined MBIM_SERVICE_MS_BASIC_CONNECT_EXTENSIONS_ENABLED
     if (mbimcli_ms_basic_connect_extensions_options_enabled ()) {
         service = MBIM_SERVICE_MS_BASIC_CONNECT_EXTENSIONS;
         actions_enabled++;
     }
+#endif
+
+    if (mbimcli_proxy_control_options_enabled ()) {
+        service = MBIM_SERVICE_PROXY_CONTROL;
+        actions_enabled++;
+    }
 
     /* Noop */
     if (noop_flag)
@@ -425,6 +480,12 @@ parse_actions (void)
         exit (EXIT_FAILURE);
     }
 
+    /* Proxy control actions are handled by the proxy itself */
+    if (service == MBIM_SERVICE_PROXY_CONTROL && !device_open_proxy_flag) {
+        g_printerr ("error: proxy control actions require --device-open-proxy\n");
+        exit (EXIT_FAILURE);
+    }
+
     /* Go on! */
 }
 
@@ -439,14 +500,31 @@ int main (int argc, char **argv)
     /* Setup option context, process it and destroy it */
     context = g_option_context_new ("- Control MBIM devices");
     g_option_context_add_group (context, mbimcli_basic_connect_get_option_group ());
+#if defined MBIM_SERVICE_PHONEBOOK_ENABLED
     g_option_context_add_group (context, mbimcli_phonebook_get_option_group ());
+#endif
+#if defined MBIM_SERVICE_DSS_ENABLED
     g_option_context_add_group (context, mbimcli_dss_get_option_group ());
+#endif
+#if defined MBIM_SERVICE_MS_FIRMWARE_ID_ENABLED
     g_option_context_add_group (context, mbimcli_ms_firmware_id_get_option_group ());
+#endif
+#if defined MBIM_SERVICE_MS_HOST_SHUTDOWN_ENABLED
     g_option_context_add_group (context, mbimcli_ms_host_shutdown_get_option_group ());
+#endif
+#if defined MBIM_SERVICE_MS_SAR_ENABLED
     g_option_context_add_group (context, mbimcli_ms_sar_get_option_group ());
+#endif
+#if defined MBIM_SERVICE_ATDS_ENABLED
     g_option_context_add_group (context, mbimcli_atds_get_option_group ());
+#endif
+#if defined MBIM_SERVICE_INTEL_FIRMWARE_UPDATE_ENABLED
     g_option_context_add_group (context, mbimcli_intel_firmware_update_get_option_group ());
+#endif
+#if defined MBIM_SERVICE_MS_BASIC_CONNECT_EXTENSIONS_ENABLED
     g_option_context_add_group (context, mbimcli_ms_basic_connect_extensions_get_option_group ());
+#endif
+    g_option_context_add_group (context, mbimcli_proxy_control_get_option_group ());
     g_option_context_add_group (context, mbimcli_link_management_get_option_group ());
     g_option_context_add_main_entries (context, main_entries, NULL);
     if (!g_option_context_parse (context, &argc, &argv, &error)) {
@@ -38,6 +38,7 @@ GOptionGroup *mbimcli_ms_sar_get_option_group           (void);
 GOptionGroup *mbimcli_atds_get_option_group             (void);
 GOptionGroup *mbimcli_intel_firmware_update_get_option_group (void);
 GOptionGroup *mbimcli_ms_basic_connect_extensions_get_option_group (void);
+GOptionGroup *mbimcli_proxy_control_get_option_group    (void);
 
 gboolean      mbimcli_basic_connect_options_enabled     (void);
 gboolean      mbimcli_phonebook_options_enabled         (void);
@@ -48,6 +49,7 @@ gboolean      mbimcli_ms_sar_options_enabled            (void);
 gboolean      mbimcli_atds_options_enabled              (void);
 gboolean      mbimcli_intel_firmware_update_options_enabled (void);
 gboolean      mbimcli_ms_basic_connect_extensions_options_enabled (void);
+gboolean      mbimcli_proxy_control_options_enabled     (void);
 
 void          mbimcli_basic_connect_run                 (MbimDevice *device,
                                                          GCancellable *cancellable);
@@ -67,6 +69,8 @@ void          mbimcli_intel_firmware_update_run         (MbimDevice *device,
                                                          GCancellable *cancellable);
 void          mbimcli_ms_basic_connect_extensions_run   (MbimDevice *device,
                                                          GCancellable *cancellable);
+void          mbimcli_proxy_control_run                 (MbimDevice *device,
+                                                         GCancellable *cancellable);
 
 
 /* link management */